@@ -1,26 +1,197 @@
 #include <algorithm>
 #include <iostream>
 #include <poll.h>
+#include <strings.h>
 #include <unistd.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include "async_connection.h"
 #include "connection.h"
+#include "event_loop_stats.h"
 #include "util.h"
 
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
 using std::cerr;
 using std::endl;
-using std::ios;
+using std::enable_shared_from_this;
+using std::list;
 using std::make_shared;
 using std::shared_ptr;
-using std::stringstream;
 using std::string;
-using std::chrono::system_clock;
-using std::chrono::duration;
+using std::vector;
+using std::chrono::steady_clock;
 
 #define INVALID_SOCK (-1)
-#define BUFSIZE (1024 * 1024)
+// the least free space a buffered read receives into, the buffer grows if it has less
+#define READ_MIN_SPACE (SMALL_BUFFER_SIZE)
+// how often a connection that is out of output budget checks whether it has been freed up
+#define OUTPUT_RETRY_INTERVAL (milliseconds(10))
+// how long a closed socket waits for the kernel to release its zerocopy buffers before it is reset
+#define RETIRED_SOCKET_TIMEOUT (milliseconds(10000))
+// room for the notifications that one recvmsg() from the error queue can return
+#define ERRQUEUE_CONTROL_SIZE (CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6)))
 
-const std::chrono::seconds DEFAULT_TIMEOUT = std::chrono::seconds(5);
+
+/*
+ * ZerocopySends tracks the MSG_ZEROCOPY sends on one socket, which the kernel makes straight from
+ * our buffers instead of copying them. The kernel numbers the successful zerocopy sendmsg() calls
+ * on a socket from 0, and once it no longer needs the pages of a range of them, it queues a
+ * notification with the range on the socket's error queue, which wakes the event loop with POLLERR.
+ *
+ * The sends of one write are `sent` into an open entry, and once the write is done its parts are
+ * `pin`ned to the entry, so that they outlive the write. They are freed once `reap` has seen the
+ * notifications for all of the entry's sends, and are charged to the global OutputStats until then.
+ * A socket only has one write in flight at a time, so only the newest entry can be open.
+ */
+class ZerocopySends {
+    struct Entry {
+        bool open;
+        uint32_t first_id;
+        uint32_t num_sends;
+        uint32_t num_released;
+        vector<string> parts;
+        size_t size;
+    };
+
+    uint32_t next_id;
+    list<Entry> entries;
+
+    void release(uint32_t lo, uint32_t hi) {
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            // ids wrap around, so compare them as offsets from the start of the entry
+            int64_t start = std::max<int64_t>((int32_t) (lo - it->first_id), 0);
+            int64_t end = std::min<int64_t>((int64_t) (int32_t) (hi - it->first_id) + 1, it->num_sends);
+            if (end > start) {
+                it->num_released += (uint32_t) (end - start);
+            }
+        }
+    }
+
+    void free_released() {
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (!it->open && it->num_released >= it->num_sends) {
+                global_output_stats().release(it->size);
+                it = entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+public:
+    ZerocopySends() : next_id(0) {}
+
+    ~ZerocopySends() {
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            global_output_stats().release(it->size);
+        }
+    }
+
+    // sent is called after each zerocopy sendmsg() that sent anything
+    void sent() {
+        if (entries.empty() || !entries.back().open) {
+            entries.push_back(Entry{true, next_id, 0, 0, vector<string>(), 0});
+        }
+        entries.back().num_sends++;
+        next_id++;
+    }
+
+    // pin takes the parts of the write that is done, if the kernel may still be reading them
+    void pin(vector<string>& parts) {
+        if (entries.empty() || !entries.back().open) {
+            return;
+        }
+        Entry& entry = entries.back();
+        entry.open = false;
+        entry.parts.swap(parts);
+        for (size_t i = 0; i < entry.parts.size(); i++) {
+            entry.size += entry.parts[i].size();
+        }
+        global_output_stats().charge(entry.size);
+        free_released();
+    }
+
+    // reap reads the notifications on the socket's error queue and returns true once nothing is pinned
+    bool reap(int sock) {
+        while (!entries.empty()) {
+            char control[ERRQUEUE_CONTROL_SIZE];
+            struct msghdr msg;
+            bzero(&msg, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (::recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+                break;
+            }
+
+            for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                bool ip_error = (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                                (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+                struct sock_extended_err* err = (struct sock_extended_err*) CMSG_DATA(cmsg);
+                if (ip_error && err->ee_origin == SO_EE_ORIGIN_ZEROCOPY && err->ee_errno == 0) {
+                    release(err->ee_info, err->ee_data);
+                }
+            }
+        }
+        free_released();
+        return entries.empty();
+    }
+};
+
+
+/*
+ * RetiredSockets holds the sockets of one thread that were destroyed while the kernel still held
+ * some of their zerocopy buffers. They have already been shut down, and are closed once the kernel
+ * has released the buffers. If that takes longer than RETIRED_SOCKET_TIMEOUT, the client has stopped
+ * reading, so the connection is reset instead, which makes the kernel drop whatever it still had to
+ * send along with our buffers. There's no event loop at hand when a socket is destroyed, so they are
+ * checked whenever another socket on the thread is destroyed or reaps its zerocopy buffers.
+ */
+class RetiredSockets {
+    struct Retired {
+        int sock;
+        shared_ptr<ZerocopySends> zerocopy;
+        steady_clock::time_point give_up;
+    };
+
+    list<Retired> sockets;
+
+public:
+    ~RetiredSockets() {
+        for (auto it = sockets.begin(); it != sockets.end(); ++it) {
+            ::close(it->sock);
+        }
+    }
+
+    static RetiredSockets& local() {
+        static thread_local RetiredSockets retired;
+        return retired;
+    }
+
+    void retire(int sock, shared_ptr<ZerocopySends> zerocopy) {
+        sockets.push_back(Retired{sock, zerocopy, steady_clock::now() + RETIRED_SOCKET_TIMEOUT});
+    }
+
+    void reap() {
+        steady_clock::time_point now = steady_clock::now();
+        for (auto it = sockets.begin(); it != sockets.end();) {
+            if (!it->zerocopy->reap(it->sock) && now < it->give_up) {
+                ++it;
+                continue;
+            }
+            if (now >= it->give_up) {
+                struct linger reset = {1, 0};
+                setsockopt(it->sock, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+            }
+            if (::close(it->sock) < 0) {
+                cerr << errno_message("close() failed: ") << endl;
+            }
+            it = sockets.erase(it);
+        }
+    }
+};
 
 
 AutoClosingSocket::AutoClosingSocket(int sock) : client_sock(sock) {}
@@ -30,43 +201,92 @@ AutoClosingSocket::~AutoClosingSocket() {
     if (::shutdown(this->client_sock, SHUT_RDWR) < 0  && errno != ENOTCONN) {
         cerr << errno_message("shutdown() failed: ") << endl;
     }
-    if (::close(this->client_sock) < 0) {
+
+    RetiredSockets& retired = RetiredSockets::local();
+    retired.reap();
+    if (zerocopy != NULL && !zerocopy->reap(this->client_sock)) {
+        // closing the socket would lose the notifications for the buffers that the kernel still holds
+        retired.retire(this->client_sock, zerocopy);
+    } else if (::close(this->client_sock) < 0) {
         cerr << errno_message("close() failed: ") << endl;
     }
     this->client_sock = INVALID_SOCK;
 }
 
+void AutoClosingSocket::reap_zerocopy() {
+    if (zerocopy != NULL) {
+        zerocopy->reap(client_sock);
+    }
+    RetiredSockets::local().reap();
+}
+
 
 /*
  * SocketReadPollable represents a pending non-blocking read operation on an AutoClosingSocket.
  * It invokes the given callback once the read operation has completed.
  * If the operation times out, it does not invoke the callback and removes itself from the event loop.
+ *
+ * If armed with a buffer and separator, it instead receives straight into the buffer's free space
+ * and keeps reading until the buffer contains the separator, then pops the content before it.
+ * The buffer is kept until the pollable is re-armed, even if it is cancelled, since io_uring may
+ * still be receiving into it. Plain reads receive into a buffer borrowed from the BufferPool
+ * for just as long as the receive is in flight, so an idle connection holds no buffer memory.
+ * Each AsyncSocketConnection reuses one SocketReadPollable (and its receive buffer) for all of
+ * its reads, so it is done until `arm` is called with the callback for the next read.
+ *
+ * An idle read waits with the idle timeout and holds an entry in the IdleConnectionList until
+ * anything arrives. If that is only part of a message, the pollable registers itself again with
+ * the header timeout, so that a client can't stretch a request over the longer idle timeout.
  */
-class SocketReadPollable : public Pollable {
+class SocketReadPollable : public CompletionPollable, public enable_shared_from_this<SocketReadPollable> {
     shared_ptr<AutoClosingSocket> conn;
     Callback<string>::F callback;
+    shared_ptr<ByteBuffer> buffer;
+    string sep;
     bool done;
-    system_clock::time_point start;
+    bool idle;
+    milliseconds timeout;
+    steady_clock::time_point deadline;
+    PooledBuffer buf;
+    shared_ptr<IdleConnectionList> idle_connections;
+    IdleConnectionList::Entry idle_entry;
+
+    void leave_idle() {
+        if (idle_connections != NULL) {
+            idle_connections->remove(idle_entry);
+            idle_connections.reset();
+        }
+    }
 
-    string try_read() {
-        char buf[BUFSIZE];
+public:
+    SocketReadPollable(shared_ptr<AutoClosingSocket> conn) : conn(conn), done(true), idle(false), timeout(0) {}
 
-        ssize_t received = ::recv(conn->client_sock, buf, sizeof(buf), 0);
-        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            return "";
-        } else if (received < 0) {
-            throw ConnectionError(errno_message("recv() failed: "));
-        } else if (received == 0) {
-            throw ConnectionClosed();
-        }
+    virtual ~SocketReadPollable() {
+        leave_idle();
+    }
 
-        buf[received] = '\0';
-        return string(buf, (size_t)received);
+    void arm(shared_ptr<ByteBuffer> buffer, const string& sep, Callback<string>::F callback, const ConnectionTimeouts& timeouts,
+             bool idle, shared_ptr<IdleConnectionList> idle_connections) {
+        this->buffer = buffer;
+        this->sep = sep;
+        this->callback = std::move(callback);
+        done = false;
+        this->idle = idle;
+        timeout = timeouts.reading_headers;
+        deadline = steady_clock::now() + (idle ? timeouts.idle : timeouts.reading_headers);
+
+        leave_idle();
+        if (idle && idle_connections != NULL) {
+            this->idle_connections = idle_connections;
+            idle_entry = idle_connections->add(this);
+        }
     }
 
-public:
-    SocketReadPollable(shared_ptr<AutoClosingSocket> conn, Callback<string>::F callback)
-            : conn(conn), callback(callback), done(false), start(system_clock::now()) {}
+    // evict is called by the IdleConnectionList once it has removed this read's entry
+    void evict() {
+        idle_connections.reset();
+        ::shutdown(conn->client_sock, SHUT_RDWR);
+    }
 
     virtual int get_fd() {
         return conn->client_sock;
@@ -80,22 +300,143 @@ public:
         return done;
     }
 
-    virtual bool past_deadline(system_clock::time_point now) {
-        return (now - start) > DEFAULT_TIMEOUT;
+    virtual steady_clock::time_point get_deadline() {
+        return deadline;
+    }
+
+    virtual shared_ptr<Pollable> notify(short revents) {
+        // the socket stays in error while zerocopy notifications are queued, so take them off first
+        if (revents & POLLERR) {
+            conn->reap_zerocopy();
+        }
+        return CompletionPollable::notify(revents);
+    }
+
+    virtual void prepare(IoRequest& request) {
+        if (buffer != NULL) {
+            char* space = buffer->prepare(READ_MIN_SPACE);
+            request = recv_request(conn->client_sock, space, buffer->available());
+            return;
+        }
+
+        if (buf.empty()) {
+            buf = BufferPool::local().acquire(MEDIUM_BUFFER_SIZE);
+        }
+        request = recv_request(conn->client_sock, buf.data(), buf.size());
     }
 
-    virtual std::shared_ptr<Pollable> notify(short) {
-        try {
-            string s = try_read();
-            if (s != "") {
-                done = true;
+    virtual shared_ptr<Pollable> complete(int result) {
+        if (result == -EAGAIN || result == -EWOULDBLOCK) {
+            // nothing arrived, so don't hold on to the space prepared for it while we wait
+            if (buffer != NULL) {
+                buffer->shrink();
+            }
+            buf.release();
+            return shared_ptr<Pollable>();
+        }
+
+        // whatever arrived, the connection isn't idle any more
+        leave_idle();
+
+        string content;
+        if (result > 0 && buffer == NULL) {
+            content.assign(buf.data(), (size_t)result);
+        } else if (result > 0) {
+            buffer->commit((size_t)result);
+            size_t split_pos = buffer->find(sep);
+            if (split_pos == string::npos && idle) {
+                idle = false;
+                deadline = steady_clock::now() + timeout;
+                return shared_from_this();
+            } else if (split_pos == string::npos) {
+                return shared_ptr<Pollable>();
             }
-            return callback(s);
-        } catch (ConnectionClosed&) {
-            // give up
-            done = true;
+            content = buffer->pop(split_pos, sep.size());
+        }
+
+        // move the callback out first, since it may re-arm this pollable for the next read
+        Callback<string>::F next = std::move(callback);
+        buf.release();
+        done = true;
+        if (result < 0) {
+            errno = -result;
+            throw ConnectionError(errno_message("recv() failed: "));
+        } else if (result == 0) {
+            // the client closed the connection, give up
             return shared_ptr<Pollable>();
         }
+
+        return next(content);
+    }
+
+    virtual void cancel() {
+        done = true;
+        callback = Callback<string>::F();
+        leave_idle();
+    }
+};
+
+
+IdleConnectionList::IdleConnectionList(size_t max_idle) : max_idle(max_idle) {}
+
+IdleConnectionList::Entry IdleConnectionList::add(SocketReadPollable* connection) {
+    evict_until(max_idle > 0 ? max_idle - 1 : 0);
+    return connections.insert(connections.end(), connection);
+}
+
+void IdleConnectionList::remove(Entry entry) {
+    connections.erase(entry);
+}
+
+void IdleConnectionList::make_room() {
+    evict_until(max_idle > 0 ? max_idle - 1 : 0);
+}
+
+size_t IdleConnectionList::size() {
+    return connections.size();
+}
+
+void IdleConnectionList::evict_until(size_t size) {
+    while (connections.size() > size) {
+        SocketReadPollable* connection = connections.front();
+        connections.pop_front();
+        connection->evict();
+    }
+}
+
+
+/*
+ * SlowReaderCheck watches a write that has had to wait for its client to read. Once it has been
+ * waiting for the grace period, a client that has read less than the minimum rate since it started
+ * waiting is a slow reader, since it would hold the rest of the write in memory for too long.
+ */
+class SlowReaderCheck {
+    bool waiting;
+    steady_clock::time_point wait_start;
+    size_t sent_at_start;
+
+public:
+    SlowReaderCheck() : waiting(false), sent_at_start(0) {}
+
+    void reset() {
+        waiting = false;
+    }
+
+    // too_slow is called whenever the write has to wait, with the bytes it has sent so far
+    bool too_slow(size_t total_sent, const OutputLimits& limits) {
+        steady_clock::time_point now = steady_clock::now();
+        if (!waiting) {
+            waiting = true;
+            wait_start = now;
+            sent_at_start = total_sent;
+            return false;
+        }
+
+        milliseconds waited = duration_cast<milliseconds>(now - wait_start);
+        if (waited < limits.slow_reader_grace) {
+            return false;
+        }
+        return (total_sent - sent_at_start) * 1000 < limits.min_send_rate * (size_t) waited.count();
     }
 };
 
@@ -104,37 +445,200 @@ public:
  * SocketWritePollable represents a pending non-blocking write operation on an AutoClosingSocket.
  * It invokes the given callback once the write operation has completed.
  * If the operation times out, it does not invoke the callback and removes itself from the event loop.
+ *
+ * The message is a list of parts, like the headers and body of a response, which are sent with
+ * a single sendmsg() without joining them. After a partial send, the iovecs are rebuilt from
+ * where it left off. Like SocketReadPollable, it is reused for every write on its connection.
+ *
+ * The bytes it has yet to send are charged to the global OutputStats until they are sent or the
+ * write is abandoned. If the client reads them slower than the OutputLimits allow, the write is
+ * abandoned like one that timed out.
+ *
+ * If the socket has zerocopy enabled, each sendmsg() of at least the zerocopy threshold is made
+ * with MSG_ZEROCOPY, and once the write is done its parts are pinned to the socket's ZerocopySends
+ * until the kernel has released them. If the kernel can't pin any more pages, the rest of the
+ * write is copied as usual.
  */
-class SocketWritePollable : public Pollable {
+class SocketWritePollable : public CompletionPollable {
     shared_ptr<AutoClosingSocket> conn;
     Callback<>::F callback;
     bool done;
-    string message;
+    vector<string> parts;
+    size_t total_size;
     size_t total_sent;
-    system_clock::time_point start;
-
-    bool try_write() {
-        do {
-            size_t left = message.size() - total_sent;
-            size_t send_amount = std::min(left, (size_t)BUFSIZE);
-            ssize_t sent = send(conn->client_sock, message.c_str() + total_sent, send_amount, 0);
-
-            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                return false;
-            } else if (sent < 0) {
-                std::cerr << errno_message("send() failed: ") << std::endl;
-                return true;
+    vector<struct iovec> iov;
+    struct msghdr msg;
+    steady_clock::time_point deadline;
+    OutputLimits limits;
+    SlowReaderCheck slow_reader;
+    bool zerocopy_send;
+    bool zerocopy_failed;
+
+    void release_unsent() {
+        global_output_stats().release(total_size - total_sent);
+        total_sent = total_size;
+    }
+
+    // pin_parts keeps the parts alive after the write for as long as the kernel may still be sending them
+    void pin_parts() {
+        if (conn->zerocopy != NULL) {
+            conn->zerocopy->pin(parts);
+        }
+    }
+
+public:
+    SocketWritePollable(shared_ptr<AutoClosingSocket> conn)
+            : conn(conn), done(true), total_size(0), total_sent(0), zerocopy_send(false), zerocopy_failed(false) {
+        bzero(&msg, sizeof(msg));
+    }
+
+    virtual ~SocketWritePollable() {
+        release_unsent();
+        pin_parts();
+    }
+
+    void arm(vector<string>& parts, Callback<>::F callback, milliseconds timeout, const OutputLimits& limits) {
+        this->parts.swap(parts);
+        arm(std::move(callback), timeout, limits);
+    }
+
+    // arm with a single part, reusing the part list so that a plain write doesn't allocate one
+    void arm(string& message, Callback<>::F callback, milliseconds timeout, const OutputLimits& limits) {
+        parts.resize(1);
+        parts[0].swap(message);
+        arm(std::move(callback), timeout, limits);
+    }
+
+    void arm(Callback<>::F callback, milliseconds timeout, const OutputLimits& limits) {
+        this->callback = std::move(callback);
+        done = false;
+        total_size = 0;
+        for (size_t i = 0; i < parts.size(); i++) {
+            total_size += parts[i].size();
+        }
+        total_sent = 0;
+        deadline = steady_clock::now() + timeout;
+        this->limits = limits;
+        slow_reader.reset();
+        zerocopy_failed = false;
+        global_output_stats().charge(total_size);
+    }
+
+    // unsent is the number of bytes this write still holds in memory
+    size_t unsent() {
+        return total_size - total_sent;
+    }
+
+    virtual int get_fd() {
+        return conn->client_sock;
+    }
+
+    virtual short get_events() {
+        return POLLOUT;
+    }
+
+    virtual bool is_done() {
+        return done;
+    }
+
+    virtual steady_clock::time_point get_deadline() {
+        return deadline;
+    }
+
+    virtual shared_ptr<Pollable> notify(short revents) {
+        if (revents & POLLERR) {
+            conn->reap_zerocopy();
+        }
+        return CompletionPollable::notify(revents);
+    }
+
+    virtual void prepare(IoRequest& request) {
+        remaining_iovecs(parts, total_sent, iov);
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = iov.size();
+        zerocopy_send = conn->zerocopy != NULL && !zerocopy_failed && unsent() >= limits.zerocopy_threshold;
+        request = sendmsg_request(conn->client_sock, &msg, zerocopy_send ? MSG_ZEROCOPY : 0);
+    }
+
+    virtual shared_ptr<Pollable> complete(int result) {
+        if (zerocopy_send && result == -ENOBUFS) {
+            // the kernel is out of memory for pinning pages, so copy the rest of the write instead
+            zerocopy_failed = true;
+            return shared_ptr<Pollable>();
+        } else if (zerocopy_send && result > 0) {
+            conn->zerocopy->sent();
+        }
+
+        if (result >= 0) {
+            total_sent += result;
+            global_output_stats().release(result);
+        }
+
+        if (result == -EAGAIN || result == -EWOULDBLOCK || (result >= 0 && total_sent < total_size)) {
+            // the client isn't keeping up, so wait for it unless it's reading too slowly to be worth it
+            if (slow_reader.too_slow(total_sent, limits)) {
+                global_output_stats().record_slow_reader();
+                cancel();
+                parts.clear();
             }
+            return shared_ptr<Pollable>();
+        } else if (result < 0) {
+            errno = -result;
+            std::cerr << errno_message("sendmsg() failed: ") << std::endl;
+        }
 
-            total_sent += sent;
-        } while (total_sent < message.size());
+        // move the callback out first, since it may re-arm this pollable for the next write
+        Callback<>::F next = std::move(callback);
+        release_unsent();
+        pin_parts();
+        parts.clear();
+        done = true;
+        return next();
+    }
 
-        return true;
+    // the parts are kept until the next write, since an io_uring send may still be reading them
+    virtual void cancel() {
+        done = true;
+        callback = Callback<>::F();
+        release_unsent();
+        pin_parts();
     }
+};
+
+
+/*
+ * SocketSendfilePollable represents a pending non-blocking sendfile() of a FileBody to an AutoClosingSocket.
+ * It invokes the given callback once the whole range has been sent.
+ * If the operation times out or fails, it does not invoke the callback and removes itself from the event loop.
+ *
+ * It waits for POLLOUT on every backend, since io_uring has no sendfile operation, and then sends
+ * as much as the socket will take. Like SocketWritePollable, it is reused for every file sent on
+ * its connection, but it drops the FileBody (closing the file) as soon as it is done with it.
+ * The file isn't held in memory, so it isn't charged to the OutputStats, but slow readers are
+ * still dropped since they hold the file open.
+ */
+class SocketSendfilePollable : public Pollable {
+    shared_ptr<AutoClosingSocket> conn;
+    Callback<>::F callback;
+    bool done;
+    shared_ptr<FileBody> file;
+    size_t total_sent;
+    steady_clock::time_point deadline;
+    OutputLimits limits;
+    SlowReaderCheck slow_reader;
 
 public:
-    SocketWritePollable(shared_ptr<AutoClosingSocket> conn, string message, Callback<>::F callback)
-            : conn(conn), callback(callback), done(false), message(message), total_sent(0), start(system_clock::now()) {}
+    SocketSendfilePollable(shared_ptr<AutoClosingSocket> conn) : conn(conn), done(true), total_sent(0) {}
+
+    void arm(shared_ptr<FileBody> file, Callback<>::F callback, milliseconds timeout, const OutputLimits& limits) {
+        this->file = file;
+        this->callback = std::move(callback);
+        done = false;
+        total_sent = 0;
+        deadline = steady_clock::now() + timeout;
+        this->limits = limits;
+        slow_reader.reset();
+    }
 
     virtual int get_fd() {
         return conn->client_sock;
@@ -148,73 +652,217 @@ public:
         return done;
     }
 
-    virtual bool past_deadline(system_clock::time_point now) {
-        return (now - start) > DEFAULT_TIMEOUT;
+    virtual steady_clock::time_point get_deadline() {
+        return deadline;
     }
 
-    virtual shared_ptr<Pollable> notify(short) {
-        done = try_write();
-        if (done) {
-            return callback();
-        } else {
-            return shared_ptr<Pollable>();
+    virtual shared_ptr<Pollable> notify(short revents) {
+        if (revents & POLLERR) {
+            conn->reap_zerocopy();
         }
+
+        while (total_sent < file->length) {
+            off_t offset = file->offset + (off_t) total_sent;
+            ssize_t result = ::sendfile(conn->client_sock, file->fd, &offset, file->length - total_sent);
+            if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (slow_reader.too_slow(total_sent, limits)) {
+                    global_output_stats().record_slow_reader();
+                    cancel();
+                }
+                return shared_ptr<Pollable>();
+            } else if (result <= 0) {
+                // the client was promised the whole range, so give up on the connection without invoking the callback
+                if (result < 0) {
+                    std::cerr << errno_message("sendfile() failed: ") << std::endl;
+                } else {
+                    std::cerr << "sendfile() failed: file ended " << file->length - total_sent << " bytes early" << std::endl;
+                }
+                cancel();
+                return shared_ptr<Pollable>();
+            }
+            total_sent += result;
+        }
+
+        // move the callback out first, since it may re-arm this pollable for the next file
+        Callback<>::F next = std::move(callback);
+        file.reset();
+        done = true;
+        return next();
+    }
+
+    virtual void cancel() {
+        done = true;
+        callback = Callback<>::F();
+        file.reset();
     }
 };
 
 
 AsyncSocketConnection::AsyncSocketConnection(int client_sock, struct in_addr client_remote_ip)
-        : conn(make_shared<AutoClosingSocket>(client_sock)), client_remote_ip(client_remote_ip) {}
+        : conn(make_shared<AutoClosingSocket>(client_sock)), client_remote_ip(client_remote_ip),
+          timeouts(DEFAULT_CONNECTION_TIMEOUTS), output_limits(DEFAULT_OUTPUT_LIMITS) {}
 
 struct in_addr AsyncSocketConnection::get_remote_ip() {
     return client_remote_ip;
 }
 
+void AsyncSocketConnection::configure(ConnectionTimeouts timeouts, shared_ptr<IdleConnectionList> idle_connections,
+                                      OutputLimits output_limits) {
+    this->timeouts = timeouts;
+    this->idle_connections = idle_connections;
+    this->output_limits = output_limits;
+
+    if (output_limits.zerocopy_threshold > 0 && conn->zerocopy == NULL) {
+        // not every socket supports it (unix sockets don't), in which case writes are just copied as usual
+        int enable = 1;
+        if (setsockopt(conn->client_sock, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0) {
+            conn->zerocopy = make_shared<ZerocopySends>();
+        }
+    }
+}
+
+size_t AsyncSocketConnection::output_room() {
+    size_t held = write_pollable != NULL ? write_pollable->unsent() : 0;
+    if (held >= output_limits.max_connection_bytes) {
+        return 0;
+    }
+    size_t room = output_limits.max_connection_bytes - held;
+
+    // waiting on the global budget only helps if some other connection holds output that can drain
+    uint64_t total = global_output_stats().buffered_bytes();
+    if (total == 0) {
+        return room;
+    } else if (total >= output_limits.max_total_bytes) {
+        return 0;
+    }
+    return std::min(room, (size_t) (output_limits.max_total_bytes - total));
+}
+
+std::shared_ptr<Pollable> AsyncSocketConnection::wait_for_output_room(Callback<>::F callback) {
+    if (output_room() > 0) {
+        return callback();
+    }
+    global_output_stats().record_output_wait();
+    return wait_for_output_room(std::move(callback), steady_clock::now() + timeouts.writing);
+}
+
+std::shared_ptr<Pollable> AsyncSocketConnection::wait_for_output_room(Callback<>::F callback, steady_clock::time_point give_up) {
+    if (output_room() > 0) {
+        return callback();
+    }
+
+    // like a write that timed out, give up on the connection if the budget isn't freed up in time
+    steady_clock::time_point now = steady_clock::now();
+    if (now >= give_up) {
+        return shared_ptr<Pollable>();
+    }
+    if (output_timer == NULL) {
+        output_timer = make_shared<Timer>();
+    }
+    return output_timer->arm(std::min(now + OUTPUT_RETRY_INTERVAL, give_up), [this, callback, give_up]() -> shared_ptr<Pollable> {
+        return wait_for_output_room(callback, give_up);
+    });
+}
+
 std::shared_ptr<Pollable> AsyncSocketConnection::read(Callback<string>::F callback) {
-    return make_shared<SocketReadPollable>(conn, callback);
+    return read_until(shared_ptr<ByteBuffer>(), "", std::move(callback));
+}
+
+std::shared_ptr<Pollable> AsyncSocketConnection::read_until(shared_ptr<ByteBuffer> buffer, string sep, Callback<string>::F callback,
+                                                            bool idle) {
+    // only allocate a new pollable if the pooled one is still in use
+    if (read_pollable == NULL || !read_pollable->is_done()) {
+        read_pollable = make_shared<SocketReadPollable>(conn);
+    }
+    read_pollable->arm(buffer, sep, std::move(callback), timeouts, idle, idle_connections);
+    return read_pollable;
 }
 
 std::shared_ptr<Pollable> AsyncSocketConnection::write(string msg, Callback<>::F callback) {
-    return make_shared<SocketWritePollable>(conn, msg, callback);
+    if (write_pollable == NULL || !write_pollable->is_done()) {
+        write_pollable = make_shared<SocketWritePollable>(conn);
+    }
+    write_pollable->arm(msg, std::move(callback), timeouts.writing, output_limits);
+    return send_now();
 }
 
-AsyncSocketConnection::AsyncSocketConnection(AsyncSocketConnection&& other)
-        : conn(make_shared<AutoClosingSocket>(other.conn->client_sock)), client_remote_ip(other.client_remote_ip) {
-    other.conn->client_sock = INVALID_SOCK;
+std::shared_ptr<Pollable> AsyncSocketConnection::writev(vector<string>& parts, Callback<>::F callback) {
+    if (write_pollable == NULL || !write_pollable->is_done()) {
+        write_pollable = make_shared<SocketWritePollable>(conn);
+    }
+    write_pollable->arm(parts, std::move(callback), timeouts.writing, output_limits);
+    return send_now();
 }
 
+std::shared_ptr<Pollable> AsyncSocketConnection::send_now() {
+    // most messages fit in the socket's send buffer, so try to send right away and only wait for the
+    // socket to become writable if it fills up
+    shared_ptr<Pollable> next_pollable = write_pollable->notify(POLLOUT);
+    if (next_pollable == NULL && !write_pollable->is_done()) {
+        return write_pollable;
+    }
+    return next_pollable;
+}
 
-AsyncBufferedConnection::AsyncBufferedConnection(std::shared_ptr<AsyncSocketConnection> conn)
-        : conn(conn), buffer(make_shared<stringstream>()) {}
+std::shared_ptr<Pollable> AsyncSocketConnection::write_file(shared_ptr<FileBody> file, Callback<>::F callback) {
+    if (sendfile_pollable == NULL || !sendfile_pollable->is_done()) {
+        sendfile_pollable = make_shared<SocketSendfilePollable>(conn);
+    }
+    sendfile_pollable->arm(file, std::move(callback), timeouts.writing, output_limits);
 
-Callback<string>::F make_read_into_buffer(shared_ptr<AsyncSocketConnection> conn, shared_ptr<stringstream> buffer, string sep, Callback<string>::F callback) {
-    return [=](string buf_str) -> shared_ptr<Pollable> {
-        buffer->seekp(0, ios::end);
-        (*buffer) << buf_str;
+    // as with write, send what fits in the socket's send buffer right away
+    shared_ptr<Pollable> next_pollable = sendfile_pollable->notify(POLLOUT);
+    if (next_pollable == NULL && !sendfile_pollable->is_done()) {
+        return sendfile_pollable;
+    }
+    return next_pollable;
+}
 
-        size_t split_pos = buffer->str().find(sep, 0);
-        if (split_pos != string::npos) {
-            string content = pop_n_sstream(*buffer, split_pos, sep.size());
-            return callback(content);
-        } else {
-            return conn->read(make_read_into_buffer(conn, buffer, sep, callback));
-        }
-    };
+AsyncSocketConnection::AsyncSocketConnection(AsyncSocketConnection&& other)
+        : conn(make_shared<AutoClosingSocket>(other.conn->client_sock)), client_remote_ip(other.client_remote_ip),
+          timeouts(other.timeouts), idle_connections(other.idle_connections), output_limits(other.output_limits) {
+    conn->zerocopy = std::move(other.conn->zerocopy);
+    other.conn->client_sock = INVALID_SOCK;
 }
 
-std::shared_ptr<Pollable> AsyncBufferedConnection::read_until(std::string sep, Callback<std::string>::F callback) {
+
+AsyncBufferedConnection::AsyncBufferedConnection(std::shared_ptr<AsyncSocketConnection> conn)
+        : conn(conn), buffer(make_shared<ByteBuffer>()) {}
+
+std::shared_ptr<Pollable> AsyncBufferedConnection::read_until(std::string sep, Callback<std::string>::F callback, bool idle) {
     // first try to read from the buffer by checking for the separator
-    size_t pos = buffer->str().find(sep, 0);
+    size_t pos = buffer->find(sep);
     if (pos != string::npos) {
-        string content = pop_n_sstream(*buffer, pos, sep.size());
+        string content = buffer->pop(pos, sep.size());
         return callback(content);
     }
 
-    return conn->read(make_read_into_buffer(conn, buffer, sep, callback));
+    // part of the next message has already arrived, so the connection isn't idle
+    return conn->read_until(buffer, sep, std::move(callback), idle && buffer->empty());
+}
+
+bool AsyncBufferedConnection::has_buffered(const string& sep) {
+    return buffer->find(sep) != string::npos;
+}
+
+size_t AsyncBufferedConnection::output_room() {
+    return conn->output_room();
+}
+
+std::shared_ptr<Pollable> AsyncBufferedConnection::wait_for_output_room(Callback<>::F callback) {
+    return conn->wait_for_output_room(std::move(callback));
 }
 
 std::shared_ptr<Pollable> AsyncBufferedConnection::write(std::string s, Callback<>::F callback) {
-    return conn->write(s, callback);
+    return conn->write(std::move(s), std::move(callback));
+}
+
+std::shared_ptr<Pollable> AsyncBufferedConnection::writev(vector<string>& parts, Callback<>::F callback) {
+    return conn->writev(parts, std::move(callback));
+}
+
+std::shared_ptr<Pollable> AsyncBufferedConnection::write_file(shared_ptr<FileBody> file, Callback<>::F callback) {
+    return conn->write_file(file, std::move(callback));
 }
 
 struct in_addr AsyncBufferedConnection::get_remote_ip() {
@@ -2,41 +2,150 @@
 #define ASYNC_CONNECTION_H
 
 #include <functional>
+#include <list>
 #include <netinet/in.h>
 #include <memory>
-#include <sstream>
+#include <string>
+#include <vector>
 #include "async_event_loop.h"
+#include "byte_buffer.h"
+#include "connection.h"
+#include "http.h"
+
+class ZerocopySends;
 
 /*
  * AutoClosingSocket wraps a socket and calls close on it in its destructor.
  * The socket is a public member and there are no other convenience functions provided.
+ *
+ * If MSG_ZEROCOPY sends are enabled on the socket, `zerocopy` tracks the buffers that the kernel
+ * may still be reading. A socket that is destroyed while the kernel still holds some of them is
+ * shut down right away, but it is only closed once the kernel has released them (see ZerocopySends).
  */
 struct AutoClosingSocket {
     int client_sock;
+    std::shared_ptr<ZerocopySends> zerocopy;
 
     AutoClosingSocket(int sock);
     ~AutoClosingSocket();
+
+    // reap_zerocopy frees the buffers that the kernel has released, which is reported with POLLERR
+    void reap_zerocopy();
+};
+
+class SocketReadPollable;
+class SocketWritePollable;
+class SocketSendfilePollable;
+
+
+/*
+ * OutputLimits bounds the response data that connections hold in memory until their clients read it.
+ * max_connection_bytes: the most one connection produces ahead of its client, e.g. in one streamed chunk
+ * max_total_bytes: the most that every connection in the process holds together (see OutputStats)
+ * min_send_rate: the bytes per second a client must read at once a write has been waiting on it for
+ *                `slow_reader_grace`, or it is dropped as a slow reader
+ * zerocopy_threshold: writes of at least this many bytes are sent with MSG_ZEROCOPY, so the kernel
+ *                     sends them straight from our buffers instead of copying them. 0 disables it
+ */
+struct OutputLimits {
+    size_t max_connection_bytes;
+    size_t max_total_bytes;
+    size_t min_send_rate;
+    std::chrono::milliseconds slow_reader_grace;
+    size_t zerocopy_threshold;
+};
+
+const OutputLimits DEFAULT_OUTPUT_LIMITS = OutputLimits{256 * 1024, 64 * 1024 * 1024, 1024, std::chrono::milliseconds(2000), 0};
+
+// a threshold to enable MSG_ZEROCOPY with: it costs a page pinning and a notification per send,
+// which only pays off over copying for sends of a few pages or more
+const size_t DEFAULT_ZEROCOPY_THRESHOLD = 32 * 1024;
+
+
+/*
+ * IdleConnectionList tracks the kept alive connections of one event loop that are waiting for
+ * their next request, from least to most recently used, and holds at most `max_idle` of them.
+ * Connections join it when they start an idle read and leave it once anything arrives.
+ * Once it is full, the least recently used connection is evicted to make room, either for another
+ * idle connection or, with `make_room`, for a newly accepted one, so that a flood of connections
+ * sheds the idle ones first. Eviction shuts the socket down, which ends the pending read as if the
+ * client had closed the connection.
+ */
+class IdleConnectionList {
+    std::list<SocketReadPollable*> connections;
+    size_t max_idle;
+
+    void evict_until(size_t size);
+
+public:
+    typedef std::list<SocketReadPollable*>::iterator Entry;
+
+    IdleConnectionList(size_t max_idle);
+
+    Entry add(SocketReadPollable* connection);
+    void remove(Entry entry);
+    void make_room();
+    size_t size();
 };
 
 /*
  * AsyncSocketConnection represents a nonblocking bydirectional bytestream.
  * `read` takes a callback to be invoked when data is ready and returns a Pollable
  *        to be enqueued in the event loop
+ * `read_until` keeps reading into the given buffer until it contains `sep`, then removes the
+ *        content before `sep` from the buffer and invokes the callback with it
  * `write` takes a string to write and a callback to invoke when the write is complete
  *        and returns a Pollable to be enqueued in the event loop
+ * `writev` is like `write`, but sends a list of parts with one sendmsg() without joining them.
+ *        It takes the parts by swapping them out of the given vector, so they aren't copied
+ * `write_file` is like `write`, but sends a range of a file with sendfile(), so its contents
+ *        go from the page cache to the socket without being copied through user space
+ * The connection keeps one read and one write pollable that are re-armed for each operation,
+ * so a keep-alive connection doesn't allocate pollables in steady state.
+ *
+ * Reads time out after the READING_HEADERS timeout, and writes after the WRITING timeout.
+ * A read started with `idle` set instead waits for its first bytes with the IDLE timeout and
+ * meanwhile holds a place in the IdleConnectionList, if the connection has one.
+ * `configure` sets the timeouts, the IdleConnectionList and the OutputLimits, and enables
+ * SO_ZEROCOPY on the socket if they have a zerocopy threshold and the socket supports it.
+ *
+ * The bytes that a write still has to send count against the OutputLimits until they are sent, and a
+ * write that waits on a client reading slower than the minimum rate gives up on the connection.
+ * `output_room` is how much more the connection may produce right now, and `wait_for_output_room`
+ * invokes its callback once that is more than nothing, or gives up after the WRITING timeout.
+ * It checks again every so often with a Timer, so like any Timer it relies on something else,
+ * like the server's listener, to keep the event loop running.
  */
 class AsyncSocketConnection {
     std::shared_ptr<AutoClosingSocket> conn;
     struct in_addr client_remote_ip;
+    ConnectionTimeouts timeouts;
+    std::shared_ptr<IdleConnectionList> idle_connections;
+    OutputLimits output_limits;
+    std::shared_ptr<SocketReadPollable> read_pollable;
+    std::shared_ptr<SocketWritePollable> write_pollable;
+    std::shared_ptr<SocketSendfilePollable> sendfile_pollable;
+    std::shared_ptr<Timer> output_timer;
+
+    std::shared_ptr<Pollable> send_now();
+    std::shared_ptr<Pollable> wait_for_output_room(Callback<>::F callback, std::chrono::steady_clock::time_point give_up);
 
 public:
     AsyncSocketConnection(int client_sock, struct in_addr client_remote_ip);
     AsyncSocketConnection(AsyncSocketConnection&&);
 
     struct in_addr get_remote_ip();
+    void configure(ConnectionTimeouts timeouts, std::shared_ptr<IdleConnectionList> idle_connections,
+                   OutputLimits output_limits = DEFAULT_OUTPUT_LIMITS);
+    size_t output_room();
+    std::shared_ptr<Pollable> wait_for_output_room(Callback<>::F callback);
 
     virtual std::shared_ptr<Pollable> read(Callback<std::string>::F callback);
+    virtual std::shared_ptr<Pollable> read_until(std::shared_ptr<ByteBuffer> buffer, std::string sep,
+                                                 Callback<std::string>::F callback, bool idle = false);
     virtual std::shared_ptr<Pollable> write(std::string, Callback<>::F callback);
+    virtual std::shared_ptr<Pollable> writev(std::vector<std::string>& parts, Callback<>::F callback);
+    virtual std::shared_ptr<Pollable> write_file(std::shared_ptr<FileBody> file, Callback<>::F callback);
 };
 
 
@@ -45,18 +154,25 @@ public:
  * allowing read_until operations similar to BufferedConnection in connection.h
  * As above, `read_until` and `write` take callbacks to be invoked when their operation is complete
  * and return pollables to be enqueued in the event loop.
+ * `has_buffered` checks whether the next `read_until` can complete without reading.
+ * A `read_until` with `idle` set only waits as an idle read if nothing at all is buffered yet.
  */
 class AsyncBufferedConnection {
     std::shared_ptr<AsyncSocketConnection> conn;
-    std::shared_ptr<std::stringstream> buffer;
+    std::shared_ptr<ByteBuffer> buffer;
 
 public:
     AsyncBufferedConnection(std::shared_ptr<AsyncSocketConnection> conn);
 
     struct in_addr get_remote_ip();
 
-    virtual std::shared_ptr<Pollable> read_until(std::string sep, Callback<std::string>::F callback);
+    virtual std::shared_ptr<Pollable> read_until(std::string sep, Callback<std::string>::F callback, bool idle = false);
+    virtual bool has_buffered(const std::string& sep);
+    virtual size_t output_room();
+    virtual std::shared_ptr<Pollable> wait_for_output_room(Callback<>::F callback);
     virtual std::shared_ptr<Pollable> write(std::string, Callback<>::F callback);
+    virtual std::shared_ptr<Pollable> writev(std::vector<std::string>& parts, Callback<>::F callback);
+    virtual std::shared_ptr<Pollable> write_file(std::shared_ptr<FileBody> file, Callback<>::F callback);
 };
 
 
@@ -0,0 +1,54 @@
+#include <stdexcept>
+#include "async_coroutine.h"
+
+using std::logic_error;
+using std::shared_ptr;
+
+
+AsyncCoroutine::AsyncCoroutine() : running(false), ready(false), run_cost(0), resume_point(0) {}
+
+shared_ptr<Pollable> AsyncCoroutine::start() {
+    running = true;
+    run_cost = 0;
+    shared_ptr<Pollable> pollable;
+    try {
+        pollable = body();
+    } catch (...) {
+        running = false;
+        throw;
+    }
+    running = false;
+    return pollable;
+}
+
+shared_ptr<Pollable> AsyncCoroutine::resumed() {
+    // the operation completed synchronously, so let CO_AWAIT continue instead of recursing into body
+    if (running) {
+        ready = true;
+        return shared_ptr<Pollable>();
+    }
+    return start();
+}
+
+void AsyncCoroutine::await_begin() {
+    ready = false;
+}
+
+bool AsyncCoroutine::await_ready(const shared_ptr<Pollable>& pollable) {
+    if (ready && pollable != NULL) {
+        throw logic_error("awaited operation completed but returned a pollable");
+    }
+    return ready;
+}
+
+Callback<>::F AsyncCoroutine::resume_with() {
+    shared_ptr<AsyncCoroutine> self = shared_from_this();
+    return [self]() -> shared_ptr<Pollable> {
+        return self->resumed();
+    };
+}
+
+bool AsyncCoroutine::charge(int cost, int budget) {
+    run_cost += cost;
+    return run_cost >= budget;
+}
@@ -0,0 +1,114 @@
+#ifndef ASYNC_COROUTINE_H
+#define ASYNC_COROUTINE_H
+
+#include <memory>
+#include "async_event_loop.h"
+
+
+/*
+ * AsyncCoroutine is a stackless coroutine for writing a multi step async operation as straight
+ * line code instead of nested callbacks, in the style of boost::asio::coroutine.
+ * Subclasses keep all of the operation's state in members and implement `body` between
+ * CO_BEGIN and CO_END, awaiting any callback based operation (read_until, write, read_file,
+ * read_contents, ...) with CO_AWAIT and `resume_with`:
+ *
+ *     CO_BEGIN
+ *     CO_AWAIT(repository->read_file(path, resume_with(file)));
+ *     if (file == NULL) {
+ *         return callback(not_found_response());
+ *     }
+ *     CO_AWAIT(file->read_contents(resume_with(contents)));
+ *     ...
+ *     CO_END
+ *
+ * The coroutine is allocated once per operation and every continuation it hands out only
+ * captures a pointer to it, so awaiting doesn't copy the operation's state into a new closure.
+ * If an awaited operation completes synchronously, `body` simply continues rather than being
+ * called again from inside the callback, so the stack doesn't grow with each completed step.
+ *
+ * A coroutine that could keep completing synchronously for a long time, like a connection with
+ * many pipelined requests, can `charge` each step against a budget and CO_YIELD once it is used
+ * up, which continues it on the next iteration of the event loop so that other pollables get a turn.
+ *
+ * Local variables don't survive a CO_AWAIT and each CO_AWAIT must be on its own line.
+ * Coroutines must be created with std::make_shared and started with `start`.
+ */
+class AsyncCoroutine : public std::enable_shared_from_this<AsyncCoroutine> {
+    bool running;
+    bool ready;
+    int run_cost;
+
+    std::shared_ptr<Pollable> resumed();
+
+protected:
+    int resume_point;
+
+    AsyncCoroutine();
+
+    // body runs the coroutine from its current resume point and returns the Pollable it is
+    // waiting on, or whatever it returns once it is finished
+    virtual std::shared_ptr<Pollable> body() = 0;
+
+    // await_begin and await_ready are used by CO_AWAIT to tell whether the awaited operation has
+    // already completed, in which case the coroutine continues instead of suspending. An operation
+    // that completed has nothing left to wait on, so await_ready throws std::logic_error if it still
+    // returned a Pollable, which would otherwise never be registered
+    void await_begin();
+    bool await_ready(const std::shared_ptr<Pollable>& pollable);
+
+    /*
+     * resume_with returns a callback that stores its result in `slot` and resumes the coroutine.
+     * `slot` must be a member of the coroutine.
+     */
+    template<class T>
+    typename Callback<T>::F resume_with(T& slot) {
+        std::shared_ptr<AsyncCoroutine> self = shared_from_this();
+        T* target = &slot;
+        return [self, target](T value) -> std::shared_ptr<Pollable> {
+            *target = std::move(value);
+            return self->resumed();
+        };
+    }
+
+    Callback<>::F resume_with();
+
+    // charge adds `cost` to the work done since the coroutine was last resumed by the event loop and
+    // returns true once that reaches `budget`, in which case the coroutine should CO_YIELD
+    bool charge(int cost, int budget);
+
+public:
+    virtual ~AsyncCoroutine() {};
+
+    // start runs the coroutine until it first suspends and returns the Pollable it is waiting on
+    std::shared_ptr<Pollable> start();
+};
+
+
+// CO_AWAIT falls through into the case that resumes it, which gcc warns about unless it's marked
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 7
+#define CO_FALLTHROUGH __attribute__ ((fallthrough))
+#else
+#define CO_FALLTHROUGH
+#endif
+
+#define CO_BEGIN switch (resume_point) { case 0:
+
+#define CO_AWAIT(operation) \
+    do { \
+        resume_point = __LINE__; \
+        await_begin(); \
+        { \
+            std::shared_ptr<Pollable> co_pollable = (operation); \
+            if (!await_ready(co_pollable)) { \
+                return co_pollable; \
+            } \
+        } \
+        CO_FALLTHROUGH; \
+        case __LINE__: ; \
+    } while (0)
+
+#define CO_YIELD CO_AWAIT(make_runnable(resume_with()))
+
+#define CO_END } return std::shared_ptr<Pollable>();
+
+#endif //ASYNC_COROUTINE_H
@@ -0,0 +1,396 @@
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fstream>
+#include <poll.h>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "async_dns_client.h"
+#include "util.h"
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::enable_shared_from_this;
+using std::make_shared;
+using std::runtime_error;
+using std::shared_ptr;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+#define DNS_PORT (53)
+#define DNS_HEADER_SIZE (12)
+#define DNS_MAX_MESSAGE_SIZE (512)
+#define DNS_MAX_LABEL_SIZE (63)
+#define DNS_MAX_NAME_SIZE (253)
+#define DNS_TYPE_A (1)
+#define DNS_CLASS_IN (1)
+#define DNS_FLAG_RESPONSE (0x8000)
+#define DNS_FLAG_TRUNCATED (0x0200)
+#define DNS_FLAG_RECURSION_DESIRED (0x0100)
+#define DNS_RCODE_MASK (0x000F)
+#define DNS_RCODE_NXDOMAIN (3)
+#define DNS_POINTER_MASK (0xC0)
+
+
+uint16_t read_u16(const string& message, size_t pos) {
+    return (uint16_t) (((unsigned char) message[pos] << 8) | (unsigned char) message[pos + 1]);
+}
+
+void append_u16(string& message, uint16_t value) {
+    message.push_back((char) (value >> 8));
+    message.push_back((char) (value & 0xFF));
+}
+
+// skip_name moves `pos` past the (possibly compressed) domain name starting at it, or returns false if it's malformed
+bool skip_name(const string& message, size_t& pos) {
+    while (pos < message.size()) {
+        unsigned char length = (unsigned char) message[pos];
+        if ((length & DNS_POINTER_MASK) == DNS_POINTER_MASK) {
+            pos += 2;
+            return pos <= message.size();
+        }
+        pos += 1 + length;
+        if (length == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+string make_dns_query(uint16_t id, string domain) {
+    if (ends_with(domain, ".")) {
+        domain.pop_back();
+    }
+    if (domain.empty() || domain.size() > DNS_MAX_NAME_SIZE) {
+        throw runtime_error("invalid domain name: '" + domain + "'");
+    }
+
+    string query;
+    append_u16(query, id);
+    append_u16(query, DNS_FLAG_RECURSION_DESIRED);
+    append_u16(query, 1);
+    append_u16(query, 0);
+    append_u16(query, 0);
+    append_u16(query, 0);
+
+    vector<string> labels = split(domain, ".");
+    for (size_t i = 0; i < labels.size(); i++) {
+        if (labels[i].empty() || labels[i].size() > DNS_MAX_LABEL_SIZE) {
+            throw runtime_error("invalid domain name: '" + domain + "'");
+        }
+        query.push_back((char) labels[i].size());
+        query += labels[i];
+    }
+    query.push_back('\0');
+
+    append_u16(query, DNS_TYPE_A);
+    append_u16(query, DNS_CLASS_IN);
+    return query;
+}
+
+bool parse_dns_response(const string& query, const string& response, DnsAnswer& answer) {
+    if (response.size() < query.size() || read_u16(response, 0) != read_u16(query, 0)) {
+        return false;
+    }
+
+    uint16_t flags = read_u16(response, 2);
+    if ((flags & DNS_FLAG_RESPONSE) == 0 || read_u16(response, 4) != 1) {
+        return false;
+    }
+
+    // the reply repeats the question, so make sure it answers the domain that was asked about
+    string asked = to_lowercase(query.substr(DNS_HEADER_SIZE));
+    if (to_lowercase(response.substr(DNS_HEADER_SIZE, asked.size())) != asked) {
+        return false;
+    }
+
+    answer.addresses.clear();
+    if ((flags & DNS_FLAG_TRUNCATED) != 0) {
+        // the records that fit may not be all of them, and getting the rest would take TCP
+        answer.error = "truncated reply";
+        return true;
+    }
+
+    uint16_t rcode = flags & DNS_RCODE_MASK;
+    if (rcode == DNS_RCODE_NXDOMAIN) {
+        answer.error = "no such domain";
+        return true;
+    } else if (rcode != 0) {
+        answer.error = "nameserver failed with rcode " + to_string(rcode);
+        return true;
+    }
+
+    // collect every A record, which includes the targets of any CNAMEs that the nameserver followed
+    uint16_t answer_count = read_u16(response, 6);
+    size_t pos = query.size();
+    for (uint16_t i = 0; i < answer_count; i++) {
+        if (!skip_name(response, pos) || pos + 10 > response.size()) {
+            return false;
+        }
+        uint16_t type = read_u16(response, pos);
+        uint16_t rclass = read_u16(response, pos + 2);
+        uint16_t data_length = read_u16(response, pos + 8);
+        pos += 10;
+        if (pos + data_length > response.size()) {
+            return false;
+        }
+
+        if (type == DNS_TYPE_A && rclass == DNS_CLASS_IN && data_length == sizeof(struct in_addr)) {
+            struct in_addr address;
+            memcpy(&address, response.data() + pos, sizeof(address));
+            answer.addresses.push_back(address);
+        }
+        pos += data_length;
+    }
+
+    answer.error = answer.addresses.empty() ? "no addresses for domain" : "";
+    return true;
+}
+
+struct sockaddr_in resolv_conf_nameserver(string path) {
+    struct sockaddr_in nameserver;
+    bzero(&nameserver, sizeof(nameserver));
+    nameserver.sin_family = AF_INET;
+    nameserver.sin_port = htons(DNS_PORT);
+    nameserver.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    std::ifstream resolv_conf(path);
+    string line;
+    while (std::getline(resolv_conf, line)) {
+        std::stringstream words(line);
+        string keyword;
+        string address;
+        words >> keyword >> address;
+        if (keyword == "nameserver" && inet_pton(AF_INET, address.c_str(), &nameserver.sin_addr) == 1) {
+            break;
+        }
+    }
+    return nameserver;
+}
+
+unordered_map<string, vector<struct in_addr>> read_hosts_file(string path) {
+    unordered_map<string, vector<struct in_addr>> hosts;
+    std::ifstream hosts_file(path);
+    string line;
+    while (std::getline(hosts_file, line)) {
+        std::stringstream words(line.substr(0, line.find('#')));
+        string address_str;
+        struct in_addr address;
+        // ipv6 entries are skipped, since only ipv4 addresses are looked up
+        if (!(words >> address_str) || inet_pton(AF_INET, address_str.c_str(), &address) != 1) {
+            continue;
+        }
+
+        string name;
+        while (words >> name) {
+            hosts[to_lowercase(name)].push_back(address);
+        }
+    }
+    return hosts;
+}
+
+
+/*
+ * DnsLookupPollable performs one AsyncDnsClient::lookup. It sends a query for every domain from a
+ * single UDP socket connected to the nameserver, then reads replies whenever the socket is readable
+ * and matches them to the outstanding queries by id. Its deadline is the end of the current attempt:
+ * when it expires, any unanswered queries are sent again and the pollable re-registers itself, until
+ * the attempts run out and the remaining domains are reported as timed out.
+ */
+class DnsLookupPollable : public Pollable, public enable_shared_from_this<DnsLookupPollable> {
+    int sock;
+    milliseconds timeout;
+    int attempts_left;
+    Callback<vector<DnsAnswer>>::F callback;
+
+    vector<DnsAnswer> answers;
+    vector<string> queries;
+    vector<bool> pending;
+    size_t num_pending;
+    steady_clock::time_point deadline;
+    bool done;
+
+    void send_pending() {
+        for (size_t i = 0; i < queries.size(); i++) {
+            // a lost datagram is just retried on the next attempt, so send errors aren't fatal
+            if (pending[i]) {
+                ::send(sock, queries[i].data(), queries[i].size(), MSG_NOSIGNAL);
+            }
+        }
+        deadline = steady_clock::now() + timeout;
+    }
+
+    void receive(const string& response) {
+        if (response.size() < DNS_HEADER_SIZE) {
+            return;
+        }
+
+        uint16_t id = read_u16(response, 0);
+        for (size_t i = 0; i < queries.size(); i++) {
+            if (pending[i] && read_u16(queries[i], 0) == id && parse_dns_response(queries[i], response, answers[i])) {
+                pending[i] = false;
+                num_pending--;
+                return;
+            }
+        }
+    }
+
+    shared_ptr<Pollable> finish() {
+        done = true;
+        Callback<vector<DnsAnswer>>::F finished = std::move(callback);
+        callback = Callback<vector<DnsAnswer>>::empty();
+        return finished(std::move(answers));
+    }
+
+public:
+    DnsLookupPollable(struct sockaddr_in nameserver, milliseconds timeout, int attempts,
+                      const unordered_map<string, vector<struct in_addr>>& hosts, vector<string> domains,
+                      Callback<vector<DnsAnswer>>::F callback)
+            : sock(-1), timeout(timeout), attempts_left(attempts), callback(callback),
+              answers(domains.size()), queries(domains.size()), pending(domains.size(), false), num_pending(0),
+              deadline(NO_DEADLINE), done(false) {
+        std::random_device random;
+        for (size_t i = 0; i < domains.size(); i++) {
+            answers[i].domain = domains[i];
+
+            struct in_addr literal;
+            if (inet_pton(AF_INET, domains[i].c_str(), &literal) == 1) {
+                answers[i].addresses.push_back(literal);
+                continue;
+            }
+
+            string name = to_lowercase(domains[i]);
+            if (ends_with(name, ".")) {
+                name.pop_back();
+            }
+            unordered_map<string, vector<struct in_addr>>::const_iterator host = hosts.find(name);
+            if (host != hosts.end()) {
+                answers[i].addresses = host->second;
+                continue;
+            }
+
+            try {
+                // ids only have to be unpredictable and distinct among this lookup's queries
+                uint16_t id;
+                do {
+                    id = (uint16_t) random();
+                } while (std::find_if(queries.begin(), queries.end(), [id](const string& query) {
+                    return !query.empty() && read_u16(query, 0) == id;
+                }) != queries.end());
+
+                queries[i] = make_dns_query(id, domains[i]);
+                pending[i] = true;
+                num_pending++;
+            } catch (runtime_error& e) {
+                answers[i].error = e.what();
+            }
+        }
+
+        if (num_pending == 0) {
+            return;
+        }
+
+        sock = socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+        if (sock < 0) {
+            throw runtime_error(errno_message("socket() failed: "));
+        }
+        // connecting makes the kernel drop datagrams that don't come from the nameserver
+        if (connect(sock, (struct sockaddr*) &nameserver, sizeof(nameserver)) < 0) {
+            close(sock);
+            throw runtime_error(errno_message("connect() failed: "));
+        }
+    }
+
+    virtual ~DnsLookupPollable() {
+        if (sock >= 0) {
+            close(sock);
+        }
+    }
+
+    // start sends the queries and returns this pollable to wait for the replies, or finishes right
+    // away if every domain was answered without a query
+    shared_ptr<Pollable> start() {
+        if (num_pending == 0) {
+            return finish();
+        }
+        attempts_left--;
+        send_pending();
+        return shared_from_this();
+    }
+
+    virtual int get_fd() {
+        return sock;
+    }
+
+    virtual short get_events() {
+        return POLLIN;
+    }
+
+    virtual bool is_done() {
+        return done;
+    }
+
+    virtual steady_clock::time_point get_deadline() {
+        return deadline;
+    }
+
+    virtual shared_ptr<Pollable> notify(short) {
+        char buf[DNS_MAX_MESSAGE_SIZE];
+        while (num_pending > 0) {
+            ssize_t received = ::recv(sock, buf, sizeof(buf), 0);
+            if (received >= 0) {
+                receive(string(buf, received));
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return shared_ptr<Pollable>();
+            } else if (errno != EINTR) {
+                // ECONNREFUSED means that nothing listens on the nameserver's port, so retrying won't help
+                // either. Any error fails the lookups that are left, rather than leaving the caller waiting
+                string error = errno == ECONNREFUSED ? "nameserver refused the query" : errno_message("recv() failed: ");
+                for (size_t i = 0; i < answers.size(); i++) {
+                    if (pending[i]) {
+                        answers[i].error = error;
+                    }
+                }
+                break;
+            }
+        }
+        return finish();
+    }
+
+    virtual shared_ptr<Pollable> expire() {
+        if (attempts_left > 0) {
+            attempts_left--;
+            send_pending();
+            return shared_from_this();
+        }
+
+        for (size_t i = 0; i < answers.size(); i++) {
+            if (pending[i]) {
+                answers[i].error = "timed out";
+            }
+        }
+        return finish();
+    }
+
+    virtual void cancel() {
+        done = true;
+        callback = Callback<vector<DnsAnswer>>::empty();
+    }
+};
+
+
+AsyncDnsClient::AsyncDnsClient() : AsyncDnsClient(resolv_conf_nameserver()) {}
+
+AsyncDnsClient::AsyncDnsClient(struct sockaddr_in nameserver, milliseconds timeout, int attempts,
+                               unordered_map<string, vector<struct in_addr>> hosts)
+        : nameserver(nameserver), timeout(timeout), attempts(attempts), hosts(hosts) {}
+
+shared_ptr<Pollable> AsyncDnsClient::lookup(vector<string> domains, Callback<vector<DnsAnswer>>::F callback) {
+    return make_shared<DnsLookupPollable>(nameserver, timeout, attempts, hosts, domains, callback)->start();
+}
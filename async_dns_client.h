@@ -0,0 +1,80 @@
+#ifndef ASYNC_DNS_CLIENT_H
+#define ASYNC_DNS_CLIENT_H
+
+#include <chrono>
+#include <memory>
+#include <netinet/in.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "async_event_loop.h"
+
+
+const std::chrono::milliseconds DEFAULT_DNS_TIMEOUT(2000);
+const int DEFAULT_DNS_ATTEMPTS = 3;
+
+
+/*
+ * DnsAnswer is the result of looking up a single domain with AsyncDnsClient.
+ * `error` describes why the lookup failed, or is empty if it succeeded.
+ */
+struct DnsAnswer {
+    std::string domain;
+    std::vector<struct in_addr> addresses;
+    std::string error;
+};
+
+
+/*
+ * read_hosts_file returns the ipv4 addresses of each name in the hosts file at `path`, with the
+ * names lowercased, or no names at all if the file can't be read.
+ */
+std::unordered_map<std::string, std::vector<struct in_addr>> read_hosts_file(std::string path = "/etc/hosts");
+
+
+/*
+ * AsyncDnsClient looks up the ipv4 addresses of domains like NetworkDnsClient from dns_client.h,
+ * but in a non-blocking manner. Rather than calling getaddrinfo on a thread, it sends its own
+ * A queries over UDP to a single nameserver and waits for the replies on the event loop.
+ *
+ * All of the domains passed to one `lookup` are queried at the same time over one socket, and
+ * each reply is matched back to its query by id. A query that hasn't been answered `timeout`
+ * after it was sent is sent again, up to `attempts` times in total.
+ * Literal ip addresses and the names in `hosts`, which is read from /etc/hosts by default, are
+ * answered without a query, like getaddrinfo would. Search domains are not used.
+ * A truncated reply is a failed lookup, since the client doesn't retry over TCP.
+ *
+ * The client only holds its configuration, so it can be shared between event loops.
+ */
+class AsyncDnsClient {
+    struct sockaddr_in nameserver;
+    std::chrono::milliseconds timeout;
+    int attempts;
+    std::unordered_map<std::string, std::vector<struct in_addr>> hosts;
+
+public:
+    AsyncDnsClient();
+    AsyncDnsClient(struct sockaddr_in nameserver, std::chrono::milliseconds timeout = DEFAULT_DNS_TIMEOUT,
+                   int attempts = DEFAULT_DNS_ATTEMPTS,
+                   std::unordered_map<std::string, std::vector<struct in_addr>> hosts = read_hosts_file());
+
+    // lookup passes one DnsAnswer per domain, in the same order, to `callback` once every lookup has finished
+    std::shared_ptr<Pollable> lookup(std::vector<std::string> domains, Callback<std::vector<DnsAnswer>>::F callback);
+};
+
+
+/*
+ * resolv_conf_nameserver returns the first ipv4 nameserver listed in the resolv.conf file at `path`,
+ * or the local nameserver at 127.0.0.1 if there isn't one, like the resolver in libc.
+ */
+struct sockaddr_in resolv_conf_nameserver(std::string path = "/etc/resolv.conf");
+
+/*
+ * Convenience functions for building and parsing DNS messages, exposed for testing.
+ * make_dns_query throws a runtime_error if `domain` isn't a valid domain name. parse_dns_response
+ * returns false if `response` is not a well formed reply to `query`.
+ */
+std::string make_dns_query(uint16_t id, std::string domain);
+bool parse_dns_response(const std::string& query, const std::string& response, DnsAnswer& answer);
+
+#endif //ASYNC_DNS_CLIENT_H
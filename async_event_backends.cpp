@@ -0,0 +1,320 @@
+#include <errno.h>
+#include <iostream>
+#include <stdexcept>
+#include <strings.h>
+#include <unistd.h>
+#include "async_event_backends.h"
+#include "util.h"
+
+using std::invalid_argument;
+using std::make_shared;
+using std::runtime_error;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+#define EPOLL_BATCH_SIZE (1024)
+#define URING_ENTRIES (4096)
+
+// io_uring user_data is tagged in its top byte with the kind of request it belongs to.
+// poll requests also carry a generation so that completions of re-armed or removed polls are ignored
+#define TAG_SHIFT (56)
+#define POLL_TAG (1ULL << TAG_SHIFT)
+#define COMPLETION_TAG (2ULL << TAG_SHIFT)
+#define IGNORED_TAG (3ULL << TAG_SHIFT)
+#define GENERATION_MASK ((1ULL << (TAG_SHIFT - 32)) - 1)
+
+
+bool PollEventBackend::add(int fd, short events) {
+    indices[fd] = pollfds.size();
+    pollfds.push_back(pollfd{fd, events, 0});
+    return true;
+}
+
+void PollEventBackend::modify(int fd, short events) {
+    pollfds[indices.at(fd)].events = events;
+}
+
+void PollEventBackend::remove(int fd) {
+    // swap the removed entry with the last one so that removal is O(1)
+    size_t index = indices.at(fd);
+    size_t last = pollfds.size() - 1;
+    if (index != last) {
+        pollfds[index] = pollfds[last];
+        indices[pollfds[index].fd] = index;
+    }
+    pollfds.pop_back();
+    indices.erase(fd);
+}
+
+void PollEventBackend::wait(int timeout_ms, vector<ReadyEvent>& ready) {
+    int ret = ::poll(pollfds.data(), pollfds.size(), timeout_ms);
+    if (ret < 0 && errno != EINTR) {
+        throw runtime_error(errno_message("poll() failed: "));
+    }
+
+    for (size_t i = 0; i < pollfds.size() && ret > 0; i++) {
+        if (pollfds[i].revents != 0) {
+            ready.push_back(ReadyEvent{pollfds[i].fd, pollfds[i].revents});
+            ret--;
+        }
+    }
+}
+
+string PollEventBackend::name() {
+    return "poll";
+}
+
+
+uint32_t epoll_events_from_poll(short events) {
+    uint32_t epoll_events = 0;
+    if (events & POLLIN) {
+        epoll_events |= EPOLLIN;
+    }
+    if (events & POLLOUT) {
+        epoll_events |= EPOLLOUT;
+    }
+    return epoll_events;
+}
+
+short poll_events_from_epoll(uint32_t epoll_events) {
+    short events = 0;
+    if (epoll_events & EPOLLIN) {
+        events |= POLLIN;
+    }
+    if (epoll_events & EPOLLOUT) {
+        events |= POLLOUT;
+    }
+    if (epoll_events & EPOLLERR) {
+        events |= POLLERR;
+    }
+    if (epoll_events & EPOLLHUP) {
+        events |= POLLHUP;
+    }
+    return events;
+}
+
+EpollEventBackend::EpollEventBackend() : epoll_fd(epoll_create1(EPOLL_CLOEXEC)), events(EPOLL_BATCH_SIZE) {
+    if (epoll_fd < 0) {
+        throw runtime_error(errno_message("epoll_create1() failed: "));
+    }
+}
+
+EpollEventBackend::~EpollEventBackend() {
+    ::close(epoll_fd);
+}
+
+bool EpollEventBackend::add(int fd, short events) {
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.events = epoll_events_from_poll(events);
+    event.data.fd = fd;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        // regular files and directories can't be watched by epoll, they are always ready
+        if (errno == EPERM) {
+            return false;
+        }
+        throw runtime_error(errno_message("epoll_ctl(EPOLL_CTL_ADD) failed: "));
+    }
+    return true;
+}
+
+void EpollEventBackend::modify(int fd, short events) {
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.events = epoll_events_from_poll(events);
+    event.data.fd = fd;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+        throw runtime_error(errno_message("epoll_ctl(EPOLL_CTL_MOD) failed: "));
+    }
+}
+
+void EpollEventBackend::remove(int fd) {
+    // ignore EBADF and ENOENT in case the fd was already closed out from under us
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != EBADF && errno != ENOENT) {
+        throw runtime_error(errno_message("epoll_ctl(EPOLL_CTL_DEL) failed: "));
+    }
+}
+
+void EpollEventBackend::wait(int timeout_ms, vector<ReadyEvent>& ready) {
+    int ret = epoll_wait(epoll_fd, events.data(), events.size(), timeout_ms);
+    if (ret < 0 && errno != EINTR) {
+        throw runtime_error(errno_message("epoll_wait() failed: "));
+    }
+
+    for (int i = 0; i < ret; i++) {
+        ready.push_back(ReadyEvent{events[i].data.fd, poll_events_from_epoll(events[i].events)});
+    }
+}
+
+string EpollEventBackend::name() {
+    return "epoll";
+}
+
+
+IoUringEventBackend::IoUringEventBackend() : ring(URING_ENTRIES), next_generation(0) {}
+
+void IoUringEventBackend::arm(int fd, IoPollRegistration& registration) {
+    registration.armed = true;
+    registration.user_data = POLL_TAG | ((next_generation++ & GENERATION_MASK) << 32) | (uint32_t) fd;
+
+    struct io_uring_sqe* sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = (uint16_t) registration.events;
+    sqe->user_data = registration.user_data;
+}
+
+void IoUringEventBackend::disarm(IoPollRegistration& registration) {
+    if (!registration.armed) {
+        return;
+    }
+    registration.armed = false;
+
+    struct io_uring_sqe* sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = registration.user_data;
+    sqe->user_data = IGNORED_TAG;
+}
+
+bool IoUringEventBackend::add(int fd, short events) {
+    IoPollRegistration& registration = polls[fd];
+    registration = IoPollRegistration{events, false, 0};
+    arm(fd, registration);
+    return true;
+}
+
+void IoUringEventBackend::modify(int fd, short events) {
+    IoPollRegistration& registration = polls.at(fd);
+    registration.events = events;
+
+    // a poll request can't be changed in place, so replace it with one for the new events
+    if (registration.armed) {
+        disarm(registration);
+        arm(fd, registration);
+    }
+}
+
+void IoUringEventBackend::remove(int fd) {
+    auto it = polls.find(fd);
+    disarm(it->second);
+    polls.erase(it);
+}
+
+void IoUringEventBackend::wait(int timeout_ms, vector<ReadyEvent>& ready) {
+    // re-arm the polls that fired last time so that fds which are still ready are reported again
+    for (size_t i = 0; i < unarmed.size(); i++) {
+        auto it = polls.find(unarmed[i]);
+        if (it != polls.end() && !it->second.armed) {
+            arm(it->first, it->second);
+        }
+    }
+    unarmed.clear();
+
+    ring.enter(timeout_ms);
+    ring.reap([&](uint64_t user_data, int32_t res) {
+        uint64_t tag = user_data & (0xffULL << TAG_SHIFT);
+        if (tag == COMPLETION_TAG) {
+            completed.push_back(Completion{user_data & ~tag, res});
+        } else if (tag == POLL_TAG) {
+            int fd = (int) (uint32_t) user_data;
+            auto it = polls.find(fd);
+            if (it == polls.end() || !it->second.armed || it->second.user_data != user_data) {
+                return;
+            }
+
+            it->second.armed = false;
+            unarmed.push_back(fd);
+            ready.push_back(ReadyEvent{fd, res < 0 ? (short) POLLERR : (short) res});
+        }
+    });
+}
+
+bool IoUringEventBackend::supports_completions() {
+    return true;
+}
+
+void IoUringEventBackend::submit(uint64_t id, const IoRequest& request) {
+    struct io_uring_sqe* sqe = ring.get_sqe();
+    sqe->fd = request.fd;
+    sqe->addr = (uint64_t) request.buf;
+    sqe->len = (uint32_t) request.len;
+    sqe->user_data = COMPLETION_TAG | id;
+
+    switch (request.op) {
+    case IO_RECV:
+        sqe->opcode = IORING_OP_RECV;
+        break;
+    case IO_SEND:
+        sqe->opcode = IORING_OP_SEND;
+        break;
+    case IO_SENDMSG:
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->len = 1;
+        sqe->msg_flags = (uint32_t) request.flags;
+        break;
+    case IO_READ:
+        sqe->opcode = IORING_OP_READ;
+        sqe->off = (uint64_t) request.offset;
+        break;
+    case IO_OPENAT:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->addr = (uint64_t) request.path;
+        sqe->len = 0;
+        sqe->open_flags = (uint32_t) request.flags;
+        break;
+    case IO_STATX:
+        sqe->opcode = IORING_OP_STATX;
+        sqe->addr = (uint64_t) request.path;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uint64_t) request.statx_buf;
+        break;
+    case IO_CALL:
+        // calls are offloaded by the event loop and never reach the kernel
+        sqe->opcode = IORING_OP_NOP;
+        break;
+    }
+}
+
+void IoUringEventBackend::cancel(uint64_t id) {
+    struct io_uring_sqe* sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = COMPLETION_TAG | id;
+    sqe->user_data = IGNORED_TAG;
+}
+
+void IoUringEventBackend::take_completions(vector<Completion>& completed) {
+    completed.insert(completed.end(), this->completed.begin(), this->completed.end());
+    this->completed.clear();
+}
+
+string IoUringEventBackend::name() {
+    return "uring";
+}
+
+
+shared_ptr<EventBackend> make_event_backend(EventBackendType type) {
+    if (type == POLL_BACKEND) {
+        return make_shared<PollEventBackend>();
+    } else if (type == URING_BACKEND) {
+        try {
+            return make_shared<IoUringEventBackend>();
+        } catch (runtime_error& e) {
+            std::cerr << "warning: io_uring unavailable, falling back to epoll: " << e.what() << std::endl;
+        }
+    }
+    return make_shared<EpollEventBackend>();
+}
+
+EventBackendType parse_event_backend(string name) {
+    if (name == "poll") {
+        return POLL_BACKEND;
+    } else if (name == "epoll") {
+        return EPOLL_BACKEND;
+    } else if (name == "uring") {
+        return URING_BACKEND;
+    }
+    throw invalid_argument("Invalid event backend: " + name);
+}
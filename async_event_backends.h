@@ -0,0 +1,188 @@
+#ifndef ASYNC_EVENT_BACKENDS_H
+#define ASYNC_EVENT_BACKENDS_H
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <poll.h>
+#include <sys/epoll.h>
+#include "io_request.h"
+#include "uring.h"
+
+
+/*
+ * ReadyEvent is a single readiness notification returned by an EventBackend.
+ * `revents` uses the poll() event flags (POLLIN, POLLOUT, POLLERR, ...) regardless of backend.
+ */
+struct ReadyEvent {
+    int fd;
+    short revents;
+};
+
+
+/*
+ * Completion is the result of an IoRequest that was submitted to a completion based EventBackend.
+ * `result` is the return value of the system call, or the negated errno on failure.
+ */
+struct Completion {
+    uint64_t id;
+    int result;
+};
+
+
+/*
+ * EventBackend is an abstract class representing the operating system mechanism that
+ * the AsyncEventLoop uses to wait for file descriptors to become ready.
+ * File descriptors are registered once with `add` and their interest is only changed
+ * with `modify` when the set of pending operations on them changes.
+ * Events are always expressed with poll() flags so that Pollables do not depend on
+ * the backend in use.
+ *
+ * Backends may also support completions, in which case whole IoRequests are submitted to the
+ * kernel with `submit` and their results are collected with `take_completions` after `wait`.
+ * Backends that only report readiness return false from `supports_completions`.
+ *
+ * It is implemented by PollEventBackend, EpollEventBackend and IoUringEventBackend below.
+ */
+class EventBackend {
+public:
+    virtual ~EventBackend() {};
+
+    // add begins watching fd for the given events. It returns false if the backend is unable
+    // to watch the fd (e.g. regular files under epoll), in which case the fd is always ready.
+    virtual bool add(int fd, short events) = 0;
+
+    // modify changes the events watched for an fd that was previously added
+    virtual void modify(int fd, short events) = 0;
+
+    // remove stops watching an fd that was previously added
+    virtual void remove(int fd) = 0;
+
+    // wait blocks for up to timeout_ms milliseconds and appends the ready fds to `ready`
+    virtual void wait(int timeout_ms, std::vector<ReadyEvent>& ready) = 0;
+
+    // supports_completions returns true if the backend can perform IoRequests with `submit`
+    virtual bool supports_completions() {
+        return false;
+    }
+
+    // submit starts performing the request. Its result is reported once by a later `take_completions`
+    virtual void submit(uint64_t, const IoRequest&) {}
+
+    // cancel asks the kernel to abort a submitted request. Its completion is still reported
+    virtual void cancel(uint64_t) {}
+
+    // take_completions appends the requests that completed during the last `wait` to `completed`
+    virtual void take_completions(std::vector<Completion>&) {}
+
+    virtual std::string name() = 0;
+};
+
+
+/*
+ * PollEventBackend implements EventBackend with the poll() system call.
+ * It keeps a persistent pollfd array so that registrations are not rebuilt every
+ * iteration, but the kernel still scans every fd on each call to wait.
+ */
+class PollEventBackend : public EventBackend {
+    std::vector<struct pollfd> pollfds;
+    std::unordered_map<int, size_t> indices;
+
+public:
+    virtual bool add(int fd, short events);
+    virtual void modify(int fd, short events);
+    virtual void remove(int fd);
+    virtual void wait(int timeout_ms, std::vector<ReadyEvent>& ready);
+
+    virtual std::string name();
+};
+
+
+/*
+ * EpollEventBackend implements EventBackend with a level triggered epoll instance.
+ * Interest is registered with the kernel once per fd, so the cost of wait is proportional
+ * to the number of ready fds rather than the number of registered fds.
+ */
+class EpollEventBackend : public EventBackend {
+    int epoll_fd;
+    std::vector<struct epoll_event> events;
+
+public:
+    EpollEventBackend();
+    ~EpollEventBackend();
+
+    virtual bool add(int fd, short events);
+    virtual void modify(int fd, short events);
+    virtual void remove(int fd);
+    virtual void wait(int timeout_ms, std::vector<ReadyEvent>& ready);
+
+    virtual std::string name();
+};
+
+
+/*
+ * IoPollRegistration is the state of a file descriptor watched by an IoUringEventBackend.
+ * `user_data` identifies its outstanding poll request, if it is armed.
+ */
+struct IoPollRegistration {
+    short events;
+    bool armed;
+    uint64_t user_data;
+};
+
+
+/*
+ * IoUringEventBackend implements EventBackend with an io_uring instance.
+ * Readiness is reported with one shot poll requests that are re-armed on every call to wait,
+ * which gives the same level triggered semantics as the other backends.
+ * It also supports completions: submitted IoRequests are performed by the kernel and both
+ * their submission and the wait for their results share a single io_uring_enter per iteration.
+ */
+class IoUringEventBackend : public EventBackend {
+    IoUring ring;
+    std::unordered_map<int, IoPollRegistration> polls;
+    std::vector<int> unarmed;
+    std::vector<Completion> completed;
+    uint64_t next_generation;
+
+    void arm(int fd, IoPollRegistration& registration);
+    void disarm(IoPollRegistration& registration);
+
+public:
+    IoUringEventBackend();
+
+    virtual bool add(int fd, short events);
+    virtual void modify(int fd, short events);
+    virtual void remove(int fd);
+    virtual void wait(int timeout_ms, std::vector<ReadyEvent>& ready);
+
+    virtual bool supports_completions();
+    virtual void submit(uint64_t id, const IoRequest& request);
+    virtual void cancel(uint64_t id);
+    virtual void take_completions(std::vector<Completion>& completed);
+
+    virtual std::string name();
+};
+
+
+/*
+ * EventBackendType selects which EventBackend implementation an AsyncEventLoop uses.
+ */
+enum EventBackendType {
+    POLL_BACKEND,
+    EPOLL_BACKEND,
+    URING_BACKEND
+};
+
+const EventBackendType DEFAULT_EVENT_BACKEND = EPOLL_BACKEND;
+
+/*
+ * Helper functions for creating backends and parsing backend names ("poll", "epoll", "uring").
+ * make_event_backend falls back to epoll if io_uring is not available on this kernel.
+ * parse_event_backend throws std::invalid_argument for unknown names.
+ */
+std::shared_ptr<EventBackend> make_event_backend(EventBackendType type);
+EventBackendType parse_event_backend(std::string name);
+
+#endif //ASYNC_EVENT_BACKENDS_H
@@ -1,100 +1,715 @@
+#include <errno.h>
+#include <algorithm>
 #include <iostream>
 #include <chrono>
-#include <poll.h>
 #include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include "async_event_loop.h"
 #include "util.h"
 
-using std::chrono::system_clock;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::dynamic_pointer_cast;
+using std::function;
+using std::lock_guard;
+using std::mutex;
+using std::pair;
 using std::shared_ptr;
+using std::static_pointer_cast;
 using std::runtime_error;
 using std::vector;
 
-#define DEFAULT_TIMEOUT (1 * 1000)
+// number of stale deadlines tolerated beyond the live ones before the deadline queue is compacted
+#define DEADLINE_COMPACT_SLACK (1024)
 
 
+static inline uint64_t elapsed_ns(steady_clock::time_point from, steady_clock::time_point to) {
+    return (uint64_t) duration_cast<nanoseconds>(to - from).count();
+}
+
+
+shared_ptr<Pollable> CompletionPollable::notify(short) {
+    while (!is_done()) {
+        IoRequest request;
+        prepare(request);
+
+        int result = perform_io_request(request);
+        if (result == -EAGAIN || result == -EWOULDBLOCK) {
+            break;
+        }
+
+        shared_ptr<Pollable> next_pollable = complete(result);
+        if (next_pollable != NULL) {
+            return next_pollable;
+        }
+    }
+    return shared_ptr<Pollable>();
+}
+
+
+/*
+ * RunnablePollable is always ready, since its fd is negative, and runs its callback once.
+ */
+class RunnablePollable : public Pollable {
+    Callback<>::F callback;
+    bool done;
+
+public:
+    RunnablePollable(Callback<>::F callback) : callback(std::move(callback)), done(false) {}
+
+    virtual int get_fd() {
+        return -1;
+    }
+
+    virtual short get_events() {
+        return POLLIN;
+    }
+
+    virtual bool is_done() {
+        return done;
+    }
+
+    virtual steady_clock::time_point get_deadline() {
+        return NO_DEADLINE;
+    }
+
+    virtual shared_ptr<Pollable> notify(short) {
+        done = true;
+        Callback<>::F next = std::move(callback);
+        return next();
+    }
+
+    virtual void cancel() {
+        callback = Callback<>::F();
+    }
+};
+
+shared_ptr<Pollable> make_runnable(Callback<>::F callback) {
+    return std::make_shared<RunnablePollable>(std::move(callback));
+}
+
+
+/*
+ * OffloadPollable performs a single IO_CALL of its work, which the event loop always offloads.
+ */
+class OffloadPollable : public CompletionPollable {
+    function<void()> work;
+    Callback<>::F callback;
+    bool done;
+
+    static int run(void* pollable) {
+        try {
+            static_cast<OffloadPollable*>(pollable)->work();
+        } catch (...) {
+            return -EIO;
+        }
+        return 0;
+    }
+
+public:
+    OffloadPollable(function<void()> work, Callback<>::F callback) : work(work), callback(std::move(callback)), done(false) {}
+
+    virtual int get_fd() {
+        return -1;
+    }
+
+    virtual short get_events() {
+        return POLLIN;
+    }
+
+    virtual bool is_done() {
+        return done;
+    }
+
+    virtual steady_clock::time_point get_deadline() {
+        return NO_DEADLINE;
+    }
+
+    virtual void prepare(IoRequest& request) {
+        request = call_request(run, this);
+    }
+
+    virtual shared_ptr<Pollable> complete(int) {
+        done = true;
+        Callback<>::F next = std::move(callback);
+        return next();
+    }
+
+    virtual void cancel() {
+        done = true;
+        callback = Callback<>::F();
+    }
+};
+
+shared_ptr<Pollable> offload(function<void()> work, Callback<>::F callback) {
+    return std::make_shared<OffloadPollable>(work, std::move(callback));
+}
+
+
+Timer::Timer() : deadline(NO_DEADLINE), registered_deadline(NO_DEADLINE), armed(false) {}
+
+shared_ptr<Pollable> Timer::arm(steady_clock::time_point deadline, Callback<>::F callback) {
+    this->callback = std::move(callback);
+    this->deadline = deadline;
+    armed = true;
+
+    // a registration that expires first just registers the timer again for the new deadline
+    if (registered_deadline != NO_DEADLINE && registered_deadline <= deadline) {
+        return shared_ptr<Pollable>();
+    }
+    registered_deadline = deadline;
+    return shared_from_this();
+}
+
+void Timer::disarm() {
+    armed = false;
+    callback = Callback<>::F();
+}
+
+int Timer::get_fd() {
+    return -1;
+}
+
+short Timer::get_events() {
+    return 0;
+}
+
+bool Timer::is_done() {
+    return !armed;
+}
+
+steady_clock::time_point Timer::get_deadline() {
+    return deadline;
+}
+
+shared_ptr<Pollable> Timer::notify(short) {
+    return shared_ptr<Pollable>();
+}
+
+shared_ptr<Pollable> Timer::expire() {
+    registered_deadline = NO_DEADLINE;
+    if (!armed) {
+        return shared_ptr<Pollable>();
+    }
+    if (steady_clock::now() < deadline) {
+        registered_deadline = deadline;
+        return shared_from_this();
+    }
+
+    armed = false;
+    Callback<>::F next = std::move(callback);
+    callback = Callback<>::F();
+    return next();
+}
+
+void Timer::cancel() {
+    registered_deadline = NO_DEADLINE;
+    disarm();
+}
+
+
+AsyncEventLoop::AsyncEventLoop() : AsyncEventLoop(make_event_backend(DEFAULT_EVENT_BACKEND)) {}
+
+AsyncEventLoop::AsyncEventLoop(shared_ptr<EventBackend> backend, shared_ptr<OffloadPool> offload_pool)
+        : backend(backend), num_pollables(0), next_id(0), offload_pool(offload_pool) {
+    offload_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (offload_fd < 0) {
+        throw runtime_error(errno_message("eventfd() failed: "));
+    }
+    backend->add(offload_fd, POLLIN);
+    stats_fd = stats_dump_fd();
+    backend->add(stats_fd, POLLIN);
+}
+
+AsyncEventLoop::~AsyncEventLoop() {
+    backend->remove(stats_fd);
+    backend->remove(offload_fd);
+    close(offload_fd);
+}
+
 void AsyncEventLoop::register_pollable(shared_ptr<Pollable> pollable) {
-    pollables.push_back(pollable);
+    shared_ptr<Timer> timer = dynamic_pointer_cast<Timer>(pollable);
+    if (timer != NULL) {
+        register_timer(timer);
+        return;
+    }
+
+    // pollables with no fd to wait on can't be made ready by the backend, so offload them if it can't perform them
+    if (backend->supports_completions() || pollable->get_fd() < 0) {
+        shared_ptr<CompletionPollable> completion_pollable = dynamic_pointer_cast<CompletionPollable>(pollable);
+        if (completion_pollable != NULL) {
+            register_completion(completion_pollable);
+            return;
+        }
+    }
+
+    int fd = pollable->get_fd();
+    steady_clock::time_point deadline = pollable->get_deadline();
+    uint64_t id = next_id++;
+
+    registrations[fd].pollables.push_back(PollableRegistration{pollable, id, deadline});
+    dirty_fds.push_back(fd);
+    num_pollables++;
+
+    if (deadline != NO_DEADLINE) {
+        deadlines.push(DeadlineEntry{deadline, id, fd});
+        compact_deadlines();
+    }
+}
+
+void AsyncEventLoop::unregister_pollable(shared_ptr<Pollable> pollable) {
+    int fd = pollable->get_fd();
+    auto it = registrations.find(fd);
+    if (it == registrations.end()) {
+        return;
+    }
+
+    vector<PollableRegistration>& pollables = it->second.pollables;
+    for (size_t i = 0; i < pollables.size(); i++) {
+        if (pollables[i].pollable == pollable) {
+            pollables.erase(pollables.begin() + i);
+            dirty_fds.push_back(fd);
+            num_pollables--;
+            return;
+        }
+    }
+}
+
+void AsyncEventLoop::update_interest(int fd) {
+    auto it = registrations.find(fd);
+    if (it == registrations.end()) {
+        return;
+    }
+    FdRegistration& registration = it->second;
+
+    // nothing is waiting on the fd any more, so stop watching it while it is still guaranteed to be open
+    if (registration.pollables.empty()) {
+        if (registration.always_ready) {
+            always_ready_fds.erase(std::find(always_ready_fds.begin(), always_ready_fds.end(), fd));
+        } else if (registration.watched) {
+            backend->remove(fd);
+        }
+        registrations.erase(it);
+        return;
+    }
+
+    short events = 0;
+    for (size_t i = 0; i < registration.pollables.size(); i++) {
+        events |= registration.pollables[i].pollable->get_events();
+    }
+
+    // negative fds have nothing to wait on, so their pollables are notified on every iteration
+    if (fd < 0) {
+        if (!registration.always_ready) {
+            registration.always_ready = true;
+            always_ready_fds.push_back(fd);
+        }
+        registration.registered_events = events;
+        return;
+    }
+
+    if (!registration.watched && !registration.always_ready) {
+        if (backend->add(fd, events)) {
+            registration.watched = true;
+        } else {
+            registration.always_ready = true;
+            always_ready_fds.push_back(fd);
+        }
+    } else if (registration.watched && events != registration.registered_events) {
+        backend->modify(fd, events);
+    }
+    registration.registered_events = events;
 }
 
-pollfd pollfd_from_pollable(shared_ptr<Pollable> pollable) {
-    return pollfd{
-        pollable->get_fd(),
-        pollable->get_events(),
-        0
-    };
+void AsyncEventLoop::flush_interest() {
+    for (size_t i = 0; i < dirty_fds.size(); i++) {
+        update_interest(dirty_fds[i]);
+    }
+    dirty_fds.clear();
 }
 
 void AsyncEventLoop::process_pollable(shared_ptr<Pollable> pollable, short revents) {
     shared_ptr<Pollable> next_pollable;
+    bool failed = false;
     try {
         next_pollable = pollable->notify(revents);
-        if (!pollable->is_done()) {
-            register_pollable(pollable);
-        }
     } catch (runtime_error& e) {
         std::cerr << "warning: uncaught exception: " << e.what() << std::endl;
+        failed = true;
+    } catch (...) {
+        std::cerr << "warning: unknown uncaught exception!" << std::endl;
+        failed = true;
+    }
+
+    if (next_pollable != NULL) {
+        register_pollable(next_pollable);
+    }
+    // a pollable that re-armed itself was registered again above, so drop its old registration
+    if (failed || pollable->is_done() || next_pollable == pollable) {
+        unregister_pollable(pollable);
+    }
+    if (failed) {
+        pollable->cancel();
+    }
+
+    // update interest before `pollable` is released so that its fd is guaranteed to still be open.
+    // registering the next pollable before unregistering this one lets a read to write transition on
+    // the same fd become a single modify
+    flush_interest();
+}
+
+void AsyncEventLoop::register_completion(shared_ptr<CompletionPollable> pollable) {
+    steady_clock::time_point deadline = pollable->get_deadline();
+    uint64_t id = next_id++;
+
+    completions[id] = PollableRegistration{pollable, id, deadline};
+    num_pollables++;
+
+    if (deadline != NO_DEADLINE) {
+        deadlines.push(DeadlineEntry{deadline, id, pollable->get_fd()});
+        compact_deadlines();
+    }
+
+    submit_completion(id, pollable);
+}
+
+void AsyncEventLoop::register_timer(shared_ptr<Timer> timer) {
+    steady_clock::time_point deadline = timer->get_deadline();
+    if (deadline == NO_DEADLINE) {
+        return;
+    }
+
+    uint64_t id = next_id++;
+    timers[id] = PollableRegistration{timer, id, deadline};
+    deadlines.push(DeadlineEntry{deadline, id, timer->get_fd()});
+    compact_deadlines();
+}
+
+void AsyncEventLoop::submit_completion(uint64_t id, shared_ptr<CompletionPollable> pollable) {
+    IoRequest request;
+    pollable->prepare(request);
+    if (request.op == IO_CALL || !backend->supports_completions()) {
+        offload_request(id, request);
+    } else {
+        backend->submit(id, request);
+    }
+}
+
+void AsyncEventLoop::offload_request(uint64_t id, const IoRequest& request) {
+    offloaded.insert(id);
+
+    AsyncEventLoop* loop = this;
+    offload_pool->submit([loop, id, request]() {
+        loop->post_offload_completion(Completion{id, perform_io_request(request)});
+    });
+}
+
+void AsyncEventLoop::post_offload_completion(const Completion& completion) {
+    {
+        lock_guard<mutex> guard(offload_lock);
+        offload_completed.push_back(completion);
+    }
+
+    uint64_t one = 1;
+    if (write(offload_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        std::cerr << errno_message("unable to wake event loop: ") << std::endl;
+    }
+}
+
+void AsyncEventLoop::drain_offload_fd() {
+    uint64_t count;
+    while (read(offload_fd, &count, sizeof(count)) > 0) {}
+}
+
+void AsyncEventLoop::take_offload_completions() {
+    // clear the eventfd before taking the completions, so that a completion posted after this
+    // still wakes the next wait
+    drain_offload_fd();
+
+    size_t first = completed.size();
+    {
+        lock_guard<mutex> guard(offload_lock);
+        completed.insert(completed.end(), offload_completed.begin(), offload_completed.end());
+        offload_completed.clear();
+    }
+
+    for (size_t i = first; i < completed.size(); i++) {
+        offloaded.erase(completed[i].id);
+    }
+}
+
+void AsyncEventLoop::process_completion(const Completion& completion) {
+    // the pollable already expired, so there is nothing left to do now that the kernel is done with it
+    if (cancelled.erase(completion.id) > 0) {
+        return;
+    }
+
+    auto it = completions.find(completion.id);
+    if (it == completions.end()) {
+        return;
+    }
+    shared_ptr<CompletionPollable> pollable = static_pointer_cast<CompletionPollable>(it->second.pollable);
+
+    shared_ptr<Pollable> next_pollable;
+    bool failed = false;
+    try {
+        next_pollable = pollable->complete(completion.result);
+    } catch (runtime_error& e) {
+        std::cerr << "warning: uncaught exception: " << e.what() << std::endl;
+        failed = true;
     } catch (...) {
         std::cerr << "warning: unknown uncaught exception!" << std::endl;
+        failed = true;
     }
 
     if (next_pollable != NULL) {
         register_pollable(next_pollable);
     }
+    if (failed || pollable->is_done() || next_pollable == pollable) {
+        completions.erase(completion.id);
+        num_pollables--;
+        if (failed) {
+            pollable->cancel();
+        }
+    } else {
+        submit_completion(completion.id, pollable);
+    }
+
+    flush_interest();
+}
+
+void AsyncEventLoop::cancel_completion(uint64_t id) {
+    auto it = completions.find(id);
+    cancelled[id] = it->second.pollable;
+    it->second.pollable->cancel();
+    completions.erase(it);
+    num_pollables--;
+
+    // an offloaded request can't be stopped, so just wait for its thread to finish with it
+    if (offloaded.count(id) == 0) {
+        backend->cancel(id);
+    }
+}
+
+PollableRegistration* AsyncEventLoop::find_registration(const DeadlineEntry& entry) {
+    auto completion = completions.find(entry.id);
+    if (completion != completions.end()) {
+        return &completion->second;
+    }
+    auto timer = timers.find(entry.id);
+    if (timer != timers.end()) {
+        return &timer->second;
+    }
+
+    auto it = registrations.find(entry.fd);
+    if (it == registrations.end()) {
+        return NULL;
+    }
+
+    vector<PollableRegistration>& pollables = it->second.pollables;
+    for (size_t i = 0; i < pollables.size(); i++) {
+        if (pollables[i].id == entry.id) {
+            return &pollables[i];
+        }
+    }
+    return NULL;
+}
+
+void AsyncEventLoop::compact_deadlines() {
+    // deadlines of completed pollables are left in the queue until they expire, so rebuild the queue
+    // from the live registrations once the stale ones outnumber them. this is amortized O(1) per push
+    if (deadlines.size() <= 2 * (num_pollables + timers.size()) + DEADLINE_COMPACT_SLACK) {
+        return;
+    }
+
+    live_deadlines.clear();
+    for (auto it = completions.begin(); it != completions.end(); it++) {
+        if (it->second.deadline != NO_DEADLINE) {
+            live_deadlines.push_back(DeadlineEntry{it->second.deadline, it->first, it->second.pollable->get_fd()});
+        }
+    }
+    for (auto it = timers.begin(); it != timers.end(); it++) {
+        live_deadlines.push_back(DeadlineEntry{it->second.deadline, it->first, it->second.pollable->get_fd()});
+    }
+    for (auto it = registrations.begin(); it != registrations.end(); it++) {
+        vector<PollableRegistration>& pollables = it->second.pollables;
+        for (size_t i = 0; i < pollables.size(); i++) {
+            if (pollables[i].deadline != NO_DEADLINE) {
+                live_deadlines.push_back(DeadlineEntry{pollables[i].deadline, pollables[i].id, it->first});
+            }
+        }
+    }
+    deadlines.rebuild(live_deadlines);
+}
+
+int AsyncEventLoop::next_timeout() {
+    if (!always_ready_fds.empty()) {
+        return 0;
+    }
+
+    while (!deadlines.empty() && find_registration(deadlines.top()) == NULL) {
+        deadlines.pop();
+    }
+    if (deadlines.empty()) {
+        return -1;
+    }
+
+    steady_clock::duration remaining = deadlines.top().deadline - steady_clock::now();
+    if (remaining <= steady_clock::duration::zero()) {
+        return 0;
+    }
+
+    // round up so that we never wake up just before the deadline and spin
+    return (int) duration_cast<milliseconds>(remaining + milliseconds(1) - steady_clock::duration(1)).count();
+}
+
+void AsyncEventLoop::reap_expired() {
+    deadlines.pop_expired(steady_clock::now(), expired_deadlines);
+
+    size_t cancelled_count = 0;
+    size_t unexpired_timers = 0;
+    for (size_t i = 0; i < expired_deadlines.size(); i++) {
+        if (completions.count(expired_deadlines[i].id) > 0) {
+            cancel_completion(expired_deadlines[i].id);
+            cancelled_count++;
+            continue;
+        }
+
+        // a disarmed or re-armed timer still has to be told that its registration is gone, but it didn't time anything out
+        auto timer = timers.find(expired_deadlines[i].id);
+        if (timer != timers.end()) {
+            Pollable& pollable = *timer->second.pollable;
+            if (pollable.is_done() || pollable.get_deadline() > timer->second.deadline) {
+                unexpired_timers++;
+            }
+            expired.push_back(timer->second.pollable);
+            timers.erase(timer);
+            continue;
+        }
+
+        PollableRegistration* registration = find_registration(expired_deadlines[i]);
+        if (registration != NULL) {
+            expired.push_back(registration->pollable);
+        }
+    }
+
+    stats.record_expired(expired.size() + cancelled_count - unexpired_timers);
+    for (size_t i = 0; i < expired.size(); i++) {
+        unregister_pollable(expired[i]);
+
+        shared_ptr<Pollable> next_pollable;
+        try {
+            next_pollable = expired[i]->expire();
+        } catch (runtime_error& e) {
+            std::cerr << "warning: uncaught exception: " << e.what() << std::endl;
+            expired[i]->cancel();
+        }
+        if (next_pollable != NULL) {
+            register_pollable(next_pollable);
+        }
+    }
+    flush_interest();
+    expired.clear();
+    expired_deadlines.clear();
+}
+
+EventLoopStats& AsyncEventLoop::get_stats() {
+    return stats;
 }
 
 void AsyncEventLoop::loop() {
-    while (!pollables.empty()) {
-        vector<shared_ptr<Pollable>> cur_pollables = pollables;
-        vector<shared_ptr<Pollable>> skipped;
-        pollables.clear();
+    steady_clock::time_point iteration_start = steady_clock::now();
+
+    // keep going until cancelled requests have completed too, since they may still use their buffers
+    while (num_pollables > 0 || !cancelled.empty()) {
+        flush_interest();
+        int timeout = next_timeout();
 
-        size_t pollables_size = cur_pollables.size();
-        pollfd* pollfds = new pollfd[pollables_size];
+        ready.clear();
+        steady_clock::time_point wait_start = steady_clock::now();
+        backend->wait(timeout, ready);
+        steady_clock::time_point wait_end = steady_clock::now();
 
-        for (size_t i = 0; i < pollables_size; i++) {
-            pollfds[i] = pollfd_from_pollable(cur_pollables[i]);
+        completed.clear();
+        backend->take_completions(completed);
+        if (!offloaded.empty()) {
+            take_offload_completions();
         }
+        stats.wait_ns.record(elapsed_ns(wait_start, wait_end));
+        stats.ready_per_wait.record(ready.size() + completed.size());
 
-        int ret = poll(pollfds, pollables_size, DEFAULT_TIMEOUT);
-        if (ret < 0) {
-            throw runtime_error(errno_message("poll() failed: "));
+        // each callback is timed from the end of the previous one so that it costs one clock read
+        steady_clock::time_point callback_start = wait_end;
+        for (size_t i = 0; i < completed.size(); i++) {
+            process_completion(completed[i]);
+
+            steady_clock::time_point callback_end = steady_clock::now();
+            stats.callback_ns.record(elapsed_ns(callback_start, callback_end));
+            stats.record_completion();
+            callback_start = callback_end;
         }
 
-        for (size_t i = 0; i < pollables_size; i++) {
-            short revents = pollfds[i].revents;
+        for (size_t i = 0; i < always_ready_fds.size(); i++) {
+            int fd = always_ready_fds[i];
+            ready.push_back(ReadyEvent{fd, registrations[fd].registered_events});
+        }
+
+        // snapshot the pollables to notify first, since notifying them can change the registrations
+        for (size_t i = 0; i < ready.size(); i++) {
+            // the completions signalled by the eventfd were taken above, so just clear any stale wakeup
+            if (ready[i].fd == offload_fd) {
+                if (offloaded.empty()) {
+                    drain_offload_fd();
+                }
+                continue;
+            }
+
+            // a stats dump was requested, which is done at the end of the iteration by whichever loop sees it first
+            if (ready[i].fd == stats_fd) {
+                uint64_t count;
+                while (read(stats_fd, &count, sizeof(count)) > 0) {}
+                continue;
+            }
+
+            auto it = registrations.find(ready[i].fd);
+            if (it == registrations.end()) {
+                continue;
+            }
 
-            if (revents != 0) {
-                process_pollable(cur_pollables[i], revents);
-            } else {
-                skipped.push_back(cur_pollables[i]);
+            vector<PollableRegistration>& pollables = it->second.pollables;
+            for (size_t j = 0; j < pollables.size(); j++) {
+                short revents = ready[i].revents & (pollables[j].pollable->get_events() | POLLERR | POLLHUP | POLLNVAL);
+                if (revents != 0) {
+                    notifying.push_back(make_pair(pollables[j].pollable, revents));
+                }
             }
         }
 
-        delete[] pollfds;
-
-        // This weird copying back and forth below serves two purposes:
-        // 1. it prunes all of the skipped file descriptors that are now past their deadlines.
-        // 2. it reorders the connections such that skipped descriptors are at the front of the list.
-        //   I found anecdotally that this helped to avoid starvation of descriptors at the end of the vector
-        //   I could have done this processing in the processing loop above using linked lists to perform the
-        //   same effect with fewer loops and still O(n) time, but I found that doing so made the code much
-        //   more convoluted so I decided to separate the behavior out. The resulting algorithm is still
-        //   O(n) + O(n) = O(n) and I haven't noticed any performance problems stemming from the additional
-        //   copies (it is just copying pointers), so I decided that it was sufficient.
-        vector<shared_ptr<Pollable>> new_pollables;
-
-        // check timeouts for every fd that was skipped
-        system_clock::time_point now = system_clock::now();
-        for (size_t i = 0; i < skipped.size(); i++) {
-            if (!skipped[i]->past_deadline(now)) {
-                new_pollables.push_back(skipped[i]);
+        callback_start = steady_clock::now();
+        for (size_t i = 0; i < notifying.size(); i++) {
+            if (!notifying[i].first->is_done()) {
+                process_pollable(notifying[i].first, notifying[i].second);
+
+                steady_clock::time_point callback_end = steady_clock::now();
+                stats.callback_ns.record(elapsed_ns(callback_start, callback_end));
+                stats.record_notification();
+                callback_start = callback_end;
             }
         }
+        notifying.clear();
 
-        for (size_t i = 0; i < pollables.size(); i++) {
-            new_pollables.push_back(pollables[i]);
+        reap_expired();
+
+        steady_clock::time_point iteration_end = steady_clock::now();
+        stats.busy_ns.record(elapsed_ns(iteration_start, wait_start) + elapsed_ns(wait_end, iteration_end));
+        stats.record_iteration(num_pollables);
+        iteration_start = iteration_end;
+
+        if (take_stats_dump_request()) {
+            std::cerr << snapshot_event_loop_stats() << std::flush;
         }
-        pollables = new_pollables;
     }
 }
@@ -4,24 +4,36 @@
 #include <chrono>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include "async_event_backends.h"
+#include "continuation.h"
+#include "deadline_queue.h"
+#include "event_loop_stats.h"
+#include "offload_pool.h"
 
 
 /*
  * Pollable is an abstract class representing a non-blocking IO operation that can be
- * polled with the poll() system call.
- * The async event loop manages a vector of pollables and will notify them when their
- * file descriptor is ready for their requested operation and of periodic time points
- * so that they can decide whether or not they are passed their deadline.
+ * polled with the poll() system call or another EventBackend.
+ * The async event loop manages the registered pollables and will notify them when their
+ * file descriptor is ready for their requested operation. Each pollable reports its deadline
+ * once when it is registered, and the event loop removes it if the deadline passes first.
  *
  * Implementations of pollable should typically contain a Callback<...>::F to pass their
  * results to once they are finished.
+ *
+ * A pollable may re-arm itself and return itself from notify (or `complete`) to be registered
+ * again with a fresh deadline, which lets a connection reuse the same pollable for every read.
  */
 class Pollable {
 public:
     virtual ~Pollable() {};
 
-    // get_fd returns the file descriptor for poll() to listen on
+    // get_fd returns the file descriptor for poll() to listen on, or a negative number if the
+    // pollable is always ready and should be notified on every iteration of the event loop
     virtual int get_fd() = 0;
 
     // get_events returns the events that poll() should check for
@@ -30,8 +42,9 @@ public:
     // is_done returns true if this pollable has completed and should be removed from the queue
     virtual bool is_done() = 0;
 
-    // past_deadline returns true if this pollable operation has timed out and the pollable should be removed
-    virtual bool past_deadline(std::chrono::system_clock::time_point) = 0;
+    // get_deadline returns the time on the monotonic clock after which this pollable operation has timed
+    // out and should be removed, or NO_DEADLINE. It is only checked once, when the pollable is registered.
+    virtual std::chrono::steady_clock::time_point get_deadline() = 0;
 
     /**
      * notify is used to notify the Pollable that one of its events has occurred
@@ -39,18 +52,56 @@ public:
      * @return another Pollable to listen to, or null if nothing more should be listened to
      */
     virtual std::shared_ptr<Pollable> notify(short revents) = 0;
+
+    // cancel is called when the event loop drops the pollable before it is done, because its deadline
+    // passed or it threw. Pollables that are reused should release their callback here
+    virtual void cancel() {}
+
+    // expire is called instead of cancel when the pollable's deadline passes. By default it just cancels
+    // the pollable, but one that handles its own timeouts, e.g. by retrying, can return another Pollable
+    virtual std::shared_ptr<Pollable> expire() {
+        cancel();
+        return std::shared_ptr<Pollable>();
+    }
 };
 
 
-// Convenience typedef to enable `Callback<string>::F` instead of `std::function<std::shared_ptr<Pollable> (string)>`
 /*
- * Callback is a convenience typedef to enable `Callback<string>::F` instead of `std::function<std::shared_ptr<Pollable> (string)>`
+ * CompletionPollable is a Pollable whose operation is expressed as a sequence of IoRequests.
+ * When the event loop's backend supports completions (io_uring), each request from `prepare` is
+ * performed by the kernel and its result is passed to `complete`, so the pollable never waits
+ * for readiness. Otherwise the default `notify` performs the requests itself with
+ * perform_io_request whenever the fd is ready, until one of them would block.
+ *
+ * `prepare` is called again for the next request as long as the pollable is not done.
+ * Any buffers referenced by the request must stay alive until `complete` is called.
+ */
+class CompletionPollable : public Pollable {
+public:
+    // prepare fills in the next request to perform
+    virtual void prepare(IoRequest& request) = 0;
+
+    /**
+     * complete is used to pass the result of the last prepared request to the pollable
+     * @param result  the result of the system call, or the negated errno on failure
+     * @return another Pollable to listen to, or null if nothing more should be listened to
+     */
+    virtual std::shared_ptr<Pollable> complete(int result) = 0;
+
+    virtual std::shared_ptr<Pollable> notify(short revents);
+};
+
+
+// Convenience typedef to enable `Callback<string>::F` instead of `Continuation<std::shared_ptr<Pollable> (string)>`
+/*
+ * Callback is a convenience typedef to enable `Callback<string>::F` instead of `Continuation<std::shared_ptr<Pollable> (string)>`
  * A Callback represents a unit of work to be invoked at some time in the future once its inputs are ready.
  * It optionally a Pollable to be added to the event loop once its unit of work is complete.
+ * Callbacks are Continuations rather than std::functions so that small lambdas don't allocate.
  */
 template<class ...Args>
 struct Callback {
-    typedef std::function<std::shared_ptr<Pollable> (Args...)> F;
+    typedef Continuation<std::shared_ptr<Pollable> (Args...)> F;
 
     /*
      * empty() is a convenience function that creates a Callback that returns NULL.
@@ -63,18 +114,158 @@ struct Callback {
 };
 
 
+const std::chrono::steady_clock::time_point NO_DEADLINE = std::chrono::steady_clock::time_point::max();
+
+
+/*
+ * make_runnable creates a Pollable that invokes `callback` on the next iteration of the event loop.
+ * It lets long running work yield to the loop and continue as a runnable task once the
+ * other ready pollables have had their turn, instead of continuing synchronously.
+ */
+std::shared_ptr<Pollable> make_runnable(Callback<>::F callback);
+
 /*
- * Represents the non-blocking asynchronous event loop that repeatedly calls poll() using
- * its internal list of pollables and processes them as events come in.
+ * offload creates a Pollable that runs blocking `work` on the event loop's OffloadPool and then
+ * invokes `callback` back on the event loop. `work` must not touch any state that the event loop
+ * may use at the same time, and should catch its own exceptions.
+ */
+std::shared_ptr<Pollable> offload(std::function<void()> work, Callback<>::F callback);
+
+
+/*
+ * Timer is a Pollable that waits for nothing but its deadline, and then invokes its callback.
+ * Timers don't keep the event loop running by themselves, so they are for bounding some other
+ * pending operation, like a request that is being processed, rather than for scheduling work.
+ *
+ * `arm` sets the callback to invoke at `deadline` and returns the timer to register, or null if
+ * the timer is still registered from an earlier arm. In that case it registers itself again once
+ * its old deadline passes, so a connection can re-arm one timer for every request without adding
+ * a deadline to the event loop each time, as long as the deadlines only move later.
+ * `disarm` stops the timer from firing and releases its callback.
+ */
+class Timer : public Pollable, public std::enable_shared_from_this<Timer> {
+    Callback<>::F callback;
+    std::chrono::steady_clock::time_point deadline;
+    std::chrono::steady_clock::time_point registered_deadline;
+    bool armed;
+
+public:
+    Timer();
+
+    std::shared_ptr<Pollable> arm(std::chrono::steady_clock::time_point deadline, Callback<>::F callback);
+    void disarm();
+
+    virtual int get_fd();
+    virtual short get_events();
+    virtual bool is_done();
+    virtual std::chrono::steady_clock::time_point get_deadline();
+    virtual std::shared_ptr<Pollable> notify(short revents);
+    virtual std::shared_ptr<Pollable> expire();
+    virtual void cancel();
+};
+
+
+/*
+ * PollableRegistration is a pollable registered with the event loop. Each registration gets
+ * a unique id so that stale entries in the DeadlineQueue can be recognized.
+ */
+struct PollableRegistration {
+    std::shared_ptr<Pollable> pollable;
+    uint64_t id;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+
+/*
+ * FdRegistration tracks the pollables that are waiting on a single file descriptor and
+ * the events that are currently registered for it with the EventBackend.
+ */
+struct FdRegistration {
+    std::vector<PollableRegistration> pollables;
+    short registered_events;
+    bool watched;
+    bool always_ready;
+};
+
+
+/*
+ * Represents the non-blocking asynchronous event loop that repeatedly waits on its
+ * EventBackend for the file descriptors of its pollables and processes them as events come in.
+ * Each file descriptor is registered with the backend once, and its interest is only updated
+ * when the events requested by its pollables change (e.g. switching from a read to a write).
+ * Pollable deadlines are kept in a DeadlineQueue so that the loop waits exactly until the next
+ * deadline and only touches the pollables that have actually expired.
+ * If the backend supports completions, CompletionPollables are not registered by fd at all.
+ * Their requests are submitted directly and they are tracked by id in `completions` instead.
+ * Expired completion pollables are kept alive in `cancelled` until their cancelled request has
+ * completed, since the kernel may still be using their buffers.
+ * Each iteration records its timings and counts in `stats` (see event_loop_stats.h), and every
+ * loop also waits on the `stats_fd` eventfd, so that a requested stats dump wakes an idle loop.
+ *
+ * CompletionPollables that the backend can't perform, namely file system requests when waiting
+ * on poll or epoll and IO_CALLs on any backend, are offloaded instead: they are performed on
+ * the OffloadPool, which posts each result to `offload_completed` and wakes the loop through the
+ * `offload_fd` eventfd. They are otherwise handled just like io_uring completions, so the loop
+ * itself never blocks on the file system. Offloaded requests can't be cancelled, so an expired
+ * one is kept in `cancelled` until its thread is done with it, and the loop must run until then.
+ *
+ * Timers have nothing to wait on, so they are only tracked by id in `timers` and in the DeadlineQueue,
+ * and aren't counted in `num_pollables`.
  */
 class AsyncEventLoop {
-    std::vector<std::shared_ptr<Pollable>> pollables;
+    std::shared_ptr<EventBackend> backend;
+    std::unordered_map<int, FdRegistration> registrations;
+    std::vector<int> always_ready_fds;
+    std::vector<int> dirty_fds;
+    std::vector<ReadyEvent> ready;
+    std::vector<std::pair<std::shared_ptr<Pollable>, short>> notifying;
+    DeadlineQueue deadlines;
+    std::vector<DeadlineEntry> expired_deadlines;
+    std::vector<std::shared_ptr<Pollable>> expired;
+    std::vector<DeadlineEntry> live_deadlines;
+    std::unordered_map<uint64_t, PollableRegistration> completions;
+    std::unordered_map<uint64_t, PollableRegistration> timers;
+    std::unordered_map<uint64_t, std::shared_ptr<Pollable>> cancelled;
+    std::vector<Completion> completed;
+    size_t num_pollables;
+    uint64_t next_id;
+    EventLoopStats stats;
+    std::shared_ptr<OffloadPool> offload_pool;
+    int offload_fd;
+    int stats_fd;
+    std::unordered_set<uint64_t> offloaded;
+    std::mutex offload_lock;
+    std::vector<Completion> offload_completed;
 
     void process_pollable(std::shared_ptr<Pollable>, short revents);
+    void register_completion(std::shared_ptr<CompletionPollable> pollable);
+    void register_timer(std::shared_ptr<Timer> timer);
+    void submit_completion(uint64_t id, std::shared_ptr<CompletionPollable> pollable);
+    void process_completion(const Completion& completion);
+    void cancel_completion(uint64_t id);
+    void offload_request(uint64_t id, const IoRequest& request);
+    void post_offload_completion(const Completion& completion);
+    void drain_offload_fd();
+    void take_offload_completions();
+    void unregister_pollable(std::shared_ptr<Pollable> pollable);
+    void update_interest(int fd);
+    void flush_interest();
+    PollableRegistration* find_registration(const DeadlineEntry& entry);
+    void compact_deadlines();
+    int next_timeout();
+    void reap_expired();
 
 public:
+    AsyncEventLoop();
+    AsyncEventLoop(std::shared_ptr<EventBackend> backend, std::shared_ptr<OffloadPool> offload_pool = default_offload_pool());
+    ~AsyncEventLoop();
+
     void register_pollable(std::shared_ptr<Pollable> pollable);
     void loop();
+
+    // get_stats returns the loop's counters and histograms, which may be snapshotted from any thread
+    // but only recorded to by pollables running on the loop
+    EventLoopStats& get_stats();
 };
 
 #endif //ASYNC_EVENT_LOOP_H
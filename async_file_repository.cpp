@@ -1,71 +1,170 @@
 #include "async_file_repository.h"
+#include "buffer_pool.h"
 #include <iostream>
 #include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <strings.h>
 #include <sys/stat.h>
-#include <sstream>
 #include "util.h"
 
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
 using std::make_shared;
 using std::shared_ptr;
 using std::string;
-using std::stringstream;
-
-#define BUFSIZE (1024 * 1024)
 
 const std::chrono::seconds DEFAULT_TIMEOUT = std::chrono::seconds(5);
 
 
 /*
  * FileReadPollable represents a pending non-blocking read operation in the file system.
- * It invokes its given callback once the data is ready.
+ * It opens the file and then reads it in chunks until the end of the file, into a buffer borrowed
+ * from the BufferPool. The first chunk is medium sized, which holds most files, and the rest use
+ * large buffers, so small files don't tie up a large buffer.
+ * It invokes its given callback once the data is ready, or with an empty string if the file can't be opened.
  */
-class FileReadPollable : public Pollable {
+class FileReadPollable : public CompletionPollable {
+    string filename;
     int fd;
     Callback<string>::F callback;
-    stringstream buffer;
+    string contents;
+    size_t total_read;
     bool done;
-    system_clock::time_point start;
-
-    bool try_read() {
-        char buf[BUFSIZE];
-
-        while (true) {
-            ssize_t ret = read(fd, buf, BUFSIZE);
-
-            if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                return false;
-            } else if (ret == -1) {
-                return false;
-            } else if (ret == 0) {
-                return true;
-            } else {
-                buf[ret] = '\0';
-                buffer << string(buf, (size_t)ret);
-                return false;
+    steady_clock::time_point deadline;
+    PooledBuffer chunk;
+
+public:
+    FileReadPollable(string filename, Callback<string>::F callback)
+            : filename(filename), fd(-1), callback(callback), total_read(0), done(false), deadline(steady_clock::now() + DEFAULT_TIMEOUT) {}
+
+    ~FileReadPollable() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // regular files are always ready, so there is no fd to wait on
+    virtual int get_fd() {
+        return -1;
+    }
+
+    virtual short get_events() {
+        return POLLIN;
+    }
+
+    virtual bool is_done() {
+        return done;
+    }
+
+    virtual steady_clock::time_point get_deadline() {
+        return deadline;
+    }
+
+    virtual void prepare(IoRequest& request) {
+        if (fd < 0) {
+            request = openat_request(filename.c_str(), O_RDONLY | O_CLOEXEC);
+            return;
+        }
+
+        chunk = BufferPool::local().acquire(total_read == 0 ? MEDIUM_BUFFER_SIZE : LARGE_BUFFER_SIZE);
+        request = read_request(fd, chunk.data(), chunk.size(), (off_t)total_read);
+    }
+
+    virtual shared_ptr<Pollable> complete(int result) {
+        if (fd < 0) {
+            if (result < 0) {
+                done = true;
+                return callback("");
             }
+            fd = result;
+            return shared_ptr<Pollable>();
+        }
+
+        if (result < 0) {
+            // give up like a timeout would
+            done = true;
+            return shared_ptr<Pollable>();
+        }
+
+        contents.append(chunk.data(), (size_t)result);
+        chunk.release();
+        total_read += result;
+        if (result > 0) {
+            return shared_ptr<Pollable>();
         }
+
+        done = true;
+        return callback(std::move(contents));
     }
+};
+
+
+/*
+ * FileOpenPollable represents a pending open() of a file in the file system whose contents will be
+ * sent with sendfile(). It invokes its given callback with a FileBody covering the first `length`
+ * bytes of the file, or null if the file can't be opened.
+ */
+class FileOpenPollable : public CompletionPollable {
+    string filename;
+    size_t length;
+    Callback<shared_ptr<FileBody>>::F callback;
+    bool done;
+    steady_clock::time_point deadline;
 
 public:
-    FileReadPollable(string filename, Callback<string>::F callback) : callback(callback), done(false), start(system_clock::now()) {
-        fd = open(filename.c_str(), O_NONBLOCK);
+    FileOpenPollable(string filename, size_t length, Callback<shared_ptr<FileBody>>::F callback)
+            : filename(filename), length(length), callback(callback), done(false), deadline(steady_clock::now() + DEFAULT_TIMEOUT) {}
+
+    virtual int get_fd() {
+        return -1;
+    }
+
+    virtual short get_events() {
+        return POLLIN;
+    }
+
+    virtual bool is_done() {
+        return done;
+    }
+
+    virtual steady_clock::time_point get_deadline() {
+        return deadline;
+    }
+
+    virtual void prepare(IoRequest& request) {
+        request = openat_request(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    }
 
-        int ret = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
-        if (ret < 0) {
-            std::cerr << "unable to set fd to non blocking!" << std::endl;
+    virtual shared_ptr<Pollable> complete(int result) {
+        done = true;
+        if (result < 0) {
+            return callback(shared_ptr<FileBody>());
         }
+        return callback(make_shared<FileBody>(result, 0, length));
     }
+};
 
-    ~FileReadPollable() {
-        close(fd);
+
+/*
+ * StatxPollable represents a pending statx() of a path in the file system.
+ * It invokes its given callback with a PathAsyncFile if the path exists, or null otherwise.
+ */
+class StatxPollable : public CompletionPollable {
+    string file_path;
+    Callback<shared_ptr<AsyncFile>>::F callback;
+    struct statx file_statx;
+    bool done;
+    steady_clock::time_point deadline;
+
+public:
+    StatxPollable(string file_path, Callback<shared_ptr<AsyncFile>>::F callback)
+            : file_path(file_path), callback(callback), done(false), deadline(steady_clock::now() + DEFAULT_TIMEOUT) {
+        bzero(&file_statx, sizeof(file_statx));
     }
 
     virtual int get_fd() {
-        return fd;
+        return -1;
     }
 
     virtual short get_events() {
@@ -76,50 +175,49 @@ public:
         return done;
     }
 
-    virtual bool past_deadline(system_clock::time_point now) {
-        return (now - start) > DEFAULT_TIMEOUT;
+    virtual steady_clock::time_point get_deadline() {
+        return deadline;
     }
 
-    virtual shared_ptr<Pollable> notify(short) {
-        done = try_read();
-        if (done) {
-            return callback(buffer.str());
-        } else {
-            return shared_ptr<Pollable>();
+    virtual void prepare(IoRequest& request) {
+        request = statx_request(file_path.c_str(), &file_statx);
+    }
+
+    virtual shared_ptr<Pollable> complete(int result) {
+        done = true;
+        if (result < 0) {
+            return callback(shared_ptr<PathAsyncFile>());
         }
+        return callback(make_shared<PathAsyncFile>(file_path, file_statx));
     }
 };
 
 
-PathAsyncFile::PathAsyncFile(string file_path) : file_path(file_path) {}
+PathAsyncFile::PathAsyncFile(string file_path, struct statx file_statx) : file_path(file_path), file_statx(file_statx) {}
 
 shared_ptr<Pollable> PathAsyncFile::is_world_readable(Callback<bool>::F callback) {
-    // TODO: make this nonblocking? - no, confirmed with professor that blocking is ok here
-    struct stat file_stat;
-    ::stat(file_path.c_str(), &file_stat);
-    return callback((file_stat.st_mode & S_IROTH));
+    return callback((file_statx.stx_mode & S_IROTH));
+}
+
+shared_ptr<Pollable> PathAsyncFile::read_size(Callback<size_t>::F callback) {
+    return callback((size_t) file_statx.stx_size);
 }
 
 shared_ptr<Pollable> PathAsyncFile::read_contents(Callback<string>::F callback) {
     return make_shared<FileReadPollable>(file_path, callback);
 }
 
+shared_ptr<Pollable> PathAsyncFile::open_contents(Callback<shared_ptr<FileBody>>::F callback) {
+    return make_shared<FileOpenPollable>(file_path, (size_t) file_statx.stx_size, callback);
+}
+
 shared_ptr<Pollable> PathAsyncFile::read_last_modified(Callback<system_clock::time_point>::F callback) {
-    // TODO: make this nonblocking? - no, confirmed with professor that blocking is ok here
-    struct stat file_stat;
-    ::stat(file_path.c_str(), &file_stat);
-    return callback(to_time_point(file_stat.st_mtime));
+    return callback(to_time_point(file_statx.stx_mtime.tv_sec));
 }
 
 
 DirectoryAsyncFileRepository::DirectoryAsyncFileRepository(string directory_path) : directory_path(directory_path) {}
 
 shared_ptr<Pollable> DirectoryAsyncFileRepository::read_file(string filename, Callback<shared_ptr<AsyncFile>>::F callback) {
-    // TODO: make this nonblocking? - no, confirmed with professor that blocking is ok here
-    string file_path = directory_path + "/" + filename;
-    if (access(file_path.c_str(), F_OK) < 0) {
-        return callback(shared_ptr<PathAsyncFile>());
-    }
-
-    return callback(make_shared<PathAsyncFile>(file_path));
+    return make_shared<StatxPollable>(directory_path + "/" + filename, callback);
 }
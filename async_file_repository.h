@@ -4,17 +4,23 @@
 #include <chrono>
 #include <memory>
 #include <string>
+#include <sys/stat.h>
 #include "async_event_loop.h"
+#include "http.h"
 
 
 /*
  * AsyncFile is an abstract class representing a unix file with asynchronous access operations.
  * It is analogous to File from file_repository.h, but asynchronous.
+ * `open_contents` opens the file for sending with sendfile() instead of reading it into memory,
+ * and invokes its callback with null if the file can't be opened.
  */
 class AsyncFile {
 public:
     virtual std::shared_ptr<Pollable> is_world_readable(Callback<bool>::F callback) = 0;
+    virtual std::shared_ptr<Pollable> read_size(Callback<size_t>::F callback) = 0;
     virtual std::shared_ptr<Pollable> read_contents(Callback<std::string>::F callback) = 0;
+    virtual std::shared_ptr<Pollable> open_contents(Callback<std::shared_ptr<FileBody>>::F callback) = 0;
     virtual std::shared_ptr<Pollable> read_last_modified(Callback<std::chrono::system_clock::time_point>::F callback) = 0;
 };
 
@@ -31,15 +37,19 @@ public:
 
 /*
  * PathAsyncFile represents a file at a given path like PathFIle from file_repository.h, but in an asynchronous manner.
+ * Its metadata comes from the statx() made when the file was looked up, so only reading its contents does IO.
  */
 class PathAsyncFile : public AsyncFile {
     std::string file_path;
+    struct statx file_statx;
 
 public:
-    PathAsyncFile(std::string file_path);
+    PathAsyncFile(std::string file_path, struct statx file_statx);
 
     virtual std::shared_ptr<Pollable> is_world_readable(Callback<bool>::F callback);
+    virtual std::shared_ptr<Pollable> read_size(Callback<size_t>::F callback);
     virtual std::shared_ptr<Pollable> read_contents(Callback<std::string>::F callback);
+    virtual std::shared_ptr<Pollable> open_contents(Callback<std::shared_ptr<FileBody>>::F callback);
     virtual std::shared_ptr<Pollable> read_last_modified(Callback<std::chrono::system_clock::time_point>::F callback);
 };
 
@@ -1,14 +1,62 @@
 #include "async_http_connection.h"
+#include <algorithm>
+#include <iostream>
 #include <memory>
+#include "async_coroutine.h"
 
+using std::dynamic_pointer_cast;
 using std::exception;
+using std::make_shared;
 using std::shared_ptr;
 using std::string;
+using std::vector;
 
 #define CRLFCRLF ("\r\n\r\n")
 
 
-AsyncHttpConnection::AsyncHttpConnection(std::shared_ptr<AsyncSocketConnection> conn) : conn(conn) {}
+/*
+ * BodyStreamCoroutine sends a BodySource over a connection a chunk at a time and then invokes its callback.
+ * The next chunk is only read once the last one has been sent, so at most one chunk is held in memory
+ * and a slow client holds back the source. Chunks are no bigger than the connection's output room,
+ * and none are read while the process is out of output budget. If the source ends early, the callback
+ * is never invoked, which drops the connection since the client was promised more bytes.
+ */
+class BodyStreamCoroutine : public AsyncCoroutine {
+    AsyncBufferedConnection* conn;
+    shared_ptr<BodySource> source;
+    Callback<>::F callback;
+
+    size_t total_sent;
+    string chunk;
+
+protected:
+    virtual shared_ptr<Pollable> body() {
+        CO_BEGIN
+
+        while (total_sent < source->size()) {
+            CO_AWAIT(conn->wait_for_output_room(resume_with()));
+            chunk = source->read_chunk(std::min(STREAM_CHUNK_SIZE, conn->output_room()));
+            if (chunk.empty()) {
+                std::cerr << "response body ended " << source->size() - total_sent << " bytes early" << std::endl;
+                return shared_ptr<Pollable>();
+            }
+
+            total_sent += chunk.size();
+            CO_AWAIT(conn->write(std::move(chunk), resume_with()));
+        }
+
+        return callback();
+
+        CO_END
+    }
+
+public:
+    BodyStreamCoroutine(AsyncBufferedConnection* conn, shared_ptr<BodySource> source, Callback<>::F callback)
+            : conn(conn), source(source), callback(callback), total_sent(0) {}
+};
+
+
+AsyncHttpConnection::AsyncHttpConnection(std::shared_ptr<AsyncSocketConnection> conn) : conn(conn), pending_size(0), kept_alive(false) {}
 
 std::shared_ptr<Pollable> AsyncHttpConnection::read_request(Callback<HttpRequest>::F callback) {
     return conn.read_until(CRLFCRLF, [=](string content) -> shared_ptr<Pollable> {
@@ -26,11 +74,47 @@ std::shared_ptr<Pollable> AsyncHttpConnection::read_request(Callback<HttpRequest
         }
 
         return shared_ptr<Pollable>();
-    });
+    }, kept_alive);
+}
+
+bool AsyncHttpConnection::queue_response(HttpResponse response) {
+    // streamed bodies are sent after their headers, so they can't be queued behind other responses,
+    // and a connection that is short on output budget sends what it has rather than holding on to more
+    if (response.body_source != NULL || pending_size >= MAX_COALESCED_BYTES || !conn.has_buffered(CRLFCRLF)
+            || pending_size + response.body.size() > conn.output_room()) {
+        return false;
+    }
+
+    // keep the body as its own part rather than copying it into a frame behind the headers
+    pending.push_back(response.pack_headers());
+    pending.push_back(string());
+    pending.back().swap(response.body);
+    pending_size += pending[pending.size() - 2].size() + pending.back().size();
+    return true;
 }
 
 std::shared_ptr<Pollable> AsyncHttpConnection::write_response(HttpResponse response, Callback<>::F callback) {
-    return conn.write(response.pack().serialize(), callback);
+    // send any queued responses ahead of this one in the same write
+    vector<string> parts;
+    parts.swap(pending);
+    pending_size = 0;
+    parts.push_back(response.pack_headers());
+    parts.push_back(string());
+    parts.back().swap(response.body);
+    kept_alive = true;
+    if (response.body_source == NULL) {
+        return conn.writev(parts, callback);
+    }
+
+    // once the headers have been sent, files go out with sendfile() and other sources are streamed a chunk at a time
+    shared_ptr<BodySource> body_source = response.body_source;
+    return conn.writev(parts, [=]() -> shared_ptr<Pollable> {
+        shared_ptr<FileBody> body_file = dynamic_pointer_cast<FileBody>(body_source);
+        if (body_file != NULL) {
+            return conn.write_file(body_file, callback);
+        }
+        return make_shared<BodyStreamCoroutine>(&conn, body_source, callback)->start();
+    });
 }
 
 
@@ -2,6 +2,8 @@
 #define ASYNC_HTTP_CONNECTION_H
 
 #include <functional>
+#include <string>
+#include <vector>
 #include "async_event_loop.h"
 #include "http.h"
 #include "async_connection.h"
@@ -11,14 +13,21 @@
  * AsyncHttpConnection wraps an AsyncSocketConnection and provides non-blocking
  * read_request and write_response methods that invoke their callbacks when
  * the operation is complete.
+ * Like HttpConnection, `queue_response` holds a response back while the next pipelined request
+ * is already buffered, and the next `write_response` sends it along with its own response.
+ * Once a response has been written, `read_request` waits for the next request as an idle read.
  */
 class AsyncHttpConnection {
     AsyncBufferedConnection conn;
+    std::vector<std::string> pending;
+    size_t pending_size;
+    bool kept_alive;
 
 public:
     AsyncHttpConnection(std::shared_ptr<AsyncSocketConnection> conn);
 
     std::shared_ptr<Pollable> read_request(Callback<HttpRequest>::F callback);
+    bool queue_response(HttpResponse);
     std::shared_ptr<Pollable> write_response(HttpResponse, Callback<>::F callback);
 };
 
@@ -1,43 +1,172 @@
 #include "async_http_server.h"
 #include "async_http_connection.h"
+#include "async_coroutine.h"
+#include <stdexcept>
+#include <thread>
 
+using std::invalid_argument;
 using std::make_shared;
 using std::shared_ptr;
+using std::static_pointer_cast;
+using std::chrono::steady_clock;
+using std::thread;
+using std::vector;
+using std::weak_ptr;
 
 
-shared_ptr<Pollable> handle_http_connection(shared_ptr<AsyncHttpConnection> http_conn, shared_ptr<AsyncHttpRequestHandler> handler);
-
-
-AsyncHttpServer::AsyncHttpServer(std::shared_ptr<AsyncSocketListener> listener, std::shared_ptr<AsyncHttpRequestHandler> handler)
-        : listener(listener), handler(handler) {}
+AsyncHttpServer::AsyncHttpServer(std::shared_ptr<AsyncSocketListener> listener, std::shared_ptr<AsyncHttpRequestHandler> handler,
+                                 EventBackendType backend, int accept_budget, ConnectionLimits limits)
+        : listener(listener), handler(handler), backend(backend), accept_budget(accept_budget), limits(limits) {}
 
 void AsyncHttpServer::serve() {
-    AsyncEventLoop loop;
+    shared_ptr<EventBackend> event_backend = make_event_backend(backend);
+    AsyncEventLoop loop(event_backend);
+    shared_ptr<IdleConnectionList> idle_connections = make_shared<IdleConnectionList>(limits.max_idle);
+
+    // io_uring sends without polling the socket, so it would never see the POLLERR that reports zerocopy notifications
+    OutputLimits output_limits = limits.output;
+    if (event_backend->supports_completions()) {
+        output_limits.zerocopy_threshold = 0;
+    }
 
     // begin listening and register a handler for incoming connections
     listener->listen();
-    loop.register_pollable(make_pollable(listener, [=](shared_ptr<AsyncSocketConnection> conn) -> shared_ptr<Pollable> {
-        return handle_http_connection(make_shared<AsyncHttpConnection>(conn), handler);
-    }));
+    loop.register_pollable(make_pollable(loop, listener, [=, &loop](shared_ptr<AsyncSocketConnection> conn) -> shared_ptr<Pollable> {
+        // idle connections are shed first, so that a flood of new ones doesn't starve active requests
+        idle_connections->make_room();
+        conn->configure(limits.timeouts, idle_connections, output_limits);
+        return handle_http_connection(loop, make_shared<AsyncHttpConnection>(conn), handler, DEFAULT_REQUEST_BUDGET, limits.timeouts);
+    }, accept_budget));
 
     loop.loop();
 }
 
 
-shared_ptr<Pollable> handle_http_connection(shared_ptr<AsyncHttpConnection> http_conn, shared_ptr<AsyncHttpRequestHandler> handler) {
-    return http_conn->read_request([=](HttpRequest request) -> shared_ptr<Pollable> {
-        if (!has_header(request.headers, "Host")) {
-            return http_conn->write_response(bad_request_response(), Callback<>::empty());
-        }
+MultiReactorAsyncHttpServer::MultiReactorAsyncHttpServer(uint16_t port, int reactors, shared_ptr<AsyncHttpRequestHandler> handler,
+                                                         EventBackendType backend, int accept_budget, ConnectionLimits limits) {
+    if (reactors < 1) {
+        throw invalid_argument("MultiReactorAsyncHttpServer needs at least one reactor");
+    }
 
-        return handler->handle_request(request, [=](HttpResponse response) -> shared_ptr<Pollable> {
-            return http_conn->write_response(response, [=]() -> shared_ptr<Pollable> {
-                if (get_header(request.headers, "Connection").value.find("close") != std::string::npos) {
-                    return shared_ptr<Pollable>();
-                }
+    // bind every listener up front so that bind errors surface on the calling thread
+    for (int i = 0; i < reactors; i++) {
+        shared_ptr<AsyncSocketListener> listener = make_shared<AsyncSocketListener>(port, true);
+        servers.push_back(make_shared<AsyncHttpServer>(listener, handler, backend, accept_budget, limits));
+    }
+}
+
+void MultiReactorAsyncHttpServer::serve() {
+    if (servers.empty()) {
+        return;
+    }
+
+    vector<thread> reactor_threads;
+    for (size_t i = 0; i + 1 < servers.size(); i++) {
+        shared_ptr<AsyncHttpServer> server = servers[i];
+        reactor_threads.push_back(thread([=]() { server->serve(); }));
+    }
+
+    servers.back()->serve();
+
+    for (size_t i = 0; i < reactor_threads.size(); i++) {
+        reactor_threads[i].join();
+    }
+}
+
+
+/*
+ * HttpConnectionCoroutine serves the requests on a single connection until the client asks to close it.
+ * Pipelined requests that are already buffered are served without waiting on the event loop,
+ * so the coroutine yields after every `request_budget` requests to let other connections run.
+ * Their responses are queued and sent together with the response to the last buffered request.
+ *
+ * While the handler processes a request, `processing_timer` bounds how long it may take. The timer
+ * is re-armed for each request, so it is only registered with the event loop every so often.
+ */
+class HttpConnectionCoroutine : public AsyncCoroutine {
+    AsyncEventLoop& loop;
+    shared_ptr<AsyncHttpConnection> http_conn;
+    shared_ptr<AsyncHttpRequestHandler> handler;
+    int request_budget;
+    ConnectionTimeouts timeouts;
+    shared_ptr<Timer> processing_timer;
+
+    HttpRequest request;
+    HttpResponse response;
+    bool keep_alive;
+    bool timed_out;
 
-                return handle_http_connection(http_conn, handler);
+    // start_processing arms the processing timer, which answers the request itself if the handler takes too long.
+    // the coroutine is still waiting on the handler then, so the connection is closed as soon as the 503 is sent
+    // rather than once the handler returns, and the coroutine ignores the handler's response when it resumes.
+    // Responses to earlier pipelined requests that are still queued go out ahead of the 503, in order.
+    // The timer only holds a weak_ptr, so that it neither keeps the coroutine alive nor calls into a freed one
+    void start_processing() {
+        weak_ptr<AsyncCoroutine> weak_self = shared_from_this();
+        shared_ptr<Pollable> timer = processing_timer->arm(steady_clock::now() + timeouts.processing, [weak_self]() -> shared_ptr<Pollable> {
+            shared_ptr<HttpConnectionCoroutine> self = static_pointer_cast<HttpConnectionCoroutine>(weak_self.lock());
+            if (self == NULL || self->http_conn == NULL) {
+                return shared_ptr<Pollable>();
+            }
+
+            self->timed_out = true;
+            return self->http_conn->write_response(service_unavailable_response(), [self]() -> shared_ptr<Pollable> {
+                // the write may complete synchronously, in which case its pollable is still running
+                return make_runnable([self]() -> shared_ptr<Pollable> {
+                    self->http_conn.reset();
+                    return shared_ptr<Pollable>();
+                });
             });
         });
-    });
+        if (timer != NULL) {
+            loop.register_pollable(timer);
+        }
+    }
+
+protected:
+    virtual shared_ptr<Pollable> body() {
+        CO_BEGIN
+
+        do {
+            CO_AWAIT(http_conn->read_request(resume_with(request)));
+            if (!has_header(request.headers, "Host")) {
+                return http_conn->write_response(bad_request_response(), Callback<>::empty());
+            }
+
+            keep_alive = get_header(request.headers, "Connection").value.find("close") == std::string::npos;
+            start_processing();
+            CO_AWAIT(handler->handle_request(request, resume_with(response)));
+            processing_timer->disarm();
+            if (timed_out) {
+                return shared_ptr<Pollable>();
+            }
+
+            if (!keep_alive || !http_conn->queue_response(response)) {
+                CO_AWAIT(http_conn->write_response(response, resume_with()));
+            }
+
+            if (keep_alive && charge(1, request_budget)) {
+                CO_YIELD;
+            }
+        } while (keep_alive);
+
+        CO_END
+    }
+
+public:
+    HttpConnectionCoroutine(AsyncEventLoop& loop, shared_ptr<AsyncHttpConnection> http_conn, shared_ptr<AsyncHttpRequestHandler> handler,
+                            int request_budget, ConnectionTimeouts timeouts)
+            : loop(loop), http_conn(http_conn), handler(handler), request_budget(request_budget), timeouts(timeouts),
+              processing_timer(make_shared<Timer>()), keep_alive(false), timed_out(false) {}
+
+    // the timer may outlive the coroutine in the event loop, so don't leave it registered for nothing
+    virtual ~HttpConnectionCoroutine() {
+        processing_timer->disarm();
+    }
+};
+
+
+shared_ptr<Pollable> handle_http_connection(AsyncEventLoop& loop, shared_ptr<AsyncHttpConnection> http_conn,
+                                            shared_ptr<AsyncHttpRequestHandler> handler, int request_budget, ConnectionTimeouts timeouts) {
+    return make_shared<HttpConnectionCoroutine>(loop, http_conn, handler, request_budget, timeouts)->start();
 }
@@ -2,9 +2,32 @@
 #define ASYNC_HTTP_SERVER_H
 
 #include "async_event_loop.h"
+#include "async_http_connection.h"
 #include "async_listener.h"
 #include "http.h"
 #include <memory>
+#include <vector>
+
+// the most pipelined requests a connection serves before yielding to the event loop
+#define DEFAULT_REQUEST_BUDGET (8)
+
+// the most idle keep-alive connections each event loop holds before evicting the least recently used
+#define DEFAULT_MAX_IDLE_CONNECTIONS (1024)
+
+
+/*
+ * ConnectionLimits configures how AsyncHttpServer manages its connections: the timeout for each
+ * ConnectionState, the most idle keep-alive connections that each event loop holds (see
+ * IdleConnectionList in async_connection.h), and the OutputLimits on their responses.
+ */
+struct ConnectionLimits {
+    ConnectionTimeouts timeouts;
+    size_t max_idle;
+    OutputLimits output;
+};
+
+const ConnectionLimits DEFAULT_CONNECTION_LIMITS = ConnectionLimits{DEFAULT_CONNECTION_TIMEOUTS, DEFAULT_MAX_IDLE_CONNECTIONS,
+                                                                    DEFAULT_OUTPUT_LIMITS};
 
 
 /*
@@ -20,17 +43,59 @@ public:
 };
 
 
+/*
+ * handle_http_connection serves the requests on `http_conn` with `handler` until the client closes it,
+ * yielding to `loop` after every `request_budget` requests that didn't have to wait on it.
+ * A request that the handler hasn't answered within the processing timeout is answered with
+ * 503 Service Unavailable, and the connection is given up.
+ */
+std::shared_ptr<Pollable> handle_http_connection(AsyncEventLoop& loop, std::shared_ptr<AsyncHttpConnection> http_conn,
+                                                 std::shared_ptr<AsyncHttpRequestHandler> handler,
+                                                 int request_budget = DEFAULT_REQUEST_BUDGET,
+                                                 ConnectionTimeouts timeouts = DEFAULT_CONNECTION_TIMEOUTS);
+
+
 /*
  * AsyncHttpServer takes an AsyncSocketListener and AsyncHttpRequestHandler and creates
  * and runs an AsyncEventLoop processing connections read from the AsyncSocketListener
- * with the given AsyncHttpRequestHandler.
+ * with the given AsyncHttpRequestHandler. The event loop waits on the given EventBackendType
+ * and accepts at most `accept_budget` connections per iteration. Its connections are managed
+ * according to `limits`, and each accepted connection evicts the least recently used idle one
+ * if the event loop already holds the most idle connections that it may.
+ * Zerocopy sends are only used with the readiness based backends (see OutputLimits).
  */
 class AsyncHttpServer {
     std::shared_ptr<AsyncSocketListener> listener;
     std::shared_ptr<AsyncHttpRequestHandler> handler;
+    EventBackendType backend;
+    int accept_budget;
+    ConnectionLimits limits;
+
+public:
+    AsyncHttpServer(std::shared_ptr<AsyncSocketListener> listener, std::shared_ptr<AsyncHttpRequestHandler> handler,
+                    EventBackendType backend = DEFAULT_EVENT_BACKEND, int accept_budget = DEFAULT_ACCEPT_BUDGET,
+                    ConnectionLimits limits = DEFAULT_CONNECTION_LIMITS);
+
+    void serve();
+};
+
+
+/*
+ * MultiReactorAsyncHttpServer runs `reactors` independent AsyncHttpServers, each on its own
+ * thread with its own AsyncEventLoop and its own AsyncSocketListener bound to the port with
+ * SO_REUSEPORT, so that the kernel spreads incoming connections across the event loops.
+ * Only the AsyncHttpRequestHandler is shared between the reactors, so it must be safe to
+ * call from several threads at once.
+ * `serve` runs the last reactor on the calling thread and blocks until all of them stop.
+ * The constructor throws std::invalid_argument for fewer than one reactor.
+ */
+class MultiReactorAsyncHttpServer {
+    std::vector<std::shared_ptr<AsyncHttpServer>> servers;
 
 public:
-    AsyncHttpServer(std::shared_ptr<AsyncSocketListener> listener, std::shared_ptr<AsyncHttpRequestHandler> handler);
+    MultiReactorAsyncHttpServer(uint16_t port, int reactors, std::shared_ptr<AsyncHttpRequestHandler> handler,
+                                EventBackendType backend = DEFAULT_EVENT_BACKEND, int accept_budget = DEFAULT_ACCEPT_BUDGET,
+                                ConnectionLimits limits = DEFAULT_CONNECTION_LIMITS);
 
     void serve();
 };
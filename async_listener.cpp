@@ -1,5 +1,5 @@
+#include <errno.h>
 #include <iostream>
-#include <fcntl.h>
 #include <sys/socket.h>
 #include <sstream>
 #include <strings.h>
@@ -10,16 +10,22 @@
 #include "listener.h"
 #include "util.h"
 
+using std::enable_shared_from_this;
 using std::make_shared;
 using std::shared_ptr;
-using std::chrono::system_clock;
+using std::chrono::steady_clock;
 
 #define INVALID_SOCK (-1)
 #define QUEUE_SIZE (2000)
 
 
-AsyncSocketListener::AsyncSocketListener(uint16_t port) {
-    this->sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+AsyncSocketListener::AsyncSocketListener(uint16_t port, bool reuse_port) : exhausted(false) {
+    this->sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+
+    int enable = 1;
+    if (reuse_port && setsockopt(this->sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        throw ListenerError(errno_message("setsockopt(SO_REUSEPORT) failed: "));
+    }
 
     struct sockaddr_in target;
     bzero(&target, sizeof(target));
@@ -33,7 +39,7 @@ AsyncSocketListener::AsyncSocketListener(uint16_t port) {
     }
 }
 
-AsyncSocketListener::AsyncSocketListener(AsyncSocketListener&& listener) : sock(listener.sock) {
+AsyncSocketListener::AsyncSocketListener(AsyncSocketListener&& listener) : sock(listener.sock), exhausted(false) {
     listener.sock = INVALID_SOCK;
 }
 
@@ -52,20 +58,38 @@ void AsyncSocketListener::listen() {
 }
 
 shared_ptr<AsyncSocketConnection> AsyncSocketListener::accept() {
-    struct sockaddr_in client_addr;
-    unsigned int client_len = sizeof(client_addr);
-
-    int client_sock = ::accept(sock, (struct sockaddr*) &client_addr, &client_len);
-    if (client_sock < 0) {
-        throw ListenerError(errno_message("accept() failed: "));
-    }
-
-    int ret = fcntl(client_sock, F_SETFL, fcntl(client_sock, F_GETFL, 0) | O_NONBLOCK);
-    if (ret < 0) {
-        std::cerr << "unable to set client sock to non blocking!" << std::endl;
+    exhausted = false;
+    while (true) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        // accept4 makes the client socket non-blocking as it is created rather than with another fcntl pair
+        int client_sock = ::accept4(sock, (struct sockaddr*) &client_addr, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock >= 0) {
+            return make_shared<AsyncSocketConnection>(client_sock, client_addr.sin_addr);
+        }
+
+        // keep the error before anything else can overwrite errno
+        int error = errno;
+        if (error == EAGAIN || error == EWOULDBLOCK) {
+            return shared_ptr<AsyncSocketConnection>();
+        }
+        // the client gave up while it was still in the backlog, so move on to the next one
+        if (error == ECONNABORTED || error == EINTR) {
+            continue;
+        }
+        // these pass once other connections close, so they mustn't stop the listener for good
+        if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM) {
+            std::cerr << errno_message("warning: accept() failed: ", error) << std::endl;
+            exhausted = true;
+            return shared_ptr<AsyncSocketConnection>();
+        }
+        throw ListenerError(errno_message("accept() failed: ", error));
     }
+}
 
-    return make_shared<AsyncSocketConnection>(client_sock, client_addr.sin_addr);
+bool AsyncSocketListener::out_of_resources() {
+    return exhausted;
 }
 
 int AsyncSocketListener::get_fd() {
@@ -75,39 +99,76 @@ int AsyncSocketListener::get_fd() {
 
 /*
  * AsyncSocketListenerPollable represents a non-blocking listen on the given
- * AsyncSocketListener. When the socket listener is ready, it calls accept() and invokes its callback
- * with the resulting connection.
+ * AsyncSocketListener. When the socket listener is ready, it calls accept() until the backlog
+ * is empty or `accept_budget` connections have been accepted, invokes its callback with each
+ * resulting connection and registers the callback's Pollable with the event loop.
+ * Connections left over after the budget is spent are accepted on the next iteration, since
+ * the listener is still ready.
+ * If the listener runs out of resources, the pollable re-registers itself without any events
+ * until ACCEPT_BACKOFF has passed, and expiring registers it to accept again.
  */
-class AsyncSocketListenerPollable : public Pollable {
+class AsyncSocketListenerPollable : public Pollable, public enable_shared_from_this<AsyncSocketListenerPollable> {
+    AsyncEventLoop& loop;
     shared_ptr<AsyncSocketListener> listener;
     Callback<shared_ptr<AsyncSocketConnection>>::F callback;
+    int accept_budget;
+    steady_clock::time_point paused_until;
 
 public:
-    AsyncSocketListenerPollable(shared_ptr<AsyncSocketListener> listener, Callback<shared_ptr<AsyncSocketConnection>>::F callback)
-            : listener(listener), callback(callback) {}
+    AsyncSocketListenerPollable(AsyncEventLoop& loop, shared_ptr<AsyncSocketListener> listener,
+                                Callback<shared_ptr<AsyncSocketConnection>>::F callback, int accept_budget)
+            : loop(loop), listener(listener), callback(callback), accept_budget(accept_budget), paused_until(NO_DEADLINE) {}
 
     virtual int get_fd() {
         return listener->get_fd();
     }
 
     virtual short get_events() {
-        return POLLIN;
+        return paused_until == NO_DEADLINE ? POLLIN : 0;
     }
 
     virtual bool is_done() {
         return false;
     }
 
-    virtual bool past_deadline(system_clock::time_point) {
-        return false;
+    virtual steady_clock::time_point get_deadline() {
+        return paused_until;
     }
 
     virtual std::shared_ptr<Pollable> notify(short) {
-        return callback(listener->accept());
+        if (paused_until != NO_DEADLINE) {
+            return shared_ptr<Pollable>();
+        }
+
+        int accepted = 0;
+        while (accepted < accept_budget) {
+            shared_ptr<AsyncSocketConnection> conn = listener->accept();
+            if (conn == NULL) {
+                break;
+            }
+            accepted++;
+
+            shared_ptr<Pollable> pollable = callback(conn);
+            if (pollable != NULL) {
+                loop.register_pollable(pollable);
+            }
+        }
+
+        loop.get_stats().accepts_per_wakeup.record(accepted);
+        if (listener->out_of_resources()) {
+            paused_until = steady_clock::now() + ACCEPT_BACKOFF;
+            return shared_from_this();
+        }
+        return shared_ptr<Pollable>();
+    }
+
+    virtual std::shared_ptr<Pollable> expire() {
+        paused_until = NO_DEADLINE;
+        return shared_from_this();
     }
 };
 
-shared_ptr<Pollable> make_pollable(shared_ptr<AsyncSocketListener> listener, Callback<shared_ptr<AsyncSocketConnection>>::F callback) {
-    return make_shared<AsyncSocketListenerPollable>(listener, callback);
+shared_ptr<Pollable> make_pollable(AsyncEventLoop& loop, shared_ptr<AsyncSocketListener> listener,
+                                   Callback<shared_ptr<AsyncSocketConnection>>::F callback, int accept_budget) {
+    return make_shared<AsyncSocketListenerPollable>(loop, listener, callback, accept_budget);
 }
-
@@ -1,34 +1,60 @@
 #ifndef ASYNC_LISTENER_H_H
 #define ASYNC_LISTENER_H_H
 
+#include <chrono>
 #include <memory>
 #include "async_connection.h"
 #include "async_event_loop.h"
 
+// the most connections a listener accepts each time the event loop finds it ready
+#define DEFAULT_ACCEPT_BUDGET (64)
+
+// how long a listener pauses accepting after it runs out of descriptors or memory
+const std::chrono::milliseconds ACCEPT_BACKOFF(100);
+
 
 /*
  * AsyncSocketListener represents a non-blocking socket listener.
  * A Pollable for the listener can be created using make_pollable below,
  * which will invoke the given callback whenever a socket is ready.
+ * `accept` returns null once there are no more pending connections, or when the process or
+ * system is out of descriptors or memory to accept one with. `out_of_resources` tells the two
+ * apart for the last call to `accept`, since the connections left in the backlog in the latter
+ * case keep the listener ready.
  *
  * Note that AsyncSocketListner is not safe for concurrent access and uncoordinated
  * concurrent access may caused blocking.
+ * If `reuse_port` is set, the socket is bound with SO_REUSEPORT so that several listeners
+ * (e.g. one per event loop thread) can bind the same port and have the kernel spread
+ * incoming connections across them.
  */
 class AsyncSocketListener {
     int sock;
+    bool exhausted;
 
 public:
-    AsyncSocketListener(uint16_t port);
+    AsyncSocketListener(uint16_t port, bool reuse_port = false);
     AsyncSocketListener(AsyncSocketListener&&);
     ~AsyncSocketListener();
 
     void listen();
     std::shared_ptr<AsyncSocketConnection> accept();
+    bool out_of_resources();
 
     int get_fd();
 };
 
-std::shared_ptr<Pollable> make_pollable(std::shared_ptr<AsyncSocketListener> listener, Callback<std::shared_ptr<AsyncSocketConnection>>::F conn);
+/*
+ * make_pollable creates a Pollable that accepts connections from `listener` whenever it is ready
+ * and registers the Pollable returned by `conn` for each one with `loop`.
+ * At most `accept_budget` connections are accepted per iteration of the event loop, so that
+ * a burst of new connections can't starve the established ones. When the listener runs out of
+ * resources, the Pollable stops waiting on it for ACCEPT_BACKOFF, rather than spinning on the
+ * connections it can't accept, and then carries on.
+ */
+std::shared_ptr<Pollable> make_pollable(AsyncEventLoop& loop, std::shared_ptr<AsyncSocketListener> listener,
+                                        Callback<std::shared_ptr<AsyncSocketConnection>>::F conn,
+                                        int accept_budget = DEFAULT_ACCEPT_BUDGET);
 
 
 #endif //ASYNC_LISTENER_H_H
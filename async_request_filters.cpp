@@ -1,34 +1,100 @@
+#include <stdexcept>
+#include <unordered_map>
 #include "async_request_filters.h"
+#include "async_coroutine.h"
 #include "htaccess.h"
 #include "dns_client.h"
 #include "util.h"
 
 using std::make_shared;
+using std::runtime_error;
 using std::shared_ptr;
 using std::string;
+using std::unordered_map;
+using std::vector;
 
 
 string htaccess_path_from_file_path(string path);
 
 
-AsyncHtAccessRequestFilter::AsyncHtAccessRequestFilter(shared_ptr<AsyncFileRepository> repository) : repository(repository) {}
+/*
+ * HtAccessCoroutine checks a single request against its .htaccess file for AsyncHtAccessRequestFilter.
+ * Any hosts named by the rules are looked up together with the AsyncDnsClient before the rules are
+ * parsed, so the whole check runs on the event loop.
+ */
+class HtAccessCoroutine : public AsyncCoroutine {
+    shared_ptr<AsyncFileRepository> repository;
+    shared_ptr<AsyncDnsClient> dns_client;
+    HttpRequest request;
+    Callback<FilterResult>::F callback;
 
-shared_ptr<Pollable> AsyncHtAccessRequestFilter::allow_request(HttpRequest request, Callback<bool>::F callback) {
-    string htacces_path = htaccess_path_from_file_path(canonicalize_path(request.uri));
+    string htaccess_path;
+    shared_ptr<AsyncFile> file;
+    string contents;
+    vector<string> domains;
+    vector<DnsAnswer> answers;
 
-    if (htacces_path != "") {
-        return repository->read_file(htacces_path, [=](shared_ptr<AsyncFile> file) -> shared_ptr<Pollable> {
-            if (file) {
-                return file->read_contents([=](string contents) -> shared_ptr<Pollable> {
-                    HtAccess htaccess = parse_htaccess_rules(contents, make_shared<NetworkDnsClient>());
-
-                    return callback(htaccess.allows(request.remote_ip));
-                });
+    // resolved returns a DnsClient that serves the answers to the rules' lookups, or NULL if one of them failed
+    shared_ptr<DnsClient> resolved() {
+        unordered_map<string, vector<struct in_addr>> addresses;
+        for (size_t i = 0; i < answers.size(); i++) {
+            if (answers[i].error != "") {
+                return shared_ptr<DnsClient>();
             }
+            addresses[answers[i].domain] = answers[i].addresses;
+        }
+        return make_shared<ResolvedDnsClient>(addresses);
+    }
 
-            return callback(true);
-        });
+    // check applies the rules to the request. It runs inside the callbacks of the lookups, so it
+    // reports invalid rules as FILTER_FAILED rather than throwing into the event loop
+    FilterResult check() {
+        shared_ptr<DnsClient> dns = resolved();
+        if (dns == NULL) {
+            return FILTER_FAILED;
+        }
+        try {
+            return parse_htaccess_rules(contents, dns).allows(request.remote_ip) ? FILTER_ALLOWED : FILTER_DENIED;
+        } catch (runtime_error&) {
+            return FILTER_FAILED;
+        }
     }
 
-    return callback(true);
+protected:
+    virtual shared_ptr<Pollable> body() {
+        CO_BEGIN
+
+        htaccess_path = htaccess_path_from_file_path(canonicalize_path(request.uri));
+        if (htaccess_path == "") {
+            return callback(FILTER_ALLOWED);
+        }
+
+        CO_AWAIT(repository->read_file(htaccess_path, resume_with(file)));
+        if (!file) {
+            return callback(FILTER_ALLOWED);
+        }
+
+        CO_AWAIT(file->read_contents(resume_with(contents)));
+        domains = htaccess_domains(contents);
+        if (!domains.empty()) {
+            CO_AWAIT(dns_client->lookup(domains, resume_with(answers)));
+        }
+        return callback(check());
+
+        CO_END
+    }
+
+public:
+    HtAccessCoroutine(shared_ptr<AsyncFileRepository> repository, shared_ptr<AsyncDnsClient> dns_client,
+                      HttpRequest request, Callback<FilterResult>::F callback)
+            : repository(repository), dns_client(dns_client), request(request), callback(callback) {}
+};
+
+
+AsyncHtAccessRequestFilter::AsyncHtAccessRequestFilter(shared_ptr<AsyncFileRepository> repository,
+                                                       shared_ptr<AsyncDnsClient> dns_client)
+        : repository(repository), dns_client(dns_client) {}
+
+shared_ptr<Pollable> AsyncHtAccessRequestFilter::allow_request(HttpRequest request, Callback<FilterResult>::F callback) {
+    return make_shared<HtAccessCoroutine>(repository, dns_client, request, callback)->start();
 }
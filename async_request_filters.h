@@ -1,33 +1,47 @@
 #ifndef ASYNC_REQUEST_FILTER_H
 #define ASYNC_REQUEST_FILTER_H
 
+#include "async_dns_client.h"
 #include "async_event_loop.h"
 #include "async_file_repository.h"
 #include "http.h"
 
 
+/*
+ * FilterResult is the outcome of an AsyncRequestFilter. FILTER_FAILED means that the filter
+ * couldn't decide, e.g. because a host named by its rules couldn't be looked up, which the
+ * synchronous filters report by throwing.
+ */
+enum FilterResult {
+    FILTER_ALLOWED,
+    FILTER_DENIED,
+    FILTER_FAILED
+};
+
 /*
  * AsyncRequestFilter is an abstract class that represents an asynchronous predicate
- * for HttpRequests. It invokes its callback with an allow/deny boolean onces the result
- * is ready.
+ * for HttpRequests. It invokes its callback with a FilterResult once the result is ready,
+ * and never throws from the callback's side of the operation.
  */
 class AsyncRequestFilter {
 public:
-    virtual std::shared_ptr<Pollable> allow_request(HttpRequest request, Callback<bool>::F callback) = 0;
+    virtual std::shared_ptr<Pollable> allow_request(HttpRequest request, Callback<FilterResult>::F callback) = 0;
 };
 
 
 /*
  * AsyncHtAccessRequestFilter filters requests like HtAccessRequestFilter from request_filters.h,
- * but in a non-blocking manner.
+ * but in a non-blocking manner. Hosts named by the rules are looked up with an AsyncDnsClient,
+ * and the request fails with FILTER_FAILED if any of them can't be resolved or the rules are invalid.
  */
 class AsyncHtAccessRequestFilter : public AsyncRequestFilter {
     std::shared_ptr<AsyncFileRepository> repository;
+    std::shared_ptr<AsyncDnsClient> dns_client;
 
 public:
-    AsyncHtAccessRequestFilter(std::shared_ptr<AsyncFileRepository>);
+    AsyncHtAccessRequestFilter(std::shared_ptr<AsyncFileRepository>, std::shared_ptr<AsyncDnsClient>);
 
-    virtual std::shared_ptr<Pollable> allow_request(HttpRequest request, Callback<bool>::F callback);
+    virtual std::shared_ptr<Pollable> allow_request(HttpRequest request, Callback<FilterResult>::F callback);
 };
 
 #endif //ASYNC_REQUEST_FILTER_H
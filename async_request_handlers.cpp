@@ -1,58 +1,128 @@
 #include "async_request_handlers.h"
 #include <string>
+#include "async_coroutine.h"
 #include "util.h"
 
 using std::chrono::system_clock;
+using std::make_shared;
 using std::shared_ptr;
 using std::string;
 
+// files at least this large are sent with sendfile() rather than read into memory, smaller ones fit in
+// a single read and go out with their headers in one send
+#define SENDFILE_MIN_SIZE (64 * 1024)
+
 
 shared_ptr<Pollable> TestAsyncHttpRequestHandler::handle_request(HttpRequest, Callback<HttpResponse>::F callback) {
     return callback(forbidden_response());
 }
 
 
-FileServingAsyncHttpRequestHandler::FileServingAsyncHttpRequestHandler(shared_ptr<AsyncFileRepository> repository) : repository(repository) {}
+/*
+ * FileServingCoroutine serves a single request for FileServingAsyncHttpRequestHandler.
+ */
+class FileServingCoroutine : public AsyncCoroutine {
+    shared_ptr<AsyncFileRepository> repository;
+    string uri;
+    Callback<HttpResponse>::F callback;
 
-shared_ptr<Pollable> FileServingAsyncHttpRequestHandler::handle_request(HttpRequest request, Callback<HttpResponse>::F callback) {
-    string path = canonicalize_path(request.uri);
-    if (path == "") {
-        return callback(not_found_response());
-    }
+    string path;
+    shared_ptr<AsyncFile> file;
+    bool world_readable;
+    size_t size;
+    string contents;
+    shared_ptr<FileBody> body_file;
+    system_clock::time_point last_modified;
 
-    if (path == "/") {
-        path = "/index.html";
-    }
+protected:
+    virtual shared_ptr<Pollable> body() {
+        CO_BEGIN
+
+        path = canonicalize_path(uri);
+        if (path == "") {
+            return callback(not_found_response());
+        }
+
+        if (path == "/") {
+            path = "/index.html";
+        }
 
-    return repository->read_file(path, [=](shared_ptr<AsyncFile> file) -> shared_ptr<Pollable> {
+        CO_AWAIT(repository->read_file(path, resume_with(file)));
         if (file == NULL) {
             return callback(not_found_response());
         }
 
-        return file->is_world_readable([=](bool world_readable) -> shared_ptr<Pollable> {
-            if (!world_readable) {
-                return callback(forbidden_response());
+        CO_AWAIT(file->is_world_readable(resume_with(world_readable)));
+        if (!world_readable) {
+            return callback(forbidden_response());
+        }
+
+        CO_AWAIT(file->read_last_modified(resume_with(last_modified)));
+        CO_AWAIT(file->read_size(resume_with(size)));
+        if (size >= SENDFILE_MIN_SIZE) {
+            CO_AWAIT(file->open_contents(resume_with(body_file)));
+            if (body_file == NULL) {
+                return callback(not_found_response());
             }
+            return callback(ok_stream_response(body_file, infer_content_type(path), last_modified));
+        }
+
+        CO_AWAIT(file->read_contents(resume_with(contents)));
+        return callback(ok_response(contents, infer_content_type(path), last_modified));
+
+        CO_END
+    }
+
+public:
+    FileServingCoroutine(shared_ptr<AsyncFileRepository> repository, string uri, Callback<HttpResponse>::F callback)
+            : repository(repository), uri(uri), callback(callback), world_readable(false), size(0) {}
+};
 
-            return file->read_contents([=](string contents) -> shared_ptr<Pollable> {
-                return file->read_last_modified([=](system_clock::time_point last_modified) -> shared_ptr<Pollable> {
-                    return callback(ok_response(contents, infer_content_type(path), last_modified));
-                });
-            });
-        });
-    });
+
+FileServingAsyncHttpRequestHandler::FileServingAsyncHttpRequestHandler(shared_ptr<AsyncFileRepository> repository) : repository(repository) {}
+
+shared_ptr<Pollable> FileServingAsyncHttpRequestHandler::handle_request(HttpRequest request, Callback<HttpResponse>::F callback) {
+    return make_shared<FileServingCoroutine>(repository, request.uri, callback)->start();
 }
 
 
+/*
+ * FilterMiddlewareCoroutine handles a single request for AsyncRequestFilterMiddleware.
+ */
+class FilterMiddlewareCoroutine : public AsyncCoroutine {
+    shared_ptr<AsyncRequestFilter> filter;
+    shared_ptr<AsyncHttpRequestHandler> handler;
+    HttpRequest request;
+    Callback<HttpResponse>::F callback;
+
+    FilterResult result;
+
+protected:
+    virtual shared_ptr<Pollable> body() {
+        CO_BEGIN
+
+        CO_AWAIT(filter->allow_request(request, resume_with(result)));
+        if (result == FILTER_FAILED) {
+            return callback(internal_server_error_response());
+        } else if (result == FILTER_DENIED) {
+            return callback(forbidden_response());
+        }
+
+        return handler->handle_request(request, callback);
+
+        CO_END
+    }
+
+public:
+    FilterMiddlewareCoroutine(shared_ptr<AsyncRequestFilter> filter, shared_ptr<AsyncHttpRequestHandler> handler,
+                              HttpRequest request, Callback<HttpResponse>::F callback)
+            : filter(filter), handler(handler), request(request), callback(callback), result(FILTER_DENIED) {}
+};
+
+
 AsyncRequestFilterMiddleware::AsyncRequestFilterMiddleware(shared_ptr<AsyncRequestFilter> filter, shared_ptr<AsyncHttpRequestHandler> handler)
         : filter(filter), handler(handler) {}
 
 shared_ptr<Pollable> AsyncRequestFilterMiddleware::handle_request(HttpRequest request, Callback<HttpResponse>::F callback) {
-    return filter->allow_request(request, [=](bool allowed) -> shared_ptr<Pollable> {
-        if (allowed) {
-            return handler->handle_request(request, callback);
-        } else {
-            return callback(forbidden_response());
-        }
-    });
+    return make_shared<FilterMiddlewareCoroutine>(filter, handler, request, callback)->start();
 }
@@ -29,6 +29,8 @@ public:
 /*
  * AsyncRequestFilterMiddleware filters incoming HttpRequests and delegates them to its delegate
  * handler like RequestFilterMiddleware from request_handlers.h, but in a non-blocking manner.
+ * A request that the filter fails on is answered with 500, like a filter that throws in the
+ * synchronous server.
  */
 class AsyncRequestFilterMiddleware : public AsyncHttpRequestHandler {
     std::shared_ptr<AsyncRequestFilter> filter;
@@ -0,0 +1,274 @@
+#!/usr/bin/env python3
+"""
+Closed loop load generator for comparing httpd thread models and event loop backends.
+
+The benchmark starts ./httpd on itest_files/ with the given thread model arguments,
+optionally opens a number of idle keep-alive connections to it, and then runs
+`concurrency` clients that each make requests back to back for `duration` seconds.
+
+With --sweep, the literal argument N in the thread model is replaced by each of the
+given values in turn, e.g. to measure how the multi-reactor async mode scales with cores.
+
+With --trickle, each request's headers are padded to the given size and sent one byte
+at a time, like a slow client, which stresses how the server buffers partial requests.
+The server's CPU time is reported along with the throughput, both per request and per
+gigabyte of response bodies sent.
+
+With --compare, a second thread model is run with the same settings after each run of the
+first one, and its throughput is reported relative to the first model's at the same N, e.g.
+to compare per-worker SO_REUSEPORT accept loops with the pool's single accept thread on short
+Connection: close requests, where accepting is most of the work.
+
+With --body, a file of the given size is generated in itest_files/ and requested instead
+of --path. Files smaller than 64KB are read into memory and sent with sendmsg() rather
+than sendfile(), so this compares the zerocopy send path against the plain copying one.
+Over loopback the kernel copies the data to the receiving socket regardless, so only
+measure zerocopy against a client on another machine.
+
+Examples:
+    ./benchmark.py --idle 10000 async poll
+    ./benchmark.py --idle 10000 async epoll
+    ./benchmark.py --path /meg.png --concurrency 4 pool 5
+    ./benchmark.py --sweep 1,2,4,8,16,32 --concurrency 64 async N
+    ./benchmark.py --close --sweep 1,2,4,8 --concurrency 32 --compare "reuseport N" pool N
+    ./benchmark.py --trickle 4096 --concurrency 16 async epoll
+    ./benchmark.py --body 49152 --concurrency 16 async epoll zerocopy
+"""
+import argparse
+import http.client
+import os
+import resource
+import signal
+import socket
+import subprocess
+import threading
+import time
+
+SLEEP_TIMEOUT = 0.5
+BASE_PATH = "itest_files/"
+GENERATED_BODY = "benchmark_body.bin"
+
+
+def raise_fd_limit(wanted):
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft < wanted:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (min(wanted, hard), hard))
+
+
+class IdleConnections:
+    """ Holds `count` connections open without sending anything on them. """
+
+    def __init__(self, port, count):
+        self.port = port
+        self.socks = []
+        for _ in range(count):
+            self.socks.append(socket.create_connection(("localhost", self.port)))
+
+    def close(self):
+        for sock in self.socks:
+            sock.close()
+
+
+class Client(threading.Thread):
+    """ Makes keep-alive GET requests (or one request per connection with close=True) until stopped. """
+
+    def __init__(self, port, path, close, deadline):
+        super().__init__()
+        self.port = port
+        self.path = path
+        self.close = close
+        self.deadline = deadline
+        self.latencies = []
+        self.bytes = 0
+        self.errors = 0
+
+    def run(self):
+        headers = {"Connection": "close"} if self.close else {}
+        conn = None
+        while time.time() < self.deadline:
+            if conn is None:
+                conn = http.client.HTTPConnection("localhost", self.port, timeout=10)
+            try:
+                start = time.perf_counter()
+                conn.request("GET", self.path, headers=headers)
+                body = conn.getresponse().read()
+                self.latencies.append(time.perf_counter() - start)
+                self.bytes += len(body)
+            except (OSError, http.client.HTTPException):
+                self.errors += 1
+                conn.close()
+                conn = None
+                continue
+            if self.close:
+                conn.close()
+                conn = None
+        if conn is not None:
+            conn.close()
+
+
+class TrickleClient(Client):
+    """ Like Client, but sends each request one byte at a time with headers padded to `size` bytes. """
+
+    def __init__(self, port, path, close, deadline, size):
+        super().__init__(port, path, close, deadline)
+        request = "GET {} HTTP/1.1\r\nHost: localhost\r\n".format(path)
+        padding = max(0, size - len(request) - len("X-Padding: \r\n\r\n"))
+        self.request = (request + "X-Padding: " + "x" * padding + "\r\n\r\n").encode()
+
+    def read_response(self, sock):
+        response = b""
+        while b"\r\n\r\n" not in response:
+            chunk = sock.recv(65536)
+            if not chunk:
+                raise OSError("connection closed")
+            response += chunk
+        head, body = response.split(b"\r\n\r\n", 1)
+        length = 0
+        for line in head.split(b"\r\n"):
+            if line.lower().startswith(b"content-length:"):
+                length = int(line.split(b":", 1)[1])
+        while len(body) < length:
+            chunk = sock.recv(65536)
+            if not chunk:
+                raise OSError("connection closed")
+            body += chunk
+        return body
+
+    def run(self):
+        sock = None
+        while time.time() < self.deadline:
+            try:
+                if sock is None:
+                    sock = socket.create_connection(("localhost", self.port), timeout=10)
+                    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+                start = time.perf_counter()
+                for i in range(len(self.request)):
+                    sock.send(self.request[i:i + 1])
+                body = self.read_response(sock)
+                self.latencies.append(time.perf_counter() - start)
+                self.bytes += len(body)
+            except OSError:
+                self.errors += 1
+                if sock is not None:
+                    sock.close()
+                sock = None
+        if sock is not None:
+            sock.close()
+
+
+def cpu_seconds(pid):
+    """ Returns the user and system CPU time used so far by the process `pid`. """
+    with open("/proc/{}/stat".format(pid)) as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def run_benchmark(args, port, model):
+    raise_fd_limit(args.idle + args.concurrency + 1024)
+
+    daemon = subprocess.Popen(["./httpd", str(port), BASE_PATH] + model, stderr=subprocess.DEVNULL)
+    time.sleep(SLEEP_TIMEOUT)
+    if daemon.poll() is not None:
+        raise Exception("failed to init server!")
+
+    try:
+        idle = IdleConnections(port, args.idle)
+        # give the server a moment to accept the idle connections before measuring
+        time.sleep(SLEEP_TIMEOUT)
+        deadline = time.time() + args.duration
+        if args.trickle:
+            clients = [TrickleClient(port, args.path, args.close, deadline, args.trickle) for _ in range(args.concurrency)]
+        else:
+            clients = [Client(port, args.path, args.close, deadline) for _ in range(args.concurrency)]
+        cpu_start = cpu_seconds(daemon.pid)
+        for client in clients:
+            client.start()
+        for client in clients:
+            client.join()
+        cpu_used = cpu_seconds(daemon.pid) - cpu_start
+        idle.close()
+    finally:
+        os.kill(daemon.pid, signal.SIGTERM)
+        daemon.wait()
+
+    latencies = [l for client in clients for l in client.latencies]
+    total_bytes = sum(client.bytes for client in clients)
+    errors = sum(client.errors for client in clients)
+
+    print("Thread model:        {}".format(" ".join(model)))
+    print("Idle connections:    {}".format(args.idle))
+    print("Concurrency level:   {}".format(args.concurrency))
+    print("Document path:       {}".format(args.path))
+    if args.trickle:
+        print("Trickled headers:    {} bytes".format(args.trickle))
+    print("Complete requests:   {}".format(len(latencies)))
+    print("Failed requests:     {}".format(errors))
+    print("Requests per second: {:.2f}".format(len(latencies) / args.duration))
+    print("Transfer rate:       {:.2f} [Kbytes/sec]".format(total_bytes / 1024 / args.duration))
+    print("Latency (ms):        50% {:.3f}  99% {:.3f}  max {:.3f}".format(
+        percentile(latencies, 50) * 1000, percentile(latencies, 99) * 1000, percentile(latencies, 100) * 1000))
+    print("Server CPU time:     {:.2f} s ({:.1f} us/request, {:.2f} s/GB)".format(
+        cpu_used, cpu_used * 1e6 / len(latencies) if latencies else 0.0, cpu_used * 1e9 / total_bytes if total_bytes else 0.0))
+    return len(latencies) / args.duration
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", type=int, default=6060)
+    parser.add_argument("--idle", type=int, default=0, help="number of idle connections to hold open")
+    parser.add_argument("--concurrency", type=int, default=4, help="number of concurrent active clients")
+    parser.add_argument("--duration", type=float, default=3.0, help="seconds to run the load for")
+    parser.add_argument("--path", default="/foo.html", help="uri to request")
+    parser.add_argument("--close", action="store_true", help="send 'Connection: close' with every request")
+    parser.add_argument("--trickle", type=int, default=0, help="pad headers to this many bytes and send them one byte at a time")
+    parser.add_argument("--body", type=int, default=0, help="request a generated file of this many bytes instead of --path")
+    parser.add_argument("--sweep", help="comma separated values to substitute for N in the thread model")
+    parser.add_argument("--compare", help="another thread model to run with the same settings, e.g. 'reuseport N'")
+    parser.add_argument("model", nargs="+", help="thread model arguments passed to ./httpd")
+    args = parser.parse_args()
+
+    if args.body:
+        with open(BASE_PATH + GENERATED_BODY, "wb") as f:
+            f.write(os.urandom(args.body))
+        args.path = "/" + GENERATED_BODY
+    try:
+        run_benchmarks(args)
+    finally:
+        if args.body:
+            os.remove(BASE_PATH + GENERATED_BODY)
+
+
+def run_benchmarks(args):
+    if not args.sweep and not args.compare:
+        run_benchmark(args, args.port, args.model)
+        return
+
+    models = [args.model]
+    if args.compare:
+        models.append(args.compare.split())
+
+    results = []
+    port = args.port
+    for n in (args.sweep.split(",") if args.sweep else ["N"]):
+        for base_model in models:
+            model = [n if arg == "N" else arg for arg in base_model]
+            results.append((" ".join(model), run_benchmark(args, port, model)))
+            port += 1
+            print()
+
+    print("{:<24} {:>12} {:>8}".format("Thread model", "Requests/s", "Speedup"))
+    for i, (model, rps) in enumerate(results):
+        # with --compare each run is relative to the first model at the same N, otherwise to the first run
+        baseline = results[i - i % len(models) if args.compare else 0][1]
+        print("{:<24} {:>12.2f} {:>8.2f}".format(model, rps, rps / baseline if baseline else 0.0))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,26 @@
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "bounded_queue.h"
+
+using std::atomic;
+using std::chrono::nanoseconds;
+
+
+void futex_wait(atomic<uint32_t>* word, uint32_t expected) {
+    // EAGAIN (the word already changed) and EINTR both just send the caller back to check again
+    syscall(SYS_futex, (uint32_t*) word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+void futex_wait(atomic<uint32_t>* word, uint32_t expected, nanoseconds timeout) {
+    // FUTEX_WAIT takes a relative timeout, and ETIMEDOUT sends the caller back to check its deadline
+    struct timespec relative;
+    relative.tv_sec = (time_t) (timeout.count() / 1000000000);
+    relative.tv_nsec = (long) (timeout.count() % 1000000000);
+    syscall(SYS_futex, (uint32_t*) word, FUTEX_WAIT_PRIVATE, expected, &relative, NULL, 0);
+}
+
+void futex_wake(atomic<uint32_t>* word, int count) {
+    syscall(SYS_futex, (uint32_t*) word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
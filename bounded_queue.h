@@ -0,0 +1,255 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+
+// the shared positions of a BoundedQueue are kept this far apart, so that producers and consumers don't false share
+const size_t CACHE_LINE_SIZE = 64;
+
+// how many times a blocked push or pop retries before it parks its thread
+const int QUEUE_SPIN_LIMIT = 256;
+
+
+/*
+ * futex_wait blocks the calling thread while `*word` still equals `expected`, until a futex_wake
+ * on the same word (or a spurious wakeup), or until `timeout` passes if one is given.
+ * futex_wake wakes up to `count` threads waiting on `word`.
+ */
+void futex_wait(std::atomic<uint32_t>* word, uint32_t expected);
+void futex_wait(std::atomic<uint32_t>* word, uint32_t expected, std::chrono::nanoseconds timeout);
+void futex_wake(std::atomic<uint32_t>* word, int count);
+
+/*
+ * cpu_relax hints to the processor that the calling thread is spinning on a shared location.
+ */
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+
+/*
+ * FutexEvent parks threads until another thread signals that the condition they wait for may have
+ * changed, without a mutex. A waiter takes a ticket with `prepare_wait`, checks its condition once
+ * more, and then either carries on or sleeps with `wait`, or with `wait_for` to give up after a
+ * timeout. A `notify` after the ticket was taken makes `wait` return right away, so no signal is
+ * lost in between.
+ *
+ * `notify` wakes one waiter and takes it off the count of waiters, so that until the woken thread
+ * gets to run and waits again, further notifies don't make system calls just to wake it again.
+ * Only notify takes waiters off the count, since a waiter can't tell whether a notify already took
+ * it off. A waiter that carries on or is woken on another's behalf stays counted, which at worst
+ * costs a later notify a spare wakeup.
+ * `notify_all` wakes every waiter, e.g. for them to notice a shutdown, and leaves them counted.
+ */
+class FutexEvent {
+    std::atomic<uint32_t> epoch;
+    std::atomic<uint32_t> waiters;
+
+public:
+    FutexEvent() : epoch(0), waiters(0) {}
+
+    uint32_t prepare_wait() {
+        waiters.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return epoch.load();
+    }
+
+    void wait(uint32_t ticket) {
+        futex_wait(&epoch, ticket);
+    }
+
+    void wait_for(uint32_t ticket, std::chrono::nanoseconds timeout) {
+        futex_wait(&epoch, ticket, timeout);
+    }
+
+    void notify() {
+        // pairs with the fence in prepare_wait: either the waiter sees our change or we see the waiter
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint32_t count = waiters.load(std::memory_order_relaxed);
+        while (count > 0) {
+            if (waiters.compare_exchange_weak(count, count - 1)) {
+                epoch.fetch_add(1);
+                futex_wake(&epoch, 1);
+                return;
+            }
+        }
+    }
+
+    void notify_all() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        epoch.fetch_add(1);
+        futex_wake(&epoch, INT_MAX);
+    }
+};
+
+
+/*
+ * BoundedQueue implements a templated thread-safe work queue of fixed capacity without locks.
+ * It is a ring of `capacity` cells (rounded up to a power of two, and at least 2), each stamped
+ * with a sequence number that says whether it is ready to be pushed to or popped from at the
+ * current lap, so producers and consumers only contend on claiming a position with
+ * compare-and-swap, and never on a common lock. The push and pop positions are padded onto
+ * their own cache lines.
+ *
+ * `try_push` and `try_pop` return false right away if the queue is full or empty.
+ * `push` and `pop` spin for a little while, and then park the calling thread on a futex until
+ * a consumer frees a cell or a producer fills one. `pop_for` is like `pop`, but gives up and
+ * returns false if nothing is pushed within `timeout`.
+ * `size` is only a snapshot, since other threads may push and pop while it is read.
+ * It is safe for multiple threads to call all of these concurrently.
+ */
+template <typename T>
+class BoundedQueue {
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    char cells_padding[CACHE_LINE_SIZE];
+    std::atomic<size_t> tail;
+    char tail_padding[CACHE_LINE_SIZE];
+    std::atomic<size_t> head;
+    char head_padding[CACHE_LINE_SIZE];
+    FutexEvent not_empty;
+    char not_empty_padding[CACHE_LINE_SIZE];
+    FutexEvent not_full;
+
+    // a single cell would look the same full as it does empty on the next lap, so there are at least two
+    static size_t round_up_capacity(size_t capacity) {
+        size_t rounded = 2;
+        while (rounded < capacity) {
+            rounded <<= 1;
+        }
+        return rounded;
+    }
+
+public:
+    BoundedQueue(size_t capacity) : cells(new Cell[round_up_capacity(capacity)]), mask(round_up_capacity(capacity) - 1),
+                                    tail(0), head(0) {
+        for (size_t i = 0; i <= mask; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    size_t capacity() {
+        return mask + 1;
+    }
+
+    size_t size() {
+        size_t popped = head.load(std::memory_order_relaxed);
+        size_t pushed = tail.load(std::memory_order_relaxed);
+        return pushed > popped ? pushed - popped : 0;
+    }
+
+    bool try_push(const T& elem) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            intptr_t lap = (intptr_t) (cell.sequence.load(std::memory_order_acquire) - pos);
+            if (lap == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = elem;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    not_empty.notify();
+                    return true;
+                }
+            } else if (lap < 0) {
+                // the cell still holds the element from the last lap, so the queue is full
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T& elem) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            intptr_t lap = (intptr_t) (cell.sequence.load(std::memory_order_acquire) - (pos + 1));
+            if (lap == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    elem = std::move(cell.value);
+                    cell.value = T();
+                    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                    not_full.notify();
+                    return true;
+                }
+            } else if (lap < 0) {
+                // the cell hasn't been filled on this lap yet, so the queue is empty
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void push(const T& elem) {
+        for (int i = 0; i < QUEUE_SPIN_LIMIT; i++) {
+            if (try_push(elem)) {
+                return;
+            }
+            cpu_relax();
+        }
+
+        while (true) {
+            uint32_t ticket = not_full.prepare_wait();
+            if (try_push(elem)) {
+                return;
+            }
+            not_full.wait(ticket);
+        }
+    }
+
+    T pop() {
+        T elem;
+        for (int i = 0; i < QUEUE_SPIN_LIMIT; i++) {
+            if (try_pop(elem)) {
+                return elem;
+            }
+            cpu_relax();
+        }
+
+        while (true) {
+            uint32_t ticket = not_empty.prepare_wait();
+            if (try_pop(elem)) {
+                return elem;
+            }
+            not_empty.wait(ticket);
+        }
+    }
+
+    bool pop_for(T& elem, std::chrono::nanoseconds timeout) {
+        for (int i = 0; i < QUEUE_SPIN_LIMIT; i++) {
+            if (try_pop(elem)) {
+                return true;
+            }
+            cpu_relax();
+        }
+
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+        while (true) {
+            uint32_t ticket = not_empty.prepare_wait();
+            if (try_pop(elem)) {
+                return true;
+            }
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now >= deadline) {
+                return false;
+            }
+            not_empty.wait_for(ticket, deadline - now);
+        }
+    }
+};
+
+#endif //BOUNDED_QUEUE_H
@@ -0,0 +1,108 @@
+#include "buffer_pool.h"
+
+static const size_t SIZE_CLASSES[BUFFER_SIZE_CLASSES] = {SMALL_BUFFER_SIZE, MEDIUM_BUFFER_SIZE, LARGE_BUFFER_SIZE};
+
+// the most free buffers kept in each size class, about 1MB of small buffers and 4MB of each other class
+static const size_t MAX_FREE_BUFFERS[BUFFER_SIZE_CLASSES] = {256, 64, 4};
+
+#define UNPOOLED (-1)
+
+
+PooledBuffer::PooledBuffer() : bytes(NULL), capacity(0), size_class(UNPOOLED) {}
+
+PooledBuffer::PooledBuffer(char* bytes, size_t capacity, int size_class)
+        : bytes(bytes), capacity(capacity), size_class(size_class) {}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept
+        : bytes(other.bytes), capacity(other.capacity), size_class(other.size_class) {
+    other.bytes = NULL;
+    other.capacity = 0;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+    if (this != &other) {
+        release();
+        bytes = other.bytes;
+        capacity = other.capacity;
+        size_class = other.size_class;
+        other.bytes = NULL;
+        other.capacity = 0;
+    }
+    return *this;
+}
+
+PooledBuffer::~PooledBuffer() {
+    release();
+}
+
+char* PooledBuffer::data() {
+    return bytes;
+}
+
+const char* PooledBuffer::data() const {
+    return bytes;
+}
+
+size_t PooledBuffer::size() const {
+    return capacity;
+}
+
+bool PooledBuffer::empty() const {
+    return bytes == NULL;
+}
+
+void PooledBuffer::release() {
+    if (bytes != NULL) {
+        BufferPool::local().release(bytes, capacity, size_class);
+        bytes = NULL;
+        capacity = 0;
+    }
+}
+
+
+BufferPool::BufferPool() : free_bytes(0) {}
+
+BufferPool::~BufferPool() {
+    for (int i = 0; i < BUFFER_SIZE_CLASSES; i++) {
+        for (size_t j = 0; j < free_buffers[i].size(); j++) {
+            delete[] free_buffers[i][j];
+        }
+    }
+}
+
+PooledBuffer BufferPool::acquire(size_t len) {
+    for (int i = 0; i < BUFFER_SIZE_CLASSES; i++) {
+        if (len > SIZE_CLASSES[i]) {
+            continue;
+        }
+
+        if (free_buffers[i].empty()) {
+            return PooledBuffer(new char[SIZE_CLASSES[i]], SIZE_CLASSES[i], i);
+        }
+        char* bytes = free_buffers[i].back();
+        free_buffers[i].pop_back();
+        free_bytes -= SIZE_CLASSES[i];
+        return PooledBuffer(bytes, SIZE_CLASSES[i], i);
+    }
+
+    return PooledBuffer(new char[len], len, UNPOOLED);
+}
+
+void BufferPool::release(char* bytes, size_t capacity, int size_class) {
+    if (size_class == UNPOOLED || free_buffers[size_class].size() >= MAX_FREE_BUFFERS[size_class]) {
+        delete[] bytes;
+        return;
+    }
+
+    free_buffers[size_class].push_back(bytes);
+    free_bytes += capacity;
+}
+
+size_t BufferPool::get_free_bytes() {
+    return free_bytes;
+}
+
+BufferPool& BufferPool::local() {
+    static thread_local BufferPool pool;
+    return pool;
+}
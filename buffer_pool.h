@@ -0,0 +1,75 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstddef>
+#include <vector>
+
+// the size classes of pooled buffers: socket reads start small, file reads use the large buffers
+#define SMALL_BUFFER_SIZE (4 * 1024)
+#define MEDIUM_BUFFER_SIZE (64 * 1024)
+#define LARGE_BUFFER_SIZE (1024 * 1024)
+#define BUFFER_SIZE_CLASSES (3)
+
+
+/*
+ * PooledBuffer is a fixed size byte buffer borrowed from a BufferPool, which it returns itself
+ * to when it is released or destroyed. It is movable but not copyable, like a unique_ptr.
+ * An empty PooledBuffer holds no memory.
+ */
+class PooledBuffer {
+    char* bytes;
+    size_t capacity;
+    int size_class;
+
+    PooledBuffer(char* bytes, size_t capacity, int size_class);
+    friend class BufferPool;
+
+public:
+    PooledBuffer();
+    PooledBuffer(PooledBuffer&& other) noexcept;
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+    ~PooledBuffer();
+
+    char* data();
+    const char* data() const;
+    size_t size() const;
+    bool empty() const;
+
+    // release returns the buffer to the pool, leaving this empty
+    void release();
+};
+
+
+/*
+ * BufferPool keeps free lists of buffers in a few size classes, so that reads can borrow a buffer
+ * that fits them for as long as the read is in flight instead of allocating one, or keeping one
+ * around while the connection is idle. Requests larger than the largest class are allocated
+ * exactly and freed rather than pooled, and each free list is capped so that a burst of large
+ * reads doesn't keep its memory forever.
+ *
+ * Each thread, and so each event loop, has its own pool (`local`), so borrowing needs no locks.
+ * A buffer is returned to the pool of the thread that releases it.
+ */
+class BufferPool {
+    std::vector<char*> free_buffers[BUFFER_SIZE_CLASSES];
+    size_t free_bytes;
+
+    void release(char* bytes, size_t capacity, int size_class);
+    friend class PooledBuffer;
+
+public:
+    BufferPool();
+    ~BufferPool();
+
+    // acquire returns a buffer of at least `len` bytes
+    PooledBuffer acquire(size_t len);
+
+    // get_free_bytes returns the memory held by the free lists
+    size_t get_free_bytes();
+
+    static BufferPool& local();
+};
+
+#endif //BUFFER_POOL_H
@@ -0,0 +1,94 @@
+#include <algorithm>
+#include <cstring>
+#include "byte_buffer.h"
+
+using std::string;
+
+
+ByteBuffer::ByteBuffer() : start(0), end(0), scanned(0) {}
+
+size_t ByteBuffer::size() const {
+    return end - start;
+}
+
+bool ByteBuffer::empty() const {
+    return start == end;
+}
+
+const char* ByteBuffer::data() const {
+    return storage.data() + start;
+}
+
+char* ByteBuffer::prepare(size_t len) {
+    if (storage.size() - end >= len) {
+        return storage.data() + end;
+    }
+
+    // move the unread bytes to the front first, and only grow if that doesn't free enough space
+    if (start > 0) {
+        memmove(storage.data(), storage.data() + start, end - start);
+        scanned -= start;
+        end -= start;
+        start = 0;
+    }
+    if (storage.size() - end < len) {
+        PooledBuffer larger = BufferPool::local().acquire(std::max(storage.size() * 2, end + len));
+        if (end > 0) {
+            memcpy(larger.data(), storage.data(), end);
+        }
+        storage = std::move(larger);
+    }
+    return storage.data() + end;
+}
+
+size_t ByteBuffer::available() const {
+    return storage.size() - end;
+}
+
+void ByteBuffer::commit(size_t len) {
+    end += len;
+}
+
+void ByteBuffer::append(const char* bytes, size_t len) {
+    memcpy(prepare(len), bytes, len);
+    commit(len);
+}
+
+size_t ByteBuffer::find(const string& sep) {
+    if (sep.empty()) {
+        return 0;
+    }
+    if (sep != scanned_sep) {
+        scanned_sep = sep;
+        scanned = start;
+    }
+
+    // a match may straddle the bytes that were already scanned and the new ones
+    size_t from = std::max(start, scanned >= sep.size() - 1 ? scanned - (sep.size() - 1) : 0);
+    const char* begin = storage.data();
+    const char* match = std::search(begin + from, begin + end, sep.begin(), sep.end());
+
+    if (match == begin + end) {
+        scanned = end;
+        return string::npos;
+    }
+    return (size_t) (match - begin) - start;
+}
+
+string ByteBuffer::pop(size_t len, size_t discard) {
+    string content(storage.data() + start, len);
+    start += std::min(len + discard, end - start);
+    scanned = start;
+
+    shrink();
+    return content;
+}
+
+void ByteBuffer::shrink() {
+    if (start == end) {
+        start = 0;
+        end = 0;
+        scanned = 0;
+        storage.release();
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef BYTE_BUFFER_H
+#define BYTE_BUFFER_H
+
+#include <cstddef>
+#include <string>
+#include "buffer_pool.h"
+
+
+/*
+ * ByteBuffer is a growable contiguous buffer of received bytes that have not been consumed yet.
+ * Data is received straight into the free space after the unread bytes (`prepare` then `commit`),
+ * and consumed from the front with `pop`, which only moves the read offset. The unread bytes are
+ * moved back to the front of the storage only when the free space runs out, so each byte is
+ * copied a constant number of times no matter how it is split across reads.
+ *
+ * `find` remembers how far it has already scanned for its separator, so that searching again
+ * after more data arrives only looks at the new bytes rather than the whole buffer.
+ *
+ * The storage is borrowed from the thread's BufferPool and handed back as soon as every byte has
+ * been consumed, so a buffer with nothing unread holds no memory.
+ */
+class ByteBuffer {
+    PooledBuffer storage;
+    size_t start;
+    size_t end;
+    size_t scanned;
+    std::string scanned_sep;
+
+public:
+    ByteBuffer();
+
+    size_t size() const;
+    bool empty() const;
+    const char* data() const;
+
+    // prepare returns space for at least `len` more bytes after the unread bytes, growing or
+    // compacting the buffer as needed, and `available` returns how much space there actually is.
+    // commit marks the first `len` bytes of that space as received
+    char* prepare(size_t len);
+    size_t available() const;
+    void commit(size_t len);
+    void append(const char* bytes, size_t len);
+
+    // find returns the offset of `sep` from the start of the unread bytes, or std::string::npos
+    size_t find(const std::string& sep);
+
+    // pop removes and returns the first `len` unread bytes, discarding the `discard` bytes after them
+    std::string pop(size_t len, size_t discard = 0);
+
+    // shrink returns the storage to the pool if there are no unread bytes, e.g. after space was
+    // prepared for a receive that had nothing to read
+    void shrink();
+};
+
+#endif //BYTE_BUFFER_H
@@ -1,4 +1,6 @@
+#include <limits.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <iostream>
 #include <stdexcept>
@@ -6,6 +8,7 @@
 #include "connection.h"
 #include "util.h"
 
+using std::chrono::milliseconds;
 using std::cerr;
 using std::endl;
 using std::ios;
@@ -13,6 +16,7 @@ using std::runtime_error;
 using std::shared_ptr;
 using std::string;
 using std::stringstream;
+using std::vector;
 
 #define INVALID_SOCK (-1)
 #define BUFFER_SIZE (2000)
@@ -23,18 +27,49 @@ ConnectionError::ConnectionError(string message) : runtime_error(message) {}
 ConnectionClosed::ConnectionClosed() : runtime_error("connection closed") {}
 
 
-SocketConnection::SocketConnection(int client_sock, struct in_addr client_remote_ip) : client_sock(client_sock), client_remote_ip(client_remote_ip) {
-    struct timeval tv;
-    tv.tv_sec = 5;
-    tv.tv_usec = 0;
+size_t remaining_iovecs(const vector<string>& parts, size_t offset, vector<struct iovec>& iov) {
+    iov.clear();
+    size_t total = 0;
+    for (size_t i = 0; i < parts.size() && iov.size() < IOV_MAX; i++) {
+        if (offset >= parts[i].size()) {
+            offset -= parts[i].size();
+            continue;
+        }
 
-    int err = setsockopt(this->client_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    if (err < 0) {
-        cerr << errno_message("setsockopt() failed: ") << endl;
+        struct iovec part;
+        part.iov_base = const_cast<char*>(parts[i].data()) + offset;
+        part.iov_len = parts[i].size() - offset;
+        iov.push_back(part);
+        total += part.iov_len;
+        offset = 0;
     }
+    return total;
+}
+
+
+milliseconds ConnectionTimeouts::of(ConnectionState state) const {
+    switch (state) {
+    case READING_HEADERS:
+        return reading_headers;
+    case PROCESSING:
+        return processing;
+    case WRITING:
+        return writing;
+    case IDLE:
+        return idle;
+    }
+    return reading_headers;
+}
+
+
+SocketConnection::SocketConnection(int client_sock, struct in_addr client_remote_ip)
+        : client_sock(client_sock), client_remote_ip(client_remote_ip), read_timeout(0), write_timeout(0) {
+    set_timeouts(DEFAULT_CONNECTION_TIMEOUTS.reading_headers, DEFAULT_CONNECTION_TIMEOUTS.writing);
 }
 
-SocketConnection::SocketConnection(SocketConnection&& conn) : client_sock(conn.client_sock) {
+SocketConnection::SocketConnection(SocketConnection&& conn)
+        : client_sock(conn.client_sock), client_remote_ip(conn.client_remote_ip), read_timeout(conn.read_timeout),
+          write_timeout(conn.write_timeout) {
     conn.client_sock = INVALID_SOCK;
 }
 
@@ -71,6 +106,25 @@ void SocketConnection::write(std::string s) {
     }
 }
 
+void SocketConnection::writev(const vector<string>& parts) {
+    vector<struct iovec> iov;
+    size_t total_sent = 0;
+    while (!this->is_closed() && remaining_iovecs(parts, total_sent, iov) > 0) {
+        struct msghdr msg;
+        bzero(&msg, sizeof(msg));
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = iov.size();
+
+        // a blocking sendmsg() only returns early if it is interrupted, so pick up where it left off
+        ssize_t sent = ::sendmsg(this->client_sock, &msg, 0);
+        if (sent < 0 && errno != EINTR) {
+            throw ConnectionError(errno_message("sendmsg() failed: "));
+        } else if (sent > 0) {
+            total_sent += sent;
+        }
+    }
+}
+
 void SocketConnection::close() {
     if (!this->is_closed()) {
         // ignore ENOTCONN in case the client closes before us
@@ -88,6 +142,35 @@ bool SocketConnection::is_closed() {
     return this->client_sock == INVALID_SOCK;
 }
 
+struct timeval to_timeval(milliseconds timeout) {
+    struct timeval tv;
+    tv.tv_sec = (time_t) (timeout.count() / 1000);
+    tv.tv_usec = (suseconds_t) (timeout.count() % 1000) * 1000;
+    return tv;
+}
+
+void SocketConnection::set_timeouts(milliseconds read_timeout, milliseconds write_timeout) {
+    // the timeouts change with the connection's state, but usually to the one it already has
+    if (read_timeout != this->read_timeout) {
+        struct timeval tv = to_timeval(read_timeout);
+        if (setsockopt(this->client_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+            cerr << errno_message("setsockopt() failed: ") << endl;
+        }
+        this->read_timeout = read_timeout;
+    }
+    if (write_timeout != this->write_timeout) {
+        struct timeval tv = to_timeval(write_timeout);
+        if (setsockopt(this->client_sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+            cerr << errno_message("setsockopt() failed: ") << endl;
+        }
+        this->write_timeout = write_timeout;
+    }
+}
+
+int SocketConnection::get_fd() {
+    return client_sock;
+}
+
 struct in_addr SocketConnection::remote_ip() {
     return client_remote_ip;
 }
@@ -99,6 +182,7 @@ BufferedConnection::BufferedConnection(shared_ptr<Connection> conn) : conn(conn)
 
 BufferedConnection::BufferedConnection(BufferedConnection&& conn) : conn(conn.conn), buffer(conn.buffer.str()) {
     conn.conn = shared_ptr<Connection>();
+    conn.buffer.str(string());
 }
 
 BufferedConnection::~BufferedConnection() {
@@ -119,6 +203,32 @@ void BufferedConnection::write(string s) {
     conn->write(s);
 }
 
+void BufferedConnection::writev(const vector<string>& parts) {
+    conn->writev(parts);
+}
+
+bool BufferedConnection::has_buffered(string sep) {
+    return this->buffer.str().find(sep, 0) != string::npos;
+}
+
+bool BufferedConnection::is_empty() {
+    return this->buffer.str().empty();
+}
+
+void BufferedConnection::fill() {
+    string buf_str = conn->read();
+    this->buffer.seekp(0, ios::end);
+    this->buffer << buf_str;
+}
+
+void BufferedConnection::set_timeouts(milliseconds read_timeout, milliseconds write_timeout) {
+    conn->set_timeouts(read_timeout, write_timeout);
+}
+
+int BufferedConnection::get_fd() {
+    return conn ? conn->get_fd() : -1;
+}
+
 string BufferedConnection::read_until(string sep) {
     // first try to read from the buffer by checking for the separator
     size_t pos = this->buffer.str().find(sep, 0);
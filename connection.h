@@ -1,17 +1,55 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <chrono>
 #include <cstdint>
 #include <memory>
 #include <netinet/in.h>
 #include <string>
 #include <sstream>
+#include <sys/uio.h>
+#include <vector>
+
+
+/*
+ * ConnectionState is the part of the request cycle that a connection is in, which decides how
+ * long the server waits on it:
+ * READING_HEADERS: receiving a request, from the first byte of a new connection or of a
+ *                  request on a kept alive one until the end of its headers
+ * PROCESSING: waiting for the request handler to produce the response
+ * WRITING: sending the response, where the timeout applies to each write making progress
+ * IDLE: a kept alive connection waiting for the first byte of its next request
+ */
+enum ConnectionState {
+    READING_HEADERS,
+    PROCESSING,
+    WRITING,
+    IDLE
+};
+
+/*
+ * ConnectionTimeouts holds the timeout for each ConnectionState. `of` returns the one for `state`.
+ */
+struct ConnectionTimeouts {
+    std::chrono::milliseconds reading_headers;
+    std::chrono::milliseconds processing;
+    std::chrono::milliseconds writing;
+    std::chrono::milliseconds idle;
+
+    std::chrono::milliseconds of(ConnectionState state) const;
+};
+
+const ConnectionTimeouts DEFAULT_CONNECTION_TIMEOUTS = ConnectionTimeouts{
+        std::chrono::seconds(5), std::chrono::seconds(30), std::chrono::seconds(10), std::chrono::seconds(15)};
 
 
 /*
  * Connection is an abstract class that represents a bidirectional stream of bytes.
  * `read` will return a string of arbitrary size but at least length 1, or throw ConnectionClosed
  * `write` will accept a string of arbitrary size and block until it is sent, or throw ConnectionClosed
+ * `writev` is like `write`, but sends the parts one after another without joining them into one string
+ * `set_timeouts` bounds how long each following `read` and `write` may block before giving up
+ * `get_fd` returns the file descriptor to wait on for the stream to become readable, or -1 if it has none
  *
  * Connection is implemented by the SocketConnection derived class below and the MockConnection class in mocks.h
  */
@@ -21,13 +59,24 @@ public:
 
     virtual std::string read() = 0;
     virtual void write(std::string) = 0;
+    virtual void writev(const std::vector<std::string>& parts) = 0;
     virtual void close() = 0;
     virtual bool is_closed() = 0;
+    virtual void set_timeouts(std::chrono::milliseconds read_timeout, std::chrono::milliseconds write_timeout) = 0;
+    virtual int get_fd() = 0;
 
     virtual struct in_addr remote_ip() = 0;
 };
 
 
+/*
+ * remaining_iovecs fills `iov` with the parts of a scatter-gather write that are left after
+ * its first `offset` bytes have been sent, so that a partial sendmsg() can be resumed.
+ * At most IOV_MAX parts are filled in, and it returns the number of bytes they cover.
+ */
+size_t remaining_iovecs(const std::vector<std::string>& parts, size_t offset, std::vector<struct iovec>& iov);
+
+
 class ConnectionError : public std::runtime_error {
 public:
     ConnectionError(std::string);
@@ -42,12 +91,15 @@ public:
 
 /*
  * SocketConnection represents a bidirectional stream of bytes backed by a tcp socket.
- * `read` and `write` call `send` and `recv` on the underlying socket.
+ * `read` and `write` call `send` and `recv` on the underlying socket, and `writev` calls `sendmsg`.
+ * The timeouts are set with SO_RCVTIMEO and SO_SNDTIMEO, only when they change.
  * The ~SocketConnection() destructor shuts down and closes the socket.
  */
 class SocketConnection : public Connection {
     int client_sock;
     struct in_addr client_remote_ip;
+    std::chrono::milliseconds read_timeout;
+    std::chrono::milliseconds write_timeout;
 
 public:
     SocketConnection(int client_sock, struct in_addr client_remote_ip);
@@ -56,8 +108,11 @@ public:
 
     virtual std::string read();
     virtual void write(std::string);
+    virtual void writev(const std::vector<std::string>& parts);
     virtual void close();
     virtual bool is_closed();
+    virtual void set_timeouts(std::chrono::milliseconds read_timeout, std::chrono::milliseconds write_timeout);
+    virtual int get_fd();
 
     virtual struct in_addr remote_ip();
 };
@@ -68,6 +123,10 @@ public:
  * buffered `read_until` operations that read until an arbitrary delimiter is encounterd.
  * It blocks until the delimiter is encountered and returns the string before the delimiter,
  * dropping the delimiter. If the underlying Connection closes, it throws ConnectionClosed.
+ * `has_buffered` checks whether the next `read_until` can return without reading.
+ * `is_empty` checks whether anything is buffered at all, and `fill` blocks until more is.
+ * Moving a BufferedConnection takes whatever it has buffered along, so that a connection can be
+ * handed to another thread between reads without losing the start of the next request.
  */
 class BufferedConnection {
     std::shared_ptr<Connection> conn;
@@ -80,9 +139,15 @@ public:
     ~BufferedConnection();
 
     std::string read_until(std::string sep);
+    bool has_buffered(std::string sep);
+    bool is_empty();
+    void fill();
     void write(std::string body);
+    void writev(const std::vector<std::string>& parts);
     void close();
     bool is_closed();
+    void set_timeouts(std::chrono::milliseconds read_timeout, std::chrono::milliseconds write_timeout);
+    int get_fd();
 
     struct in_addr remote_ip();
 };
@@ -1,47 +1,65 @@
+#include <iomanip>
 #include <iostream>
 #include <thread>
 #include <stdexcept>
 #include "connection_handlers.h"
 
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
 using std::cerr;
 using std::endl;
 using std::exception;
+using std::lock_guard;
+using std::mutex;
 using std::thread;
 using std::shared_ptr;
 using std::make_shared;
+using std::unique_lock;
 
 
-void handle_connection(shared_ptr<HttpRequestHandler> handler, HttpConnection&& conn) {
+bool serve_request(shared_ptr<HttpRequestHandler> handler, HttpConnection& conn) {
     try {
-        while (true) {
-            HttpRequest request = conn.read_request();
-            if (!has_header(request.headers, "Host")) {
-                conn.write_response(bad_request_response());
-                return;
-            } else {
-                HttpResponse response = handler->handle_request(request);
-                conn.write_response(response);
-            }
+        HttpRequest request = conn.read_request();
+        if (!has_header(request.headers, "Host")) {
+            conn.write_response(bad_request_response());
+            return false;
+        }
 
-            if (get_header(request.headers, "Connection").value.find("close") != std::string::npos) {
-                return;
-            }
+        bool keep_alive = get_header(request.headers, "Connection").value.find("close") == std::string::npos;
+        HttpResponse response = handler->handle_request(request);
+        // if more pipelined requests are waiting, answer them all with one write
+        if (!keep_alive || !conn.queue_response(response)) {
+            conn.write_response(response);
         }
+        return keep_alive;
     } catch (HttpRequestParseError&) {
         conn.write_response(bad_request_response());
     } catch (ConnectionClosed&) {
-        return;
+        return false;
     } catch (exception& e) {
         cerr << "Encountered unexpected exception: " << e.what() << endl;
         conn.write_response(internal_server_error_response());
     }
+    return false;
+}
+
+void handle_connection(shared_ptr<HttpRequestHandler> handler, HttpConnection&& conn) {
+    while (serve_request(handler, conn)) {}
 }
 
 
 BlockingHttpConnectionHandler::BlockingHttpConnectionHandler(shared_ptr<HttpRequestHandler> handler) : handler(handler) {}
 
 void BlockingHttpConnectionHandler::handle_connection(HttpConnection&& conn) {
-    ::handle_connection(handler, std::move(conn));
+    // the calling thread may be a MultiListenerHttpServer worker, which should outlive a failed connection
+    try {
+        ::handle_connection(handler, std::move(conn));
+    } catch (...) {
+        cerr << "ERROR: exception bubbled up to top level blocking handler function!" << endl;
+    }
 }
 
 
@@ -53,27 +71,265 @@ void ThreadSpawningHttpConnectionHandler::handle_connection(HttpConnection&& con
 }
 
 
-void handle_work_queue(shared_ptr<SynchronizedQueue<shared_ptr<HttpConnection>>> work_queue, shared_ptr<HttpRequestHandler> handler) {
+double PoolStatsSnapshot::mean_queue_delay_us() const {
+    return dequeued == 0 ? 0.0 : (double) queue_delay_us / dequeued;
+}
+
+std::ostream& operator<<(std::ostream& os, const PoolStatsSnapshot& snapshot) {
+    return os << "workers=" << snapshot.workers << " busy=" << snapshot.busy << " queued=" << snapshot.queued
+              << " grown=" << snapshot.grown << " retired=" << snapshot.retired << " dequeued=" << snapshot.dequeued
+              << " queue_delay_us mean=" << std::fixed << std::setprecision(1) << snapshot.mean_queue_delay_us()
+              << " max=" << snapshot.max_queue_delay_us;
+}
+
+
+// reject_connection answers a connection that there is no room to queue for with 503, before it is closed
+void reject_connection(HttpConnection& conn) {
+    try {
+        conn.write_response(service_unavailable_response());
+    } catch (exception& e) {
+        cerr << "Failed to reject connection: " << e.what() << endl;
+    }
+}
+
+int64_t steady_ns(steady_clock::time_point time) {
+    return duration_cast<nanoseconds>(time.time_since_epoch()).count();
+}
+
+ThreadPoolHttpConnectionHandler::ThreadPoolHttpConnectionHandler(shared_ptr<HttpRequestHandler> handler, int size,
+                                                                 size_t queue_capacity, QueueFullPolicy full_policy, PoolSizing sizing)
+    : handler(handler), work_queue(), watcher(), full_policy(full_policy), min_size(size), sizing(sizing),
+      pool_lock(), stopped(), stopping(false), thread_pool(), finished(), stats_reporter(),
+      live_workers(0), busy_workers(0), grown(0), retired(0), dequeued(0), queue_delay_us(0), max_queue_delay_us(0),
+      last_dequeue_ns(steady_ns(steady_clock::now())) {
+    work_queue = make_shared<BoundedQueue<QueuedConnection>>(queue_capacity);
+
+    shared_ptr<BoundedQueue<QueuedConnection>> ready_queue = work_queue;
+    watcher = make_shared<ReadinessWatcher>([ready_queue](shared_ptr<HttpConnection> conn) {
+        // the watcher thread never waits for room, since every other parked connection would wait with it
+        if (!ready_queue->try_push(QueuedConnection{conn, steady_clock::now()})) {
+            reject_connection(*conn);
+        }
+    });
+
+    lock_guard<mutex> guard(pool_lock);
+    for (int i = 0; i < size; i++) {
+        start_worker();
+    }
+    if (sizing.stats_interval.count() > 0) {
+        stats_reporter = thread(&ThreadPoolHttpConnectionHandler::report_stats, this);
+    }
+}
+
+ThreadPoolHttpConnectionHandler::~ThreadPoolHttpConnectionHandler() {
+    uint64_t workers;
+    {
+        lock_guard<mutex> guard(pool_lock);
+        stopping = true;
+        workers = live_workers.load();
+    }
+    stopped.notify_all();
+
+    // once the watcher is stopped nothing else is queued, so the empty connections are the last ones taken
+    watcher->stop();
+
+    // no workers are added once stopping is set, so each live one takes an empty connection and stops
+    for (uint64_t i = 0; i < workers; i++) {
+        work_queue->push(QueuedConnection{shared_ptr<HttpConnection>(), steady_clock::now()});
+    }
+    for (size_t i = 0; i < thread_pool.size(); i++) {
+        thread_pool[i].join();
+    }
+    if (stats_reporter.joinable()) {
+        stats_reporter.join();
+    }
+}
+
+bool ThreadPoolHttpConnectionHandler::is_elastic() {
+    return sizing.max_size > min_size;
+}
+
+// start_worker must be called with pool_lock held
+void ThreadPoolHttpConnectionHandler::start_worker() {
+    // join the workers that retired since the last one was started, so their threads don't pile up
+    for (size_t i = 0; i < finished.size(); i++) {
+        for (size_t j = 0; j < thread_pool.size(); j++) {
+            if (thread_pool[j].get_id() == finished[i]) {
+                thread_pool[j].join();
+                thread_pool.erase(thread_pool.begin() + j);
+                break;
+            }
+        }
+    }
+    finished.clear();
+
+    live_workers++;
+    thread_pool.push_back(thread(&ThreadPoolHttpConnectionHandler::work, this));
+}
+
+void ThreadPoolHttpConnectionHandler::grow() {
+    if (!is_elastic() || live_workers.load() >= (uint64_t) sizing.max_size) {
+        return;
+    }
+
+    lock_guard<mutex> guard(pool_lock);
+    if (!stopping && live_workers.load() < (uint64_t) sizing.max_size) {
+        start_worker();
+        grown++;
+    }
+}
+
+bool ThreadPoolHttpConnectionHandler::take(QueuedConnection& queued) {
+    if (!is_elastic()) {
+        queued = work_queue->pop();
+        return true;
+    }
+
     while (true) {
-        shared_ptr<HttpConnection> conn_ptr = work_queue->pop();
+        if (work_queue->pop_for(queued, sizing.idle_timeout)) {
+            return true;
+        }
 
+        // only the workers beyond the initial size retire, whichever of them happen to be idle
+        lock_guard<mutex> guard(pool_lock);
+        if (live_workers.load() > (uint64_t) min_size) {
+            live_workers--;
+            retired++;
+            finished.push_back(std::this_thread::get_id());
+            return false;
+        }
+    }
+}
+
+void ThreadPoolHttpConnectionHandler::record_dequeue(steady_clock::time_point enqueued) {
+    steady_clock::time_point now = steady_clock::now();
+    last_dequeue_ns.store(steady_ns(now));
+
+    uint64_t delay_us = (uint64_t) duration_cast<microseconds>(now - enqueued).count();
+    dequeued++;
+    queue_delay_us += delay_us;
+    uint64_t max_delay = max_queue_delay_us.load();
+    while (delay_us > max_delay && !max_queue_delay_us.compare_exchange_weak(max_delay, delay_us)) {}
+
+    if (now - enqueued > sizing.max_queue_delay) {
+        grow();
+    }
+}
+
+void ThreadPoolHttpConnectionHandler::work() {
+    QueuedConnection queued;
+    while (take(queued)) {
+        // an empty connection is the signal to stop
+        if (!queued.conn) {
+            lock_guard<mutex> guard(pool_lock);
+            live_workers--;
+            return;
+        }
+        record_dequeue(queued.enqueued);
+
+        busy_workers++;
         try {
-            handle_connection(handler, std::move(*conn_ptr));
+            // keep the connection while its client has more requests in flight, rather than waiting
+            // on it to send the next one. Without a socket to wait on, it is served in place
+            while (serve_request(handler, *queued.conn)) {
+                if (!queued.conn->has_buffered_request() && queued.conn->get_fd() >= 0) {
+                    watcher->watch(queued.conn);
+                    break;
+                }
+            }
         } catch (...) {
             cerr << "ERROR: exception bubbled up to top level threadpool function!" << endl;
         }
+        busy_workers--;
+        queued = QueuedConnection();
+    }
+}
+
+void ThreadPoolHttpConnectionHandler::report_stats() {
+    steady_clock::time_point start = steady_clock::now();
+    unique_lock<mutex> guard(pool_lock);
+    while (!stopped.wait_for(guard, sizing.stats_interval, [this]() { return stopping; })) {
+        guard.unlock();
+        duration<double> elapsed = steady_clock::now() - start;
+        cerr << "pool stats at " << std::fixed << std::setprecision(1) << elapsed.count() << "s: " << stats() << endl;
+        guard.lock();
     }
 }
 
-ThreadPoolHttpConnectionHandler::ThreadPoolHttpConnectionHandler(shared_ptr<HttpRequestHandler> handler, int size)
-    : handler(handler), thread_pool(), work_queue() {
-    work_queue = make_shared<SynchronizedQueue<shared_ptr<HttpConnection>>>();
+PoolStatsSnapshot ThreadPoolHttpConnectionHandler::stats() {
+    return PoolStatsSnapshot{live_workers.load(), busy_workers.load(), work_queue->size(), grown.load(), retired.load(),
+                             dequeued.exchange(0), queue_delay_us.exchange(0), max_queue_delay_us.exchange(0)};
+}
+
+void ThreadPoolHttpConnectionHandler::handle_connection(HttpConnection&& conn) {
+    QueuedConnection queued{make_shared<HttpConnection>(std::move(conn)), steady_clock::now()};
+
+    // grow ahead of the delays being measured if the queue is long, or is stuck behind busy workers
+    size_t depth = work_queue->size();
+    bool stalled = depth > 0 && busy_workers.load() >= live_workers.load() &&
+                   steady_ns(queued.enqueued) - last_dequeue_ns.load() > duration_cast<nanoseconds>(sizing.max_queue_delay).count();
+    if (depth >= sizing.max_queue_depth || stalled) {
+        grow();
+    }
+
+    if (work_queue->try_push(queued)) {
+        return;
+    }
+
+    if (full_policy == BLOCK_WHEN_FULL) {
+        work_queue->push(queued);
+        return;
+    }
+
+    // shed the connection rather than letting it wait behind a queue that is already full
+    reject_connection(*queued.conn);
+}
+
+
+WorkStealingHttpConnectionHandler::WorkStealingHttpConnectionHandler(shared_ptr<HttpRequestHandler> handler, int size)
+    : handler(handler), queues(), watcher(), workers() {
+    queues = make_shared<WorkStealingQueues<shared_ptr<HttpConnection>>>(size);
+
+    shared_ptr<WorkStealingQueues<shared_ptr<HttpConnection>>> ready_queues = queues;
+    watcher = make_shared<ReadinessWatcher>([ready_queues](shared_ptr<HttpConnection> conn) {
+        ready_queues->submit(conn);
+    });
 
     for (int i = 0; i < size; i++) {
-        thread_pool.push_back(thread(handle_work_queue, work_queue, handler));
+        workers.push_back(thread(&WorkStealingHttpConnectionHandler::work, this, (size_t) i));
     }
 }
 
-void ThreadPoolHttpConnectionHandler::handle_connection(HttpConnection&& conn) {
-    work_queue->push(make_shared<HttpConnection>(std::move(conn)));
+WorkStealingHttpConnectionHandler::~WorkStealingHttpConnectionHandler() {
+    queues->stop();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+void WorkStealingHttpConnectionHandler::work(size_t worker) {
+    shared_ptr<HttpConnection> conn;
+    while (queues->take(worker, conn)) {
+        try {
+            // a pipelined request goes behind the worker's other connections rather than jumping them
+            if (serve_request(handler, *conn)) {
+                if (conn->has_buffered_request()) {
+                    queues->push_local(worker, conn);
+                } else {
+                    watcher->watch(conn);
+                }
+            }
+        } catch (...) {
+            cerr << "ERROR: exception bubbled up to top level work stealing function!" << endl;
+        }
+        conn.reset();
+    }
+}
+
+void WorkStealingHttpConnectionHandler::handle_connection(HttpConnection&& conn) {
+    watcher->watch(make_shared<HttpConnection>(std::move(conn)));
+}
+
+uint64_t WorkStealingHttpConnectionHandler::steals() {
+    return queues->steals();
 }
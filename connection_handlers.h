@@ -1,11 +1,29 @@
 #ifndef CONNECTION_HANDLER_H
 #define CONNECTION_HANDLER_H
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <ostream>
 #include <thread>
 #include <vector>
+#include "bounded_queue.h"
+#include "readiness_watcher.h"
 #include "server.h"
-#include "synchronized_queue.h"
+#include "work_stealing_queues.h"
+
+
+/*
+ * serve_request answers the next request on the connection, and returns whether the connection
+ * should be kept alive for another one. If the request is malformed or handling it fails, it
+ * answers with an error instead and returns false, as it does if the client closed the connection.
+ * handle_connection keeps serving requests on the connection until it shouldn't be kept alive.
+ */
+bool serve_request(std::shared_ptr<HttpRequestHandler> handler, HttpConnection& conn);
+void handle_connection(std::shared_ptr<HttpRequestHandler> handler, HttpConnection&& conn);
 
 
 /*
@@ -37,21 +55,164 @@ public:
 };
 
 
+/*
+ * QueueFullPolicy decides what ThreadPoolHttpConnectionHandler does with a new connection while
+ * its work queue is full.
+ * BLOCK_WHEN_FULL: wait for a worker to free up room, which leaves later connections in the listen backlog
+ * REJECT_WHEN_FULL: answer with 503 Service Unavailable and close the connection
+ */
+enum QueueFullPolicy {
+    BLOCK_WHEN_FULL,
+    REJECT_WHEN_FULL
+};
+
+const size_t DEFAULT_WORK_QUEUE_CAPACITY = 1024;
+
+
+/*
+ * PoolSizing lets ThreadPoolHttpConnectionHandler grow past its initial size while connections
+ * queue up, and shrink back once the load passes:
+ * max_size: the most workers the pool grows to. The pool keeps its initial size if this is no more
+ * max_queue_delay: a worker is added once a connection waited in the queue for longer than this,
+ *                  or once nothing has been taken off the queue for this long while it holds any
+ * max_queue_depth: a worker is added once more than this many connections are queued
+ * idle_timeout: a worker beyond the initial size retires once it waits this long for a connection
+ * stats_interval: how often the pool logs its PoolStatsSnapshot to stderr, or 0 to never log it
+ */
+struct PoolSizing {
+    int max_size;
+    std::chrono::milliseconds max_queue_delay;
+    size_t max_queue_depth;
+    std::chrono::milliseconds idle_timeout;
+    std::chrono::milliseconds stats_interval;
+};
+
+const PoolSizing DEFAULT_POOL_SIZING = PoolSizing{0, std::chrono::milliseconds(10), 8, std::chrono::seconds(30), std::chrono::milliseconds(0)};
+
+// how often a pool logs its stats when they are asked for on the command line
+const std::chrono::milliseconds DEFAULT_POOL_STATS_INTERVAL = std::chrono::seconds(1);
+
+
+/*
+ * PoolStatsSnapshot is a point in time copy of the stats of a ThreadPoolHttpConnectionHandler.
+ * `workers` is the number of live workers, `busy` the number serving a connection, and `queued`
+ * the number of connections waiting for one. `grown` and `retired` count the workers that were
+ * added and that retired since the pool started. The rest cover the time since the previous
+ * snapshot, so that successive snapshots show how the load changes: `dequeued` is the number of
+ * connections that workers took off the queue, `queue_delay_us` the total time they had waited
+ * in it, and `max_queue_delay_us` the longest any of them had waited.
+ * `mean_queue_delay_us` is the average wait of the connections taken off the queue.
+ */
+struct PoolStatsSnapshot {
+    uint64_t workers;
+    uint64_t busy;
+    uint64_t queued;
+    uint64_t grown;
+    uint64_t retired;
+    uint64_t dequeued;
+    uint64_t queue_delay_us;
+    uint64_t max_queue_delay_us;
+
+    double mean_queue_delay_us() const;
+};
+std::ostream& operator<<(std::ostream&, const PoolStatsSnapshot&);
+
+
 /*
  * ThreadPoolHttpConnectionHandler handles incoming connections by passing them off to a pool
- * of `size` threads using a synchronized work queue. It returns to the calling thread
- * immediately, but the request will not begin processing until a worker thread is free to
- * pull the request off the queue.
+ * of `size` threads using a lock-free BoundedQueue that holds up to `queue_capacity` connections.
+ * It returns to the calling thread immediately unless the queue is full, but the request will
+ * not begin processing until a worker thread is free to pull the request off the queue.
+ * While the queue is full, new connections are handled according to `full_policy`.
+ * A worker serves a connection until it has answered every request that has arrived, and then
+ * parks a kept alive connection with a ReadinessWatcher, which puts it back on the queue once
+ * the client sends more, so that idle keep-alive clients don't tie up workers between requests.
+ * Connections coming back from the watcher while the queue is full are answered with 503 and closed,
+ * whatever the `full_policy`, since the watcher can't wait for room without stalling the rest.
+ *
+ * With a `sizing` whose max_size is above `size`, the pool is elastic: it adds workers, up to
+ * max_size, while connections wait in the queue for too long or too many of them queue up, and
+ * the workers beyond `size` retire once they sit idle. `stats` takes a PoolStatsSnapshot, which
+ * a thread of the pool also logs to stderr every `stats_interval` if that is set, along with the
+ * seconds since the pool started, so that the log shows the pool's size and delays over time.
+ * The destructor stops the workers once they finish their current connections.
  */
 class ThreadPoolHttpConnectionHandler : public HttpConnectionHandler {
+    struct QueuedConnection {
+        std::shared_ptr<HttpConnection> conn;
+        std::chrono::steady_clock::time_point enqueued;
+    };
+
     std::shared_ptr<HttpRequestHandler> handler;
+    std::shared_ptr<BoundedQueue<QueuedConnection>> work_queue;
+    std::shared_ptr<ReadinessWatcher> watcher;
+    QueueFullPolicy full_policy;
+    int min_size;
+    PoolSizing sizing;
+
+    // the workers and the decisions to add or retire them are guarded by pool_lock
+    std::mutex pool_lock;
+    std::condition_variable stopped;
+    bool stopping;
     std::vector<std::thread> thread_pool;
-    std::shared_ptr<SynchronizedQueue<std::shared_ptr<HttpConnection>>> work_queue;
+    std::vector<std::thread::id> finished;
+    std::thread stats_reporter;
+
+    std::atomic<uint64_t> live_workers;
+    std::atomic<uint64_t> busy_workers;
+    std::atomic<uint64_t> grown;
+    std::atomic<uint64_t> retired;
+    std::atomic<uint64_t> dequeued;
+    std::atomic<uint64_t> queue_delay_us;
+    std::atomic<uint64_t> max_queue_delay_us;
+    std::atomic<int64_t> last_dequeue_ns;
+
+    bool is_elastic();
+    void start_worker();
+    void grow();
+    bool take(QueuedConnection& queued);
+    void record_dequeue(std::chrono::steady_clock::time_point enqueued);
+    void work();
+    void report_stats();
+
+public:
+    ThreadPoolHttpConnectionHandler(std::shared_ptr<HttpRequestHandler>, int size,
+                                    size_t queue_capacity = DEFAULT_WORK_QUEUE_CAPACITY, QueueFullPolicy full_policy = BLOCK_WHEN_FULL,
+                                    PoolSizing sizing = DEFAULT_POOL_SIZING);
+    virtual ~ThreadPoolHttpConnectionHandler();
+
+    virtual void handle_connection(HttpConnection&&);
+    PoolStatsSnapshot stats();
+};
+
+
+/*
+ * WorkStealingHttpConnectionHandler schedules requests rather than connections over a pool of
+ * `size` threads. Each worker serves one request at a time from its own deque of connections
+ * (see WorkStealingQueues), and steals from the deque of a random other worker once its own runs
+ * dry. After each request a kept alive connection goes to the back of the worker's deque if its
+ * next request has already arrived, and otherwise is parked with a ReadinessWatcher, which hands
+ * it to a worker again once the client sends more. New connections are parked the same way until
+ * their first request arrives, so no worker waits on a quiet client, and a few busy clients
+ * can't hold on to every worker while other connections wait.
+ * `steals` is the number of connections that workers took from each other's deques.
+ * The destructor stops the workers once they finish their current requests, and closes the
+ * connections they haven't gotten to.
+ */
+class WorkStealingHttpConnectionHandler : public HttpConnectionHandler {
+    std::shared_ptr<HttpRequestHandler> handler;
+    std::shared_ptr<WorkStealingQueues<std::shared_ptr<HttpConnection>>> queues;
+    std::shared_ptr<ReadinessWatcher> watcher;
+    std::vector<std::thread> workers;
+
+    void work(size_t worker);
 
 public:
-    ThreadPoolHttpConnectionHandler(std::shared_ptr<HttpRequestHandler>, int size);
+    WorkStealingHttpConnectionHandler(std::shared_ptr<HttpRequestHandler>, int size);
+    virtual ~WorkStealingHttpConnectionHandler();
 
     virtual void handle_connection(HttpConnection&&);
+    uint64_t steals();
 };
 
 #endif //CONNECTION_HANDLER_H
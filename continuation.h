@@ -0,0 +1,184 @@
+#ifndef CONTINUATION_H
+#define CONTINUATION_H
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// callables up to this size are stored inside the Continuation rather than on the heap.
+// this fits a lambda that captures a handful of shared_ptrs and flags
+#define CONTINUATION_INLINE_SIZE (64)
+
+
+template<class Signature>
+class Continuation;
+
+/*
+ * Continuation is a copyable, type erased function wrapper like std::function that is used
+ * for the async event loop's callbacks.
+ * Unlike std::function, which heap allocates any callable that isn't trivially copyable
+ * (e.g. every lambda that captures a shared_ptr), callables of up to CONTINUATION_INLINE_SIZE
+ * bytes are stored inline, so creating, copying and invoking a small continuation never allocates.
+ * Larger callables fall back to the heap.
+ */
+template<class R, class ...Args>
+class Continuation<R (Args...)> {
+    struct Ops {
+        R (*invoke)(void* storage, Args... args);
+        void (*copy)(void* dst, const void* src);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* storage);
+    };
+
+    typedef typename std::aligned_storage<CONTINUATION_INLINE_SIZE>::type Storage;
+
+    template<class F>
+    struct InlineOps {
+        static F* get(void* storage) {
+            return static_cast<F*>(storage);
+        }
+
+        static R invoke(void* storage, Args... args) {
+            return (*get(storage))(std::forward<Args>(args)...);
+        }
+
+        static void copy(void* dst, const void* src) {
+            new (dst) F(*static_cast<const F*>(src));
+        }
+
+        static void move(void* dst, void* src) {
+            new (dst) F(std::move(*get(src)));
+            get(src)->~F();
+        }
+
+        static void destroy(void* storage) {
+            get(storage)->~F();
+        }
+
+        static const Ops* ops() {
+            static const Ops ops = {&invoke, &copy, &move, &destroy};
+            return &ops;
+        }
+    };
+
+    template<class F>
+    struct HeapOps {
+        static F* get(void* storage) {
+            return *static_cast<F**>(storage);
+        }
+
+        static R invoke(void* storage, Args... args) {
+            return (*get(storage))(std::forward<Args>(args)...);
+        }
+
+        static void copy(void* dst, const void* src) {
+            new (dst) F*(new F(**static_cast<F* const*>(src)));
+        }
+
+        static void move(void* dst, void* src) {
+            new (dst) F*(get(src));
+        }
+
+        static void destroy(void* storage) {
+            delete get(storage);
+        }
+
+        static const Ops* ops() {
+            static const Ops ops = {&invoke, &copy, &move, &destroy};
+            return &ops;
+        }
+    };
+
+    template<class F>
+    struct StoredInline {
+        static const bool value = sizeof(F) <= sizeof(Storage) && std::alignment_of<Storage>::value % std::alignment_of<F>::value == 0
+                                  && std::is_nothrow_move_constructible<F>::value;
+    };
+
+    mutable Storage storage;
+    const Ops* ops;
+
+    template<class F>
+    void init(F&& f, std::true_type) {
+        typedef typename std::decay<F>::type Functor;
+        new (&storage) Functor(std::forward<F>(f));
+        ops = InlineOps<Functor>::ops();
+    }
+
+    template<class F>
+    void init(F&& f, std::false_type) {
+        typedef typename std::decay<F>::type Functor;
+        new (&storage) Functor*(new Functor(std::forward<F>(f)));
+        ops = HeapOps<Functor>::ops();
+    }
+
+    void reset() {
+        if (ops != NULL) {
+            ops->destroy(&storage);
+            ops = NULL;
+        }
+    }
+
+    // take moves the callable out of other, which must not be this, into this empty continuation
+    void take(Continuation& other) {
+        if (other.ops != NULL) {
+            other.ops->move(&storage, &other.storage);
+            ops = other.ops;
+            other.ops = NULL;
+        }
+    }
+
+public:
+    Continuation() : ops(NULL) {}
+
+    template<class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Continuation>::value>::type>
+    Continuation(F&& f) : ops(NULL) {
+        init(std::forward<F>(f), std::integral_constant<bool, StoredInline<typename std::decay<F>::type>::value>());
+    }
+
+    Continuation(const Continuation& other) : ops(NULL) {
+        if (other.ops != NULL) {
+            other.ops->copy(&storage, &other.storage);
+            ops = other.ops;
+        }
+    }
+
+    Continuation(Continuation&& other) noexcept : ops(NULL) {
+        take(other);
+    }
+
+    ~Continuation() {
+        reset();
+    }
+
+    Continuation& operator=(const Continuation& other) {
+        Continuation copy(other);
+        return *this = std::move(copy);
+    }
+
+    // the new callable is moved aside before the old one is destroyed, since it may be owned by the old one
+    Continuation& operator=(Continuation&& other) noexcept {
+        if (this != &other) {
+            Continuation moved(std::move(other));
+            reset();
+            take(moved);
+        }
+        return *this;
+    }
+
+    explicit operator bool() const {
+        return ops != NULL;
+    }
+
+    // like std::function, calling an empty continuation throws std::bad_function_call
+    R operator()(Args... args) const {
+        if (ops == NULL) {
+            throw std::bad_function_call();
+        }
+        return ops->invoke(&storage, std::forward<Args>(args)...);
+    }
+};
+
+#endif //CONTINUATION_H
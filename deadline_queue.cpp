@@ -0,0 +1,45 @@
+#include <algorithm>
+#include "deadline_queue.h"
+
+using std::chrono::steady_clock;
+using std::vector;
+
+
+// orders the heap so that the earliest deadline is at the front
+bool later_deadline(const DeadlineEntry& lhs, const DeadlineEntry& rhs) {
+    return lhs.deadline > rhs.deadline;
+}
+
+void DeadlineQueue::push(DeadlineEntry entry) {
+    heap.push_back(entry);
+    std::push_heap(heap.begin(), heap.end(), later_deadline);
+}
+
+void DeadlineQueue::pop() {
+    std::pop_heap(heap.begin(), heap.end(), later_deadline);
+    heap.pop_back();
+}
+
+const DeadlineEntry& DeadlineQueue::top() {
+    return heap.front();
+}
+
+void DeadlineQueue::pop_expired(steady_clock::time_point now, vector<DeadlineEntry>& expired) {
+    while (!heap.empty() && heap.front().deadline <= now) {
+        expired.push_back(heap.front());
+        pop();
+    }
+}
+
+void DeadlineQueue::rebuild(const vector<DeadlineEntry>& entries) {
+    heap = entries;
+    std::make_heap(heap.begin(), heap.end(), later_deadline);
+}
+
+bool DeadlineQueue::empty() {
+    return heap.empty();
+}
+
+size_t DeadlineQueue::size() {
+    return heap.size();
+}
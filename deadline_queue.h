@@ -0,0 +1,45 @@
+#ifndef DEADLINE_QUEUE_H
+#define DEADLINE_QUEUE_H
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+
+/*
+ * DeadlineEntry is a single deadline tracked by a DeadlineQueue. The `id` and `fd` are
+ * opaque to the queue and are used by the owner to find what the deadline belongs to.
+ */
+struct DeadlineEntry {
+    std::chrono::steady_clock::time_point deadline;
+    uint64_t id;
+    int fd;
+};
+
+
+/*
+ * DeadlineQueue implements a min-heap of deadlines on the monotonic clock.
+ * Pushing a deadline is O(log n), finding the next deadline is O(1), and popping every
+ * expired deadline is O(expired log n).
+ * Entries are never removed early. Instead the owner checks whether a popped entry is
+ * still relevant ("lazy deletion") and can `rebuild` the queue if it fills up with stale entries.
+ */
+class DeadlineQueue {
+    std::vector<DeadlineEntry> heap;
+
+public:
+    void push(DeadlineEntry entry);
+    void pop();
+    const DeadlineEntry& top();
+
+    // pop_expired moves every entry with a deadline at or before `now` into `expired`
+    void pop_expired(std::chrono::steady_clock::time_point now, std::vector<DeadlineEntry>& expired);
+
+    // rebuild replaces the contents of the queue with the given live entries
+    void rebuild(const std::vector<DeadlineEntry>& entries);
+
+    bool empty();
+    size_t size();
+};
+
+#endif //DEADLINE_QUEUE_H
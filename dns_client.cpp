@@ -31,6 +31,17 @@ std::vector<struct in_addr> NetworkDnsClient::lookup(string domain) {
 }
 
 
+ResolvedDnsClient::ResolvedDnsClient(std::unordered_map<string, vector<struct in_addr>> resolved) : resolved(resolved) {}
+
+vector<struct in_addr> ResolvedDnsClient::lookup(string domain) {
+    auto it = resolved.find(domain);
+    if (it == resolved.end()) {
+        throw runtime_error("domain was not resolved: '" + domain + "'");
+    }
+    return it->second;
+}
+
+
 vector<struct in_addr> NopDnsClient::lookup(string) {
     return vector<struct in_addr>();
 }
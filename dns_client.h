@@ -3,12 +3,13 @@
 
 #include <netinet/in.h>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 /*
  * DnsClient is an abstract class that can take a given domain string and return all of
  * the ip addresses associated with it.
- * It is implemented by NetworkDnsClient and NopDnsClient below, and by MockDnsClient in mocks.h.
+ * It is implemented by NetworkDnsClient, ResolvedDnsClient and NopDnsClient below, and by MockDnsClient in mocks.h.
  */
 class DnsClient {
 public:
@@ -28,6 +29,20 @@ public:
 };
 
 
+/*
+ * ResolvedDnsClient implements DnsClient with the results of lookups that were already made,
+ * e.g. by AsyncDnsClient. Domains that weren't looked up throw a runtime_error, like a failed lookup.
+ */
+class ResolvedDnsClient : public DnsClient {
+    const std::unordered_map<std::string, std::vector<struct in_addr>> resolved;
+
+public:
+    ResolvedDnsClient(std::unordered_map<std::string, std::vector<struct in_addr>> resolved);
+
+    virtual std::vector<struct in_addr> lookup(std::string domain);
+};
+
+
 /*
  * NopDnsClient implements DnsClient by returning an empty vector for every domain name.
  */
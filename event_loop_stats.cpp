@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <errno.h>
+#include <iomanip>
+#include <mutex>
+#include <signal.h>
+#include <stdexcept>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <vector>
+#include "event_loop_stats.h"
+#include "util.h"
+
+using std::atomic;
+using std::endl;
+using std::lock_guard;
+using std::memory_order_relaxed;
+using std::mutex;
+using std::ostream;
+using std::runtime_error;
+using std::vector;
+
+
+// adds n to a counter that is only ever written by one thread, which avoids a locked read-modify-write
+static inline void add_relaxed(atomic<uint64_t>& counter, uint64_t n) {
+    counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+
+void HistogramSnapshot::merge(const HistogramSnapshot& other) {
+    count += other.count;
+    sum += other.sum;
+    max = std::max(max, other.max);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        buckets[i] += other.buckets[i];
+    }
+}
+
+double HistogramSnapshot::mean() const {
+    if (count == 0) {
+        return 0;
+    }
+    return (double) sum / count;
+}
+
+uint64_t HistogramSnapshot::percentile(double p) const {
+    uint64_t target = (uint64_t) (p * count);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > target || (seen == count && seen > 0)) {
+            // the largest value that falls into bucket i, but never more than the largest value recorded
+            uint64_t upper = i == 0 ? 0 : (i == HISTOGRAM_BUCKETS - 1 ? UINT64_MAX : (1ULL << i) - 1);
+            return std::min(upper, max);
+        }
+    }
+    return 0;
+}
+
+ostream& operator<<(ostream& os, const HistogramSnapshot& snapshot) {
+    return os << "count=" << snapshot.count << " mean=" << std::fixed << std::setprecision(1) << snapshot.mean()
+              << " p50<=" << snapshot.percentile(0.5) << " p99<=" << snapshot.percentile(0.99)
+              << " max=" << snapshot.max;
+}
+
+
+Histogram::Histogram() : count(0), sum(0), max(0) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        buckets[i].store(0, memory_order_relaxed);
+    }
+}
+
+void Histogram::record(uint64_t value) {
+    int bucket = value == 0 ? 0 : std::min(64 - __builtin_clzll(value), HISTOGRAM_BUCKETS - 1);
+    add_relaxed(buckets[bucket], 1);
+    add_relaxed(count, 1);
+    add_relaxed(sum, value);
+    if (value > max.load(memory_order_relaxed)) {
+        max.store(value, memory_order_relaxed);
+    }
+}
+
+HistogramSnapshot Histogram::snapshot() const {
+    HistogramSnapshot snapshot;
+    snapshot.count = count.load(memory_order_relaxed);
+    snapshot.sum = sum.load(memory_order_relaxed);
+    snapshot.max = max.load(memory_order_relaxed);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        snapshot.buckets[i] = buckets[i].load(memory_order_relaxed);
+    }
+    return snapshot;
+}
+
+
+void EventLoopStatsSnapshot::merge(const EventLoopStatsSnapshot& other) {
+    loops += other.loops;
+    iterations += other.iterations;
+    notifications += other.notifications;
+    completions += other.completions;
+    expired += other.expired;
+    pollables += other.pollables;
+    buffered_output_bytes += other.buffered_output_bytes;
+    slow_readers += other.slow_readers;
+    output_waits += other.output_waits;
+    busy_ns.merge(other.busy_ns);
+    wait_ns.merge(other.wait_ns);
+    ready_per_wait.merge(other.ready_per_wait);
+    callback_ns.merge(other.callback_ns);
+    accepts_per_wakeup.merge(other.accepts_per_wakeup);
+}
+
+double EventLoopStatsSnapshot::utilization() const {
+    uint64_t total = busy_ns.sum + wait_ns.sum;
+    if (total == 0) {
+        return 0;
+    }
+    return (double) busy_ns.sum / total;
+}
+
+ostream& operator<<(ostream& os, const EventLoopStatsSnapshot& snapshot) {
+    os << "event loops: " << snapshot.loops << endl;
+    os << "iterations: " << snapshot.iterations << endl;
+    os << "notifications: " << snapshot.notifications << endl;
+    os << "completions: " << snapshot.completions << endl;
+    os << "expired: " << snapshot.expired << endl;
+    os << "pollables: " << snapshot.pollables << endl;
+    os << "utilization: " << std::fixed << std::setprecision(3) << snapshot.utilization() << endl;
+    os << "busy_ns: " << snapshot.busy_ns << endl;
+    os << "wait_ns: " << snapshot.wait_ns << endl;
+    os << "ready_per_wait: " << snapshot.ready_per_wait << endl;
+    os << "callback_ns: " << snapshot.callback_ns << endl;
+    os << "accepts_per_wakeup: " << snapshot.accepts_per_wakeup << endl;
+    os << "buffered_output_bytes: " << snapshot.buffered_output_bytes << endl;
+    os << "slow_readers: " << snapshot.slow_readers << endl;
+    os << "output_waits: " << snapshot.output_waits << endl;
+    return os;
+}
+
+
+static mutex registry_lock;
+static vector<EventLoopStats*> registry;
+
+EventLoopStats::EventLoopStats() : iterations(0), notifications(0), completions(0), expired(0), pollables(0) {
+    lock_guard<mutex> guard(registry_lock);
+    registry.push_back(this);
+}
+
+EventLoopStats::~EventLoopStats() {
+    lock_guard<mutex> guard(registry_lock);
+    registry.erase(std::find(registry.begin(), registry.end(), this));
+}
+
+void EventLoopStats::record_iteration(uint64_t num_pollables) {
+    add_relaxed(iterations, 1);
+    pollables.store(num_pollables, memory_order_relaxed);
+}
+
+void EventLoopStats::record_notification() {
+    add_relaxed(notifications, 1);
+}
+
+void EventLoopStats::record_completion() {
+    add_relaxed(completions, 1);
+}
+
+void EventLoopStats::record_expired(uint64_t num_expired) {
+    add_relaxed(expired, num_expired);
+}
+
+EventLoopStatsSnapshot EventLoopStats::snapshot() const {
+    EventLoopStatsSnapshot snapshot;
+    snapshot.loops = 1;
+    snapshot.iterations = iterations.load(memory_order_relaxed);
+    snapshot.notifications = notifications.load(memory_order_relaxed);
+    snapshot.completions = completions.load(memory_order_relaxed);
+    snapshot.expired = expired.load(memory_order_relaxed);
+    snapshot.pollables = pollables.load(memory_order_relaxed);
+    snapshot.buffered_output_bytes = 0;
+    snapshot.slow_readers = 0;
+    snapshot.output_waits = 0;
+    snapshot.busy_ns = busy_ns.snapshot();
+    snapshot.wait_ns = wait_ns.snapshot();
+    snapshot.ready_per_wait = ready_per_wait.snapshot();
+    snapshot.callback_ns = callback_ns.snapshot();
+    snapshot.accepts_per_wakeup = accepts_per_wakeup.snapshot();
+    return snapshot;
+}
+
+
+EventLoopStatsSnapshot snapshot_event_loop_stats() {
+    EventLoopStatsSnapshot total;
+    memset(&total, 0, sizeof(total));
+
+    lock_guard<mutex> guard(registry_lock);
+    for (size_t i = 0; i < registry.size(); i++) {
+        total.merge(registry[i]->snapshot());
+    }
+
+    const OutputStats& output = global_output_stats();
+    total.buffered_output_bytes = output.buffered_bytes();
+    total.slow_readers = output.slow_reader_count();
+    total.output_waits = output.output_wait_count();
+    return total;
+}
+
+
+OutputStats::OutputStats() : buffered(0), slow_readers(0), output_waits(0) {}
+
+void OutputStats::charge(uint64_t bytes) {
+    buffered.fetch_add(bytes, memory_order_relaxed);
+}
+
+void OutputStats::release(uint64_t bytes) {
+    buffered.fetch_sub(bytes, memory_order_relaxed);
+}
+
+void OutputStats::record_slow_reader() {
+    slow_readers.fetch_add(1, memory_order_relaxed);
+}
+
+void OutputStats::record_output_wait() {
+    output_waits.fetch_add(1, memory_order_relaxed);
+}
+
+uint64_t OutputStats::buffered_bytes() const {
+    return buffered.load(memory_order_relaxed);
+}
+
+uint64_t OutputStats::slow_reader_count() const {
+    return slow_readers.load(memory_order_relaxed);
+}
+
+uint64_t OutputStats::output_wait_count() const {
+    return output_waits.load(memory_order_relaxed);
+}
+
+OutputStats& global_output_stats() {
+    static OutputStats stats;
+    return stats;
+}
+
+
+static atomic<bool> dump_requested(false);
+static atomic<int> dump_fd(-1);
+
+static void request_stats_dump(int) {
+    dump_requested.store(true);
+
+    // write() is async signal safe, but may clobber the errno of the interrupted code
+    int saved_errno = errno;
+    uint64_t one = 1;
+    int fd = dump_fd.load();
+    if (fd >= 0 && write(fd, &one, sizeof(one)) < 0) {}
+    errno = saved_errno;
+}
+
+int stats_dump_fd() {
+    static mutex fd_lock;
+    lock_guard<mutex> guard(fd_lock);
+    if (dump_fd.load() < 0) {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0) {
+            throw runtime_error(errno_message("eventfd() failed: "));
+        }
+        dump_fd.store(fd);
+    }
+    return dump_fd.load();
+}
+
+void install_stats_dump_handler(int signum) {
+    // make the eventfd before the handler can run
+    stats_dump_fd();
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stats_dump;
+    sigemptyset(&action.sa_mask);
+    sigaction(signum, &action, NULL);
+}
+
+bool take_stats_dump_request() {
+    return dump_requested.load(memory_order_relaxed) && dump_requested.exchange(false);
+}
@@ -0,0 +1,175 @@
+#ifndef EVENT_LOOP_STATS_H
+#define EVENT_LOOP_STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+#define HISTOGRAM_BUCKETS (64)
+
+
+/*
+ * HistogramSnapshot is a point in time copy of a Histogram that can be merged with the
+ * snapshots of other histograms and queried for approximate percentiles.
+ * Bucket 0 counts zeros and bucket i counts values in [2^(i-1), 2^i).
+ */
+struct HistogramSnapshot {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+
+    void merge(const HistogramSnapshot& other);
+    double mean() const;
+
+    // percentile returns an upper bound on the value below which `p` (0 to 1) of the values fall
+    uint64_t percentile(double p) const;
+};
+std::ostream& operator<<(std::ostream&, const HistogramSnapshot&);
+
+
+/*
+ * Histogram counts values in power of two buckets so that recording a value is a handful of
+ * instructions with no allocation.
+ * It may only be recorded to by a single thread, but can be snapshotted from any thread,
+ * since every field is a relaxed atomic that is only written by its owner.
+ */
+class Histogram {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+
+public:
+    Histogram();
+
+    void record(uint64_t value);
+    HistogramSnapshot snapshot() const;
+};
+
+
+/*
+ * EventLoopStatsSnapshot is a point in time copy of the stats of one or more event loops.
+ * Durations are in nanoseconds. `pollables` is the number registered when the snapshot was taken.
+ * The output counters are shared by every event loop (see OutputStats below), so they are only
+ * filled in by snapshot_event_loop_stats, and are zero in the snapshot of a single loop.
+ */
+struct EventLoopStatsSnapshot {
+    uint64_t loops;
+    uint64_t iterations;
+    uint64_t notifications;
+    uint64_t completions;
+    uint64_t expired;
+    uint64_t pollables;
+    uint64_t buffered_output_bytes;
+    uint64_t slow_readers;
+    uint64_t output_waits;
+
+    HistogramSnapshot busy_ns;
+    HistogramSnapshot wait_ns;
+    HistogramSnapshot ready_per_wait;
+    HistogramSnapshot callback_ns;
+    HistogramSnapshot accepts_per_wakeup;
+
+    void merge(const EventLoopStatsSnapshot& other);
+
+    // utilization returns the fraction of time spent processing events rather than waiting for them
+    double utilization() const;
+};
+std::ostream& operator<<(std::ostream&, const EventLoopStatsSnapshot&);
+
+
+/*
+ * EventLoopStats holds the counters and histograms recorded by a single AsyncEventLoop:
+ * `busy_ns`         time spent processing each iteration, excluding the wait
+ * `wait_ns`         time spent waiting in the EventBackend each iteration
+ * `ready_per_wait`  ready fds and completions returned by each wait
+ * `callback_ns`     time spent in each notify() or complete(), including the callbacks they invoke
+ * `accepts_per_wakeup`  connections accepted each time a listener was ready
+ * Like Histogram, it is written by the event loop's thread and may be read from any thread.
+ *
+ * Every live EventLoopStats is registered in a global list so that snapshot_event_loop_stats
+ * can aggregate all of the event loops in the process, e.g. for every reactor in "async N".
+ */
+class EventLoopStats {
+    std::atomic<uint64_t> iterations;
+    std::atomic<uint64_t> notifications;
+    std::atomic<uint64_t> completions;
+    std::atomic<uint64_t> expired;
+    std::atomic<uint64_t> pollables;
+
+public:
+    Histogram busy_ns;
+    Histogram wait_ns;
+    Histogram ready_per_wait;
+    Histogram callback_ns;
+    Histogram accepts_per_wakeup;
+
+    EventLoopStats();
+    ~EventLoopStats();
+
+    void record_iteration(uint64_t num_pollables);
+    void record_notification();
+    void record_completion();
+    void record_expired(uint64_t num_expired);
+
+    EventLoopStatsSnapshot snapshot() const;
+};
+
+
+/*
+ * OutputStats tracks the response bytes that connections hold in memory until their clients read
+ * them, across every event loop in the process, so that they can be held to a global budget:
+ * `buffered_bytes`  bytes that have been handed to a write but not yet sent
+ * `slow_readers`    connections dropped for reading their responses too slowly
+ * `output_waits`    times a connection held off producing more of a response for lack of budget
+ * Unlike EventLoopStats it is written by every event loop thread, so each update is an atomic add.
+ */
+class OutputStats {
+    std::atomic<uint64_t> buffered;
+    std::atomic<uint64_t> slow_readers;
+    std::atomic<uint64_t> output_waits;
+
+public:
+    OutputStats();
+
+    void charge(uint64_t bytes);
+    void release(uint64_t bytes);
+    void record_slow_reader();
+    void record_output_wait();
+
+    uint64_t buffered_bytes() const;
+    uint64_t slow_reader_count() const;
+    uint64_t output_wait_count() const;
+};
+
+/*
+ * global_output_stats returns the OutputStats shared by the whole process.
+ */
+OutputStats& global_output_stats();
+
+/*
+ * snapshot_event_loop_stats returns the merged stats of every event loop in the process.
+ */
+EventLoopStatsSnapshot snapshot_event_loop_stats();
+
+/*
+ * install_stats_dump_handler makes the given signal (e.g. SIGUSR1) request a dump of
+ * snapshot_event_loop_stats to stderr. The signal handler only sets a flag, and the next
+ * event loop to finish an iteration does the dump, since a signal handler can't safely take locks.
+ * The handler also writes to the stats_dump_fd eventfd, which every event loop waits on, so that
+ * an idle loop wakes up for the dump even if the signal is delivered to another thread.
+ */
+void install_stats_dump_handler(int signum);
+
+/*
+ * stats_dump_fd returns the process wide eventfd that install_stats_dump_handler's handler writes to.
+ */
+int stats_dump_fd();
+
+/*
+ * take_stats_dump_request returns true once for each dump requested by the signal.
+ */
+bool take_stats_dump_request();
+
+#endif //EVENT_LOOP_STATS_H
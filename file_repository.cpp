@@ -1,6 +1,7 @@
 #include <iostream>
 #include <fstream>
 #include <iterator>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -28,6 +29,20 @@ std::string PathFile::contents() {
     return string(istreambuf_iterator<char>(file_stream), istreambuf_iterator<char>());
 }
 
+shared_ptr<BodySource> PathFile::open_contents() {
+    int fd = ::open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return shared_ptr<BodySource>();
+    }
+
+    struct stat file_stat;
+    if (::fstat(fd, &file_stat) < 0) {
+        ::close(fd);
+        return shared_ptr<BodySource>();
+    }
+    return make_shared<FileBody>(fd, 0, (size_t) file_stat.st_size);
+}
+
 system_clock::time_point PathFile::last_modified() {
     struct stat file_stat;
     ::stat(file_path.c_str(), &file_stat);
@@ -4,11 +4,14 @@
 #include <chrono>
 #include <memory>
 #include <string>
+#include "http.h"
 
 
 /*
  * File is an abstract class representing a unix file.
  * It provides accessors for the properties necessary to implement FileServingHttpHandler.
+ * `open_contents` returns a BodySource that streams the contents instead of reading them all
+ * at once, or NULL if the file can't be opened.
  * It is implemented below by PathFile and by MockFile in mocks.h
  */
 class File {
@@ -17,6 +20,7 @@ public:
 
     virtual bool world_readable() = 0;
     virtual std::string contents() = 0;
+    virtual std::shared_ptr<BodySource> open_contents() = 0;
     virtual std::chrono::system_clock::time_point last_modified() = 0;
 };
 
@@ -49,6 +53,7 @@ public:
 
     virtual bool world_readable();
     virtual std::string contents();
+    virtual std::shared_ptr<BodySource> open_contents();
     virtual std::chrono::system_clock::time_point last_modified();
 };
 
@@ -118,6 +118,14 @@ vector<CidrBlock> parse_cidr_or_domain(string host_str, shared_ptr<DnsClient> dn
     }
 }
 
+vector<string> split_rule_line(string rule_line) {
+    vector<string> rule_components = split(rule_line, " from ");
+    if (rule_components.size() != 2) {
+        throw runtime_error("invalid rule line in htaccess: '" + rule_line + "'");
+    }
+    return rule_components;
+}
+
 HtAccess parse_htaccess_rules(string rules_str, shared_ptr<DnsClient> dns_client) {
     vector<HtAccessRule> rules;
 
@@ -127,11 +135,7 @@ HtAccess parse_htaccess_rules(string rules_str, shared_ptr<DnsClient> dns_client
             continue;
         }
 
-        vector<string> rule_components = split(rules_lines[i], " from ");
-        if (rule_components.size() != 2) {
-            throw runtime_error("invalid rule line in htaccess: '" + rules_lines[i] + "'");
-        }
-
+        vector<string> rule_components = split_rule_line(rules_lines[i]);
         bool allow = parse_allow_deny(rule_components[0]);
         vector<CidrBlock> blocks = parse_cidr_or_domain(rule_components[1], dns_client);
 
@@ -142,3 +146,23 @@ HtAccess parse_htaccess_rules(string rules_str, shared_ptr<DnsClient> dns_client
 
     return HtAccess(rules);
 }
+
+vector<string> htaccess_domains(string rules_str) {
+    vector<string> domains;
+
+    vector<string> rules_lines = split(rules_str, "\n");
+    for (size_t i = 0; i < rules_lines.size(); i++) {
+        if (rules_lines[i] == "") {
+            continue;
+        }
+
+        string host_str = split_rule_line(rules_lines[i])[1];
+        try {
+            parse_cidr(host_str);
+        } catch (runtime_error&) {
+            domains.push_back(host_str);
+        }
+    }
+
+    return domains;
+}
@@ -63,4 +63,10 @@ public:
  */
 HtAccess parse_htaccess_rules(std::string rule_str, std::shared_ptr<DnsClient> dns_client);
 
+/*
+ * Returns the domain names in a string representation of .htaccess rules, i.e. every host that
+ * parse_htaccess_rules would have to look up, so that they can be resolved ahead of time.
+ */
+std::vector<std::string> htaccess_domains(std::string rule_str);
+
 #endif //HTACCESS_H
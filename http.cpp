@@ -1,4 +1,7 @@
+#include <algorithm>
+#include <iostream>
 #include <stdexcept>
+#include <unistd.h>
 #include "connection.h"
 #include "http.h"
 #include "util.h"
@@ -114,7 +117,66 @@ bool operator!=(const HttpStatus& lhs, const HttpStatus& rhs) {
 }
 
 
+StringBody::StringBody(string contents) : contents(contents), position(0) {}
+
+size_t StringBody::size() {
+    return contents.size();
+}
+
+string StringBody::read_chunk(size_t max) {
+    string chunk = contents.substr(position, max);
+    position += chunk.size();
+    return chunk;
+}
+
+
+FileBody::FileBody(int fd, off_t offset, size_t length) : fd(fd), offset(offset), length(length), position(0) {}
+
+FileBody::~FileBody() {
+    if (::close(fd) < 0) {
+        std::cerr << errno_message("close() failed: ") << std::endl;
+    }
+}
+
+size_t FileBody::size() {
+    return length;
+}
+
+string FileBody::read_chunk(size_t max) {
+    string chunk(std::min(max, length - position), '\0');
+    if (chunk.empty()) {
+        return chunk;
+    }
+
+    ssize_t result = ::pread(fd, &chunk[0], chunk.size(), offset + (off_t) position);
+    if (result < 0) {
+        std::cerr << errno_message("pread() failed: ") << std::endl;
+        result = 0;
+    }
+
+    // a file that shrank after it was opened ends early, which the connection treats like an error
+    chunk.resize((size_t) result);
+    position += chunk.size();
+    return chunk;
+}
+
+
+GeneratorBody::GeneratorBody(size_t body_size, std::function<string(size_t)> generate) : body_size(body_size), generate(generate) {}
+
+size_t GeneratorBody::size() {
+    return body_size;
+}
+
+string GeneratorBody::read_chunk(size_t max) {
+    return generate(max);
+}
+
+
 HttpFrame HttpResponse::pack() {
+    return HttpFrame{this->pack_headers() + this->body};
+}
+
+string HttpResponse::pack_headers() {
     stringstream buf;
 
     buf << this->version << " " << this->status.code << " " << this->status.name << CRLF;
@@ -125,17 +187,20 @@ HttpFrame HttpResponse::pack() {
 
     buf << CRLF;
 
-    buf << this->body;
-
-    return HttpFrame{buf.str()};
+    return buf.str();
 }
 
 std::ostream& operator<<(std::ostream& os, const HttpResponse& response) {
-    return os << "{'" << response.version << "', " << response.status << ", " << response.headers << ", '" << response.body << "'}";
+    os << "{'" << response.version << "', " << response.status << ", " << response.headers << ", '" << response.body << "'";
+    if (response.body_source != NULL) {
+        os << ", {" << response.body_source->size() << " streamed bytes}";
+    }
+    return os << "}";
 }
 
 bool operator==(const HttpResponse& lhs, const HttpResponse& rhs) {
-    return lhs.version == rhs.version && lhs.status == rhs.status && lhs.headers == rhs.headers && lhs.body == rhs.body;
+    return lhs.version == rhs.version && lhs.status == rhs.status && lhs.headers == rhs.headers && lhs.body == rhs.body
+           && lhs.body_source == rhs.body_source;
 }
 
 bool operator!=(const HttpResponse& lhs, const HttpResponse& rhs) {
@@ -157,7 +222,23 @@ HttpResponse ok_response(string body, string content_type, system_clock::time_po
                     HttpHeader{"Content-Type", content_type},
                     HttpHeader{"Last-Modified", to_http_date(last_modified)}
             },
-            body
+            body,
+            shared_ptr<BodySource>()
+    };
+}
+
+HttpResponse ok_stream_response(shared_ptr<BodySource> body_source, string content_type, system_clock::time_point last_modified) {
+    return HttpResponse{
+            HTTP_VERSION_1_1,
+            OK_STATUS,
+            vector<HttpHeader>{
+                    SERVER_HEADER,
+                    HttpHeader{"Content-Length", to_string(body_source->size())},
+                    HttpHeader{"Content-Type", content_type},
+                    HttpHeader{"Last-Modified", to_http_date(last_modified)}
+            },
+            "",
+            body_source
     };
 }
 
@@ -166,7 +247,8 @@ HttpResponse error_response(HttpStatus status) {
             HTTP_VERSION_1_1,
             status,
             vector<HttpHeader>{SERVER_HEADER, EMPTY_CONTENT_LENGTH},
-            ""
+            "",
+            shared_ptr<BodySource>()
     };
 }
 
@@ -186,6 +268,10 @@ HttpResponse internal_server_error_response() {
     return error_response(INTERNAL_SERVER_ERROR_STATUS);
 }
 
+HttpResponse service_unavailable_response() {
+    return error_response(SERVICE_UNAVAILABLE_STATUS);
+}
+
 string infer_content_type(string filename) {
     if (ends_with(filename, ".html")) {
         return "text/html";
@@ -2,6 +2,8 @@
 #define HTTP_H
 
 #include <chrono>
+#include <functional>
+#include <memory>
 #include <netinet/in.h>
 #include <stdexcept>
 #include <vector>
@@ -81,27 +83,119 @@ bool operator==(const HttpStatus&, const HttpStatus&);
 bool operator!=(const HttpStatus&, const HttpStatus&);
 
 
+/*
+ * BodySource is an abstract class representing a response body that is produced a chunk at a
+ * time while it is sent, so that it never has to be in memory all at once.
+ * `size` returns the total size of the body, which is sent ahead of it as the Content-Length.
+ * `read_chunk` returns the next bytes of the body, at most `max` of them, or an empty string
+ * once the body is exhausted. The connections only read the next chunk once the last one has
+ * been sent, so a slow client holds back the source instead of piling up chunks in memory.
+ *
+ * BodySource is implemented by StringBody, FileBody and GeneratorBody below.
+ */
+class BodySource {
+public:
+    virtual ~BodySource() {};
+
+    virtual size_t size() = 0;
+    virtual std::string read_chunk(size_t max) = 0;
+};
+
+
+/*
+ * StringBody is a BodySource over bytes that are already in memory.
+ */
+class StringBody : public BodySource {
+    std::string contents;
+    size_t position;
+
+public:
+    StringBody(std::string contents);
+
+    virtual size_t size();
+    virtual std::string read_chunk(size_t max);
+};
+
+
+/*
+ * FileBody is a BodySource over a range of an open file. The async connections send it
+ * straight from the file with sendfile(), without ever reading it into memory, and the
+ * synchronous ones read it a chunk at a time with pread().
+ * It owns the file descriptor and closes it when it is destroyed.
+ */
+class FileBody : public BodySource {
+public:
+    int fd;
+    off_t offset;
+    size_t length;
+
+private:
+    size_t position;
+
+public:
+    FileBody(int fd, off_t offset, size_t length);
+    virtual ~FileBody();
+
+    virtual size_t size();
+    virtual std::string read_chunk(size_t max);
+};
+
+
+/*
+ * GeneratorBody is a BodySource that pulls its chunks from a function, for bodies that are
+ * computed as they are sent. The function is called with the most bytes it may return and
+ * must produce exactly `size` bytes in total.
+ */
+class GeneratorBody : public BodySource {
+    size_t body_size;
+    std::function<std::string(size_t)> generate;
+
+public:
+    GeneratorBody(size_t body_size, std::function<std::string(size_t)> generate);
+
+    virtual size_t size();
+    virtual std::string read_chunk(size_t max);
+};
+
+
 /*
  * HttpResponse represents an http response ready to be serialized and sent over
  * a connection. The `pack` method will serialize it into an HttpFrame.
  * HttpResponse objects should be constructed by HttpRequestHandlers and returned
  * so that it can be sent over the HttpConnection. Helper functions for constructing
  * common responses are declared below.
+ * `pack_headers` serializes just the status line and headers, so that the connections can send
+ * the body after them with a scatter-gather write instead of copying it into the frame.
+ * If `body_source` is set, it is streamed after `body` by the connection, and `pack` leaves it out.
  */
 struct HttpResponse {
     std::string version;
     HttpStatus status;
     std::vector<HttpHeader> headers;
     std::string body;
+    std::shared_ptr<BodySource> body_source;
 
 public:
     HttpFrame pack();
+    std::string pack_headers();
 };
 std::ostream& operator<<(std::ostream&, const HttpResponse&);
 bool operator==(const HttpResponse&, const HttpResponse&);
 bool operator!=(const HttpResponse&, const HttpResponse&);
 
 
+/*
+ * MAX_COALESCED_BYTES bounds how much response data a connection holds back to send together
+ * when it answers a batch of pipelined requests.
+ */
+const size_t MAX_COALESCED_BYTES = 64 * 1024;
+
+/*
+ * STREAM_CHUNK_SIZE is the most a connection reads from a BodySource at a time.
+ */
+const size_t STREAM_CHUNK_SIZE = 64 * 1024;
+
+
 /*
  * HttpStatus constants for common statuses
  */
@@ -110,15 +204,18 @@ const HttpStatus BAD_REQUEST_STATUS = HttpStatus{400, "Bad Request"};
 const HttpStatus FORBIDDEN_STATUS = HttpStatus{403, "Forbidden"};
 const HttpStatus NOT_FOUND_STATUS = HttpStatus{404, "Not Found"};
 const HttpStatus INTERNAL_SERVER_ERROR_STATUS = HttpStatus{500, "Internal Server Error"};
+const HttpStatus SERVICE_UNAVAILABLE_STATUS = HttpStatus{503, "Service Unavailable"};
 
 /*
  * Helper functions for constructing common responses
  */
 HttpResponse ok_response(std::string body, std::string content_type, std::chrono::system_clock::time_point last_modified);
+HttpResponse ok_stream_response(std::shared_ptr<BodySource> body_source, std::string content_type, std::chrono::system_clock::time_point last_modified);
 HttpResponse bad_request_response();
 HttpResponse forbidden_response();
 HttpResponse not_found_response();
 HttpResponse internal_server_error_response();
+HttpResponse service_unavailable_response();
 
 /*
  * Helper function for infering content type based on the name of a file
@@ -1,4 +1,8 @@
+#include <ctype.h>
 #include <iostream>
+#include <signal.h>
+#include <stdexcept>
+#include <stdlib.h>
 #include "httpd.h"
 #include "connection.h"
 #include "connection_handlers.h"
@@ -7,6 +11,7 @@
 #include "file_repository.h"
 #include "request_handlers.h"
 #include "async_request_handlers.h"
+#include "event_loop_stats.h"
 
 using std::cerr;
 using std::cout;
@@ -44,19 +49,29 @@ shared_ptr<HttpRequestHandler> wrap_htaccess_middleware(shared_ptr<FileRepositor
     return make_shared<RequestFilterMiddleware>(htaccess_filter, handler);
 }
 
-void serve_sync(unsigned short port, string doc_root, ThreadModel thread_model) {
+void serve_sync(unsigned short port, string doc_root, ThreadModel thread_model, PoolOptions pool_options) {
     shared_ptr<FileRepository> repository = make_shared<DirectoryFileRepository>(doc_root);
     shared_ptr<HttpRequestHandler> file_serving_handler = make_shared<FileServingHttpHandler>(repository);
 
     shared_ptr<HttpRequestHandler> request_handler = wrap_htaccess_middleware(repository, file_serving_handler);
 
+    if (pool_options.scheduler == PER_WORKER_LISTENERS) {
+        MultiListenerHttpServer server(port, (int)thread_model, make_shared<BlockingHttpConnectionHandler>(request_handler));
+        server.serve();
+        return;
+    }
+
     shared_ptr<HttpConnectionHandler> connection_handler;
     if (thread_model == NO_THREADS) {
         connection_handler = make_shared<BlockingHttpConnectionHandler>(request_handler);
     } else if (thread_model == NO_POOL) {
         connection_handler = make_shared<ThreadSpawningHttpConnectionHandler>(request_handler);
+    } else if (pool_options.scheduler == WORK_STEALING) {
+        connection_handler = make_shared<WorkStealingHttpConnectionHandler>(request_handler, (int)thread_model);
     } else {
-        connection_handler = make_shared<ThreadPoolHttpConnectionHandler>(request_handler, (int)thread_model);
+        connection_handler = make_shared<ThreadPoolHttpConnectionHandler>(request_handler, (int)thread_model,
+                                                                          pool_options.queue_capacity, pool_options.full_policy,
+                                                                          pool_options.sizing);
     }
 
     HttpServer server(HttpListener(make_shared<SocketListener>(port)), connection_handler);
@@ -64,26 +79,70 @@ void serve_sync(unsigned short port, string doc_root, ThreadModel thread_model)
 }
 
 shared_ptr<AsyncHttpRequestHandler> wrap_htaccess_middleware_async(shared_ptr<AsyncFileRepository> repository, shared_ptr<AsyncHttpRequestHandler> handler) {
-    shared_ptr<AsyncRequestFilter> htaccess_filter = make_shared<AsyncHtAccessRequestFilter>(repository);
+    shared_ptr<AsyncRequestFilter> htaccess_filter = make_shared<AsyncHtAccessRequestFilter>(repository, make_shared<AsyncDnsClient>());
     return make_shared<AsyncRequestFilterMiddleware>(htaccess_filter, handler);
 }
 
-void serve_async(unsigned short port, string doc_root) {
+void serve_async(unsigned short port, string doc_root, AsyncOptions async_options) {
     shared_ptr<AsyncFileRepository> repository = make_shared<DirectoryAsyncFileRepository>(doc_root);
     shared_ptr<AsyncHttpRequestHandler> file_serving_handler = make_shared<FileServingAsyncHttpRequestHandler>(repository);
 
     shared_ptr<AsyncHttpRequestHandler> request_handler = wrap_htaccess_middleware_async(repository, file_serving_handler);
 
-    AsyncHttpServer server(make_shared<AsyncSocketListener>(port), request_handler);
-    server.serve();
+    // `kill -USR1` dumps the event loop stats to stderr
+    install_stats_dump_handler(SIGUSR1);
+
+    if (async_options.reactors > 1) {
+        MultiReactorAsyncHttpServer server(port, async_options.reactors, request_handler, async_options.backend,
+                                           async_options.accept_budget, async_options.limits);
+        server.serve();
+    } else {
+        AsyncHttpServer server(make_shared<AsyncSocketListener>(port), request_handler, async_options.backend,
+                               async_options.accept_budget, async_options.limits);
+        server.serve();
+    }
+}
+
+AsyncOptions parse_async_options(int argc, char** argv) {
+    AsyncOptions options = DEFAULT_ASYNC_OPTIONS;
+    if (argc == 0 || string(argv[0]) != "async") {
+        return options;
+    }
+
+    // zerocopy can follow any of the other options, so take it off the end first
+    if (argc > 1 && string(argv[argc - 1]) == "zerocopy") {
+        options.limits.output.zerocopy_threshold = DEFAULT_ZEROCOPY_THRESHOLD;
+        argc--;
+    }
+
+    int i = 1;
+    if (i < argc && isdigit(argv[i][0])) {
+        options.reactors = (int) strtol(argv[i], NULL, 10);
+        if (options.reactors <= 0) {
+            throw invalid_argument(string("Invalid number of reactors: ") + argv[i]);
+        }
+        i++;
+    }
+    if (i < argc) {
+        options.backend = parse_event_backend(argv[i]);
+        i++;
+    }
+    if (i < argc) {
+        options.accept_budget = (int) strtol(argv[i], NULL, 10);
+        if (options.accept_budget <= 0) {
+            throw invalid_argument(string("Invalid accept budget: ") + argv[i]);
+        }
+    }
+
+    return options;
 }
 
-void start_httpd(unsigned short port, string doc_root, ThreadModel thread_model) {
+void start_httpd(unsigned short port, string doc_root, ThreadModel thread_model, AsyncOptions async_options, PoolOptions pool_options) {
     cerr << "Starting server (port: " << port << ", doc_root: " << doc_root << ")" << endl;
 
     if (thread_model == ASYNC_EVENT_LOOP) {
-        serve_async(port, doc_root);
+        serve_async(port, doc_root, async_options);
     } else {
-        serve_sync(port, doc_root, thread_model);
+        serve_sync(port, doc_root, thread_model, pool_options);
     }
 }
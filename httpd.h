@@ -2,15 +2,21 @@
 #define HTTPD_H
 
 #include <string>
+#include "async_event_backends.h"
+#include "async_http_server.h"
+#include "async_listener.h"
+#include "connection_handlers.h"
 
 /*
  * ThreadModel represents the different possible threading models used by the server.
- * A positive value indicates a thread pool with that many threads in the pool.
+ * A positive value indicates a thread pool with that many threads in the pool, which takes
+ * connections or requests as configured by PoolOptions.
  * The constants declared below represent different models as follows:
  * NO_POOL: a thread-per-connection model
  * NO_THREADS: a blocking model that handles requests on the main thread
  * ASYNC_EVENT_LOOP: an non-blocking model that handles requests on the
- *                   main thread using asynchronous IO.
+ *                   main thread using asynchronous IO, or on several event loop
+ *                   threads as configured by AsyncOptions.
  */
 typedef int ThreadModel;
 
@@ -18,6 +24,58 @@ const ThreadModel ASYNC_EVENT_LOOP = -2;
 const ThreadModel NO_THREADS = -1;
 const ThreadModel NO_POOL = 0;
 
-void start_httpd(unsigned short port, std::string doc_root, ThreadModel thread_model);
+/*
+ * AsyncOptions configures the ASYNC_EVENT_LOOP thread model. It is ignored by the other models.
+ * backend: the EventBackend (poll or epoll) that the event loops wait on
+ * reactors: the number of event loop threads, each with its own SO_REUSEPORT listener
+ * accept_budget: the most connections each event loop accepts per iteration
+ * limits: the connection timeouts, the most idle keep-alive connections each event loop holds,
+ *         the output budgets and minimum rate at which clients must read responses, and the
+ *         size from which responses are sent with MSG_ZEROCOPY, if at all
+ */
+struct AsyncOptions {
+    EventBackendType backend;
+    int reactors;
+    int accept_budget;
+    ConnectionLimits limits;
+};
+
+const AsyncOptions DEFAULT_ASYNC_OPTIONS = AsyncOptions{DEFAULT_EVENT_BACKEND, 1, DEFAULT_ACCEPT_BUDGET, DEFAULT_CONNECTION_LIMITS};
+
+/*
+ * parse_async_options parses the thread model arguments of httpd, e.g. "async 4 epoll 16 zerocopy",
+ * into AsyncOptions, or returns DEFAULT_ASYNC_OPTIONS for any other thread model.
+ * It throws std::invalid_argument for fewer than one reactor and other invalid values.
+ */
+AsyncOptions parse_async_options(int argc, char** argv);
+
+/*
+ * PoolOptions configures the thread pool model. It is ignored by the other models.
+ * queue_capacity: the most accepted connections that wait in the work queue for a pool thread
+ * full_policy: whether the accept thread waits for room or rejects connections while the queue is full
+ * sizing: how far the pool grows past its initial size under load, and how often it logs its stats
+ * scheduler: how the pool threads get their work. SHARED_QUEUE: they take whole connections from the
+ *            shared work queue. WORK_STEALING: they take turns serving single requests with a
+ *            WorkStealingHttpConnectionHandler. PER_WORKER_LISTENERS: each one accepts connections
+ *            from a SO_REUSEPORT listener of its own and serves them itself (see MultiListenerHttpServer).
+ *            The latter two ignore the options above
+ */
+enum PoolScheduler {
+    SHARED_QUEUE,
+    WORK_STEALING,
+    PER_WORKER_LISTENERS
+};
+
+struct PoolOptions {
+    size_t queue_capacity;
+    QueueFullPolicy full_policy;
+    PoolScheduler scheduler;
+    PoolSizing sizing;
+};
+
+const PoolOptions DEFAULT_POOL_OPTIONS = PoolOptions{DEFAULT_WORK_QUEUE_CAPACITY, BLOCK_WHEN_FULL, SHARED_QUEUE, DEFAULT_POOL_SIZING};
+
+void start_httpd(unsigned short port, std::string doc_root, ThreadModel thread_model, AsyncOptions async_options = DEFAULT_ASYNC_OPTIONS,
+                 PoolOptions pool_options = DEFAULT_POOL_OPTIONS);
 
 #endif // HTTPD_H
@@ -0,0 +1,66 @@
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "io_request.h"
+
+
+IoRequest recv_request(int fd, void* buf, size_t len) {
+    return IoRequest{IO_RECV, fd, buf, len, 0, NULL, 0, NULL, NULL};
+}
+
+IoRequest send_request(int fd, const void* buf, size_t len) {
+    return IoRequest{IO_SEND, fd, const_cast<void*>(buf), len, 0, NULL, 0, NULL, NULL};
+}
+
+IoRequest sendmsg_request(int fd, const struct msghdr* msg, int flags) {
+    return IoRequest{IO_SENDMSG, fd, const_cast<struct msghdr*>(msg), 0, 0, NULL, flags, NULL, NULL};
+}
+
+IoRequest read_request(int fd, void* buf, size_t len, off_t offset) {
+    return IoRequest{IO_READ, fd, buf, len, offset, NULL, 0, NULL, NULL};
+}
+
+IoRequest openat_request(const char* path, int flags) {
+    return IoRequest{IO_OPENAT, AT_FDCWD, NULL, 0, 0, path, flags, NULL, NULL};
+}
+
+IoRequest statx_request(const char* path, struct statx* statx_buf) {
+    return IoRequest{IO_STATX, AT_FDCWD, NULL, 0, 0, path, 0, statx_buf, NULL};
+}
+
+IoRequest call_request(int (*call)(void*), void* arg) {
+    return IoRequest{IO_CALL, -1, arg, 0, 0, NULL, 0, NULL, call};
+}
+
+
+int perform_io_request(const IoRequest& request) {
+    ssize_t ret = -1;
+
+    switch (request.op) {
+    case IO_RECV:
+        ret = ::recv(request.fd, request.buf, request.len, 0);
+        break;
+    case IO_SEND:
+        ret = ::send(request.fd, request.buf, request.len, 0);
+        break;
+    case IO_SENDMSG:
+        ret = ::sendmsg(request.fd, (const struct msghdr*) request.buf, request.flags);
+        break;
+    case IO_READ:
+        ret = ::pread(request.fd, request.buf, request.len, request.offset);
+        break;
+    case IO_OPENAT:
+        ret = ::openat(request.fd, request.path, request.flags);
+        break;
+    case IO_STATX:
+        ret = ::statx(request.fd, request.path, 0, STATX_BASIC_STATS, request.statx_buf);
+        break;
+    case IO_CALL:
+        return request.call(request.buf);
+    }
+
+    if (ret < 0) {
+        return -errno;
+    }
+    return (int) ret;
+}
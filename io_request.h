@@ -0,0 +1,73 @@
+#ifndef IO_REQUEST_H
+#define IO_REQUEST_H
+
+#include <cstddef>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+/*
+ * IoOp enumerates the system calls that can be described by an IoRequest.
+ */
+enum IoOp {
+    IO_RECV,
+    IO_SEND,
+    IO_SENDMSG,
+    IO_READ,
+    IO_OPENAT,
+    IO_STATX,
+    IO_CALL
+};
+
+
+/*
+ * IoRequest is a backend independent description of a single system call.
+ * It can be submitted to a completion based EventBackend (io_uring), which performs it in
+ * the kernel on our behalf, or performed directly with perform_io_request.
+ * The buffers and path it points to are owned by whoever prepared the request and must
+ * stay alive until the request completes.
+ *
+ * IO_RECV / IO_SEND:  fd, buf, len
+ * IO_SENDMSG:         fd, buf (a struct msghdr describing the iovecs to send), flags (the sendmsg flags)
+ * IO_READ:            fd, buf, len, offset
+ * IO_OPENAT:          path, flags (relative paths are relative to the working directory)
+ * IO_STATX:           path, statx_buf
+ * IO_CALL:            call, buf (calls `call(buf)`, which returns a result like a system call)
+ *
+ * IO_CALL is used for blocking work that has no system call of its own, like a DNS lookup.
+ * It is never submitted to the kernel, so the event loop always performs it on its OffloadPool.
+ */
+struct IoRequest {
+    IoOp op;
+    int fd;
+    void* buf;
+    size_t len;
+    off_t offset;
+    const char* path;
+    int flags;
+    struct statx* statx_buf;
+    int (*call)(void*);
+};
+
+/*
+ * Helper functions for constructing IoRequests
+ */
+IoRequest recv_request(int fd, void* buf, size_t len);
+IoRequest send_request(int fd, const void* buf, size_t len);
+IoRequest sendmsg_request(int fd, const struct msghdr* msg, int flags = 0);
+IoRequest read_request(int fd, void* buf, size_t len, off_t offset);
+IoRequest openat_request(const char* path, int flags);
+IoRequest statx_request(const char* path, struct statx* statx_buf);
+IoRequest call_request(int (*call)(void*), void* arg);
+
+
+/*
+ * perform_io_request makes the system call described by the request on the calling thread.
+ * Like an io_uring completion, it returns the result of the system call on success or the
+ * negated errno on failure.
+ */
+int perform_io_request(const IoRequest& request);
+
+#endif //IO_REQUEST_H
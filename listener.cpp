@@ -16,9 +16,14 @@ using std::stringstream;
 ListenerError::ListenerError(std::string message) : runtime_error(message) {}
 
 
-SocketListener::SocketListener(uint16_t port) {
+SocketListener::SocketListener(uint16_t port, bool reuse_port) {
     this->sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
 
+    int enable = 1;
+    if (reuse_port && setsockopt(this->sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        throw ListenerError(errno_message("setsockopt(SO_REUSEPORT) failed: "));
+    }
+
     struct sockaddr_in target;
     bzero(&target, sizeof(target));
     target.sin_family = AF_INET;
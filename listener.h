@@ -31,13 +31,16 @@ public:
  * Socket listener listens on the given port on the wildcard interface and returns
  * pointers to incoming connections when the `accept` method is called.
  * If no connection is waiting when `accept` is called, it blocks until one is ready.
+ * If `reuse_port` is set, the socket is bound with SO_REUSEPORT so that several listeners
+ * (e.g. one per worker thread) can bind the same port and have the kernel spread
+ * incoming connections across them.
  * The ~SocketListener destructor closes the listening socket.
  */
 class SocketListener : public Listener {
     int sock;
 
 public:
-    SocketListener(uint16_t port);
+    SocketListener(uint16_t port, bool reuse_port = false);
     SocketListener(SocketListener&&);
     ~SocketListener();
 
@@ -1,6 +1,8 @@
 #include <algorithm>
+#include <ctype.h>
 #include <iostream>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <limits.h>
 #include <stdexcept>
@@ -10,10 +12,10 @@
 using namespace std;
 
 const ThreadModel DEFAULT_THREAD_MODEL = NO_POOL;
-const vector<string> THREAD_MODELS = vector<string>{"nothread", "nopool", "pool", "async"};
+const vector<string> THREAD_MODELS = vector<string>{"nothread", "nopool", "pool", "steal", "reuseport", "async"};
 
 void usage(char* argv0) {
-    cerr << "Usage: " << argv0 << " listen_port docroot_dir [nothread | nopool | pool size | async]" << endl;
+    cerr << "Usage: " << argv0 << " listen_port docroot_dir [nothread | nopool | pool size[-max_size] [queue_capacity [block | reject]] [stats] | steal size | reuseport size | async [reactors] [poll | epoll | uring [accept_budget]] [zerocopy]]" << endl;
 }
 
 uint16_t parse_port(char* port_str) {
@@ -30,6 +32,15 @@ uint16_t parse_port(char* port_str) {
     return (uint16_t) port;
 }
 
+// parse_pool_size parses the number of threads of a pool, which must have at least one
+int parse_pool_size(char* size_str) {
+    long int size = strtol(size_str, NULL, 10);
+    if (size < 1) {
+        throw invalid_argument(string("Invalid number of threads: ") + size_str);
+    }
+    return (int) size;
+}
+
 ThreadModel parse_thread_model(int argc, char** argv) {
     if (argc == 0) {
         return DEFAULT_THREAD_MODEL;
@@ -55,8 +66,65 @@ ThreadModel parse_thread_model(int argc, char** argv) {
     }
 }
 
+PoolOptions parse_pool_options(int argc, char** argv) {
+    PoolOptions options = DEFAULT_POOL_OPTIONS;
+    if (argc > 0 && string(argv[0]) == "steal") {
+        options.scheduler = WORK_STEALING;
+        if (argc >= 2) {
+            parse_pool_size(argv[1]);
+        }
+        return options;
+    }
+    if (argc > 0 && string(argv[0]) == "reuseport") {
+        options.scheduler = PER_WORKER_LISTENERS;
+        if (argc >= 2) {
+            parse_pool_size(argv[1]);
+        }
+        return options;
+    }
+    if (argc == 0 || string(argv[0]) != "pool") {
+        return options;
+    }
+
+    // stats can follow any of the other options, so take it off the end first
+    if (argc > 1 && string(argv[argc - 1]) == "stats") {
+        options.sizing.stats_interval = DEFAULT_POOL_STATS_INTERVAL;
+        argc--;
+    }
+    if (argc >= 2) {
+        // an elastic pool is given as its initial and most threads, e.g. "4-64"
+        int min_size = parse_pool_size(argv[1]);
+        const char* max_size = strchr(argv[1], '-');
+        if (max_size != NULL) {
+            options.sizing.max_size = (int) strtol(max_size + 1, NULL, 10);
+            if (options.sizing.max_size < min_size) {
+                throw invalid_argument(string("Invalid pool size range: ") + argv[1]);
+            }
+        }
+    }
+    if (argc >= 3) {
+        long int capacity = strtol(argv[2], NULL, 10);
+        if (capacity <= 0) {
+            throw invalid_argument(string("Invalid queue capacity: ") + argv[2]);
+        }
+        options.queue_capacity = (size_t) capacity;
+    }
+    if (argc >= 4) {
+        string policy = argv[3];
+        if (policy == "block") {
+            options.full_policy = BLOCK_WHEN_FULL;
+        } else if (policy == "reject") {
+            options.full_policy = REJECT_WHEN_FULL;
+        } else {
+            throw invalid_argument("Invalid queue full policy: " + policy);
+        }
+    }
+
+    return options;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc < 3 || argc > 5) {
+    if (argc < 3 || argc > 8) {
         usage(argv[0]);
         return 1;
     }
@@ -65,8 +133,10 @@ int main(int argc, char* argv[]) {
         uint16_t port = parse_port(argv[1]);
         string doc_root = argv[2];
         ThreadModel thread_model = parse_thread_model(argc - 3, argv + 3);
+        AsyncOptions async_options = parse_async_options(argc - 3, argv + 3);
+        PoolOptions pool_options = parse_pool_options(argc - 3, argv + 3);
 
-        start_httpd(port, doc_root, thread_model);
+        start_httpd(port, doc_root, thread_model, async_options, pool_options);
     } catch (invalid_argument& e) {
         cerr << e.what() << endl;
         usage(argv[0]);
@@ -3,7 +3,9 @@
 #include "util.h"
 #include "mocks.h"
 
+using std::chrono::milliseconds;
 using std::chrono::system_clock;
+using std::make_shared;
 using std::shared_ptr;
 using std::string;
 using std::vector;
@@ -13,10 +15,12 @@ using std::vector;
 
 
 MockConnection::MockConnection(string payload, struct in_addr mock_remote_ip)
-        : read_payload(payload), write_payload(), read_size(DEFAULT_READ_SIZE), closed(false), mock_remote_ip(mock_remote_ip) {}
+        : read_payload(payload), write_payload(), read_size(DEFAULT_READ_SIZE), write_count(0), closed(false), mock_remote_ip(mock_remote_ip),
+          mock_read_timeout(0), mock_write_timeout(0) {}
 
 MockConnection::MockConnection(string payload, int read_size, struct in_addr mock_remote_ip)
-        : read_payload(payload), write_payload(), read_size(read_size), closed(false), mock_remote_ip(mock_remote_ip) {}
+        : read_payload(payload), write_payload(), read_size(read_size), write_count(0), closed(false), mock_remote_ip(mock_remote_ip),
+          mock_read_timeout(0), mock_write_timeout(0) {}
 
 MockConnection::~MockConnection() {}
 
@@ -34,9 +38,17 @@ std::string MockConnection::read() {
 }
 
 void MockConnection::write(string s) {
+    this->write_count++;
     this->write_payload << s;
 }
 
+void MockConnection::writev(const vector<string>& parts) {
+    this->write_count++;
+    for (size_t i = 0; i < parts.size(); i++) {
+        this->write_payload << parts[i];
+    }
+}
+
 void MockConnection::close() {
     closed = true;
 }
@@ -45,6 +57,15 @@ bool MockConnection::is_closed() {
     return closed;
 }
 
+void MockConnection::set_timeouts(milliseconds read_timeout, milliseconds write_timeout) {
+    mock_read_timeout = read_timeout;
+    mock_write_timeout = write_timeout;
+}
+
+int MockConnection::get_fd() {
+    return -1;
+}
+
 struct in_addr MockConnection::remote_ip() {
     return mock_remote_ip;
 }
@@ -53,6 +74,18 @@ string MockConnection::written() {
     return write_payload.str();
 }
 
+int MockConnection::writes() {
+    return write_count;
+}
+
+milliseconds MockConnection::read_timeout() {
+    return mock_read_timeout;
+}
+
+milliseconds MockConnection::write_timeout() {
+    return mock_write_timeout;
+}
+
 
 MockListener::MockListener(vector<shared_ptr<Connection>> connections) : connections(connections) {
     std::reverse(this->connections.begin(), this->connections.end());
@@ -103,6 +136,10 @@ std::string MockFile::contents() {
     return contents_payload;
 }
 
+shared_ptr<BodySource> MockFile::open_contents() {
+    return make_shared<StringBody>(contents_payload);
+}
+
 system_clock::time_point MockFile::last_modified() {
     return last_modified_payload;
 }
@@ -17,14 +17,19 @@
  * `read` is implemented by reading in specified chunk sizes from a preset buffer until
  * the buffer is empty, after which additional calls will throw ConnectionClosed
  * `write` is implemented by appending to an internal buffer.
- * The written bytes can be inspected for verification using the `written` method.
+ * The written bytes can be inspected for verification using the `written` method,
+ * and the number of writes they took with the `writes` method.
+ * The last timeouts that were set can be inspected with `read_timeout` and `write_timeout`.
  */
 class MockConnection : public Connection {
     std::stringstream read_payload;
     std::stringstream write_payload;
     int read_size;
+    int write_count;
     bool closed;
     struct in_addr mock_remote_ip;
+    std::chrono::milliseconds mock_read_timeout;
+    std::chrono::milliseconds mock_write_timeout;
 
 public:
     MockConnection(std::string payload, struct in_addr mock_remote_ip={0});
@@ -33,12 +38,18 @@ public:
 
     virtual std::string read();
     virtual void write(std::string);
+    virtual void writev(const std::vector<std::string>& parts);
     virtual void close();
     virtual bool is_closed();
+    virtual void set_timeouts(std::chrono::milliseconds read_timeout, std::chrono::milliseconds write_timeout);
+    virtual int get_fd();
 
     virtual struct in_addr remote_ip();
 
     std::string written();
+    int writes();
+    std::chrono::milliseconds read_timeout();
+    std::chrono::milliseconds write_timeout();
 };
 
 
@@ -92,6 +103,7 @@ public:
 
     virtual bool world_readable();
     virtual std::string contents();
+    virtual std::shared_ptr<BodySource> open_contents();
     virtual std::chrono::system_clock::time_point last_modified();
 };
 
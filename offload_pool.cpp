@@ -0,0 +1,36 @@
+#include <iostream>
+#include <thread>
+#include "offload_pool.h"
+
+using std::function;
+using std::make_shared;
+using std::shared_ptr;
+using std::thread;
+
+
+void handle_offload_queue(shared_ptr<SynchronizedQueue<function<void()>>> work_queue) {
+    while (true) {
+        function<void()> work = work_queue->pop();
+
+        try {
+            work();
+        } catch (...) {
+            std::cerr << "ERROR: exception bubbled up to top level offload pool function!" << std::endl;
+        }
+    }
+}
+
+OffloadPool::OffloadPool(int size) : work_queue(make_shared<SynchronizedQueue<function<void()>>>()) {
+    for (int i = 0; i < size; i++) {
+        thread(handle_offload_queue, work_queue).detach();
+    }
+}
+
+void OffloadPool::submit(function<void()> work) {
+    work_queue->push(std::move(work));
+}
+
+shared_ptr<OffloadPool> default_offload_pool() {
+    static shared_ptr<OffloadPool> pool = make_shared<OffloadPool>(DEFAULT_OFFLOAD_THREADS);
+    return pool;
+}
@@ -0,0 +1,36 @@
+#ifndef OFFLOAD_POOL_H
+#define OFFLOAD_POOL_H
+
+#include <functional>
+#include <memory>
+#include "synchronized_queue.h"
+
+// the number of threads in the pool shared by every event loop
+#define DEFAULT_OFFLOAD_THREADS (4)
+
+
+/*
+ * OffloadPool runs blocking work, like file system calls and DNS lookups, on a pool of `size`
+ * threads so that the event loops never block on it. Work is passed to the threads through an
+ * unbounded SynchronizedQueue, since offloaded work can't be turned away once an event loop has
+ * started waiting on it.
+ * The work is responsible for reporting its own result, e.g. with AsyncEventLoop's eventfd.
+ *
+ * The threads are detached and live as long as the process, since they only share the queue.
+ */
+class OffloadPool {
+    std::shared_ptr<SynchronizedQueue<std::function<void()>>> work_queue;
+
+public:
+    OffloadPool(int size);
+
+    void submit(std::function<void()> work);
+};
+
+/*
+ * default_offload_pool returns the pool shared by every AsyncEventLoop that isn't given its own.
+ * It is started the first time it is used.
+ */
+std::shared_ptr<OffloadPool> default_offload_pool();
+
+#endif //OFFLOAD_POOL_H
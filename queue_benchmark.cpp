@@ -0,0 +1,77 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "bounded_queue.h"
+#include "synchronized_queue.h"
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::thread;
+using std::vector;
+
+// the total number of elements passed through the queue for each thread count
+#define DEFAULT_ITEMS (1000000)
+// the capacity of the BoundedQueue, the same as the pool's default work queue
+#define BENCHMARK_CAPACITY (1024)
+#define MAX_THREADS (64)
+
+
+/*
+ * run_contended has `threads` producers push `items` elements through the queue in total
+ * while as many consumers pop them, and returns the elements passed per second.
+ */
+template <typename Queue>
+double run_contended(Queue& queue, int threads, size_t items) {
+    size_t per_thread = items / threads;
+    vector<thread> workers;
+
+    steady_clock::time_point start = steady_clock::now();
+    for (int i = 0; i < threads; i++) {
+        workers.push_back(thread([&queue, per_thread]() {
+            for (size_t j = 0; j < per_thread; j++) {
+                queue.push(j);
+            }
+        }));
+        workers.push_back(thread([&queue, per_thread]() {
+            for (size_t j = 0; j < per_thread; j++) {
+                queue.pop();
+            }
+        }));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+
+    duration<double> elapsed = steady_clock::now() - start;
+    return (double) (per_thread * threads) / elapsed.count();
+}
+
+
+/*
+ * queue_benchmark compares the work queues under contention. For 1 to 64 producer threads, each
+ * with a consumer thread of its own, it reports millions of elements per second through the
+ * mutex based SynchronizedQueue and the lock-free BoundedQueue.
+ *
+ * Usage: ./queue_benchmark [items]
+ */
+int main(int argc, char* argv[]) {
+    size_t items = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ITEMS;
+    if (items == 0) {
+        fprintf(stderr, "Usage: %s [items]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%8s %20s %20s %8s\n", "Threads", "Synchronized Mops/s", "Bounded Mops/s", "Speedup");
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        SynchronizedQueue<size_t> synchronized_queue;
+        BoundedQueue<size_t> bounded_queue(BENCHMARK_CAPACITY);
+
+        double synchronized_rate = run_contended(synchronized_queue, threads, items);
+        double bounded_rate = run_contended(bounded_queue, threads, items);
+        printf("%8d %20.2f %20.2f %8.2f\n", threads, synchronized_rate / 1e6, bounded_rate / 1e6, bounded_rate / synchronized_rate);
+    }
+
+    return 0;
+}
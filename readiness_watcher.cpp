@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <iostream>
+#include <poll.h>
+#include <stdexcept>
+#include <vector>
+#include "async_event_loop.h"
+#include "readiness_watcher.h"
+
+using std::chrono::steady_clock;
+using std::cerr;
+using std::endl;
+using std::exception;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::shared_ptr;
+using std::thread;
+using std::unordered_map;
+using std::vector;
+
+// how long the watcher thread waits for readiness at a time, which bounds how late quiet
+// connections are dropped and how long the destructor waits for the thread to stop
+#define WATCHER_TICK_MS (100)
+
+
+ReadinessWatcher::ReadinessWatcher(ReadyCallback ready)
+        : ready(ready), backend(make_shared<EpollEventBackend>()), lock(), parked(), next_deadline(NO_DEADLINE),
+          stopping(false), watcher() {
+    watcher = thread(&ReadinessWatcher::run, this);
+}
+
+ReadinessWatcher::~ReadinessWatcher() {
+    stop();
+}
+
+void ReadinessWatcher::stop() {
+    stopping.store(true);
+    if (watcher.joinable()) {
+        watcher.join();
+    }
+
+    // the dropped connections are closed as they go out of scope, after the lock is released
+    unordered_map<int, Parked> dropped;
+    lock_guard<mutex> guard(lock);
+    for (unordered_map<int, Parked>::iterator entry = parked.begin(); entry != parked.end(); ++entry) {
+        backend->remove(entry->first);
+    }
+    dropped.swap(parked);
+}
+
+void ReadinessWatcher::watch(shared_ptr<HttpConnection> conn) {
+    int fd = conn->get_fd();
+    {
+        lock_guard<mutex> guard(lock);
+        // checked under the lock, so that a connection is either dropped here or by stop
+        if (stopping.load()) {
+            return;
+        }
+        // holding the lock keeps the watcher thread from looking up the fd before the connection is parked
+        if (fd >= 0 && backend->add(fd, POLLIN)) {
+            steady_clock::time_point deadline = steady_clock::now() + conn->wait_timeout();
+            parked[fd] = Parked{conn, deadline};
+            next_deadline = std::min(next_deadline, deadline);
+            return;
+        }
+    }
+    ready(conn);
+}
+
+size_t ReadinessWatcher::size() {
+    lock_guard<mutex> guard(lock);
+    return parked.size();
+}
+
+shared_ptr<HttpConnection> ReadinessWatcher::unpark(int fd) {
+    lock_guard<mutex> guard(lock);
+    unordered_map<int, Parked>::iterator entry = parked.find(fd);
+    if (entry == parked.end()) {
+        return shared_ptr<HttpConnection>();
+    }
+
+    // stop watching before anyone else gets the connection, since they may close it and reuse the fd
+    backend->remove(fd);
+    shared_ptr<HttpConnection> conn = entry->second.conn;
+    parked.erase(entry);
+    return conn;
+}
+
+void ReadinessWatcher::drop_expired() {
+    // the expired connections are closed as they go out of scope, after the lock is released
+    vector<shared_ptr<HttpConnection>> expired;
+
+    lock_guard<mutex> guard(lock);
+    steady_clock::time_point now = steady_clock::now();
+    if (now < next_deadline) {
+        return;
+    }
+
+    next_deadline = NO_DEADLINE;
+    for (unordered_map<int, Parked>::iterator entry = parked.begin(); entry != parked.end();) {
+        if (entry->second.deadline <= now) {
+            backend->remove(entry->first);
+            expired.push_back(entry->second.conn);
+            entry = parked.erase(entry);
+        } else {
+            next_deadline = std::min(next_deadline, entry->second.deadline);
+            ++entry;
+        }
+    }
+}
+
+void ReadinessWatcher::run() {
+    vector<ReadyEvent> events;
+    while (!stopping.load()) {
+        events.clear();
+        try {
+            backend->wait(WATCHER_TICK_MS, events);
+        } catch (exception& e) {
+            cerr << "Readiness watcher failed to wait: " << e.what() << endl;
+        }
+
+        // connections that were dropped can't show up in the events, since they are only dropped after these
+        for (size_t i = 0; i < events.size(); i++) {
+            shared_ptr<HttpConnection> conn = unpark(events[i].fd);
+            if (conn) {
+                ready(conn);
+            }
+        }
+        drop_expired();
+    }
+}
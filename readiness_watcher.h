@@ -0,0 +1,59 @@
+#ifndef READINESS_WATCHER_H
+#define READINESS_WATCHER_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include "async_event_backends.h"
+#include "server.h"
+
+
+/*
+ * ReadinessWatcher holds HttpConnections between their requests, so that no thread has to block
+ * on a connection while its client is quiet. `watch` parks a connection, and a thread of the
+ * watcher's own waits on all of the parked connections with an EpollEventBackend and passes
+ * each one to the `ready` callback as soon as it becomes readable, which includes its client
+ * closing it.
+ * A connection that stays quiet for longer than its `wait_timeout` is dropped, which closes it.
+ * Parked connections keep anything they have already buffered, and a connection without a
+ * socket to wait on is passed to `ready` right away.
+ * `size` is the number of parked connections. `stop` stops the thread and drops the connections
+ * that are still parked, along with any that are watched afterwards, so that once it returns
+ * `ready` is not called again. The destructor stops the watcher if that hasn't happened yet.
+ */
+class ReadinessWatcher {
+public:
+    typedef std::function<void(std::shared_ptr<HttpConnection>)> ReadyCallback;
+
+private:
+    struct Parked {
+        std::shared_ptr<HttpConnection> conn;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    ReadyCallback ready;
+    std::shared_ptr<EventBackend> backend;
+    std::mutex lock;
+    std::unordered_map<int, Parked> parked;
+    std::chrono::steady_clock::time_point next_deadline;
+    std::atomic<bool> stopping;
+    std::thread watcher;
+
+    void run();
+    std::shared_ptr<HttpConnection> unpark(int fd);
+    void drop_expired();
+
+public:
+    ReadinessWatcher(ReadyCallback ready);
+    ~ReadinessWatcher();
+
+    void watch(std::shared_ptr<HttpConnection> conn);
+    size_t size();
+    void stop();
+};
+
+#endif //READINESS_WATCHER_H
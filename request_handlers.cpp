@@ -5,6 +5,9 @@ using std::shared_ptr;
 using std::string;
 using std::vector;
 
+// files at least this large are streamed to the connection a chunk at a time rather than read into memory
+#define STREAM_MIN_SIZE (64 * 1024)
+
 
 FileServingHttpHandler::FileServingHttpHandler(shared_ptr<FileRepository> repository) : repository(repository) {}
 
@@ -26,7 +29,14 @@ HttpResponse FileServingHttpHandler::handle_request(const HttpRequest &request)
         return forbidden_response();
     }
 
-    HttpResponse response = ok_response(file->contents(), infer_content_type(path), file->last_modified());
+    shared_ptr<BodySource> contents = file->open_contents();
+    if (contents == NULL) {
+        return not_found_response();
+    } else if (contents->size() >= STREAM_MIN_SIZE) {
+        return ok_stream_response(contents, infer_content_type(path), file->last_modified());
+    }
+
+    HttpResponse response = ok_response(contents->read_chunk(contents->size()), infer_content_type(path), file->last_modified());
     return response;
 }
 
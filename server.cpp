@@ -1,21 +1,45 @@
 #include "server.h"
 #include <iostream>
+#include <stdexcept>
+#include <thread>
 
+using std::chrono::milliseconds;
+using std::invalid_argument;
+using std::make_shared;
 using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::vector;
 
 #define CRLFCRLF ("\r\n\r\n")
 
 
-HttpConnection::HttpConnection(shared_ptr<Connection> conn) : conn(conn) {}
+HttpConnection::HttpConnection(shared_ptr<Connection> conn, ConnectionTimeouts timeouts)
+        : conn(conn), pending(), pending_size(0), timeouts(timeouts), kept_alive(false) {}
 
-HttpConnection::HttpConnection(HttpConnection&& http_conn) : conn(std::move(http_conn.conn)) {}
+HttpConnection::HttpConnection(HttpConnection&& http_conn)
+        : conn(std::move(http_conn.conn)), pending(std::move(http_conn.pending)), pending_size(http_conn.pending_size),
+          timeouts(http_conn.timeouts), kept_alive(http_conn.kept_alive) {}
 
-HttpFrame HttpConnection::read_frame() {
-    return HttpFrame{conn.read_until(CRLFCRLF)};
+void HttpConnection::set_state(ConnectionState state) {
+    conn.set_timeouts(timeouts.of(state), timeouts.writing);
 }
 
-void HttpConnection::write_frame(HttpFrame frame) {
-    this->conn.write(frame.serialize());
+ConnectionState HttpConnection::waiting_state() {
+    // a kept alive connection may wait for its next request for the idle timeout, but once the
+    // request starts arriving the rest of its headers get the header timeout
+    return kept_alive && conn.is_empty() ? IDLE : READING_HEADERS;
+}
+
+HttpFrame HttpConnection::read_frame() {
+    if (conn.is_empty()) {
+        set_state(waiting_state());
+        conn.fill();
+    }
+    if (!conn.has_buffered(CRLFCRLF)) {
+        set_state(READING_HEADERS);
+    }
+    return HttpFrame{conn.read_until(CRLFCRLF)};
 }
 
 HttpRequest HttpConnection::read_request() {
@@ -24,14 +48,66 @@ HttpRequest HttpConnection::read_request() {
     return request;
 }
 
+bool HttpConnection::queue_response(HttpResponse response) {
+    // streamed bodies are sent after their headers, so they can't be queued behind other responses
+    if (response.body_source != NULL || pending_size >= MAX_COALESCED_BYTES || !conn.has_buffered(CRLFCRLF)) {
+        return false;
+    }
+
+    // keep the body as its own part rather than copying it into a frame behind the headers
+    pending.push_back(response.pack_headers());
+    pending.push_back(string());
+    pending.back().swap(response.body);
+    pending_size += pending[pending.size() - 2].size() + pending.back().size();
+    return true;
+}
+
 void HttpConnection::write_response(HttpResponse response) {
-    this->write_frame(response.pack());
+    // send any queued responses ahead of this one in the same write
+    vector<string> parts;
+    parts.swap(pending);
+    pending_size = 0;
+    parts.push_back(response.pack_headers());
+    parts.push_back(string());
+    parts.back().swap(response.body);
+    this->conn.writev(parts);
+    kept_alive = true;
+
+    if (response.body_source == NULL) {
+        return;
+    }
+
+    // the blocking writes hold back the next chunk until the last one is sent
+    size_t total_sent = 0;
+    while (total_sent < response.body_source->size()) {
+        string chunk = response.body_source->read_chunk(STREAM_CHUNK_SIZE);
+        if (chunk.empty()) {
+            // the client was promised more than the body holds, so the connection can't be reused
+            std::cerr << "response body ended " << response.body_source->size() - total_sent << " bytes early" << std::endl;
+            this->conn.close();
+            return;
+        }
+        this->conn.write(chunk);
+        total_sent += chunk.size();
+    }
+}
+
+bool HttpConnection::has_buffered_request() {
+    return conn.has_buffered(CRLFCRLF);
+}
+
+milliseconds HttpConnection::wait_timeout() {
+    return timeouts.of(waiting_state());
+}
+
+int HttpConnection::get_fd() {
+    return conn.get_fd();
 }
 
 
-HttpListener::HttpListener(shared_ptr<Listener> listener) : listener(listener) {}
+HttpListener::HttpListener(shared_ptr<Listener> listener, ConnectionTimeouts timeouts) : listener(listener), timeouts(timeouts) {}
 
-HttpListener::HttpListener(HttpListener&& listener) : listener(listener.listener) {
+HttpListener::HttpListener(HttpListener&& listener) : listener(listener.listener), timeouts(listener.timeouts) {
     listener.listener = shared_ptr<Listener>();
 }
 
@@ -40,7 +116,7 @@ void HttpListener::listen() {
 }
 
 HttpConnection HttpListener::accept() {
-    return HttpConnection(listener->accept());
+    return HttpConnection(listener->accept(), timeouts);
 }
 
 
@@ -59,3 +135,30 @@ void HttpServer::serve() {
 }
 
 
+MultiListenerHttpServer::MultiListenerHttpServer(uint16_t port, int workers, shared_ptr<HttpConnectionHandler> handler,
+                                                 ConnectionTimeouts timeouts) {
+    // without a worker, serve would return right away and nothing would ever accept
+    if (workers < 1) {
+        throw invalid_argument("MultiListenerHttpServer needs at least one worker");
+    }
+
+    // bind every listener up front so that bind errors surface on the calling thread
+    for (int i = 0; i < workers; i++) {
+        HttpListener listener(make_shared<SocketListener>(port, true), timeouts);
+        servers.push_back(make_shared<HttpServer>(std::move(listener), handler));
+    }
+}
+
+void MultiListenerHttpServer::serve() {
+    vector<thread> worker_threads;
+    for (size_t i = 0; i + 1 < servers.size(); i++) {
+        shared_ptr<HttpServer> server = servers[i];
+        worker_threads.push_back(thread([=]() { server->serve(); }));
+    }
+
+    servers.back()->serve();
+
+    for (size_t i = 0; i < worker_threads.size(); i++) {
+        worker_threads[i].join();
+    }
+}
@@ -2,6 +2,9 @@
 #define SERVER_H
 
 #include <memory>
+#include <string>
+#include <vector>
+#include "connection.h"
 #include "http.h"
 #include "listener.h"
 
@@ -14,31 +17,51 @@
  * connection closes, it throws ConnectionClosed.
  * The `write_response` method serializes and sends an HttpResponse. It throws
  * ConnectionClosed if the underlying connection closes.
+ * The `queue_response` method holds an HttpResponse back if the next request has already
+ * been received, so that a batch of pipelined requests is answered with a single write by
+ * the `write_response` call for the last one. It returns false, without queueing the
+ * response, if it should be written right away instead.
+ * Reads and writes are bounded by the ConnectionTimeouts for the connection's state, so once a
+ * response has been sent the next request is awaited with the idle timeout.
+ * `has_buffered_request` checks whether the next request has already been received in full, and
+ * `wait_timeout` is how long the next `read_request` may wait for its first bytes to arrive.
+ * `get_fd` is the socket to wait on for them, or -1 if there is none.
  */
 class HttpConnection {
     BufferedConnection conn;
+    std::vector<std::string> pending;
+    size_t pending_size;
+    ConnectionTimeouts timeouts;
+    bool kept_alive;
 
     HttpFrame read_frame();
-    void write_frame(HttpFrame frame);
+    ConnectionState waiting_state();
+    void set_state(ConnectionState state);
 
 public:
-    HttpConnection(std::shared_ptr<Connection> conn);
+    HttpConnection(std::shared_ptr<Connection> conn, ConnectionTimeouts timeouts = DEFAULT_CONNECTION_TIMEOUTS);
     HttpConnection(HttpConnection&&);
 
     HttpRequest read_request();
+    bool queue_response(HttpResponse);
     void write_response(HttpResponse);
+
+    bool has_buffered_request();
+    std::chrono::milliseconds wait_timeout();
+    int get_fd();
 };
 
 
 /*
  * HttpListener wraps a Listener object and returns accepted connections prewrapped
- * as HttpConnection objects.
+ * as HttpConnection objects, with the given timeouts.
  */
 class HttpListener {
     std::shared_ptr<Listener> listener;
+    ConnectionTimeouts timeouts;
 
 public:
-    HttpListener(std::shared_ptr<Listener>);
+    HttpListener(std::shared_ptr<Listener>, ConnectionTimeouts timeouts = DEFAULT_CONNECTION_TIMEOUTS);
     HttpListener(HttpListener&&);
 
     void listen();
@@ -89,4 +112,26 @@ public:
     void serve();
 };
 
+
+/*
+ * MultiListenerHttpServer runs `workers` independent HttpServers, each on its own thread with its
+ * own SocketListener bound to the port with SO_REUSEPORT, so that the kernel spreads incoming
+ * connections across the workers and each one accepts and handles its connections itself,
+ * without a central accept thread or work queue in between.
+ * The HttpConnectionHandler is shared between the workers, so it must be safe to call from
+ * several threads at once, and it should handle each connection on the calling thread, like
+ * BlockingHttpConnectionHandler does, for the worker to own the connection from accept to close.
+ * There must be at least one worker. `serve` runs the last worker on the calling thread and
+ * blocks until all of them stop.
+ */
+class MultiListenerHttpServer {
+    std::vector<std::shared_ptr<HttpServer>> servers;
+
+public:
+    MultiListenerHttpServer(uint16_t port, int workers, std::shared_ptr<HttpConnectionHandler> handler,
+                            ConnectionTimeouts timeouts = DEFAULT_CONNECTION_TIMEOUTS);
+
+    void serve();
+};
+
 #endif //SERVER_H
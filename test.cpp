@@ -1,23 +1,73 @@
+#include <atomic>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "async_connection.h"
+#include "async_coroutine.h"
+#include "async_dns_client.h"
+#include "async_event_backends.h"
+#include "async_event_loop.h"
+#include "async_file_repository.h"
+#include "async_http_server.h"
+#include "async_listener.h"
+#include "buffer_pool.h"
+#include "byte_buffer.h"
+#include "async_request_handlers.h"
+#include "bounded_queue.h"
 #include "connection.h"
+#include "continuation.h"
 #include "connection_handlers.h"
+#include "deadline_queue.h"
+#include "event_loop_stats.h"
 #include "htaccess.h"
+#include "httpd.h"
 #include "http.h"
+#include "io_request.h"
 #include "request_filters.h"
 #include "request_handlers.h"
 #include "listener.h"
 #include "mocks.h"
 #include "server.h"
+#include "uring.h"
 #include "util.h"
+#include "work_stealing_queues.h"
 
 using namespace std;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
 
+
+// count every heap allocation made by the test binary so that tests can check that code paths don't allocate
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size) {
+    allocations++;
+    void* ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == NULL) {
+        throw bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
 class TestRunner {
     int passes;
     int fails;
@@ -89,6 +139,26 @@ public:
     }
 };
 
+/*
+ * CapturedStderr collects everything written to std::cerr while it is alive, so that tests can
+ * check the warnings they provoke instead of printing them among the test results.
+ */
+class CapturedStderr {
+    stringstream captured;
+    streambuf* original;
+
+public:
+    CapturedStderr() : original(cerr.rdbuf(captured.rdbuf())) {}
+
+    ~CapturedStderr() {
+        cerr.rdbuf(original);
+    }
+
+    string text() {
+        return captured.str();
+    }
+};
+
 string itos(int i) {
     stringstream buf;
     buf << i;
@@ -105,7 +175,7 @@ HttpRequest make_request(string uri, vector<HttpHeader> headers={}, struct in_ad
 }
 
 HttpResponse make_response(HttpStatus status, vector<HttpHeader> headers={}, string body="") {
-    return {HTTP_VERSION_1_1, status, headers, body};
+    return {HTTP_VERSION_1_1, status, headers, body, shared_ptr<BodySource>()};
 }
 
 shared_ptr<MockFile> make_file(string contents) {
@@ -226,7 +296,7 @@ void test_mock_listener(TestRunner& runner) {
 }
 
 void test_mock_handler(TestRunner& runner) {
-    HttpResponse response = HttpResponse{HTTP_VERSION_1_1, OK_STATUS, vector<HttpHeader>{HttpHeader{"OtherKey", "othervalue"}}, ""};
+    HttpResponse response = HttpResponse{HTTP_VERSION_1_1, OK_STATUS, vector<HttpHeader>{HttpHeader{"OtherKey", "othervalue"}}, "", shared_ptr<BodySource>()};
     MockHttpRequestHandler mock_handler(response);
 
     vector<HttpRequest> requests = {
@@ -414,7 +484,7 @@ void test_http_listener(TestRunner& runner) {
     shared_ptr<MockListener> mock_listener = make_shared<MockListener>(mock_connections);
     HttpListener http_listener(mock_listener);
 
-    HttpResponse response{HTTP_VERSION_1_1, OK_STATUS, vector<HttpHeader>{HttpHeader{"KEY", "VAL"}}, ""};
+    HttpResponse response{HTTP_VERSION_1_1, OK_STATUS, vector<HttpHeader>{HttpHeader{"KEY", "VAL"}}, "", shared_ptr<BodySource>()};
     string response_str = response.pack().serialize();
 
     http_listener.listen();
@@ -485,7 +555,7 @@ void test_pipelined_http_server(TestRunner& runner) {
     };
     shared_ptr<MockListener> mock_listener = make_shared<MockListener>(mock_connections);
 
-    HttpResponse response{HTTP_VERSION_1_1, OK_STATUS, vector<HttpHeader>{HttpHeader{"OtherKey", "othervalue"}}, ""};
+    HttpResponse response{HTTP_VERSION_1_1, OK_STATUS, vector<HttpHeader>{HttpHeader{"OtherKey", "othervalue"}}, "", shared_ptr<BodySource>()};
     shared_ptr<MockHttpRequestHandler> mock_request_handler = make_shared<MockHttpRequestHandler>(response);
     shared_ptr<HttpConnectionHandler> connection_handler = make_shared<BlockingHttpConnectionHandler>(mock_request_handler);
 
@@ -496,6 +566,7 @@ void test_pipelined_http_server(TestRunner& runner) {
     // TODO: maybe make two different responses to verify sent in the correct order
     runner.assert_equal(vector<HttpRequest>{request_1, request_2}, mock_request_handler->requests(), "pipelined handler received requests incorrectly");
     runner.assert_equal(response.pack().serialize() + response.pack().serialize(), mock_connections[0]->written(), "pipelined conn received responses incorrectly");
+    runner.assert_equal(1, mock_connections[0]->writes(), "pipelined responses are sent with one write");
 }
 
 void test_file_serving_handler(TestRunner& runner) {
@@ -621,6 +692,1993 @@ void test_request_filter_middleware(TestRunner& runner) {
     runner.assert_equal(forbidden_response(), middleware.handle_request(make_request("/foo/bar.html")), "filter middleware /foo/bar.html");
 }
 
+void test_deadline_queue(TestRunner& runner) {
+    steady_clock::time_point base = steady_clock::time_point();
+    DeadlineQueue queue;
+    runner.assert_true(queue.empty(), "new deadline queue is empty");
+
+    queue.push(DeadlineEntry{base + chrono::seconds(5), 1, 10});
+    queue.push(DeadlineEntry{base + chrono::seconds(1), 2, 11});
+    queue.push(DeadlineEntry{base + chrono::seconds(3), 3, 12});
+    queue.push(DeadlineEntry{base + chrono::seconds(2), 4, 13});
+    runner.assert_equal((size_t) 4, queue.size(), "deadline queue size after pushes");
+    runner.assert_equal((uint64_t) 2, queue.top().id, "earliest deadline is on top");
+
+    vector<DeadlineEntry> expired;
+    queue.pop_expired(base, expired);
+    runner.assert_equal((size_t) 0, expired.size(), "nothing expired before first deadline");
+
+    queue.pop_expired(base + chrono::seconds(3), expired);
+    runner.assert_equal((size_t) 3, expired.size(), "deadlines at or before 3s expired");
+    runner.assert_equal((uint64_t) 2, expired[0].id, "first expired deadline");
+    runner.assert_equal((uint64_t) 4, expired[1].id, "second expired deadline");
+    runner.assert_equal((uint64_t) 3, expired[2].id, "third expired deadline");
+    runner.assert_equal(12, expired[2].fd, "expired deadline keeps its fd");
+    runner.assert_equal((uint64_t) 1, queue.top().id, "remaining deadline is on top");
+
+    queue.rebuild(vector<DeadlineEntry>{{base + chrono::seconds(9), 7, 1}, {base + chrono::seconds(8), 8, 2}});
+    runner.assert_equal((size_t) 2, queue.size(), "deadline queue size after rebuild");
+    runner.assert_equal((uint64_t) 8, queue.top().id, "earliest deadline is on top after rebuild");
+    queue.pop();
+    queue.pop();
+    runner.assert_true(queue.empty(), "deadline queue is empty after popping everything");
+}
+
+void test_byte_buffer(TestRunner& runner) {
+    ByteBuffer buffer;
+    runner.assert_true(buffer.empty(), "new byte buffer is empty");
+    runner.assert_equal(string::npos, buffer.find("\r\n\r\n"), "empty buffer has no separator");
+
+    // feed the separator one byte at a time so that it straddles the scanned bytes
+    string request = "GET / HTTP/1.1\r\nHost: a\r\n\r\nGET /next";
+    size_t found = string::npos;
+    size_t fed = 0;
+    while (found == string::npos && fed < request.size()) {
+        buffer.append(&request[fed++], 1);
+        found = buffer.find("\r\n\r\n");
+    }
+    runner.assert_equal((size_t) 23, found, "separator is found once its last byte arrives");
+    runner.assert_equal((size_t) 27, fed, "separator is found as soon as it is complete");
+
+    buffer.append(request.data() + fed, request.size() - fed);
+    runner.assert_equal(string("GET / HTTP/1.1\r\nHost: a"), buffer.pop(found, 4), "pop returns content before separator");
+    runner.assert_equal(string("GET /next"), string(buffer.data(), buffer.size()), "pop leaves the rest");
+    runner.assert_equal(string::npos, buffer.find("\r\n\r\n"), "rest has no separator");
+    runner.assert_equal((size_t) 5, buffer.find("next"), "find with a new separator rescans");
+
+    // receiving more than the free space compacts or grows the buffer without losing unread bytes
+    char* space = buffer.prepare(100000);
+    runner.assert_true(buffer.available() >= 100000, "prepare makes room");
+    memset(space, 'x', 100000);
+    buffer.commit(100000);
+    runner.assert_equal((size_t) 100009, buffer.size(), "commit adds received bytes");
+    runner.assert_equal(string("GET /next"), buffer.pop(9), "unread bytes survive growth");
+    runner.assert_equal(string(100000, 'x'), buffer.pop(100000), "received bytes are kept");
+    runner.assert_true(buffer.empty(), "buffer is empty after popping everything");
+}
+
+void test_buffer_pool(TestRunner& runner) {
+    BufferPool pool;
+    PooledBuffer small = pool.acquire(100);
+    runner.assert_equal((size_t) SMALL_BUFFER_SIZE, small.size(), "small request gets a small buffer");
+    PooledBuffer medium = pool.acquire(SMALL_BUFFER_SIZE + 1);
+    runner.assert_equal((size_t) MEDIUM_BUFFER_SIZE, medium.size(), "request rounds up to its size class");
+    PooledBuffer huge = pool.acquire(LARGE_BUFFER_SIZE + 1);
+    runner.assert_equal((size_t) LARGE_BUFFER_SIZE + 1, huge.size(), "oversized request is allocated exactly");
+
+    // buffers go back to the pool of the releasing thread
+    size_t free_before = BufferPool::local().get_free_bytes();
+    char* small_bytes = small.data();
+    small.release();
+    runner.assert_true(small.empty(), "released buffer is empty");
+    runner.assert_equal(free_before + SMALL_BUFFER_SIZE, BufferPool::local().get_free_bytes(), "released buffer is pooled");
+    PooledBuffer reused = BufferPool::local().acquire(10);
+    runner.assert_true(reused.data() == small_bytes, "pooled buffer is reused");
+    huge.release();
+    runner.assert_equal(free_before, BufferPool::local().get_free_bytes(), "oversized buffer is not pooled");
+
+    PooledBuffer moved = std::move(medium);
+    runner.assert_true(medium.empty() && !moved.empty(), "moving a buffer transfers it");
+
+    // a byte buffer holds no memory once everything has been consumed
+    ByteBuffer buffer;
+    buffer.append("hello", 5);
+    free_before = BufferPool::local().get_free_bytes();
+    buffer.pop(5);
+    runner.assert_equal(free_before + SMALL_BUFFER_SIZE, BufferPool::local().get_free_bytes(), "consumed byte buffer returns its storage");
+}
+
+void test_perform_io_request(TestRunner& runner) {
+    int fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+
+    char buf[16];
+    runner.assert_equal(-EAGAIN, perform_io_request(recv_request(fds[1], buf, sizeof(buf))), "recv on empty socket would block");
+    runner.assert_equal(5, perform_io_request(send_request(fds[0], "hello", 5)), "send returns bytes sent");
+    runner.assert_equal(5, perform_io_request(recv_request(fds[1], buf, sizeof(buf))), "recv returns bytes received");
+    runner.assert_equal(string("hello"), string(buf, 5), "recv reads sent bytes");
+
+    struct statx file_statx;
+    runner.assert_equal(0, perform_io_request(statx_request(".", &file_statx)), "statx of directory succeeds");
+    runner.assert_true(S_ISDIR(file_statx.stx_mode), "statx reports directory");
+    runner.assert_equal(-ENOENT, perform_io_request(statx_request("no/such/file", &file_statx)), "statx of missing file fails");
+    runner.assert_equal(-ENOENT, perform_io_request(openat_request("no/such/file", O_RDONLY)), "open of missing file fails");
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// reported_events returns the events reported for `fd` in `ready`, or 0 if it wasn't reported
+short reported_events(const vector<ReadyEvent>& ready, int fd) {
+    for (size_t i = 0; i < ready.size(); i++) {
+        if (ready[i].fd == fd) {
+            return ready[i].revents;
+        }
+    }
+    return 0;
+}
+
+void test_readiness_event_backends(TestRunner& runner) {
+    vector<EventBackendType> types = {POLL_BACKEND, EPOLL_BACKEND};
+    for (size_t i = 0; i < types.size(); i++) {
+        shared_ptr<EventBackend> backend = make_event_backend(types[i]);
+        string name = backend->name() + " ";
+        int fds[2];
+        int other[2];
+        runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+        runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, other), "socketpair succeeds");
+
+        // an fd stays registered, and is reported on every wait while it is ready
+        vector<ReadyEvent> ready;
+        runner.assert_true(backend->add(fds[1], POLLIN), name + "add socket");
+        runner.assert_true(backend->add(other[1], POLLIN), name + "add other socket");
+        backend->wait(0, ready);
+        runner.assert_equal((size_t) 0, ready.size(), name + "empty sockets are not readable");
+        runner.assert_equal(5, (int) write(fds[0], "hello", 5), "write to socket");
+        runner.assert_equal(5, (int) write(other[0], "hello", 5), "write to other socket");
+        backend->wait(1000, ready);
+        runner.assert_true(reported_events(ready, fds[1]) & POLLIN, name + "readable socket is reported");
+        runner.assert_true(reported_events(ready, other[1]) & POLLIN, name + "readable other socket is reported");
+        ready.clear();
+        backend->wait(1000, ready);
+        runner.assert_equal((size_t) 2, ready.size(), name + "readiness is level triggered");
+
+        // modify replaces the events that are watched
+        backend->modify(fds[1], POLLOUT);
+        ready.clear();
+        backend->wait(1000, ready);
+        short revents = reported_events(ready, fds[1]);
+        runner.assert_true(revents & POLLOUT, name + "modified socket is reported writable");
+        runner.assert_false(revents & POLLIN, name + "modified socket is no longer reported readable");
+
+        // a removed fd is no longer reported, while the others still are, and it can be added again
+        backend->remove(fds[1]);
+        ready.clear();
+        backend->wait(1000, ready);
+        runner.assert_equal((short) 0, reported_events(ready, fds[1]), name + "removed socket is not reported");
+        runner.assert_true(reported_events(ready, other[1]) & POLLIN, name + "other socket is still reported");
+        backend->modify(other[1], POLLOUT);
+        ready.clear();
+        backend->wait(1000, ready);
+        runner.assert_equal((short) POLLOUT, (short) (reported_events(ready, other[1]) & (POLLIN | POLLOUT)),
+                            name + "other socket can be modified after a removal");
+        runner.assert_true(backend->add(fds[1], POLLIN), name + "re-add socket");
+        ready.clear();
+        backend->wait(1000, ready);
+        runner.assert_true(reported_events(ready, fds[1]) & POLLIN, name + "re-added socket is reported");
+        backend->remove(fds[1]);
+        backend->remove(other[1]);
+
+        close(fds[0]);
+        close(fds[1]);
+        close(other[0]);
+        close(other[1]);
+    }
+
+    // epoll can't watch regular files, which the event loop then treats as always ready
+    shared_ptr<EventBackend> epoll_backend = make_event_backend(EPOLL_BACKEND);
+    int file = open("itest_files/foo.html", O_RDONLY);
+    runner.assert_false(epoll_backend->add(file, POLLIN), "epoll can't watch a regular file");
+    close(file);
+}
+
+void test_uring_event_backend(TestRunner& runner) {
+    shared_ptr<EventBackend> backend = make_event_backend(URING_BACKEND);
+    if (!backend->supports_completions()) {
+        cerr << "io_uring unavailable, skipping test_uring_event_backend" << endl;
+        return;
+    }
+
+    int fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+
+    // readiness is level triggered, so a readable fd is reported on every wait until it is drained
+    vector<ReadyEvent> ready;
+    backend->add(fds[1], POLLIN);
+    backend->wait(0, ready);
+    runner.assert_equal((size_t) 0, ready.size(), "empty socket is not readable");
+    runner.assert_equal(5, perform_io_request(send_request(fds[0], "hello", 5)), "send returns bytes sent");
+    backend->wait(1000, ready);
+    backend->wait(1000, ready);
+    runner.assert_equal((size_t) 2, ready.size(), "readable socket is reported on every wait");
+    runner.assert_equal(fds[1], ready[0].fd, "ready event has fd");
+    runner.assert_true(ready[0].revents & POLLIN, "ready event is readable");
+    backend->remove(fds[1]);
+
+    char buf[16];
+    vector<Completion> completed;
+    backend->submit(7, recv_request(fds[1], buf, sizeof(buf)));
+    while (completed.empty()) {
+        backend->wait(1000, ready);
+        backend->take_completions(completed);
+    }
+    runner.assert_equal((size_t) 1, completed.size(), "recv completes once");
+    runner.assert_equal((uint64_t) 7, completed[0].id, "completion has request id");
+    runner.assert_equal(5, completed[0].result, "completion has bytes received");
+    runner.assert_equal(string("hello"), string(buf, 5), "recv completion reads sent bytes");
+
+    // a cancelled request still completes, with -ECANCELED
+    completed.clear();
+    backend->submit(8, recv_request(fds[1], buf, sizeof(buf)));
+    backend->wait(0, ready);
+    backend->cancel(8);
+    while (completed.empty()) {
+        backend->wait(1000, ready);
+        backend->take_completions(completed);
+    }
+    runner.assert_equal((uint64_t) 8, completed[0].id, "cancelled request completes");
+    runner.assert_equal(-ECANCELED, completed[0].result, "cancelled request result");
+
+    close(fds[0]);
+    close(fds[1]);
+
+    // taking more entries than the submission queue holds submits the pending ones first
+    IoUring ring(4);
+    for (int i = 0; i < 10; i++) {
+        ring.get_sqe()->user_data = i;
+    }
+    size_t reaped = 0;
+    uint64_t user_data_sum = 0;
+    for (int i = 0; i < 10 && reaped < 10; i++) {
+        ring.enter(1000);
+        reaped += ring.reap([&](uint64_t user_data, int32_t) { user_data_sum += user_data; });
+    }
+    runner.assert_equal((size_t) 10, reaped, "every entry of an overfull submission queue completes");
+    runner.assert_equal((uint64_t) 45, user_data_sum, "each entry completes once");
+}
+
+void test_continuation(TestRunner& runner) {
+    shared_ptr<int> value = make_shared<int>(41);
+
+    size_t before = allocations;
+    Continuation<int (int)> small = [value](int x) { return *value + x; };
+    Continuation<int (int)> small_copy = small;
+    Continuation<int (int)> small_moved = std::move(small);
+    size_t small_allocations = allocations - before;
+    runner.assert_equal((size_t) 0, small_allocations, "small continuations are stored inline");
+    runner.assert_equal(42, small_copy(1), "copied continuation invokes callable");
+    runner.assert_equal(43, small_moved(2), "moved continuation invokes callable");
+    runner.assert_true(!small, "moved from continuation is empty");
+    runner.assert_throws<bad_function_call>([&]() { small(1); }, "calling a moved from continuation");
+    Continuation<int (int)> empty;
+    runner.assert_true(!empty, "default constructed continuation is empty");
+    runner.assert_throws<bad_function_call>([&]() { empty(1); }, "calling an empty continuation");
+
+    char padding[CONTINUATION_INLINE_SIZE] = {1};
+    before = allocations;
+    Continuation<int (int)> large = [value, padding](int x) { return *value + padding[0] + x; };
+    size_t large_allocations = allocations - before;
+    runner.assert_equal((size_t) 1, large_allocations, "large continuations are stored on the heap");
+    Continuation<int (int)> large_copy = large;
+    runner.assert_equal(43, large(1), "large continuation invokes callable");
+    runner.assert_equal(44, large_copy(2), "copied large continuation invokes callable");
+
+    small_copy = large;
+    runner.assert_equal(45, small_copy(3), "assigned continuation invokes new callable");
+    small_moved = Continuation<int (int)>();
+    large = Continuation<int (int)>();
+    runner.assert_equal(3l, value.use_count(), "continuations release their captures");
+}
+
+/*
+ * PingState tracks the progress of the client in test_keep_alive_allocations
+ */
+struct PingState {
+    int pings;
+    size_t allocations_after_warmup;
+    size_t allocations_after_pings;
+};
+
+#define WARMUP_PINGS (500)
+#define MEASURED_PINGS (1000)
+
+shared_ptr<Pollable> echo_server(shared_ptr<AsyncBufferedConnection> conn) {
+    return conn->read_until("\r\n\r\n", [conn](string request) -> shared_ptr<Pollable> {
+        return conn->write(request + "\r\n\r\n", [conn]() -> shared_ptr<Pollable> {
+            return echo_server(conn);
+        });
+    });
+}
+
+shared_ptr<Pollable> ping_client(shared_ptr<AsyncBufferedConnection> conn, shared_ptr<PingState> state) {
+    return conn->write("ping\r\n\r\n", [conn, state]() -> shared_ptr<Pollable> {
+        return conn->read_until("\r\n\r\n", [conn, state](string reply) -> shared_ptr<Pollable> {
+            if (reply != "ping") {
+                return shared_ptr<Pollable>();
+            }
+
+            state->pings++;
+            if (state->pings == WARMUP_PINGS) {
+                state->allocations_after_warmup = allocations;
+            } else if (state->pings == WARMUP_PINGS + MEASURED_PINGS) {
+                state->allocations_after_pings = allocations;
+                return shared_ptr<Pollable>();
+            }
+            return ping_client(conn, state);
+        });
+    });
+}
+
+void test_keep_alive_allocations(TestRunner& runner) {
+    int fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+
+    // the messages fit in std::string's small buffer, so any allocation would come from the connection
+    // and event loop machinery itself rather than from the data
+    struct in_addr addr;
+    addr.s_addr = 0;
+    shared_ptr<AsyncBufferedConnection> server = make_shared<AsyncBufferedConnection>(make_shared<AsyncSocketConnection>(fds[1], addr));
+    shared_ptr<AsyncBufferedConnection> client = make_shared<AsyncBufferedConnection>(make_shared<AsyncSocketConnection>(fds[0], addr));
+    shared_ptr<PingState> state = make_shared<PingState>(PingState{0, 0, 0});
+
+    AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+    loop.register_pollable(echo_server(server));
+    loop.register_pollable(ping_client(client, state));
+    server.reset();
+    client.reset();
+    loop.loop();
+
+    runner.assert_equal(WARMUP_PINGS + MEASURED_PINGS, state->pings, "every ping is echoed");
+    size_t steady_state_allocations = state->allocations_after_pings - state->allocations_after_warmup;
+    runner.assert_equal((size_t) 0, steady_state_allocations, "keep-alive read/write cycles don't allocate in steady state");
+}
+
+shared_ptr<Pollable> increment_now(int value, Callback<int>::F callback) {
+    return callback(value + 1);
+}
+
+/*
+ * CountingCoroutine awaits a synchronously completing operation `target` times and then
+ * echoes a line over its connection, to exercise both ways that CO_AWAIT can resume.
+ */
+class CountingCoroutine : public AsyncCoroutine {
+    shared_ptr<AsyncBufferedConnection> conn;
+    int target;
+
+public:
+    int count;
+    string line;
+    bool finished;
+
+    CountingCoroutine(shared_ptr<AsyncBufferedConnection> conn, int target)
+            : conn(conn), target(target), count(0), finished(false) {}
+
+protected:
+    virtual shared_ptr<Pollable> body() {
+        CO_BEGIN
+
+        while (count < target) {
+            CO_AWAIT(increment_now(count, resume_with(count)));
+        }
+
+        CO_AWAIT(conn->read_until("\n", resume_with(line)));
+        CO_AWAIT(conn->write(line + "\n", resume_with()));
+        finished = true;
+
+        CO_END
+    }
+};
+
+// increment_leaving_work completes right away, but returns more work for the event loop anyway
+shared_ptr<Pollable> increment_leaving_work(int value, Callback<int>::F callback, shared_ptr<Pollable> work) {
+    callback(value + 1);
+    return work;
+}
+
+/*
+ * LeakingCoroutine awaits an operation that completes synchronously but still returns `leftover`,
+ * which CO_AWAIT would otherwise drop.
+ */
+class LeakingCoroutine : public AsyncCoroutine {
+    shared_ptr<Pollable> leftover;
+    int value;
+
+protected:
+    virtual shared_ptr<Pollable> body() {
+        CO_BEGIN
+        CO_AWAIT(increment_leaving_work(value, resume_with(value), leftover));
+        CO_END
+    }
+
+public:
+    LeakingCoroutine(shared_ptr<Pollable> leftover) : leftover(leftover), value(0) {}
+};
+
+void test_async_coroutine(TestRunner& runner) {
+    int fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+
+    struct in_addr addr;
+    addr.s_addr = 0;
+    shared_ptr<AsyncBufferedConnection> conn = make_shared<AsyncBufferedConnection>(make_shared<AsyncSocketConnection>(fds[1], addr));
+
+    // a million synchronous completions would overflow the stack if each one recursed into the coroutine
+    shared_ptr<CountingCoroutine> coroutine = make_shared<CountingCoroutine>(conn, 1000000);
+    shared_ptr<Pollable> pollable = coroutine->start();
+    runner.assert_equal(1000000, coroutine->count, "coroutine continues through synchronous completions");
+    runner.assert_true(pollable != NULL, "coroutine suspends on pending read");
+    runner.assert_true(!coroutine->finished, "suspended coroutine is not finished");
+
+    AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+    loop.register_pollable(pollable);
+    runner.assert_equal(6, (int) write(fds[0], "hello\n", 6), "write to coroutine's connection");
+    loop.loop();
+
+    char buf[16];
+    runner.assert_equal(6, (int) read(fds[0], buf, sizeof(buf)), "read echo from coroutine");
+    runner.assert_equal(string("hello"), coroutine->line, "coroutine resumes with read result");
+    runner.assert_true(coroutine->finished, "coroutine runs to completion");
+
+    // an operation that completed has nothing left to wait on, so a pollable it returns can't be dropped quietly
+    shared_ptr<LeakingCoroutine> leaking = make_shared<LeakingCoroutine>(make_runnable([]() -> shared_ptr<Pollable> {
+        return shared_ptr<Pollable>();
+    }));
+    runner.assert_throws<logic_error>([&]() { leaking->start(); }, "completed operation that returns a pollable");
+
+    close(fds[0]);
+}
+
+void test_histogram(TestRunner& runner) {
+    Histogram histogram;
+    histogram.record(0);
+    for (uint64_t i = 1; i <= 100; i++) {
+        histogram.record(i);
+    }
+
+    HistogramSnapshot snapshot = histogram.snapshot();
+    runner.assert_equal((uint64_t) 101, snapshot.count, "histogram counts every value");
+    runner.assert_equal((uint64_t) 5050, snapshot.sum, "histogram sums every value");
+    runner.assert_equal((uint64_t) 100, snapshot.max, "histogram tracks max");
+    runner.assert_equal((uint64_t) 1, snapshot.buckets[0], "zero has its own bucket");
+    runner.assert_equal((uint64_t) 1, snapshot.buckets[1], "bucket 1 holds 1");
+    runner.assert_equal((uint64_t) 2, snapshot.buckets[2], "bucket 2 holds 2 and 3");
+    runner.assert_equal((uint64_t) 37, snapshot.buckets[7], "bucket 7 holds 64 to 100");
+    runner.assert_equal((uint64_t) 63, snapshot.percentile(0.5), "p50 is bounded by its bucket");
+    runner.assert_equal((uint64_t) 100, snapshot.percentile(0.99), "p99 is bounded by max");
+    runner.assert_equal((uint64_t) 0, snapshot.percentile(0), "p0 is the smallest bucket");
+
+    Histogram other;
+    other.record(1000);
+    snapshot.merge(other.snapshot());
+    runner.assert_equal((uint64_t) 102, snapshot.count, "merged histogram count");
+    runner.assert_equal((uint64_t) 1000, snapshot.max, "merged histogram max");
+    runner.assert_equal((uint64_t) 1, snapshot.buckets[10], "merged histogram bucket");
+}
+
+/*
+ * IdlePollable waits on an fd that never becomes ready, so it is only ever removed by its deadline.
+ */
+class IdlePollable : public Pollable {
+    int fd;
+    steady_clock::time_point deadline;
+
+public:
+    bool cancelled;
+
+    IdlePollable(int fd, steady_clock::time_point deadline) : fd(fd), deadline(deadline), cancelled(false) {}
+
+    virtual int get_fd() { return fd; }
+    virtual short get_events() { return POLLIN; }
+    virtual bool is_done() { return false; }
+    virtual steady_clock::time_point get_deadline() { return deadline; }
+    virtual shared_ptr<Pollable> notify(short) { return shared_ptr<Pollable>(); }
+    virtual void cancel() { cancelled = true; }
+};
+
+void test_event_loop_stats(TestRunner& runner) {
+    int fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+    int idle_fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, idle_fds), "socketpair succeeds");
+
+    struct in_addr addr;
+    addr.s_addr = 0;
+    shared_ptr<AsyncBufferedConnection> conn = make_shared<AsyncBufferedConnection>(make_shared<AsyncSocketConnection>(fds[1], addr));
+    shared_ptr<CountingCoroutine> coroutine = make_shared<CountingCoroutine>(conn, 0);
+    shared_ptr<IdlePollable> idle = make_shared<IdlePollable>(idle_fds[1], steady_clock::now() + chrono::milliseconds(10));
+
+    AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+    EventLoopStatsSnapshot before = snapshot_event_loop_stats();
+    loop.register_pollable(coroutine->start());
+    loop.register_pollable(idle);
+    runner.assert_equal(6, (int) write(fds[0], "hello\n", 6), "write to coroutine's connection");
+    loop.loop();
+
+    EventLoopStatsSnapshot stats = loop.get_stats().snapshot();
+    runner.assert_true(coroutine->finished, "coroutine runs to completion");
+    runner.assert_true(idle->cancelled, "idle pollable is cancelled by its deadline");
+    runner.assert_equal((uint64_t) 1, stats.expired, "loop counts expired pollable");
+    runner.assert_true(stats.notifications >= 1, "loop counts read notification");
+    runner.assert_equal(stats.notifications, stats.callback_ns.count, "every notification is timed");
+    runner.assert_true(stats.iterations >= 2, "loop counts iterations");
+    runner.assert_equal(stats.iterations, stats.busy_ns.count, "every iteration is timed");
+    runner.assert_equal(stats.iterations, stats.wait_ns.count, "every wait is timed");
+    runner.assert_true(stats.wait_ns.sum >= 5000000, "loop waits for the idle deadline");
+    runner.assert_true(stats.ready_per_wait.max >= 1, "loop counts ready fds");
+    runner.assert_equal((uint64_t) 0, stats.pollables, "no pollables are left");
+
+    // the process wide snapshot includes every live loop
+    EventLoopStatsSnapshot after = snapshot_event_loop_stats();
+    runner.assert_equal(before.loops, after.loops, "process snapshot counts live loops");
+    runner.assert_equal(before.iterations + stats.iterations, after.iterations, "process snapshot merges iterations");
+
+    close(fds[0]);
+    close(idle_fds[0]);
+    close(idle_fds[1]);
+}
+
+void test_stats_dump_wakes_idle_loop(TestRunner& runner) {
+    int idle_fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, idle_fds), "socketpair succeeds");
+    shared_ptr<IdlePollable> idle = make_shared<IdlePollable>(idle_fds[1], steady_clock::now() + chrono::seconds(10));
+
+    CapturedStderr dump;
+    install_stats_dump_handler(SIGUSR1);
+    AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+    loop.register_pollable(idle);
+    std::thread looper([&]() { loop.loop(); });
+
+    // the signal goes to this thread rather than the loop's, which would otherwise sleep until the deadline
+    std::this_thread::sleep_for(chrono::milliseconds(50));
+    uint64_t iterations = loop.get_stats().snapshot().iterations;
+    raise(SIGUSR1);
+    for (int i = 0; i < 100 && loop.get_stats().snapshot().iterations == iterations; i++) {
+        std::this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    runner.assert_true(loop.get_stats().snapshot().iterations > iterations, "stats dump wakes an idle loop");
+    runner.assert_false(take_stats_dump_request(), "woken loop takes the dump request");
+
+    runner.assert_equal(1, (int) write(idle_fds[0], "x", 1), "write to idle connection");
+    looper.join();
+    signal(SIGUSR1, SIG_DFL);
+    runner.assert_true(dump.text().find("event loops: ") != string::npos, "woken loop dumps the stats");
+    close(idle_fds[0]);
+    close(idle_fds[1]);
+}
+
+// parse_async_args parses `args` like httpd's thread model arguments
+AsyncOptions parse_async_args(vector<string> args) {
+    vector<char*> argv;
+    for (size_t i = 0; i < args.size(); i++) {
+        argv.push_back(&args[i][0]);
+    }
+    return parse_async_options((int) argv.size(), argv.data());
+}
+
+void test_multi_reactor_async_server(TestRunner& runner) {
+    // "async N" runs N reactors, and the backend and accept budget can follow it
+    runner.assert_equal(1, parse_async_args({"async"}).reactors, "async runs one reactor by default");
+    runner.assert_equal(1, parse_async_args({"pool", "4"}).reactors, "other thread models run one reactor");
+    AsyncOptions options = parse_async_args({"async", "4", "poll", "16", "zerocopy"});
+    runner.assert_equal(4, options.reactors, "async N runs N reactors");
+    runner.assert_equal((int) POLL_BACKEND, (int) options.backend, "backend follows the reactors");
+    runner.assert_equal(16, options.accept_budget, "accept budget follows the backend");
+    runner.assert_equal((size_t) DEFAULT_ZEROCOPY_THRESHOLD, (size_t) options.limits.output.zerocopy_threshold, "zerocopy ends the options");
+    runner.assert_equal((int) EPOLL_BACKEND, (int) parse_async_args({"async", "epoll"}).backend, "reactors can be left out");
+    runner.assert_throws<invalid_argument>([]() { parse_async_args({"async", "0"}); }, "async 0 is rejected");
+    runner.assert_throws<invalid_argument>([]() { parse_async_args({"async", "-2"}); }, "negative reactors are rejected");
+
+    uint16_t port;
+    {
+        AsyncSocketListener probe(0);
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        runner.assert_equal(0, getsockname(probe.get_fd(), (struct sockaddr*) &addr, &addr_len), "getsockname succeeds");
+        port = ntohs(addr.sin_port);
+    }
+
+    // every reactor binds a SO_REUSEPORT listener of its own to the port up front
+    shared_ptr<AsyncHttpRequestHandler> handler = make_shared<TestAsyncHttpRequestHandler>();
+    MultiReactorAsyncHttpServer server(port, 3, handler);
+    AsyncSocketListener shared(port, true);
+    shared.listen();
+    runner.assert_throws<ListenerError>([&]() { AsyncSocketListener exclusive(port); }, "reactors' port can't be bound without SO_REUSEPORT");
+    runner.assert_throws<invalid_argument>([&]() { MultiReactorAsyncHttpServer(port, 0, handler); }, "server without reactors is rejected");
+    runner.assert_throws<invalid_argument>([&]() { MultiReactorAsyncHttpServer(port, -1, handler); }, "server with negative reactors is rejected");
+}
+
+void test_reuse_port_listeners(TestRunner& runner) {
+    uint16_t port;
+    {
+        AsyncSocketListener probe(0);
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        runner.assert_equal(0, getsockname(probe.get_fd(), (struct sockaddr*) &addr, &addr_len), "getsockname succeeds");
+        port = ntohs(addr.sin_port);
+    }
+
+    // every worker binds a listener of its own to the same port
+    SocketListener first(port, true);
+    SocketListener second(port, true);
+    first.listen();
+    second.listen();
+    bool rejected = false;
+    try {
+        SocketListener exclusive(port);
+    } catch (ListenerError&) {
+        rejected = true;
+    }
+    runner.assert_true(rejected, "listener without SO_REUSEPORT can't share the port");
+
+    shared_ptr<HttpConnectionHandler> handler = make_shared<BlockingHttpConnectionHandler>(
+            make_shared<MockHttpRequestHandler>(make_response(OK_STATUS)));
+    runner.assert_throws<invalid_argument>([&](){ MultiListenerHttpServer(port, 0, handler); }, "server without workers is rejected");
+}
+
+void test_batched_accept(TestRunner& runner) {
+    shared_ptr<AsyncSocketListener> listener = make_shared<AsyncSocketListener>(0);
+    listener->listen();
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    runner.assert_equal(0, getsockname(listener->get_fd(), (struct sockaddr*) &addr, &addr_len), "getsockname succeeds");
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    runner.assert_true(listener->accept() == NULL, "accept returns null without pending connections");
+
+    vector<int> clients;
+    for (int i = 0; i < 5; i++) {
+        int client = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+        runner.assert_equal(0, connect(client, (struct sockaddr*) &addr, sizeof(addr)), "client connects");
+        clients.push_back(client);
+    }
+
+    AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+    int accepted = 0;
+    shared_ptr<Pollable> pollable = make_pollable(loop, listener, [&](shared_ptr<AsyncSocketConnection>) -> shared_ptr<Pollable> {
+        accepted++;
+        return shared_ptr<Pollable>();
+    }, 2);
+
+    // the backlog is drained two connections at a time until it is empty
+    pollable->notify(POLLIN);
+    runner.assert_equal(2, accepted, "first wakeup accepts up to the budget");
+    pollable->notify(POLLIN);
+    runner.assert_equal(4, accepted, "second wakeup accepts up to the budget");
+    pollable->notify(POLLIN);
+    runner.assert_equal(5, accepted, "third wakeup accepts the rest of the backlog");
+
+    HistogramSnapshot accepts = loop.get_stats().snapshot().accepts_per_wakeup;
+    runner.assert_equal((uint64_t) 3, accepts.count, "every wakeup is recorded");
+    runner.assert_equal((uint64_t) 5, accepts.sum, "every accept is recorded");
+    runner.assert_equal((uint64_t) 2, accepts.max, "accepts per wakeup are bounded by the budget");
+
+    // once the process is out of descriptors, the listener backs off instead of failing for good
+    int client = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    runner.assert_equal(0, connect(client, (struct sockaddr*) &addr, sizeof(addr)), "client connects");
+    clients.push_back(client);
+    struct rlimit original;
+    getrlimit(RLIMIT_NOFILE, &original);
+    struct rlimit lowered = original;
+    lowered.rlim_cur = (rlim_t) (client + 8);
+    setrlimit(RLIMIT_NOFILE, &lowered);
+    vector<int> filler;
+    int fd;
+    while ((fd = dup(client)) >= 0) {
+        filler.push_back(fd);
+    }
+
+    CapturedStderr warning;
+    runner.assert_true(pollable->notify(POLLIN) == pollable, "listener re-registers itself when out of descriptors");
+    runner.assert_equal(string("warning: accept() failed: ") + strerror(EMFILE) + "\n", warning.text(), "listener warns that it is out of descriptors");
+    runner.assert_true(listener->out_of_resources(), "listener reports running out of descriptors");
+    runner.assert_equal((short) 0, pollable->get_events(), "paused listener waits for nothing");
+    runner.assert_true(pollable->get_deadline() != NO_DEADLINE, "paused listener has a deadline to resume at");
+    runner.assert_false(pollable->is_done(), "paused listener stays registered");
+
+    for (size_t i = 0; i < filler.size(); i++) {
+        close(filler[i]);
+    }
+    setrlimit(RLIMIT_NOFILE, &original);
+    runner.assert_true(pollable->expire() == pollable, "listener resumes after its backoff");
+    runner.assert_equal((short) POLLIN, pollable->get_events(), "resumed listener waits for connections");
+    runner.assert_true(pollable->get_deadline() == NO_DEADLINE, "resumed listener has no deadline");
+    pollable->notify(POLLIN);
+    runner.assert_equal(6, accepted, "connection left in the backlog is accepted after the backoff");
+    runner.assert_false(listener->out_of_resources(), "listener has resources again");
+
+    for (size_t i = 0; i < clients.size(); i++) {
+        close(clients[i]);
+    }
+}
+
+/*
+ * serve_pipelined sends `requests` pipelined requests to a connection served with `request_budget`
+ * and returns the number of event loop iterations it took to answer them all.
+ */
+uint64_t serve_pipelined(TestRunner& runner, int requests, int request_budget) {
+    int fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+
+    string pipelined;
+    for (int i = 0; i < requests; i++) {
+        pipelined += "GET / HTTP/1.1\r\nHost: a\r\n\r\n";
+    }
+    runner.assert_equal((int) pipelined.size(), (int) write(fds[0], pipelined.data(), pipelined.size()), "write pipelined requests");
+    shutdown(fds[0], SHUT_WR);
+
+    struct in_addr addr;
+    addr.s_addr = 0;
+    shared_ptr<AsyncHttpConnection> http_conn = make_shared<AsyncHttpConnection>(make_shared<AsyncSocketConnection>(fds[1], addr));
+    AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+    loop.register_pollable(handle_http_connection(loop, http_conn, make_shared<TestAsyncHttpRequestHandler>(), request_budget));
+    http_conn.reset();
+    loop.loop();
+
+    string responses;
+    char buf[4096];
+    ssize_t len;
+    while ((len = read(fds[0], buf, sizeof(buf))) > 0) {
+        responses.append(buf, len);
+    }
+    close(fds[0]);
+
+    int answered = 0;
+    for (size_t pos = responses.find("HTTP/1.1 403"); pos != string::npos; pos = responses.find("HTTP/1.1 403", pos + 1)) {
+        answered++;
+    }
+    runner.assert_equal(requests, answered, "every pipelined request is answered");
+    return loop.get_stats().snapshot().iterations;
+}
+
+void test_connection_request_budget(TestRunner& runner) {
+    uint64_t unlimited = serve_pipelined(runner, 20, 1000);
+    uint64_t budgeted = serve_pipelined(runner, 20, 4);
+
+    // a budget of 4 yields to the loop after the 4th, 8th, 12th, 16th and 20th requests
+    runner.assert_equal(unlimited + 5, budgeted, "connection yields to the loop when its budget is used up");
+}
+
+void test_offload(TestRunner& runner) {
+    std::thread::id loop_thread = std::this_thread::get_id();
+    std::thread::id work_thread = loop_thread;
+    std::thread::id callback_thread;
+    bool finished = false;
+
+    AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+    loop.register_pollable(offload([&]() {
+        work_thread = std::this_thread::get_id();
+    }, [&]() -> shared_ptr<Pollable> {
+        callback_thread = std::this_thread::get_id();
+        finished = true;
+        return shared_ptr<Pollable>();
+    }));
+    loop.loop();
+
+    runner.assert_true(finished, "offloaded work completes");
+    runner.assert_true(work_thread != loop_thread, "offloaded work runs off the event loop");
+    runner.assert_true(callback_thread == loop_thread, "offload callback runs on the event loop");
+
+    // without io_uring, file system requests are offloaded too
+    string contents;
+    shared_ptr<AsyncFileRepository> repository = make_shared<DirectoryAsyncFileRepository>("itest_files");
+    loop.register_pollable(repository->read_file("/foo.html", [&](shared_ptr<AsyncFile> file) -> shared_ptr<Pollable> {
+        return file->read_contents([&](string file_contents) -> shared_ptr<Pollable> {
+            contents = file_contents;
+            return shared_ptr<Pollable>();
+        });
+    }));
+    loop.loop();
+
+    runner.assert_equal((size_t) 37, contents.size(), "offloaded file read returns contents");
+    runner.assert_true(loop.get_stats().snapshot().completions >= 4, "offloaded requests complete on the loop");
+}
+
+void test_sendfile_response(TestRunner& runner) {
+    AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+    shared_ptr<AsyncHttpRequestHandler> handler = make_shared<FileServingAsyncHttpRequestHandler>(
+            make_shared<DirectoryAsyncFileRepository>("itest_files"));
+
+    // small files are read into memory, large ones are left in the file for sendfile()
+    HttpResponse small_response;
+    HttpResponse large_response;
+    HttpRequest request = HttpRequest{"GET", "/foo.html", HTTP_VERSION_1_1, vector<HttpHeader>(), "", {0}};
+    loop.register_pollable(handler->handle_request(request, [&](HttpResponse response) -> shared_ptr<Pollable> {
+        small_response = response;
+        return shared_ptr<Pollable>();
+    }));
+    request.uri = "/cat.png";
+    loop.register_pollable(handler->handle_request(request, [&](HttpResponse response) -> shared_ptr<Pollable> {
+        large_response = response;
+        return shared_ptr<Pollable>();
+    }));
+    loop.loop();
+
+    runner.assert_equal((size_t) 37, small_response.body.size(), "small file is read into the body");
+    runner.assert_true(small_response.body_source == NULL, "small file is not sent with sendfile");
+    runner.assert_equal(string(""), large_response.body, "large file is not read into the body");
+    runner.assert_true(dynamic_pointer_cast<FileBody>(large_response.body_source) != NULL, "large file is sent with sendfile");
+    runner.assert_equal((size_t) 994348, large_response.body_source->size(), "large file body covers the whole file");
+    runner.assert_equal(string("994348"), get_header(large_response.headers, "Content-Length").value, "large file content length");
+
+    // serve it over a connection, with the client reading on another thread since it doesn't fit in the socket buffer
+    int fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+    fcntl(fds[0], F_SETFL, 0);
+    string get = "GET /cat.png HTTP/1.1\r\nHost: a\r\n\r\n";
+    runner.assert_equal((int) get.size(), (int) write(fds[0], get.data(), get.size()), "write request");
+    shutdown(fds[0], SHUT_WR);
+
+    string received;
+    std::thread client([&]() {
+        char buf[4096];
+        ssize_t len;
+        while ((len = read(fds[0], buf, sizeof(buf))) > 0) {
+            received.append(buf, len);
+        }
+    });
+
+    struct in_addr addr;
+    addr.s_addr = 0;
+    shared_ptr<AsyncHttpConnection> http_conn = make_shared<AsyncHttpConnection>(make_shared<AsyncSocketConnection>(fds[1], addr));
+    loop.register_pollable(handle_http_connection(loop, http_conn, handler, DEFAULT_REQUEST_BUDGET));
+    http_conn.reset();
+    loop.loop();
+    client.join();
+    close(fds[0]);
+
+    string contents = DirectoryFileRepository("itest_files").get_file("/cat.png")->contents();
+    size_t body_pos = received.find("\r\n\r\n");
+    runner.assert_true(received.find("HTTP/1.1 200 OK") == 0, "sendfile response has a status line");
+    runner.assert_true(body_pos != string::npos && received.substr(body_pos + 4) == contents, "sendfile response body matches the file");
+}
+
+void test_scatter_gather_write(TestRunner& runner) {
+    vector<string> parts = {"head", "", "body"};
+    vector<struct iovec> iov;
+    runner.assert_equal((size_t) 8, remaining_iovecs(parts, 0, iov), "iovecs cover every part");
+    runner.assert_equal((size_t) 2, iov.size(), "empty parts are skipped");
+    runner.assert_equal((size_t) 5, remaining_iovecs(parts, 3, iov), "iovecs resume within a part");
+    runner.assert_equal(string("d"), string((char*) iov[0].iov_base, iov[0].iov_len), "first iovec starts at the offset");
+    runner.assert_equal((size_t) 2, remaining_iovecs(parts, 6, iov), "iovecs resume in a later part");
+    runner.assert_equal((size_t) 0, remaining_iovecs(parts, 8, iov), "nothing remains once everything is sent");
+
+    // the parts are larger than the socket buffer, so the async write has to resume after partial sends
+    string head(100000, 'h');
+    string body(3000000, 'b');
+    int fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+    fcntl(fds[0], F_SETFL, 0);
+
+    string received;
+    std::thread client([&]() {
+        char buf[65536];
+        ssize_t len;
+        while ((len = read(fds[0], buf, sizeof(buf))) > 0) {
+            received.append(buf, len);
+        }
+    });
+
+    bool written = false;
+    {
+        struct in_addr addr;
+        addr.s_addr = 0;
+        AsyncSocketConnection conn(fds[1], addr);
+        vector<string> async_parts = {head, body};
+        AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+        loop.register_pollable(conn.writev(async_parts, [&]() -> shared_ptr<Pollable> {
+            written = true;
+            return shared_ptr<Pollable>();
+        }));
+        loop.loop();
+    }
+    client.join();
+    close(fds[0]);
+
+    runner.assert_true(written, "async writev completes");
+    runner.assert_true(received == head + body, "async writev sends every part in order");
+
+    // the blocking SocketConnection sends the same parts in full
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds), "socketpair succeeds");
+    received = "";
+    std::thread sync_client([&]() {
+        char buf[65536];
+        ssize_t len;
+        while ((len = read(fds[0], buf, sizeof(buf))) > 0) {
+            received.append(buf, len);
+        }
+    });
+    {
+        struct in_addr addr;
+        addr.s_addr = 0;
+        SocketConnection conn(fds[1], addr);
+        conn.writev(vector<string>{head, body});
+    }
+    sync_client.join();
+    close(fds[0]);
+
+    runner.assert_true(received == head + body, "writev sends every part in order");
+}
+
+void test_pipelined_response_coalescing(TestRunner& runner) {
+    int fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+    string pipelined = "GET /a HTTP/1.1\r\nHost: a\r\n\r\nGET /b HTTP/1.1\r\nHost: b\r\n\r\n";
+    runner.assert_equal((int) pipelined.size(), (int) write(fds[0], pipelined.data(), pipelined.size()), "write pipelined requests");
+
+    struct in_addr addr;
+    addr.s_addr = 0;
+    AsyncHttpConnection http_conn(make_shared<AsyncSocketConnection>(fds[1], addr));
+    AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+    HttpResponse first = ok_response("first", "text/plain", system_clock::time_point());
+    HttpResponse second = ok_response("second", "text/plain", system_clock::time_point());
+    bool queued_first = false;
+    bool queued_second = true;
+    bool written = false;
+
+    loop.register_pollable(http_conn.read_request([&](HttpRequest) -> shared_ptr<Pollable> {
+        queued_first = http_conn.queue_response(first);
+        return http_conn.read_request([&](HttpRequest) -> shared_ptr<Pollable> {
+            queued_second = http_conn.queue_response(second);
+            return http_conn.write_response(second, [&]() -> shared_ptr<Pollable> {
+                written = true;
+                return shared_ptr<Pollable>();
+            });
+        });
+    }));
+    loop.loop();
+
+    runner.assert_true(queued_first, "response is queued while the next request is buffered");
+    runner.assert_true(!queued_second, "response to the last buffered request is not queued");
+    runner.assert_true(written, "queued responses are written");
+
+    char buf[4096];
+    ssize_t len = read(fds[0], buf, sizeof(buf));
+    runner.assert_equal(first.pack().serialize() + second.pack().serialize(), string(buf, len > 0 ? len : 0), "queued responses are sent in order");
+    close(fds[0]);
+}
+
+/*
+ * counting_body returns a GeneratorBody of `size` bytes that counts how many chunks it is asked for.
+ * If `short_by` is non zero, it ends that many bytes early.
+ */
+shared_ptr<BodySource> counting_body(size_t size, int& chunks, size_t short_by=0) {
+    shared_ptr<size_t> produced = make_shared<size_t>(0);
+    return make_shared<GeneratorBody>(size, [=, &chunks](size_t max) -> string {
+        chunks++;
+        size_t len = std::min(max, size - short_by - *produced);
+        *produced += len;
+        return string(len, 'g');
+    });
+}
+
+void test_body_sources(TestRunner& runner) {
+    StringBody string_body("hello world");
+    runner.assert_equal((size_t) 11, string_body.size(), "string body size");
+    runner.assert_equal(string("hello"), string_body.read_chunk(5), "string body first chunk");
+    runner.assert_equal(string(" world"), string_body.read_chunk(100), "string body last chunk");
+    runner.assert_equal(string(""), string_body.read_chunk(100), "string body is exhausted");
+
+    shared_ptr<BodySource> file_body = DirectoryFileRepository("itest_files").get_file("/foo.html")->open_contents();
+    runner.assert_equal((size_t) 37, file_body->size(), "file body size");
+    string file_contents = file_body->read_chunk(30);
+    file_contents += file_body->read_chunk(30);
+    runner.assert_equal(DirectoryFileRepository("itest_files").get_file("/foo.html")->contents(), file_contents, "file body reads the file");
+    runner.assert_equal(string(""), file_body->read_chunk(30), "file body is exhausted");
+    runner.assert_true(DirectoryFileRepository("itest_files").get_file("/nope") == NULL, "missing file");
+
+    // the synchronous file server streams large files instead of reading them into memory
+    HttpRequest request = HttpRequest{"GET", "/cat.png", HTTP_VERSION_1_1, vector<HttpHeader>{{"Host", "a"}}, "", {0}};
+    HttpResponse response = FileServingHttpHandler(make_shared<DirectoryFileRepository>("itest_files")).handle_request(request);
+    runner.assert_equal(string(""), response.body, "large file is not read into the body");
+    runner.assert_equal((size_t) 994348, response.body_source->size(), "large file is streamed");
+
+    // the synchronous connection streams the body a chunk at a time
+    int chunks = 0;
+    size_t size = 2 * STREAM_CHUNK_SIZE + 10;
+    shared_ptr<MockConnection> mock_conn = make_shared<MockConnection>("");
+    HttpConnection http_conn(mock_conn);
+    response = ok_stream_response(counting_body(size, chunks), "text/plain", system_clock::time_point());
+    http_conn.write_response(response);
+    runner.assert_equal(response.pack_headers() + string(size, 'g'), mock_conn->written(), "streamed response is written");
+    runner.assert_equal(3, chunks, "body is read a chunk at a time");
+    runner.assert_equal(4, mock_conn->writes(), "headers and each chunk are written separately");
+
+    // and so does the async connection, with a client reading on another thread
+    int fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+    fcntl(fds[0], F_SETFL, 0);
+    string received;
+    std::thread client([&]() {
+        char buf[65536];
+        ssize_t len;
+        while ((len = read(fds[0], buf, sizeof(buf))) > 0) {
+            received.append(buf, len);
+        }
+    });
+
+    chunks = 0;
+    size = 40 * STREAM_CHUNK_SIZE;
+    bool written = false;
+    bool short_written = false;
+    CapturedStderr early_end;
+    {
+        struct in_addr addr;
+        addr.s_addr = 0;
+        AsyncHttpConnection async_conn(make_shared<AsyncSocketConnection>(fds[1], addr));
+        AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+        response = ok_stream_response(counting_body(size, chunks), "text/plain", system_clock::time_point());
+        loop.register_pollable(async_conn.write_response(response, [&]() -> shared_ptr<Pollable> {
+            written = true;
+            int short_chunks = 0;
+            HttpResponse short_response = ok_stream_response(counting_body(100, short_chunks, 50), "text/plain", system_clock::time_point());
+            return async_conn.write_response(short_response, [&]() -> shared_ptr<Pollable> {
+                short_written = true;
+                return shared_ptr<Pollable>();
+            });
+        }));
+        loop.loop();
+    }
+    client.join();
+    close(fds[0]);
+
+    runner.assert_true(written, "streamed async response is written");
+    runner.assert_equal(40, chunks, "async body is read a chunk at a time");
+    runner.assert_true(received.find(response.pack_headers() + string(size, 'g')) == 0, "streamed async response is sent");
+    runner.assert_true(!short_written, "connection is dropped when a body ends early");
+    runner.assert_equal(string("response body ended 50 bytes early\n"), early_end.text(), "body that ends early is reported");
+}
+
+/*
+ * StubDnsServer answers A queries on a UDP socket bound to 127.0.0.1 from a background thread.
+ * Domains in `addresses` are answered with their addresses and any others with NXDOMAIN, except that
+ * the first `drops` queries for a domain are ignored, and "silent.test" is never answered at all.
+ */
+class StubDnsServer {
+    int sock;
+    std::atomic<bool> stopped;
+    std::thread thread;
+
+    static string query_domain(const string& query) {
+        string domain;
+        for (size_t pos = 12; pos < query.size() && query[pos] != 0; pos += 1 + query[pos]) {
+            domain += (domain.empty() ? "" : ".") + query.substr(pos + 1, query[pos]);
+        }
+        return domain;
+    }
+
+    string respond(const string& query) {
+        string domain = query_domain(query);
+        string response = query;
+        if (addresses.count(domain) == 0) {
+            response[2] = (char) 0x81;
+            response[3] = (char) 0x83;
+            return response;
+        }
+
+        response[2] = (char) 0x81;
+        response[3] = (char) 0x80;
+        response[7] = (char) addresses[domain].size();
+        for (size_t i = 0; i < addresses[domain].size(); i++) {
+            // a compressed name pointing back to the question, type A, class IN, ttl and the address
+            response += string("\xC0\x0C\x00\x01\x00\x01\x00\x00\x00\x3C\x00\x04", 12);
+            response += string((const char*) &addresses[domain][i], sizeof(struct in_addr));
+        }
+        return response;
+    }
+
+    void serve() {
+        char buf[512];
+        while (!stopped) {
+            struct sockaddr_in client;
+            socklen_t client_len = sizeof(client);
+            ssize_t len = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr*) &client, &client_len);
+            if (len <= 0) {
+                continue;
+            }
+
+            string query(buf, len);
+            string domain = query_domain(query);
+            if (queries[domain]++ < drops[domain] || domain == "silent.test") {
+                continue;
+            }
+            string response = respond(query);
+            sendto(sock, response.data(), response.size(), 0, (struct sockaddr*) &client, client_len);
+        }
+    }
+
+public:
+    unordered_map<string, vector<struct in_addr>> addresses;
+    unordered_map<string, int> drops;
+    unordered_map<string, int> queries;
+    struct sockaddr_in address;
+
+    StubDnsServer(unordered_map<string, vector<struct in_addr>> addresses, unordered_map<string, int> drops)
+            : stopped(false), addresses(addresses), drops(drops) {
+        sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        struct timeval poll_interval = {0, 10000};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &poll_interval, sizeof(poll_interval));
+
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr = parse_ip("127.0.0.1");
+        bind(sock, (struct sockaddr*) &address, sizeof(address));
+        socklen_t address_len = sizeof(address);
+        getsockname(sock, (struct sockaddr*) &address, &address_len);
+
+        thread = std::thread([this]() { serve(); });
+    }
+
+    ~StubDnsServer() {
+        stop();
+        close(sock);
+    }
+
+    void stop() {
+        if (!stopped) {
+            stopped = true;
+            thread.join();
+        }
+    }
+};
+
+void test_async_dns_client(TestRunner& runner) {
+    vector<struct in_addr> foo_addresses = {parse_ip("1.2.3.4"), parse_ip("5.6.7.8")};
+    StubDnsServer server({{"foo.test", foo_addresses}, {"retry.test", {parse_ip("9.9.9.9")}}}, {{"retry.test", 1}});
+
+    // every lookup is in flight at once, and the unanswered ones are retried each attempt
+    vector<DnsAnswer> answers;
+    unordered_map<string, vector<struct in_addr>> hosts{{"hosted.test", {parse_ip("127.0.0.2")}}};
+    AsyncDnsClient client(server.address, chrono::milliseconds(50), 3, hosts);
+    AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+    steady_clock::time_point start = steady_clock::now();
+    loop.register_pollable(client.lookup({"foo.test", "missing.test", "retry.test", "silent.test", "10.0.0.1", "bad..test", "Hosted.Test."},
+                                         [&](vector<DnsAnswer> results) -> shared_ptr<Pollable> {
+        answers = results;
+        return shared_ptr<Pollable>();
+    }));
+    loop.loop();
+    chrono::milliseconds elapsed = chrono::duration_cast<chrono::milliseconds>(steady_clock::now() - start);
+    server.stop();
+
+    runner.assert_equal((size_t) 7, answers.size(), "dns lookup answers every domain");
+    runner.assert_equal(string("foo.test"), answers[0].domain, "dns answers are in order");
+    runner.assert_equal(foo_addresses, answers[0].addresses, "dns lookup returns every address");
+    runner.assert_equal(string(""), answers[0].error, "dns lookup succeeds");
+    runner.assert_equal(string("no such domain"), answers[1].error, "dns lookup of missing domain");
+    runner.assert_equal(vector<struct in_addr>{parse_ip("9.9.9.9")}, answers[2].addresses, "dns lookup is retried");
+    runner.assert_equal(2, server.queries["retry.test"], "dns query is sent again after a timeout");
+    runner.assert_equal(string("timed out"), answers[3].error, "dns lookup times out");
+    runner.assert_equal(3, server.queries["silent.test"], "dns query is sent once per attempt");
+    runner.assert_equal(1, server.queries["foo.test"], "answered dns query is not retried");
+    runner.assert_equal(vector<struct in_addr>{parse_ip("10.0.0.1")}, answers[4].addresses, "literal address needs no query");
+    runner.assert_true(answers[5].error != "", "invalid domain fails");
+    runner.assert_equal(vector<struct in_addr>{parse_ip("127.0.0.2")}, answers[6].addresses, "hosts file name needs no query");
+    runner.assert_equal(0, server.queries["hosted.test"], "hosts file name is not queried");
+    runner.assert_true(elapsed >= chrono::milliseconds(150) && elapsed < chrono::milliseconds(1000), "dns attempts are spread over the timeouts");
+
+    // a truncated reply fails rather than passing off the records that fit as every address
+    string query = make_dns_query(7, "foo.test");
+    string truncated = query;
+    truncated[2] = (char) 0x83;
+    truncated[3] = (char) 0x80;
+    DnsAnswer truncated_answer;
+    runner.assert_true(parse_dns_response(query, truncated, truncated_answer), "truncated reply is parsed");
+    runner.assert_equal(string("truncated reply"), truncated_answer.error, "truncated reply fails the lookup");
+
+    char hosts_path[] = "/tmp/test_hostsXXXXXX";
+    int hosts_fd = mkstemp(hosts_path);
+    string hosts_file = "# comment\n127.0.0.1 localhost Local.Test # local\n::1 localhost ip6-localhost\n10.0.0.5 local.test\n";
+    runner.assert_equal((ssize_t) hosts_file.size(), write(hosts_fd, hosts_file.data(), hosts_file.size()), "write hosts file");
+    close(hosts_fd);
+    unordered_map<string, vector<struct in_addr>> read_hosts = read_hosts_file(hosts_path);
+    unlink(hosts_path);
+    runner.assert_equal((size_t) 2, read_hosts.size(), "hosts file names");
+    runner.assert_equal(vector<struct in_addr>{parse_ip("127.0.0.1")}, read_hosts["localhost"], "hosts file skips ipv6 addresses");
+    runner.assert_equal(vector<struct in_addr>{parse_ip("127.0.0.1"), parse_ip("10.0.0.5")}, read_hosts["local.test"],
+                        "hosts file names are lowercased and keep every address");
+    runner.assert_true(read_hosts_file("/nonexistent/hosts").empty(), "missing hosts file has no names");
+
+    // the htaccess rules are split into their domains, which are looked up before the rules are parsed
+    string rules = "allow from foo.test\ndeny from 10.0.0.0/8\ndeny from retry.test\n";
+    runner.assert_equal(vector<string>{"foo.test", "retry.test"}, htaccess_domains(rules), "htaccess domains");
+    shared_ptr<DnsClient> resolved = make_shared<ResolvedDnsClient>(unordered_map<string, vector<struct in_addr>>{
+            {"foo.test", foo_addresses}, {"retry.test", {parse_ip("9.9.9.9")}}});
+    HtAccess htaccess = parse_htaccess_rules(rules, resolved);
+    runner.assert_true(htaccess.allows(parse_ip("5.6.7.8")), "resolved htaccess allows foo.test");
+    runner.assert_false(htaccess.allows(parse_ip("9.9.9.9")), "resolved htaccess denies retry.test");
+    runner.assert_throws<runtime_error>([&]() { parse_htaccess_rules("deny from other.test", resolved); },
+                                        "unresolved htaccess domain");
+
+    // a nameserver that isn't listening fails the lookup as soon as the kernel reports it, rather than timing out
+    struct sockaddr_in closed_address = server.address;
+    int closed = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    closed_address.sin_port = 0;
+    bind(closed, (struct sockaddr*) &closed_address, sizeof(closed_address));
+    socklen_t closed_len = sizeof(closed_address);
+    getsockname(closed, (struct sockaddr*) &closed_address, &closed_len);
+    close(closed);
+    AsyncDnsClient refused_client(closed_address, chrono::seconds(2), 3, hosts);
+    answers.clear();
+    start = steady_clock::now();
+    loop.register_pollable(refused_client.lookup({"foo.test"}, [&](vector<DnsAnswer> results) -> shared_ptr<Pollable> {
+        answers = results;
+        return shared_ptr<Pollable>();
+    }));
+    loop.loop();
+    runner.assert_equal((size_t) 1, answers.size(), "refused dns lookup is answered");
+    runner.assert_equal(string("nameserver refused the query"), answers.empty() ? string() : answers[0].error, "refused dns lookup fails");
+    runner.assert_true(steady_clock::now() - start < chrono::seconds(1), "refused dns lookup isn't retried");
+}
+
+void test_async_htaccess_lookup_failures(TestRunner& runner) {
+    char doc_root[] = "/tmp/test_htaccessXXXXXX";
+    runner.assert_true(mkdtemp(doc_root) != NULL, "mkdtemp succeeds");
+    string root = doc_root;
+    vector<pair<string, string>> files = {
+            {"/missing/.htaccess", "deny from missing.test\n"},
+            {"/invalid/.htaccess", "deny from bad..test\n"},
+            {"/local/.htaccess", "deny from 10.0.0.0/8\n"},
+            {"/local/page.html", "hello"}};
+    mkdir((root + "/missing").c_str(), 0755);
+    mkdir((root + "/invalid").c_str(), 0755);
+    mkdir((root + "/local").c_str(), 0755);
+    for (size_t i = 0; i < files.size(); i++) {
+        int fd = open((root + files[i].first).c_str(), O_WRONLY | O_CREAT, 0644);
+        runner.assert_equal((ssize_t) files[i].second.size(), write(fd, files[i].second.data(), files[i].second.size()), "write doc root file");
+        close(fd);
+    }
+
+    // a failed lookup answers 500 whether it took a query to the nameserver or failed without one
+    StubDnsServer server({}, {});
+    shared_ptr<AsyncFileRepository> repository = make_shared<DirectoryAsyncFileRepository>(root);
+    shared_ptr<AsyncDnsClient> dns_client = make_shared<AsyncDnsClient>(server.address, chrono::milliseconds(50), 3,
+                                                                        unordered_map<string, vector<struct in_addr>>());
+    AsyncRequestFilterMiddleware middleware(make_shared<AsyncHtAccessRequestFilter>(repository, dns_client),
+                                            make_shared<FileServingAsyncHttpRequestHandler>(repository));
+    vector<string> uris = {"/missing/page.html", "/invalid/page.html", "/local/page.html"};
+    vector<HttpResponse> responses(uris.size());
+    AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+    for (size_t i = 0; i < uris.size(); i++) {
+        HttpResponse* response = &responses[i];
+        loop.register_pollable(middleware.handle_request(make_request(uris[i], {}, parse_ip("127.0.0.1")),
+                                                         [response](HttpResponse result) -> shared_ptr<Pollable> {
+            *response = result;
+            return shared_ptr<Pollable>();
+        }));
+    }
+    loop.loop();
+    server.stop();
+
+    runner.assert_equal(internal_server_error_response(), responses[0], "nxdomain htaccess lookup fails the request");
+    runner.assert_equal(1, server.queries["missing.test"], "nxdomain htaccess lookup is queried once");
+    runner.assert_equal(internal_server_error_response(), responses[1], "invalid htaccess domain fails the request");
+    runner.assert_equal(string("hello"), responses[2].body, "resolved htaccess allows the request");
+
+    for (size_t i = 0; i < files.size(); i++) {
+        unlink((root + files[i].first).c_str());
+    }
+    rmdir((root + "/missing").c_str());
+    rmdir((root + "/invalid").c_str());
+    rmdir((root + "/local").c_str());
+    rmdir(doc_root);
+}
+
+/*
+ * StalledAsyncHttpRequestHandler never answers its requests, except those for `answered_uri`, but holds on to
+ * their callbacks until they are released. Its pollable waits on `fd` until `deadline`, so the event loop keeps
+ * running until then.
+ */
+class StalledAsyncHttpRequestHandler : public AsyncHttpRequestHandler {
+    int fd;
+    steady_clock::time_point deadline;
+    string answered_uri;
+    vector<Callback<HttpResponse>::F> callbacks;
+
+public:
+    StalledAsyncHttpRequestHandler(int fd, steady_clock::time_point deadline, string answered_uri = "")
+            : fd(fd), deadline(deadline), answered_uri(answered_uri) {}
+
+    virtual shared_ptr<Pollable> handle_request(HttpRequest request, Callback<HttpResponse>::F callback) {
+        if (request.uri == answered_uri) {
+            return callback(make_response(OK_STATUS, vector<HttpHeader>{}, "answered"));
+        }
+        callbacks.push_back(callback);
+        return make_shared<IdlePollable>(fd, deadline);
+    }
+
+    void release() {
+        callbacks.clear();
+    }
+};
+
+// read_all reads from the blocking socket `fd` until the peer shuts it down
+string read_all(int fd) {
+    string received;
+    char buf[4096];
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        received.append(buf, len);
+    }
+    return received;
+}
+
+void test_connection_timeouts(TestRunner& runner) {
+    ConnectionTimeouts timeouts{chrono::milliseconds(1), chrono::milliseconds(2), chrono::milliseconds(3), chrono::milliseconds(4)};
+    runner.assert_true(timeouts.of(READING_HEADERS) == chrono::milliseconds(1), "reading headers timeout");
+    runner.assert_true(timeouts.of(PROCESSING) == chrono::milliseconds(2), "processing timeout");
+    runner.assert_true(timeouts.of(WRITING) == chrono::milliseconds(3), "writing timeout");
+    runner.assert_true(timeouts.of(IDLE) == chrono::milliseconds(4), "idle timeout");
+
+    // the blocking connection waits for its first request with the header timeout and for later ones with the idle timeout
+    HttpRequest request = make_request("/", vector<HttpHeader>{{"Host", "foo"}});
+    string serialized = request.pack().serialize();
+    shared_ptr<MockConnection> mock_conn = make_shared<MockConnection>(serialized + serialized, (int) serialized.size());
+    HttpConnection http_conn(mock_conn, timeouts);
+    http_conn.read_request();
+    runner.assert_true(mock_conn->read_timeout() == timeouts.reading_headers, "first request is read with the header timeout");
+    runner.assert_true(mock_conn->write_timeout() == timeouts.writing, "responses are written with the write timeout");
+    http_conn.write_response(make_response(OK_STATUS, vector<HttpHeader>{}));
+    http_conn.read_request();
+    runner.assert_true(mock_conn->read_timeout() == timeouts.idle, "kept alive connection waits with the idle timeout");
+
+    // timers fire at their deadline, but don't keep the event loop running by themselves
+    AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+    int fired = 0;
+    Callback<>::F fire = [&]() -> shared_ptr<Pollable> {
+        fired++;
+        return shared_ptr<Pollable>();
+    };
+    shared_ptr<Timer> timer = make_shared<Timer>();
+    loop.register_pollable(timer->arm(steady_clock::now() + chrono::seconds(10), fire));
+    steady_clock::time_point start = steady_clock::now();
+    loop.loop();
+    runner.assert_true(steady_clock::now() - start < chrono::seconds(1), "timer doesn't keep the event loop running");
+    runner.assert_equal(0, fired, "timer doesn't fire early");
+
+    int fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+    loop.register_pollable(make_shared<IdlePollable>(fds[1], steady_clock::now() + chrono::milliseconds(100)));
+    shared_ptr<Pollable> rearmed = timer->arm(steady_clock::now() + chrono::milliseconds(20), fire);
+    runner.assert_true(rearmed != NULL, "earlier deadline registers the timer again");
+    loop.register_pollable(rearmed);
+    runner.assert_true(timer->arm(steady_clock::now() + chrono::milliseconds(40), fire) == NULL, "later deadline reuses the registration");
+    loop.loop();
+    runner.assert_equal(1, fired, "re-armed timer fires once");
+
+    loop.register_pollable(make_shared<IdlePollable>(fds[1], steady_clock::now() + chrono::milliseconds(50)));
+    loop.register_pollable(timer->arm(steady_clock::now() + chrono::milliseconds(10), fire));
+    timer->disarm();
+    loop.loop();
+    runner.assert_equal(1, fired, "disarmed timer doesn't fire");
+    close(fds[0]);
+    close(fds[1]);
+
+    // a request that takes longer than the processing timeout is answered with 503
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds), "socketpair succeeds");
+    int stalled[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, stalled), "socketpair succeeds");
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    runner.assert_equal((int) serialized.size(), (int) write(fds[0], serialized.data(), serialized.size()), "write request");
+
+    struct in_addr addr;
+    addr.s_addr = 0;
+    shared_ptr<AsyncSocketConnection> conn = make_shared<AsyncSocketConnection>(fds[1], addr);
+    ConnectionTimeouts processing_timeouts = DEFAULT_CONNECTION_TIMEOUTS;
+    processing_timeouts.processing = chrono::milliseconds(20);
+    conn->configure(processing_timeouts, shared_ptr<IdleConnectionList>());
+    shared_ptr<StalledAsyncHttpRequestHandler> handler = make_shared<StalledAsyncHttpRequestHandler>(
+            stalled[1], steady_clock::now() + chrono::milliseconds(200));
+    loop.register_pollable(handle_http_connection(loop, make_shared<AsyncHttpConnection>(conn), handler,
+                                                  DEFAULT_REQUEST_BUDGET, processing_timeouts));
+    conn.reset();
+    struct timeval tv = {1, 0};
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    loop.loop();
+
+    // the handler still hasn't answered, but the connection was closed once the 503 was sent
+    string received = read_all(fds[0]);
+    char byte;
+    runner.assert_true(received.find("HTTP/1.1 503 Service Unavailable") == 0, "stalled request is answered with 503");
+    runner.assert_equal((ssize_t) 0, recv(fds[0], &byte, 1, MSG_DONTWAIT), "timed out connection is closed before the handler returns");
+    handler->release();
+    close(fds[0]);
+
+    // responses to earlier pipelined requests that are still queued are sent ahead of the 503
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds), "socketpair succeeds");
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    string pipelined = make_request("/answered", vector<HttpHeader>{{"Host", "foo"}}).pack().serialize() + serialized;
+    runner.assert_equal((int) pipelined.size(), (int) write(fds[0], pipelined.data(), pipelined.size()), "write pipelined requests");
+    conn = make_shared<AsyncSocketConnection>(fds[1], addr);
+    conn->configure(processing_timeouts, shared_ptr<IdleConnectionList>());
+    handler = make_shared<StalledAsyncHttpRequestHandler>(stalled[1], steady_clock::now() + chrono::milliseconds(200), "/answered");
+    loop.register_pollable(handle_http_connection(loop, make_shared<AsyncHttpConnection>(conn), handler,
+                                                  DEFAULT_REQUEST_BUDGET, processing_timeouts));
+    conn.reset();
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    loop.loop();
+
+    received = read_all(fds[0]);
+    size_t unavailable = received.find("HTTP/1.1 503 Service Unavailable");
+    runner.assert_true(received.find("HTTP/1.1 200 OK") == 0, "queued response is sent first");
+    runner.assert_true(received.find("answered") != string::npos, "queued response is sent whole");
+    runner.assert_true(unavailable != string::npos && unavailable > received.find("answered"), "stalled pipelined request is answered with 503 after it");
+    handler->release();
+    close(fds[0]);
+    close(stalled[0]);
+    close(stalled[1]);
+}
+
+void test_idle_connection_eviction(TestRunner& runner) {
+    ConnectionTimeouts timeouts = DEFAULT_CONNECTION_TIMEOUTS;
+    shared_ptr<IdleConnectionList> idle_connections = make_shared<IdleConnectionList>(2);
+    AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+    struct in_addr addr;
+    addr.s_addr = 0;
+
+    // each idle read joins the list, and the least recently used one is evicted once it's full
+    vector<int> clients;
+    vector<shared_ptr<AsyncBufferedConnection>> conns;
+    vector<string> received(3, "none");
+    for (int i = 0; i < 3; i++) {
+        int fds[2];
+        runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+        fcntl(fds[0], F_SETFL, 0);
+        shared_ptr<AsyncSocketConnection> conn = make_shared<AsyncSocketConnection>(fds[1], addr);
+        conn->configure(timeouts, idle_connections);
+        conns.push_back(make_shared<AsyncBufferedConnection>(conn));
+        clients.push_back(fds[0]);
+        loop.register_pollable(conns[i]->read_until("\r\n", [&received, i](string line) -> shared_ptr<Pollable> {
+            received[i] = line;
+            return shared_ptr<Pollable>();
+        }, true));
+    }
+    runner.assert_equal((size_t) 2, idle_connections->size(), "idle connections are capped");
+    runner.assert_equal(string(""), read_all(clients[0]), "least recently used connection is evicted");
+
+    // a new connection makes room by evicting the least recently used idle one
+    idle_connections->make_room();
+    runner.assert_equal((size_t) 1, idle_connections->size(), "make room evicts an idle connection");
+    runner.assert_equal(string(""), read_all(clients[1]), "connection evicted for a new one is shut down");
+
+    // anything arriving takes the connection out of the list
+    runner.assert_equal(5, (int) write(clients[2], "foo\r\n", 5), "write line");
+    loop.loop();
+    runner.assert_equal(string("foo"), received[2], "active connection isn't evicted");
+    runner.assert_equal(string("none"), received[0], "evicted connection reads nothing");
+    runner.assert_equal((size_t) 0, idle_connections->size(), "connection with data isn't idle");
+
+    for (size_t i = 0; i < clients.size(); i++) {
+        close(clients[i]);
+    }
+
+    // an idle read waits with the idle timeout, until part of a message arrives
+    ConnectionTimeouts short_idle = DEFAULT_CONNECTION_TIMEOUTS;
+    short_idle.idle = chrono::milliseconds(20);
+    ConnectionTimeouts short_headers = DEFAULT_CONNECTION_TIMEOUTS;
+    short_headers.reading_headers = chrono::milliseconds(20);
+    vector<ConnectionTimeouts> configs = {short_idle, short_headers};
+    for (size_t i = 0; i < configs.size(); i++) {
+        int fds[2];
+        runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+        if (i == 1) {
+            runner.assert_equal(3, (int) write(fds[0], "foo", 3), "write partial line");
+        }
+        shared_ptr<AsyncSocketConnection> conn = make_shared<AsyncSocketConnection>(fds[1], addr);
+        conn->configure(configs[i], idle_connections);
+        shared_ptr<AsyncBufferedConnection> buffered = make_shared<AsyncBufferedConnection>(conn);
+        steady_clock::time_point start = steady_clock::now();
+        loop.register_pollable(buffered->read_until("\r\n", [](string) -> shared_ptr<Pollable> {
+            return shared_ptr<Pollable>();
+        }, true));
+        loop.loop();
+        runner.assert_true(steady_clock::now() - start < chrono::seconds(1), "idle read times out with the matching timeout");
+        runner.assert_equal((size_t) 0, idle_connections->size(), "timed out read leaves the idle list");
+        close(fds[0]);
+    }
+}
+
+/*
+ * start_drain reads from the blocking socket `fd` on another thread, `chunk` bytes every `interval`,
+ * until the peer closes it, and counts the bytes read.
+ */
+std::thread start_drain(int fd, size_t chunk, chrono::milliseconds interval, size_t& received) {
+    return std::thread([=, &received]() {
+        vector<char> buf(chunk);
+        ssize_t len;
+        while ((len = read(fd, buf.data(), buf.size())) > 0) {
+            received += len;
+            std::this_thread::sleep_for(interval);
+        }
+    });
+}
+
+void test_output_budget(TestRunner& runner) {
+    OutputStats& output_stats = global_output_stats();
+    uint64_t buffered_before = output_stats.buffered_bytes();
+    struct in_addr addr;
+    addr.s_addr = 0;
+    AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+    string message(4 * 1024 * 1024, 'm');
+
+    // a client that reads slower than the minimum rate is dropped once the grace period is up
+    int fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+    fcntl(fds[0], F_SETFL, 0);
+    OutputLimits strict = DEFAULT_OUTPUT_LIMITS;
+    strict.min_send_rate = 1024 * 1024 * 1024;
+    strict.slow_reader_grace = chrono::milliseconds(20);
+    shared_ptr<AsyncSocketConnection> conn = make_shared<AsyncSocketConnection>(fds[1], addr);
+    conn->configure(DEFAULT_CONNECTION_TIMEOUTS, shared_ptr<IdleConnectionList>(), strict);
+    uint64_t slow_readers_before = output_stats.slow_reader_count();
+    bool written = false;
+    loop.register_pollable(conn->write(message, [&]() -> shared_ptr<Pollable> {
+        written = true;
+        return shared_ptr<Pollable>();
+    }));
+    runner.assert_true(output_stats.buffered_bytes() > buffered_before, "unsent bytes are charged to the budget");
+    runner.assert_equal(snapshot_event_loop_stats().buffered_output_bytes, output_stats.buffered_bytes(), "stats report buffered bytes");
+    size_t received = 0;
+    std::thread client = start_drain(fds[0], 4096, chrono::milliseconds(2), received);
+    steady_clock::time_point start = steady_clock::now();
+    loop.loop();
+    runner.assert_true(steady_clock::now() - start < chrono::seconds(5), "slow reader is dropped before the write times out");
+    conn.reset();
+    client.join();
+    close(fds[0]);
+    runner.assert_false(written, "slow reader's write doesn't complete");
+    runner.assert_true(received < message.size(), "slow reader doesn't get the whole message");
+    runner.assert_equal(slow_readers_before + 1, output_stats.slow_reader_count(), "slow reader is counted");
+    runner.assert_equal(buffered_before, output_stats.buffered_bytes(), "dropped write releases its budget");
+
+    // while another connection holds the process's output budget, a connection waits for room to produce more
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+    fcntl(fds[0], F_SETFL, 0);
+    shared_ptr<AsyncSocketConnection> holder = make_shared<AsyncSocketConnection>(fds[1], addr);
+    loop.register_pollable(holder->write(message, Callback<>::empty()));
+    runner.assert_equal((size_t) 0, holder->output_room(), "no output room while a write holds more than the connection budget");
+    int waiting_fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, waiting_fds), "socketpair succeeds");
+    OutputLimits tiny = DEFAULT_OUTPUT_LIMITS;
+    tiny.max_total_bytes = 1;
+    shared_ptr<AsyncSocketConnection> waiting = make_shared<AsyncSocketConnection>(waiting_fds[1], addr);
+    waiting->configure(DEFAULT_CONNECTION_TIMEOUTS, shared_ptr<IdleConnectionList>(), tiny);
+    runner.assert_equal((size_t) 0, waiting->output_room(), "no output room while over the global budget");
+    uint64_t waits_before = output_stats.output_wait_count();
+    bool room = false;
+    loop.register_pollable(waiting->wait_for_output_room([&]() -> shared_ptr<Pollable> {
+        room = true;
+        return shared_ptr<Pollable>();
+    }));
+    // the retries are timers, so stand in for a listener to keep the event loop running
+    loop.register_pollable(make_shared<IdlePollable>(waiting_fds[0], steady_clock::now() + chrono::milliseconds(300)));
+    received = 0;
+    client = start_drain(fds[0], 65536, chrono::milliseconds(0), received);
+    loop.loop();
+    runner.assert_true(room, "connection gets output room once the budget drains");
+    runner.assert_equal(waits_before + 1, output_stats.output_wait_count(), "output wait is counted");
+    runner.assert_equal(tiny.max_connection_bytes, waiting->output_room(), "output room is the connection budget once nothing is buffered");
+    holder.reset();
+    client.join();
+    runner.assert_equal(message.size(), received, "budget holder's write completes");
+    close(fds[0]);
+    close(waiting_fds[0]);
+
+    // streamed bodies are produced in chunks no bigger than the connection's budget
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), "socketpair succeeds");
+    fcntl(fds[0], F_SETFL, 0);
+    OutputLimits small = DEFAULT_OUTPUT_LIMITS;
+    small.max_connection_bytes = 16 * 1024;
+    conn = make_shared<AsyncSocketConnection>(fds[1], addr);
+    conn->configure(DEFAULT_CONNECTION_TIMEOUTS, shared_ptr<IdleConnectionList>(), small);
+    int chunks = 0;
+    written = false;
+    {
+        AsyncHttpConnection http_conn(conn);
+        conn.reset();
+        HttpResponse response = ok_stream_response(counting_body(64 * small.max_connection_bytes, chunks), "text/plain",
+                                                   system_clock::time_point());
+        loop.register_pollable(http_conn.write_response(response, [&]() -> shared_ptr<Pollable> {
+            written = true;
+            return shared_ptr<Pollable>();
+        }));
+        received = 0;
+        client = start_drain(fds[0], 65536, chrono::milliseconds(0), received);
+        loop.loop();
+    }
+    client.join();
+    close(fds[0]);
+    runner.assert_true(written, "budgeted stream is written");
+    runner.assert_equal(64, chunks, "stream chunks are bounded by the connection budget");
+    runner.assert_equal(buffered_before, output_stats.buffered_bytes(), "completed writes release their budget");
+}
+
+void test_zerocopy_sends(TestRunner& runner) {
+    OutputStats& output_stats = global_output_stats();
+    uint64_t buffered_before = output_stats.buffered_bytes();
+    AsyncEventLoop loop(make_event_backend(EPOLL_BACKEND));
+
+    // zerocopy needs a tcp socket, so connect to a listener over loopback
+    shared_ptr<AsyncSocketListener> listener = make_shared<AsyncSocketListener>(0);
+    listener->listen();
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    runner.assert_equal(0, getsockname(listener->get_fd(), (struct sockaddr*) &addr, &addr_len), "getsockname succeeds");
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int client = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    runner.assert_equal(0, connect(client, (struct sockaddr*) &addr, sizeof(addr)), "client connects");
+    shared_ptr<AsyncSocketConnection> conn = listener->accept();
+    runner.assert_true(conn != NULL, "connection is accepted");
+    OutputLimits zerocopy = DEFAULT_OUTPUT_LIMITS;
+    zerocopy.zerocopy_threshold = DEFAULT_ZEROCOPY_THRESHOLD;
+    conn->configure(DEFAULT_CONNECTION_TIMEOUTS, shared_ptr<IdleConnectionList>(), zerocopy);
+
+    string small(1024, 's');
+    string large(4 * 1024 * 1024, ' ');
+    for (size_t i = 0; i < large.size(); i++) {
+        large[i] = (char) ('a' + i % 26);
+    }
+    string received;
+    std::thread reader([&]() {
+        char buf[65536];
+        ssize_t len;
+        while (received.size() < small.size() + large.size() && (len = read(client, buf, sizeof(buf))) > 0) {
+            received.append(buf, len);
+        }
+    });
+
+    // writes below the threshold are copied, so nothing is left pinned once they're done
+    // (either write may fit in the socket's send buffer, in which case it completes right away)
+    bool written = false;
+    shared_ptr<Pollable> pollable = conn->write(small, [&]() -> shared_ptr<Pollable> {
+        written = true;
+        return shared_ptr<Pollable>();
+    });
+    if (pollable != NULL) {
+        loop.register_pollable(pollable);
+        loop.loop();
+    }
+    runner.assert_true(written, "small write completes");
+    runner.assert_equal(buffered_before, output_stats.buffered_bytes(), "small write isn't pinned");
+
+    // a large write's buffers stay pinned after it's done, until the kernel reports that it released them
+    written = false;
+    pollable = conn->write(large, [&]() -> shared_ptr<Pollable> {
+        written = true;
+        return shared_ptr<Pollable>();
+    });
+    if (pollable != NULL) {
+        loop.register_pollable(pollable);
+        loop.loop();
+    }
+    runner.assert_true(written, "large write completes");
+    runner.assert_true(output_stats.buffered_bytes() > buffered_before, "large write is pinned until the kernel releases it");
+    reader.join();
+    runner.assert_equal(small.size() + large.size(), received.size(), "client receives both writes");
+    runner.assert_true(received == small + large, "zerocopy write arrives intact");
+
+    // the kernel may report releasing the last buffers a little after the client has read them, in which
+    // case the socket is retired until it does, and the retired sockets are reaped as others are destroyed
+    // (the write pollable holds on to the socket too, so it has to go before the socket is destroyed)
+    close(client);
+    pollable.reset();
+    conn.reset();
+    for (int i = 0; i < 100 && output_stats.buffered_bytes() != buffered_before; i++) {
+        std::this_thread::sleep_for(chrono::milliseconds(10));
+        AutoClosingSocket reaper(socket(PF_INET, SOCK_STREAM, IPPROTO_TCP));
+    }
+    runner.assert_equal(buffered_before, output_stats.buffered_bytes(), "released buffers are unpinned");
+}
+
+void test_bounded_queue(TestRunner& runner) {
+    BoundedQueue<int> queue(5);
+    runner.assert_equal((size_t) 8, queue.capacity(), "capacity is rounded up to a power of two");
+    int elem = 0;
+    runner.assert_false(queue.try_pop(elem), "empty queue can't be popped");
+
+    // elements come out in the order they went in, and the queue wraps around the ring
+    for (int lap = 0; lap < 3; lap++) {
+        for (int i = 0; i < 8; i++) {
+            runner.assert_true(queue.try_push(lap * 8 + i), "push succeeds while there is room");
+        }
+        runner.assert_false(queue.try_push(-1), "push fails once the queue is full");
+        runner.assert_equal((size_t) 8, queue.size(), "full queue size");
+        for (int i = 0; i < 8; i++) {
+            runner.assert_true(queue.try_pop(elem), "pop succeeds while there are elements");
+            runner.assert_equal(lap * 8 + i, elem, "elements are popped in order");
+        }
+        runner.assert_false(queue.try_pop(elem), "drained queue can't be popped");
+    }
+
+    // blocked producers and consumers park until they can make progress, and nothing is lost or repeated
+    BoundedQueue<int> shared(4);
+    const int threads = 4;
+    const int per_thread = 20000;
+    std::atomic<long> sum(0);
+    std::atomic<int> popped(0);
+    vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(std::thread([&shared, t, per_thread]() {
+            for (int i = 0; i < per_thread; i++) {
+                shared.push(t * per_thread + i + 1);
+            }
+        }));
+        workers.push_back(std::thread([&shared, &sum, &popped, per_thread]() {
+            for (int i = 0; i < per_thread; i++) {
+                sum += shared.pop();
+                popped++;
+            }
+        }));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    long total = (long) threads * per_thread;
+    runner.assert_equal(threads * per_thread, popped.load(), "every pushed element is popped");
+    runner.assert_equal(total * (total + 1) / 2, sum.load(), "every element is popped exactly once");
+    runner.assert_equal((size_t) 0, shared.size(), "queue is empty once every element is popped");
+
+    // a timed pop gives up once nothing arrives in time
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    runner.assert_false(shared.pop_for(elem, chrono::milliseconds(20)), "timed pop of an empty queue gives up");
+    runner.assert_true(chrono::steady_clock::now() - start >= chrono::milliseconds(20), "timed pop waits for its timeout");
+    shared.push(7);
+    runner.assert_true(shared.pop_for(elem, chrono::milliseconds(20)) && elem == 7, "timed pop takes a pushed element");
+}
+
+void test_thread_pool_queue_full(TestRunner& runner) {
+    HttpRequest request = make_request("/", vector<HttpHeader>{{"Host", "foo"}});
+    shared_ptr<HttpRequestHandler> handler = make_shared<MockHttpRequestHandler>(make_response(OK_STATUS, vector<HttpHeader>{}));
+
+    // without any workers the first connections fill the queue, so the next one is rejected
+    ThreadPoolHttpConnectionHandler pool(handler, 0, 2, REJECT_WHEN_FULL);
+    shared_ptr<MockConnection> queued = make_shared<MockConnection>(request.pack().serialize());
+    shared_ptr<MockConnection> rejected = make_shared<MockConnection>(request.pack().serialize());
+    pool.handle_connection(HttpConnection(queued));
+    pool.handle_connection(HttpConnection(make_shared<MockConnection>(request.pack().serialize())));
+    pool.handle_connection(HttpConnection(rejected));
+    runner.assert_equal(string(""), queued->written(), "queued connection waits for a worker");
+    runner.assert_true(rejected->written().find("503 Service Unavailable") != string::npos, "connection is rejected while the queue is full");
+}
+
+// read_responses reads from the socket `fd` until `count` responses have arrived or the peer is done
+string read_responses(int fd, size_t count) {
+    string received;
+    char buf[4096];
+    ssize_t len;
+    while (split(received, "HTTP/1.1 200 OK").size() <= count && (len = read(fd, buf, sizeof(buf))) > 0) {
+        received.append(buf, len);
+    }
+    return received;
+}
+
+// SlowHttpRequestHandler takes `delay` to answer each request, and is safe to call from several threads
+class SlowHttpRequestHandler : public HttpRequestHandler {
+    chrono::milliseconds delay;
+    std::atomic<int> handled;
+
+public:
+    SlowHttpRequestHandler(chrono::milliseconds delay) : delay(delay), handled(0) {}
+
+    virtual HttpResponse handle_request(const HttpRequest&) {
+        std::this_thread::sleep_for(delay);
+        handled++;
+        return make_response(OK_STATUS);
+    }
+
+    int count() {
+        return handled.load();
+    }
+};
+
+void test_elastic_thread_pool(TestRunner& runner) {
+    HttpRequest request = make_request("/", vector<HttpHeader>{{"Host", "foo"}, {"Connection", "close"}});
+    shared_ptr<SlowHttpRequestHandler> handler = make_shared<SlowHttpRequestHandler>(chrono::milliseconds(50));
+    PoolSizing sizing{4, chrono::milliseconds(5), 2, chrono::milliseconds(200), chrono::milliseconds(0)};
+    ThreadPoolHttpConnectionHandler pool(handler, 1, 16, BLOCK_WHEN_FULL, sizing);
+    runner.assert_equal((uint64_t) 1, pool.stats().workers, "elastic pool starts at its initial size");
+
+    // connections queue up behind the only worker, so the pool grows to take them
+    for (int i = 0; i < 8; i++) {
+        pool.handle_connection(HttpConnection(make_shared<MockConnection>(request.pack().serialize())));
+    }
+    for (int i = 0; i < 500 && handler->count() < 8; i++) {
+        std::this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    PoolStatsSnapshot busy = pool.stats();
+    runner.assert_equal(8, handler->count(), "every queued connection is served");
+    runner.assert_true(busy.grown >= 1, "pool grows while connections wait");
+    runner.assert_true(busy.workers > 1 && busy.workers <= 4, "pool grows up to its max size");
+    runner.assert_equal((uint64_t) 8, busy.dequeued, "every connection taken off the queue is counted");
+    runner.assert_true(busy.max_queue_delay_us > 0, "queueing delay is measured");
+    runner.assert_equal((uint64_t) 0, pool.stats().dequeued, "delays are counted since the previous snapshot");
+
+    // once the load passes, the extra workers retire
+    for (int i = 0; i < 200 && pool.stats().workers > 1; i++) {
+        std::this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    PoolStatsSnapshot idle = pool.stats();
+    runner.assert_equal((uint64_t) 1, idle.workers, "idle pool shrinks back to its initial size");
+    runner.assert_equal(idle.grown, idle.retired, "every added worker retires");
+}
+
+void test_thread_pool_parks_idle_connections(TestRunner& runner) {
+    string request = "GET / HTTP/1.1\r\nHost: foo\r\n\r\n";
+    shared_ptr<HttpRequestHandler> handler = make_shared<MockHttpRequestHandler>(make_response(OK_STATUS, vector<HttpHeader>{}, "ok"));
+    struct in_addr addr;
+    addr.s_addr = 0;
+    struct timeval tv = {2, 0};
+
+    int idle_fds[2];
+    int busy_fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, idle_fds), "socketpair succeeds");
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, busy_fds), "socketpair succeeds");
+    setsockopt(idle_fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(busy_fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    {
+        ThreadPoolHttpConnectionHandler pool(handler, 1);
+
+        // the request is followed by the start of the next one, which stays buffered while the connection is parked
+        string partial = request + "GET / HT";
+        runner.assert_equal((ssize_t) partial.size(), write(idle_fds[0], partial.data(), partial.size()), "write request");
+        pool.handle_connection(HttpConnection(make_shared<SocketConnection>(idle_fds[1], addr)));
+        runner.assert_true(ends_with(read_responses(idle_fds[0], 1), "\r\n\r\nok"), "first connection is answered");
+
+        // the only worker is free for another connection while the first one is idle
+        pool.handle_connection(HttpConnection(make_shared<SocketConnection>(busy_fds[1], addr)));
+        for (int i = 0; i < 2; i++) {
+            runner.assert_equal((ssize_t) request.size(), write(busy_fds[0], request.data(), request.size()), "write request");
+            runner.assert_true(ends_with(read_responses(busy_fds[0], 1), "\r\n\r\nok"), "second connection is answered while the first is idle");
+        }
+
+        string rest = "TP/1.1\r\nHost: foo\r\n\r\n";
+        runner.assert_equal((ssize_t) rest.size(), write(idle_fds[0], rest.data(), rest.size()), "write rest of request");
+        runner.assert_true(ends_with(read_responses(idle_fds[0], 1), "\r\n\r\nok"), "parked connection keeps the start of its next request");
+    }
+    runner.assert_equal(string(""), read_all(idle_fds[0]), "parked connection is closed when the pool shuts down");
+    close(idle_fds[0]);
+    close(busy_fds[0]);
+}
+
+void test_thread_pool_rejects_returning_connections(TestRunner& runner) {
+    string request = "GET / HTTP/1.1\r\nHost: foo\r\n\r\n";
+    HttpRequest closing = make_request("/", vector<HttpHeader>{{"Host", "foo"}, {"Connection", "close"}});
+    shared_ptr<HttpRequestHandler> handler = make_shared<SlowHttpRequestHandler>(chrono::milliseconds(200));
+    struct in_addr addr;
+    addr.s_addr = 0;
+    struct timeval tv = {2, 0};
+
+    int fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds), "socketpair succeeds");
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    {
+        ThreadPoolHttpConnectionHandler pool(handler, 1, 2, REJECT_WHEN_FULL);
+        runner.assert_equal((ssize_t) request.size(), write(fds[0], request.data(), request.size()), "write request");
+        pool.handle_connection(HttpConnection(make_shared<SocketConnection>(fds[1], addr)));
+        runner.assert_true(read_responses(fds[0], 1).find("200 OK") != string::npos, "connection is answered before it is parked");
+
+        // the only worker is busy and the queue behind it is full when the parked connection comes back
+        pool.handle_connection(HttpConnection(make_shared<MockConnection>(closing.pack().serialize())));
+        std::this_thread::sleep_for(chrono::milliseconds(50));
+        for (int i = 0; i < 2; i++) {
+            pool.handle_connection(HttpConnection(make_shared<MockConnection>(closing.pack().serialize())));
+        }
+        runner.assert_equal((ssize_t) request.size(), write(fds[0], request.data(), request.size()), "write request");
+        string rejected = read_all(fds[0]);
+        runner.assert_true(rejected.find("503 Service Unavailable") != string::npos, "returning connection is rejected while the queue is full");
+    }
+    close(fds[0]);
+}
+
+void test_work_stealing_queues(TestRunner& runner) {
+    WorkStealingQueues<int> queues(2);
+    int task = 0;
+    runner.assert_false(queues.pop(0, task), "empty queues can't be popped");
+
+    // a worker serves its own deque in order, and a thief takes from the other end
+    queues.push(0, 1);
+    queues.push(0, 2);
+    queues.push(0, 3);
+    runner.assert_equal((size_t) 3, queues.size(), "pushed tasks are counted");
+    runner.assert_true(queues.pop(0, task), "worker pops from its own deque");
+    runner.assert_equal(1, task, "worker pops the oldest of its own tasks");
+    runner.assert_true(queues.pop(1, task), "idle worker steals");
+    runner.assert_equal(3, task, "thief steals the newest task");
+    runner.assert_equal((uint64_t) 1, queues.steals(), "steal is counted");
+    runner.assert_true(queues.pop(0, task), "worker pops the rest of its deque");
+    runner.assert_equal(2, task, "remaining task is left for its owner");
+    runner.assert_equal((uint64_t) 1, queues.steals(), "popping from its own deque isn't a steal");
+
+    // submitted tasks are spread over the deques in turn
+    queues.submit(4);
+    queues.submit(5);
+    runner.assert_true(queues.pop(1, task) && task == 5, "second submitted task goes to the second worker");
+    runner.assert_true(queues.pop(0, task) && task == 4, "first submitted task goes to the first worker");
+
+    // tasks pushed to one worker are taken by every worker, each exactly once
+    WorkStealingQueues<int> shared(4);
+    const int total = 20000;
+    std::atomic<long> sum(0);
+    std::atomic<int> taken(0);
+    vector<std::thread> workers;
+    for (size_t w = 0; w < 4; w++) {
+        workers.push_back(std::thread([&shared, &sum, &taken, w]() {
+            int value = 0;
+            while (shared.take(w, value)) {
+                sum += value;
+                taken++;
+            }
+        }));
+    }
+    for (int i = 1; i <= total; i++) {
+        shared.push(0, i);
+    }
+    while (taken.load() < total) {
+        std::this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    shared.stop();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    runner.assert_equal((long) total * (total + 1) / 2, sum.load(), "every task is taken exactly once");
+    runner.assert_false(shared.take(0, task), "take returns false once stopped");
+}
+
+void test_work_stealing_handler(TestRunner& runner) {
+    string request = "GET / HTTP/1.1\r\nHost: foo\r\n\r\n";
+    shared_ptr<HttpRequestHandler> handler = make_shared<MockHttpRequestHandler>(make_response(OK_STATUS, vector<HttpHeader>{}, "ok"));
+    struct in_addr addr;
+    addr.s_addr = 0;
+    struct timeval tv = {2, 0};
+
+    int fds[2];
+    int pipelined_fds[2];
+    int quiet_fds[2];
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds), "socketpair succeeds");
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, pipelined_fds), "socketpair succeeds");
+    runner.assert_equal(0, socketpair(AF_UNIX, SOCK_STREAM, 0, quiet_fds), "socketpair succeeds");
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(pipelined_fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(quiet_fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    {
+        // the mock request handler isn't thread safe, so a single worker serves every connection
+        WorkStealingHttpConnectionHandler pool(handler, 1);
+        ConnectionTimeouts short_idle = DEFAULT_CONNECTION_TIMEOUTS;
+        short_idle.reading_headers = chrono::milliseconds(200);
+        pool.handle_connection(HttpConnection(make_shared<SocketConnection>(fds[1], addr)));
+        pool.handle_connection(HttpConnection(make_shared<SocketConnection>(pipelined_fds[1], addr)));
+        pool.handle_connection(HttpConnection(make_shared<SocketConnection>(quiet_fds[1], addr), short_idle));
+
+        // a kept alive connection is handed back to a worker for each request it sends
+        for (int i = 0; i < 3; i++) {
+            runner.assert_equal((ssize_t) request.size(), write(fds[0], request.data(), request.size()), "write request");
+            string response = read_responses(fds[0], 1);
+            runner.assert_true(ends_with(response, "\r\n\r\nok"), "kept alive connection is answered after it was parked");
+        }
+
+        // pipelined requests that arrive together are all answered
+        string pipelined = request + request + request;
+        runner.assert_equal((ssize_t) pipelined.size(), write(pipelined_fds[0], pipelined.data(), pipelined.size()), "write pipelined requests");
+        runner.assert_equal((size_t) 4, split(read_responses(pipelined_fds[0], 3), "HTTP/1.1 200 OK").size(), "every pipelined request is answered");
+
+        // a connection that never sends a request is closed once its header timeout passes
+        runner.assert_equal(string(""), read_all(quiet_fds[0]), "quiet connection is closed without a response");
+    }
+    runner.assert_equal(string(""), read_all(fds[0]), "parked connection is closed when the pool shuts down");
+    close(fds[0]);
+    close(pipelined_fds[0]);
+    close(quiet_fds[0]);
+}
+
 typedef void (*TestFunc)(TestRunner&);
 
 int main() {
@@ -646,7 +2704,41 @@ int main() {
         test_file_serving_handler,
         test_cidr_block,
         test_htaccess_request_filter,
-        test_request_filter_middleware
+        test_request_filter_middleware,
+        test_deadline_queue,
+        test_byte_buffer,
+        test_buffer_pool,
+        test_perform_io_request,
+        test_readiness_event_backends,
+        test_uring_event_backend,
+        test_continuation,
+        test_keep_alive_allocations,
+        test_async_coroutine,
+        test_histogram,
+        test_event_loop_stats,
+        test_stats_dump_wakes_idle_loop,
+        test_multi_reactor_async_server,
+        test_reuse_port_listeners,
+        test_batched_accept,
+        test_connection_request_budget,
+        test_offload,
+        test_sendfile_response,
+        test_scatter_gather_write,
+        test_pipelined_response_coalescing,
+        test_body_sources,
+        test_async_dns_client,
+        test_async_htaccess_lookup_failures,
+        test_connection_timeouts,
+        test_idle_connection_eviction,
+        test_output_budget,
+        test_zerocopy_sends,
+        test_bounded_queue,
+        test_thread_pool_queue_full,
+        test_thread_pool_parks_idle_connections,
+        test_thread_pool_rejects_returning_connections,
+        test_elastic_thread_pool,
+        test_work_stealing_queues,
+        test_work_stealing_handler
     };
 
     for (size_t i = 0; i < test_funcs.size(); i++) {
@@ -0,0 +1,144 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdexcept>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "uring.h"
+#include "util.h"
+
+using std::function;
+using std::runtime_error;
+
+// features that IoUring relies on: one mmap for both rings, no dropped completions
+// and timeouts passed directly to io_uring_enter
+#define REQUIRED_FEATURES (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)
+
+
+int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t arg_size) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+IoUring::IoUring(unsigned entries) : ring_ptr(MAP_FAILED), sqes((struct io_uring_sqe*) MAP_FAILED), pending(0) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring_fd = io_uring_setup(entries, &params);
+    if (ring_fd < 0) {
+        throw runtime_error(errno_message("io_uring_setup() failed: "));
+    }
+    if ((params.features & REQUIRED_FEATURES) != REQUIRED_FEATURES) {
+        ::close(ring_fd);
+        throw runtime_error("io_uring is missing required features");
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring_size = sq_size > cq_size ? sq_size : cq_size;
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring_ptr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (ring_ptr != MAP_FAILED) {
+        sqes = (struct io_uring_sqe*) mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    }
+    if (ring_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+        std::string message = errno_message("mmap() of io_uring failed: ");
+        this->~IoUring();
+        throw runtime_error(message);
+    }
+
+    char* ring = (char*) ring_ptr;
+    sq_head = (unsigned*) (ring + params.sq_off.head);
+    sq_tail = (unsigned*) (ring + params.sq_off.tail);
+    sq_mask = *(unsigned*) (ring + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_array = (unsigned*) (ring + params.sq_off.array);
+
+    cq_head = (unsigned*) (ring + params.cq_off.head);
+    cq_tail = (unsigned*) (ring + params.cq_off.tail);
+    cq_mask = *(unsigned*) (ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*) (ring + params.cq_off.cqes);
+}
+
+IoUring::~IoUring() {
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqes_size);
+    }
+    if (ring_ptr != MAP_FAILED) {
+        munmap(ring_ptr, ring_size);
+    }
+    ::close(ring_fd);
+}
+
+struct io_uring_sqe* IoUring::get_sqe() {
+    unsigned tail = *sq_tail;
+
+    // the submission queue is full, so hand what we have to the kernel without waiting
+    // until it has consumed at least one entry, since it may not take all of them at once
+    while (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+        int ret = io_uring_enter(ring_fd, pending, 0, 0, NULL, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0) {
+            throw runtime_error(errno_message("io_uring_enter() failed: "));
+        } else if (ret == 0) {
+            throw runtime_error("io_uring submission queue is full");
+        }
+        pending -= ret;
+    }
+
+    unsigned index = tail & sq_mask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    pending++;
+
+    return sqe;
+}
+
+bool IoUring::enter(int timeout_ms) {
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = timeout_ms < 0 ? 0 : (uint64_t) &ts;
+
+    unsigned min_complete = timeout_ms == 0 ? 0 : 1;
+    unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+    int ret = io_uring_enter(ring_fd, pending, min_complete, flags, &arg, sizeof(arg));
+    if (ret < 0) {
+        // ETIME is a timeout, EINTR a signal and EBUSY means completions must be reaped first
+        if (errno == ETIME || errno == EINTR || errno == EBUSY) {
+            return false;
+        }
+        throw runtime_error(errno_message("io_uring_enter() failed: "));
+    }
+
+    pending -= ret;
+    return true;
+}
+
+size_t IoUring::reap(function<void (uint64_t, int32_t)> f) {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+    size_t reaped = 0;
+    for (; head != tail; head++, reaped++) {
+        struct io_uring_cqe* cqe = &cqes[head & cq_mask];
+        f(cqe->user_data, cqe->res);
+    }
+
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
@@ -0,0 +1,57 @@
+#ifndef URING_H
+#define URING_H
+
+#include <cstdint>
+#include <functional>
+#include <linux/io_uring.h>
+
+
+/*
+ * IoUring is a minimal wrapper around a Linux io_uring instance made with the raw
+ * io_uring_setup and io_uring_enter system calls.
+ * `get_sqe` returns a zeroed submission queue entry to fill in. Entries are not seen by the
+ * kernel until the next call to `enter`, which submits every pending entry and optionally
+ * waits for completions in a single system call. `reap` then invokes a function for every
+ * completion queue entry that is ready.
+ * If the submission queue is full, `get_sqe` submits the pending entries right away, and throws
+ * std::runtime_error if the kernel won't take any of them.
+ *
+ * The constructor throws std::runtime_error if the kernel does not support io_uring or
+ * lacks a feature that we depend on, so callers can fall back to another mechanism.
+ * IoUring is not safe for concurrent access.
+ */
+class IoUring {
+    int ring_fd;
+    void* ring_ptr;
+    size_t ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    unsigned pending;
+
+public:
+    IoUring(unsigned entries);
+    ~IoUring();
+
+    struct io_uring_sqe* get_sqe();
+
+    // enter submits every pending entry and waits up to timeout_ms milliseconds for at least
+    // one completion, or indefinitely for a negative timeout. It returns false on timeout
+    bool enter(int timeout_ms);
+
+    // reap invokes f(user_data, res) for every ready completion and returns the number reaped
+    size_t reap(std::function<void (uint64_t, int32_t)> f);
+};
+
+#endif //URING_H
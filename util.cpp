@@ -173,15 +173,27 @@ std::ostream &operator<<(std::ostream &os, const system_clock::time_point &tp) {
 }
 
 
+// strerror_r is the GNU version, which returns the message, whenever _GNU_SOURCE is defined (as g++ does),
+// and otherwise the POSIX one, which fills in the buffer and returns 0 on success
+inline const char* strerror_result(char* message, const char*) {
+    return message;
+}
+
+inline const char* strerror_result(int ret, const char* buf) {
+    return ret == 0 ? buf : "";
+}
+
 string errno_message(string prefix) {
+    return errno_message(prefix, errno);
+}
+
+string errno_message(string prefix, int errnum) {
     char buf[1024];
     bzero(buf, sizeof(buf));
-    if (strerror_r(errno, buf, sizeof(buf)) != 0) {
-        buf[0] = '\0';
-    }
+    const char* message = strerror_result(strerror_r(errnum, buf, sizeof(buf)), buf);
 
     stringstream error;
-    error << prefix << buf;
+    error << prefix << message;
     return error.str();
 }
 
@@ -60,7 +60,9 @@ std::string to_http_date(const std::chrono::system_clock::time_point& tp);
 std::ostream& operator<<(std::ostream& os, const std::chrono::system_clock::time_point& tp);
 
 
+// errno_message returns `prefix` followed by the description of errno, or of `errnum` if given
 std::string errno_message(std::string prefix);
+std::string errno_message(std::string prefix, int errnum);
 
 
 std::ostream& operator<<(std::ostream& os, const struct in_addr& addr);
@@ -0,0 +1,166 @@
+#ifndef WORK_STEALING_QUEUES_H
+#define WORK_STEALING_QUEUES_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include "bounded_queue.h"
+
+
+/*
+ * WorkStealingQueues implements a templated set of work queues for a pool of `workers` threads,
+ * with a deque of tasks for each worker, each under a mutex of its own.
+ * `submit` spreads new tasks over the workers' deques in turn, and `push` adds a task to the back
+ * of a given worker's deque. `push_local` is for a worker adding to its own deque: it only wakes
+ * another worker if there is more in the deque than the task the worker will take next itself.
+ * `pop` takes the task at the front of the worker's own deque, so each worker serves its tasks
+ * in order. If that is empty it steals the task at the back of another worker's deque, trying
+ * them in order from a random one, so that a thief takes the task that would have waited the
+ * longest and meets the owner as little as possible.
+ * `take` is like `pop`, but parks the thread on a futex while there is no work in any deque, and
+ * returns false once `stop` has been called.
+ * `steals` counts the tasks that were taken from another worker's deque.
+ * It is safe for multiple threads to call all of these concurrently.
+ */
+template <typename T>
+class WorkStealingQueues {
+    struct WorkerDeque {
+        std::mutex lock;
+        std::deque<T> tasks;
+        // lets thieves skip empty deques without taking their lock
+        std::atomic<size_t> size;
+        char padding[CACHE_LINE_SIZE];
+
+        WorkerDeque() : lock(), tasks(), size(0) {}
+    };
+
+    size_t workers;
+    std::unique_ptr<WorkerDeque[]> deques;
+    std::atomic<size_t> next_worker;
+    std::atomic<uint64_t> steal_count;
+    std::atomic<bool> stopped;
+    FutexEvent work_available;
+
+    static size_t random_index(size_t bound) {
+        static thread_local std::minstd_rand random((unsigned) std::hash<std::thread::id>()(std::this_thread::get_id()));
+        return random() % bound;
+    }
+
+    size_t push_back(size_t worker, const T& task) {
+        WorkerDeque& deque = deques[worker];
+        std::lock_guard<std::mutex> guard(deque.lock);
+        deque.tasks.push_back(task);
+        deque.size.store(deque.tasks.size());
+        return deque.tasks.size();
+    }
+
+    bool pop_front(size_t worker, T& task) {
+        WorkerDeque& deque = deques[worker];
+        if (deque.size.load() == 0) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(deque.lock);
+        if (deque.tasks.empty()) {
+            return false;
+        }
+        task = std::move(deque.tasks.front());
+        deque.tasks.pop_front();
+        deque.size.store(deque.tasks.size());
+        return true;
+    }
+
+    bool pop_back(size_t worker, T& task) {
+        WorkerDeque& deque = deques[worker];
+        if (deque.size.load() == 0) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(deque.lock);
+        if (deque.tasks.empty()) {
+            return false;
+        }
+        task = std::move(deque.tasks.back());
+        deque.tasks.pop_back();
+        deque.size.store(deque.tasks.size());
+        return true;
+    }
+
+public:
+    // a pool without workers still gets a deque, so that submitting to it is well defined
+    WorkStealingQueues(size_t workers) : workers(std::max<size_t>(workers, 1)), deques(new WorkerDeque[std::max<size_t>(workers, 1)]),
+                                         next_worker(0), steal_count(0), stopped(false) {}
+
+    size_t size() {
+        size_t total = 0;
+        for (size_t i = 0; i < workers; i++) {
+            total += deques[i].size.load();
+        }
+        return total;
+    }
+
+    uint64_t steals() {
+        return steal_count.load();
+    }
+
+    void submit(const T& task) {
+        push(next_worker.fetch_add(1) % workers, task);
+    }
+
+    void push(size_t worker, const T& task) {
+        push_back(worker, task);
+        work_available.notify();
+    }
+
+    void push_local(size_t worker, const T& task) {
+        if (push_back(worker, task) > 1) {
+            work_available.notify();
+        }
+    }
+
+    bool pop(size_t worker, T& task) {
+        if (pop_front(worker, task)) {
+            return true;
+        }
+
+        size_t start = random_index(workers);
+        for (size_t i = 0; i < workers; i++) {
+            size_t victim = (start + i) % workers;
+            if (victim != worker && pop_back(victim, task)) {
+                steal_count.fetch_add(1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool take(size_t worker, T& task) {
+        while (!stopped.load()) {
+            if (pop(worker, task)) {
+                return true;
+            }
+
+            uint32_t ticket = work_available.prepare_wait();
+            if (pop(worker, task)) {
+                return true;
+            }
+            if (stopped.load()) {
+                break;
+            }
+            work_available.wait(ticket);
+        }
+        return false;
+    }
+
+    void stop() {
+        stopped.store(true);
+        work_available.notify_all();
+    }
+};
+
+#endif //WORK_STEALING_QUEUES_H